@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <string.h>
+#include "IoTConnectAllocator.h"
+#include "IoTConnectError.h"
+
+#define MEM_ALIGN_UP(x) (((x) + IOT_CONNECT_MEM_ALIGN - 1) & ~(size_t)(IOT_CONNECT_MEM_ALIGN - 1))
+
+static IoTConnectHeapAllocator heap_allocator;
+static IoTConnectAllocator* global_allocator = &heap_allocator;
+
+void iot_connect_set_allocator(IoTConnectAllocator* _allocator)
+{
+    global_allocator = _allocator ? _allocator : &heap_allocator;
+}
+
+IoTConnectAllocator* iot_connect_get_allocator()
+{
+    return global_allocator;
+}
+
+void* iot_connect_malloc(size_t _size, IoTConnectMemTag _tag)
+{
+    return global_allocator->alloc(_size, _tag);
+}
+
+void iot_connect_free(void* _ptr, IoTConnectMemTag _tag)
+{
+    global_allocator->dealloc(_ptr, _tag);
+}
+
+int IoTConnectAllocator::get_stats(int _tag, IoTConnectMemStats* _stats)
+{
+    return IOT_CONNECT_ERROR_NS_UNSUPPORTED;
+}
+
+void* IoTConnectHeapAllocator::alloc(size_t _size, IoTConnectMemTag _tag)
+{
+    return malloc(_size);
+}
+
+void IoTConnectHeapAllocator::dealloc(void* _ptr, IoTConnectMemTag _tag)
+{
+    free(_ptr);
+}
+
+IoTConnectPoolAllocator::IoTConnectPoolAllocator(void* _mem, size_t _mem_size, size_t _block_size) :
+    mem(NULL),
+    block_size(0),
+    blocks(0),
+    free_blocks(0),
+    free_list(NULL)
+{
+    uintptr_t start = MEM_ALIGN_UP((uintptr_t)_mem);
+    int i;
+
+    if (!_mem || _block_size == 0 || start - (uintptr_t)_mem >= _mem_size) {
+        return;
+    }
+
+    mem = (uint8_t*)start;
+    // a free block holds the next pointer
+    block_size = MEM_ALIGN_UP(_block_size < sizeof(void*) ? sizeof(void*) : _block_size);
+    blocks = (_mem_size - (start - (uintptr_t)_mem)) / block_size;
+    free_blocks = blocks;
+
+    for (i = blocks - 1; i >= 0; i--) {
+        void* block = mem + i * block_size;
+        *(void**)block = free_list;
+        free_list = block;
+    }
+}
+
+void* IoTConnectPoolAllocator::alloc(size_t _size, IoTConnectMemTag _tag)
+{
+    void* block = NULL;
+
+    if (_size > block_size) {
+        return NULL;
+    }
+
+    mutex.lock();
+    if (free_list) {
+        block = free_list;
+        free_list = *(void**)block;
+        free_blocks--;
+    }
+    mutex.unlock();
+
+    return block;
+}
+
+void IoTConnectPoolAllocator::dealloc(void* _ptr, IoTConnectMemTag _tag)
+{
+    uint8_t* p = (uint8_t*)_ptr;
+
+    if (!p || p < mem || p >= mem + blocks * block_size || (p - mem) % block_size) {
+        return;
+    }
+
+    mutex.lock();
+    *(void**)p = free_list;
+    free_list = p;
+    free_blocks++;
+    mutex.unlock();
+}
+
+size_t IoTConnectPoolAllocator::get_block_size() const
+{
+    return block_size;
+}
+
+int IoTConnectPoolAllocator::get_blocks() const
+{
+    return blocks;
+}
+
+int IoTConnectPoolAllocator::get_free_blocks() const
+{
+    return free_blocks;
+}
+
+IoTConnectArenaAllocator::IoTConnectArenaAllocator(void* _mem, size_t _mem_size) :
+    mem(NULL),
+    mem_size(0),
+    used(0),
+    last(0),
+    peak(0)
+{
+    uintptr_t start = MEM_ALIGN_UP((uintptr_t)_mem);
+
+    if (!_mem || start - (uintptr_t)_mem >= _mem_size) {
+        return;
+    }
+
+    mem = (uint8_t*)start;
+    mem_size = _mem_size - (start - (uintptr_t)_mem);
+}
+
+void* IoTConnectArenaAllocator::alloc(size_t _size, IoTConnectMemTag _tag)
+{
+    void* p = NULL;
+    size_t size = MEM_ALIGN_UP(_size);
+
+    mutex.lock();
+    if (size >= _size && size <= mem_size - used) {
+        p = mem + used;
+        last = used;
+        used += size;
+        if (used > peak) {
+            peak = used;
+        }
+    }
+    mutex.unlock();
+
+    return p;
+}
+
+void IoTConnectArenaAllocator::dealloc(void* _ptr, IoTConnectMemTag _tag)
+{
+    if (!_ptr) {
+        return;
+    }
+
+    mutex.lock();
+    // only the latest one is given back
+    if ((uint8_t*)_ptr == mem + last && last < used) {
+        used = last;
+    }
+    mutex.unlock();
+}
+
+void IoTConnectArenaAllocator::reset()
+{
+    mutex.lock();
+    used = 0;
+    last = 0;
+    mutex.unlock();
+}
+
+size_t IoTConnectArenaAllocator::get_used() const
+{
+    return used;
+}
+
+size_t IoTConnectArenaAllocator::get_peak() const
+{
+    return peak;
+}
+
+static void account_alloc(IoTConnectMemStats* _stats, size_t _size)
+{
+    _stats->live_bytes += _size;
+    _stats->allocs++;
+    if (_stats->live_bytes > _stats->peak_bytes) {
+        _stats->peak_bytes = _stats->live_bytes;
+    }
+}
+
+IoTConnectAccountingAllocator::IoTConnectAccountingAllocator(IoTConnectAllocator* _backend) :
+    backend(_backend)
+{
+    memset(stats, 0, sizeof(stats));
+}
+
+void* IoTConnectAccountingAllocator::alloc(size_t _size, IoTConnectMemTag _tag)
+{
+    uint8_t* p = (uint8_t*)backend->alloc(_size + IOT_CONNECT_MEM_ALIGN, _tag);
+
+    mutex.lock();
+    if (!p) {
+        stats[_tag].fails++;
+        stats[IOT_CONNECT_MEM_TAGS].fails++;
+        mutex.unlock();
+        return NULL;
+    }
+
+    *(size_t*)p = _size;
+    account_alloc(&stats[_tag], _size);
+    account_alloc(&stats[IOT_CONNECT_MEM_TAGS], _size);
+    mutex.unlock();
+
+    return p + IOT_CONNECT_MEM_ALIGN;
+}
+
+void IoTConnectAccountingAllocator::dealloc(void* _ptr, IoTConnectMemTag _tag)
+{
+    uint8_t* p;
+    size_t size;
+
+    if (!_ptr) {
+        return;
+    }
+
+    p = (uint8_t*)_ptr - IOT_CONNECT_MEM_ALIGN;
+    size = *(size_t*)p;
+
+    mutex.lock();
+    stats[_tag].live_bytes -= size;
+    stats[IOT_CONNECT_MEM_TAGS].live_bytes -= size;
+    mutex.unlock();
+
+    backend->dealloc(p, _tag);
+}
+
+int IoTConnectAccountingAllocator::get_stats(int _tag, IoTConnectMemStats* _stats)
+{
+    if (_tag < 0 || _tag > IOT_CONNECT_MEM_TAGS || !_stats) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    mutex.lock();
+    *_stats = stats[_tag];
+    mutex.unlock();
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+#ifndef __IOT_CONNECT_ALLOCATOR_H__
+#define __IOT_CONNECT_ALLOCATOR_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "IoTConnectPlatform.h"
+
+#define IOT_CONNECT_MEM_ALIGN 8
+
+// Who asks for the memory, for accounting
+typedef enum {
+    IOT_CONNECT_MEM_CLIENT = 0,     // MQTT session, downstream device table
+    IOT_CONNECT_MEM_PUB,            // publish buffer messages and payloads
+    IOT_CONNECT_MEM_RECV,           // copies of received messages
+    IOT_CONNECT_MEM_PROPERTY,       // property values
+    IOT_CONNECT_MEM_JSON,           // json strings of properties, unescaped values
+    IOT_CONNECT_MEM_DEVICE,         // client id, user name, topics, SAS token
+    IOT_CONNECT_MEM_OTA,            // OTA journal record and the last chunk padded
+    IOT_CONNECT_MEM_TAGS
+} IoTConnectMemTag;
+
+typedef struct {
+    size_t live_bytes;
+    size_t peak_bytes;
+    uint32_t allocs;
+    uint32_t fails;
+} IoTConnectMemStats;
+
+// Every allocation of the library goes through an allocator, set globally
+// with iot_connect_set_allocator() or per client. Set it before creating
+// devices and properties, memory is returned to the allocator it came from.
+class IoTConnectAllocator {
+
+public:
+    virtual ~IoTConnectAllocator() {}
+
+    // Aligned for any type, NULL if out of memory
+    virtual void* alloc(size_t _size, IoTConnectMemTag _tag) = 0;
+    // _ptr may be NULL
+    virtual void dealloc(void* _ptr, IoTConnectMemTag _tag) = 0;
+    // Usage of a tag, IOT_CONNECT_MEM_TAGS for the total, if the allocator keeps accounts
+    virtual int get_stats(int _tag, IoTConnectMemStats* _stats);
+};
+
+// malloc / free, the default
+class IoTConnectHeapAllocator : public IoTConnectAllocator {
+
+public:
+    void* alloc(size_t _size, IoTConnectMemTag _tag);
+    void dealloc(void* _ptr, IoTConnectMemTag _tag);
+};
+
+// Fixed size blocks carved from a caller's region, O(1) and no fragmentation.
+// Requests larger than the block size fail.
+class IoTConnectPoolAllocator : public IoTConnectAllocator {
+
+public:
+    // The block size is rounded up to IOT_CONNECT_MEM_ALIGN
+    IoTConnectPoolAllocator(void* _mem, size_t _mem_size, size_t _block_size);
+
+    void* alloc(size_t _size, IoTConnectMemTag _tag);
+    void dealloc(void* _ptr, IoTConnectMemTag _tag);
+
+    size_t get_block_size() const;
+    int get_blocks() const;
+    int get_free_blocks() const;
+
+private:
+    uint8_t* mem;
+    size_t block_size;
+    int blocks;
+    int free_blocks;
+    void* free_list;
+
+    Mutex mutex;
+};
+
+// Bump allocation from a caller's region. Only the latest allocation can be
+// given back, reset() releases everything at once, e.g. for objects created
+// at boot or per message.
+class IoTConnectArenaAllocator : public IoTConnectAllocator {
+
+public:
+    IoTConnectArenaAllocator(void* _mem, size_t _mem_size);
+
+    void* alloc(size_t _size, IoTConnectMemTag _tag);
+    void dealloc(void* _ptr, IoTConnectMemTag _tag);
+
+    void reset();
+    size_t get_used() const;
+    size_t get_peak() const;
+
+private:
+    uint8_t* mem;
+    size_t mem_size;
+    size_t used;
+    size_t last;
+    size_t peak;
+
+    Mutex mutex;
+};
+
+// Counts live bytes and peak usage per tag, on top of another allocator.
+// Every block carries a IOT_CONNECT_MEM_ALIGN bytes header with its size.
+class IoTConnectAccountingAllocator : public IoTConnectAllocator {
+
+public:
+    IoTConnectAccountingAllocator(IoTConnectAllocator* _backend);
+
+    void* alloc(size_t _size, IoTConnectMemTag _tag);
+    void dealloc(void* _ptr, IoTConnectMemTag _tag);
+
+    int get_stats(int _tag, IoTConnectMemStats* _stats);
+
+private:
+    IoTConnectAllocator* backend;
+    IoTConnectMemStats stats[IOT_CONNECT_MEM_TAGS + 1];
+
+    Mutex mutex;
+};
+
+// NULL for the heap
+void iot_connect_set_allocator(IoTConnectAllocator* _allocator);
+IoTConnectAllocator* iot_connect_get_allocator();
+
+// Through the global allocator
+void* iot_connect_malloc(size_t _size, IoTConnectMemTag _tag);
+void iot_connect_free(void* _ptr, IoTConnectMemTag _tag);
+
+#endif
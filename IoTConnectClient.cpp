@@ -1,12 +1,27 @@
-#include "mbed_trace.h"
 #include "IoTConnectClient.h"
 #include "AzureRootCert.h"
 #include "MQTTPacket.h"
+#include "IoTConnectOta.h"
+#include <new>
+#if !defined(IOT_CONNECT_PLATFORM_POSIX)
+#include "IoTConnectNetworkMbed.h"
+#endif
 
 
 #define TRACE_GROUP  "IoTConnectClient"
 #define CLIENT_SUB_BINDS_SIZE MBED_CONF_IOT_CONNECT_MQTT_CLIENT_INSTANCE_MAX
 #define CLIENT_TOPIC_NAME_LEN 100
+#define CLIENT_RECONNECT_RETRY_MS 10000
+#define CLIENT_CONNECT_TIMEOUT_MS 30000
+#define CLIENT_STACK_BYTES (MQTT_CLIENT_THREAD_STACK_SIZE + IOT_CONNECT_THREAD_STACK_EXTRA)
+#define CLIENT_STACK_PATTERN 0xCC
+// left alone below the stack pointer when painting, for memset's own frame
+#define CLIENT_STACK_PAINT_MARGIN 64
+// event loop: yield() per read, wake-up without sigio, and when nothing else is due
+#define CLIENT_MAIN_YIELD_MS 100
+#define CLIENT_EVENT_YIELD_MS 1
+#define CLIENT_EVENT_POLL_MS 100
+#define CLIENT_EVENT_IDLE_MS 60000
 
 typedef struct {
     const char* topic;
@@ -14,21 +29,60 @@ typedef struct {
 }ClientSubTopicBind;
 
 static ClientSubTopicBind binds[CLIENT_SUB_BINDS_SIZE];
+// Clients subscribe and receive in their own threads
+static Mutex binds_mutex;
 
 static int client_sub_topic_bind(IoTConnectClient* _client, const char* _topic)
 {
     int i;
+    int ret = IOT_CONNECT_ERROR_CLIENT_OUT_OF_INSTANCE;
+
+    binds_mutex.lock();
     for (i = 0; i < CLIENT_SUB_BINDS_SIZE; i++) {
+        // re-subscribe after reconnected
+        if (binds[i].client == _client && binds[i].topic == _topic) {
+            ret = 0;
+            break;
+        }
+
         if (binds[i].topic == NULL) {
             binds[i].topic = _topic;
             binds[i].client = _client;
 
-            return 0;
+            ret = 0;
+            break;
         }
     }
+    binds_mutex.unlock();
+
+    return ret;
+}
+
+// Bytes never touched from the bottom of a painted stack
+static uint32_t stack_untouched(const unsigned char* _bottom, const unsigned char* _end)
+{
+    const unsigned char* p = _bottom;
+
+    while (p < _end && *p == CLIENT_STACK_PATTERN) {
+        p++;
+    }
+
+    return p - _bottom;
+}
+
+#if MQTT_CLIENT_STACK_STATS
+// Paint the free stack below the caller, returns how far it painted
+static MBED_NOINLINE unsigned char* stack_paint_below(unsigned char* _bottom)
+{
+    unsigned char* end = (unsigned char*)__builtin_frame_address(0) - CLIENT_STACK_PAINT_MARGIN;
+
+    if (end > _bottom) {
+        memset(_bottom, CLIENT_STACK_PATTERN, end - _bottom);
+    }
 
-    return IOT_CONNECT_ERROR_CLIENT_OUT_OF_INSTANCE;
+    return end;
 }
+#endif
 
 static void mqtt_string_clone(MQTTString& a, char* bptr, int blen)
 {
@@ -48,39 +102,43 @@ static void mqtt_string_clone(MQTTString& a, char* bptr, int blen)
 	snprintf(bptr, alen < blen ? alen : blen, "%s", (char*)aptr);
 }
 
-static bool mqtt_is_topic_matched(const char* topicFilter, MQTTString& topicName)
+// "devices/{client_id}/messages/devicebound/..."
+static const char* mqtt_topic_device_id(MQTTString& topicName, size_t* _len)
 {
-    const char* curf = topicFilter;
-    char* curn = topicName.lenstring.data;
-    char* curn_end = curn + topicName.lenstring.len;
+    static const char prefix[] = "devices/";
+    const char* topic = topicName.lenstring.data;
+    const char* topic_end = topic + topicName.lenstring.len;
+    const char* id;
+    const char* id_end;
+
+    if (topicName.lenstring.len <= (int)sizeof(prefix) - 1 ||
+        memcmp(topic, prefix, sizeof(prefix) - 1) != 0) {
+        return NULL;
+    }
 
-    while (*curf && curn < curn_end)
-    {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
-        }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
+    id = topic + sizeof(prefix) - 1;
+    id_end = (const char*)memchr(id, '/', topic_end - id);
+    if (!id_end) {
+        return NULL;
+    }
+
+    *_len = id_end - id;
 
-    return (curn == curn_end) && (*curf == '\0');
+    return id;
 }
 
-static void client_sub_handle_internal(MQTT::MessageData& _data)
+// _context is the client whose session received the message
+static void client_sub_handle_internal(MQTT::MessageData& _data, void* _context)
 {
     MQTT::Message &_msg = _data.message;
-    static char topic[CLIENT_TOPIC_NAME_LEN];
+    char topic[CLIENT_TOPIC_NAME_LEN];
     IoTConnectClient* client = NULL;
+    const char* id = NULL;
+    size_t id_len = 0;
     int i;
+#if MQTT_CLIENT_PROFILE
+    uint64_t start_cpu_us = iot_connect_cpu_us();
+#endif
 
     mqtt_string_clone(_data.topicName, topic, CLIENT_TOPIC_NAME_LEN);
 
@@ -88,6 +146,7 @@ static void client_sub_handle_internal(MQTT::MessageData& _data)
     tr_debug("Dump message payload");
     tr_debug("%.*s", _msg.payloadlen, _msg.payload);
 
+    binds_mutex.lock();
     for (i = 0; i < CLIENT_SUB_BINDS_SIZE; i++) {
         if (binds[i].topic == NULL) {
             break;
@@ -100,157 +159,282 @@ static void client_sub_handle_internal(MQTT::MessageData& _data)
         }
     }
 
-    if (client) {
-        char* buf;
-        size_t buf_len = _msg.payloadlen + 1;
-        buf = (char*)malloc(buf_len);
-        if (!buf) {
-            tr_error("Out of memory when buffer message");
-            return;
-        }
-        memcpy(buf, _msg.payload, _msg.payloadlen);
-        buf[_msg.payloadlen] = '\0';
+    binds_mutex.unlock();
 
-        MQTT::Message* msg_new = (MQTT::Message*)malloc(sizeof(MQTT::Message));
-        if (!msg_new) {
-            tr_error("Out of memory when buffer message");
-            return;
-        }
-        memset(msg_new, 0, sizeof(MQTT::Message));
-        msg_new->qos = _msg.qos;
-        msg_new->retained = _msg.retained;
-        msg_new->dup = _msg.dup;
-        msg_new->id = _msg.id;
-        msg_new->payload = buf;
-        msg_new->payloadlen = _msg.payloadlen;
-
-        if (client->on_received) {
-            tr_info("Client has a customized on_received callback");
-            tr_debug("NOTE: This won't update device properties because client has handler this message");
-            client->on_received(msg_new);
-        } else {
-            tr_debug("Update device properties according to the message");
-            client->update_props_on_recieved(msg_new);
+    if (!client && _context) {
+        // Gateway mode, route by the device id in topic to a downstream device of this client
+        id = mqtt_topic_device_id(_data.topicName, &id_len);
+        if (id) {
+            client = (IoTConnectClient*)_context;
         }
+    }
 
-        // Free buffer
-        if (msg_new) {
-            free(msg_new);
-        }
-        if (buf) {
-            free(buf);
+    if (client) {
+#if MQTT_CLIENT_PROFILE
+        IoTConnectProfileMark mark;
+        client->profile_mark(&mark);
+        mark.cpu_us = start_cpu_us;
+#endif
+        if (id) {
+            client->dispatch_downstream(_msg, id, id_len);
+        } else {
+            client->dispatch_received(_msg, NULL);
         }
+#if MQTT_CLIENT_PROFILE
+        client->profile_add(IOT_CONNECT_PROFILE_RECEIVE, &mark);
+#endif
     }
 }
 
+#if !defined(IOT_CONNECT_PLATFORM_POSIX)
 IoTConnectClient::IoTConnectClient(NetworkInterface *_network, IoTConnectDevice *_device) :
-    network(_network),
+    IoTConnectClient(new IoTConnectNetworkMbed(_network), _device)
+{
+    own_transport = true;
+}
+#endif
+
+IoTConnectClient::IoTConnectClient(IoTConnectNetwork *_transport, IoTConnectDevice *_device) :
     device(_device),
     auth_type(IOT_CONNECT_AUTH_SYMMETRIC_KEY),
     entry(NULL),
-    socket(new TLSSocket),
+    transport(_transport),
+    own_transport(false),
+    tap(_transport),
+    allocator(NULL),
     mqtt_client(NULL),
+    ca_store(NULL),
+    client_store(NULL),
+    device_store(NULL),
+    tls_profile(iot_connect_tls_profile_default()),
+    tls_heap(0),
+    tls_heap_handshake(0),
     on_received(NULL),
     on_connection_lost(NULL),
-    thread(osPriorityNormal, MQTT_CLIENT_THREAD_STACK_SIZE),
-    msg_id_pub_props(0)
+    lost_reported(false),
+    on_phase(NULL),
+    connect_next(IOT_CONNECT_PHASE_CERT),
+    connecting(false),
+    stack_mem(NULL),
+    stack_size(0),
+    stack_max(0),
+    callback_stack_max(0),
+    thread(NULL),
+    running(false),
+    queue(NULL),
+    queue_timer_id(0),
+    queue_call_id(0),
+    queue_pending(false),
+    queue_sigio(false),
+    keepalive_s(MQTT_KEEPALIVE),
+    ping_timeout_ms(MQTT_PING_TIMEOUT_MS),
+    mqtt_version(MQTT_VERSION),
+    ota(NULL),
+    pub_rate_due_ms(0),
+    msg_id_pub_props(0),
+    pub_props_period_ms(0),
+    pub_props_qos(MQTT::QOS0),
+    pub_props_last_ms(0),
+    subscribed(false),
+    sub_qos(MQTT::QOS0),
+    renew_retry_ms(0),
+    pub_stats_period_ms(0),
+    pub_stats_qos(MQTT::QOS0),
+    pub_stats_last_ms(0),
+    children(NULL),
+    children_num(0),
+    children_cap(0),
+    children_unsubscribed(0),
+    unsubs(NULL),
+    topic_buf(NULL),
+    topic_buf_size(0)
 {
     if (_device) {
         entry = _device->get_entry();
         auth_type = _device->get_auth_type();
     }
 
-    mqtt_client = new MQTTClient(socket);
+    memset(&stats, 0, sizeof(stats));
+    memset(profile, 0, sizeof(profile));
+
+    pub_rate_msgs.set(MQTT_PUB_RATE_MSGS, MQTT_PUB_RATE_MSG_BURST, Kernel::get_ms_count());
+    pub_rate_bytes.set(MQTT_PUB_RATE_BYTES, MQTT_PUB_RATE_BYTE_BURST, Kernel::get_ms_count());
+
+    mqtt_client = new_mqtt_client();
 
 }
 
 IoTConnectClient::~IoTConnectClient() {
-    MQTT::Message* msg = NULL;
+    IoTConnectPubMsg* msg = NULL;
+    int i;
+
+    if (queue) {
+        tap.sigio(NULL);
+        if (queue_timer_id) {
+            queue->cancel(queue_timer_id);
+        }
+        if (queue_call_id) {
+            queue->cancel(queue_call_id);
+        }
+        queue = NULL;
+    }
+
+    if (thread) {
+        running = false;
+        thread->join();
+        thread->~Thread();
+        mem_free(thread, IOT_CONNECT_MEM_CLIENT);
+    }
 
     disconnect();
-    delete mqtt_client;
-    delete socket;
+    delete_mqtt_client();
+    if (own_transport) {
+        delete transport;
+    } else {
+        tap.set_trust_store(NULL, NULL);
+    }
+    if (device_store) {
+        device_store->~IoTConnectTrustStore();
+        mem_free(device_store, IOT_CONNECT_MEM_CLIENT);
+    }
 
     while(!pubs.empty()) {
         pubs.pop(msg);
         if (msg) {
-            if (msg->payload) {
-                free(msg->payload);
-            }
-            free(msg);
+            // the devices may go on with another client
+            clear_report(msg);
+            free_pub_msg(msg);
         }
     }
+
+    for (i = 0; i < children_num; i++) {
+        mem_free(children[i].sub, IOT_CONNECT_MEM_CLIENT);
+    }
+    mem_free(children, IOT_CONNECT_MEM_CLIENT);
+    while (unsubs) {
+        IoTConnectTopicNode* next = unsubs->next;
+        mem_free(unsubs, IOT_CONNECT_MEM_CLIENT);
+        unsubs = next;
+    }
+    mem_free(topic_buf, IOT_CONNECT_MEM_CLIENT);
+    // the thread has been joined
+    mem_free(stack_mem, IOT_CONNECT_MEM_CLIENT);
 }
 
-int IoTConnectClient::connect()
+void* IoTConnectClient::mem_alloc(size_t _size, IoTConnectMemTag _tag)
 {
-    int ret = socket->open(network);
-    if (ret != NSAPI_ERROR_OK) {
-        tr_error("Could not open socket! Error code: %d", ret);
-        return ret;
+    return (allocator ? allocator : iot_connect_get_allocator())->alloc(_size, _tag);
+}
+
+void IoTConnectClient::mem_free(void* _ptr, IoTConnectMemTag _tag)
+{
+    (allocator ? allocator : iot_connect_get_allocator())->dealloc(_ptr, _tag);
+}
+
+IoTConnectMqttSession* IoTConnectClient::new_mqtt_client()
+{
+    void* mem = mem_alloc(sizeof(IoTConnectMqttSession), IOT_CONNECT_MEM_CLIENT);
+
+    if (!mem) {
+        tr_error("Out of memory when create MQTT client");
+        return NULL;
     }
 
-    {
-        ret = socket->set_root_ca_cert(azure_root_certs);
-        if (ret != NSAPI_ERROR_OK) {
-            tr_error("Could not set ca cert! Returned %d\n", ret);
-            return ret;
-        }
+    return new (mem) IoTConnectMqttSession(tap);
+}
+
+void IoTConnectClient::delete_mqtt_client()
+{
+    IoTConnectMqttSession* session = mqtt_client;
+
+    if (session) {
+        // keep the session's counters, get_stats() reads them under the lock
+        stats_mutex.lock();
+        stats.pings += session->get_pings();
+        stats.ping_timeouts += session->get_ping_timeouts();
+        mqtt_client = NULL;
+        stats_mutex.unlock();
+
+        session->~IoTConnectMqttSession();
+        mem_free(session, IOT_CONNECT_MEM_CLIENT);
     }
+}
 
-    if (auth_type == IOT_CONNECT_AUTH_CLIENT_SIDE_CERT) {
+int IoTConnectClient::set_allocator(IoTConnectAllocator* _allocator)
+{
+    if (thread || queue || is_connected() || !pubs.empty() || children) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
 
-        const char* _client_cert_pem;
-        const char* _client_key_pem;
+    delete_mqtt_client();
+    allocator = _allocator;
+    mqtt_client = new_mqtt_client();
 
-        _client_cert_pem = device->get_cert_pem();
-        _client_key_pem = device->get_private_key_pem();
+    return mqtt_client ? 0 : IOT_CONNECT_ERROR_OUT_OF_MEM;
+}
 
+int IoTConnectClient::connect()
+{
+    int phase;
+    int ret;
 
-        if (!_client_cert_pem || !_client_key_pem) {
-            ret = IOT_CONNECT_ERROR_INVAL;
-            tr_error("Client Cert pem or private key is null with cert auth type! Error code: %d", ret);
+    for (phase = IOT_CONNECT_PHASE_CERT; phase < IOT_CONNECT_PHASES; phase++) {
+        ret = connect_phase((IoTConnectPhase)phase);
+        if (ret != 0) {
             return ret;
         }
+    }
 
-        ret = socket->set_client_cert_key(_client_cert_pem, _client_key_pem);
-        if (ret != NSAPI_ERROR_OK) {
-            tr_error("Could not set keys! Returned %d\n", ret);
-            return ret;
-        }
+    return 0;
+}
+
+int IoTConnectClient::connect_phase(IoTConnectPhase _phase)
+{
+    int ret;
 
+    if (!mqtt_client) {
+        return IOT_CONNECT_ERROR_OUT_OF_MEM;
     }
 
+    switch (_phase) {
+        case IOT_CONNECT_PHASE_CERT:
+            return load_certs();
 
-    {
-        SocketAddress a;
-        network->gethostbyname(entry->get_mqtt_server_host_name(), &a);
-        a.set_port(entry->get_mqtt_port());
-        tr_info("Try to connect to %s(ip: %s):%d",
-                entry->get_mqtt_server_host_name(),
-                a.get_ip_address(), a.get_port()
-        );
-        socket->set_timeout(30000);
-        ret = socket->connect(a);
-
-        if (ret != NSAPI_ERROR_OK) {
-            tr_error("Could not connect! Returned %d\n", ret);
+        case IOT_CONNECT_PHASE_DNS:
+        case IOT_CONNECT_PHASE_TCP:
+            return tap.connect_phase(_phase, entry->get_mqtt_server_host_name(), entry->get_mqtt_port(),
+                                     CLIENT_CONNECT_TIMEOUT_MS);
+
+        case IOT_CONNECT_PHASE_TLS:
+            return tls_connect();
+
+        case IOT_CONNECT_PHASE_MQTT:
+            break;
+
+        default:
+            return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    if (device->has_symmetric_key()) {
+        ret = device->renew_pwd();
+        if (ret != 0) {
+            tr_error("Could not generate SAS token! Returned %d", ret);
             return ret;
         }
-
-        tr_info("Connection established");
     }
 
     tr_info("MQTT Client is trying to connect to the service ...\n");
     {
         MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
         // Azure Iot Hub - Should be be 4 (3.1.1)
-        data.MQTTVersion = 4;
+        data.MQTTVersion = mqtt_version;
         data.clientID.cstring = (char*)device->get_client_id();
         data.username.cstring = (char*)device->get_user_name();
         data.password.cstring = (char*)device->get_pwd();
+        data.keepAliveInterval = keepalive_s;
+        mqtt_client->set_ping_timeout(ping_timeout_ms);
 
-        tr_debug("MQTT Client - mqtt version:\t\%s", data.MQTTVersion == 4 ? "3.1.1" : "3.1");
+        tr_debug("MQTT Client - mqtt version:\t\%s", data.MQTTVersion == 4 ? "3.1.1" : "5");
         tr_debug("MQTT Client - client id:\t%s", data.clientID.cstring);
         tr_debug("MQTT Client - username:\t%s", data.username.cstring);
         tr_debug("MQTT Client - password:\t%s", data.password.cstring);
@@ -262,164 +446,1638 @@ int IoTConnectClient::connect()
         }
     }
 
+    if (mqtt_client->is_mqtt5()) {
+        tr_info("MQTT 5, receive maximum %u, %u topic aliases", mqtt_client->get_receive_max(),
+                mqtt_client->get_topic_alias_max());
+    }
     tr_info("MQTT Client is connected\n");
 
     return 0;
 }
 
-int IoTConnectClient::disconnect()
+int IoTConnectClient::tls_connect()
 {
-    return 0;
+    bool measure = iot_connect_tls_heap_started();
+    size_t base = 0;
+    size_t held;
+    size_t peak;
+    int ret;
+
+    if (measure) {
+        // other clients' handshakes wait, the counters are shared
+        base = iot_connect_tls_heap_begin();
+    }
+
+    ret = tap.connect_phase(IOT_CONNECT_PHASE_TLS, entry->get_mqtt_server_host_name(), entry->get_mqtt_port(),
+                            CLIENT_CONNECT_TIMEOUT_MS);
+
+    if (measure) {
+        // buffers have shrunk by now with MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+        iot_connect_tls_heap_end(base, &held, &peak);
+        if (ret == 0) {
+            tls_heap = held;
+            tls_heap_handshake = peak;
+            tr_info("TLS heap %u bytes, %u in the handshake", (unsigned)tls_heap, (unsigned)tls_heap_handshake);
+        }
+    }
+
+    return ret;
 }
 
-bool IoTConnectClient::is_connected()
+int IoTConnectClient::load_certs()
 {
-    return mqtt_client->isConnected();
-}
+    IoTConnectTrustStore* ca = ca_store ? ca_store : IoTConnectTrustStore::get_azure_root();
+    IoTConnectTrustStore* own = client_store;
+    const char* _client_cert_pem = NULL;
+    const char* _client_key_pem = NULL;
+    int ret;
 
+    if (auth_type == IOT_CONNECT_AUTH_CLIENT_SIDE_CERT) {
+        _client_cert_pem = device->get_cert_pem();
+        _client_key_pem = device->get_private_key_pem();
 
-int IoTConnectClient::subscribe(MQTT::QoS qos, Callback<void(MQTT::Message*)> _on_received)
-{
-    const char* topic_sub = device->get_mqtt_topic_sub();
+        if (!own && (!_client_cert_pem || !_client_key_pem)) {
+            ret = IOT_CONNECT_ERROR_INVAL;
+            tr_error("Client Cert pem or private key is null with cert auth type! Error code: %d", ret);
+            return ret;
+        }
 
-    int rc = mqtt_client->subscribe(topic_sub, qos, client_sub_handle_internal);
-    if (rc != MQTT::SUCCESS) {
-        tr_error("Subscribe topic:%s with QoS:%d failed", topic_sub, qos);
-        return IOT_CONNECT_ERROR_CLIENT_SUB;
+        if (!own && ca && !device_store) {
+            void* mem = mem_alloc(sizeof(IoTConnectTrustStore), IOT_CONNECT_MEM_CLIENT);
+            if (!mem) {
+                return IOT_CONNECT_ERROR_OUT_OF_MEM;
+            }
+            device_store = new (mem) IoTConnectTrustStore();
+
+            ret = device_store->set_client_cert_key(_client_cert_pem, _client_key_pem);
+            if (ret != 0) {
+                device_store->~IoTConnectTrustStore();
+                mem_free(device_store, IOT_CONNECT_MEM_CLIENT);
+                device_store = NULL;
+                return ret;
+            }
+        }
+        if (!own) {
+            own = device_store;
+        }
+    } else {
+        own = NULL;
     }
 
-    on_received = _on_received;
+    // transports without profiles take mbedTLS's defaults
+    ret = tap.set_tls_profile(tls_profile);
+    if (ret != 0 && ret != IOT_CONNECT_ERROR_NS_UNSUPPORTED) {
+        return ret;
+    }
 
-    client_sub_topic_bind(this, topic_sub);
+    if (ca) {
+        ret = tap.set_trust_store(ca, own);
+        if (ret != IOT_CONNECT_ERROR_NS_UNSUPPORTED) {
+            return ret;
+        }
+    }
+
+    // the transport parses PEM at every connect
+    ret = tap.set_root_ca_cert(azure_root_certs);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (auth_type == IOT_CONNECT_AUTH_CLIENT_SIDE_CERT) {
+        if (!_client_cert_pem || !_client_key_pem) {
+            ret = IOT_CONNECT_ERROR_INVAL;
+            tr_error("Client Cert pem or private key is null with cert auth type! Error code: %d", ret);
+            return ret;
+        }
+
+        ret = tap.set_client_cert_key(_client_cert_pem, _client_key_pem);
+        if (ret != 0) {
+            return ret;
+        }
+    }
 
     return 0;
 }
 
-int IoTConnectClient::pub(MQTT::Message* _msg)
+int IoTConnectClient::set_trust_store(IoTConnectTrustStore* _ca, IoTConnectTrustStore* _client)
 {
-    MQTT::Message* msg_to_pub;
-    char* buf = NULL;
-    size_t buf_len = 0;
-
-    if (!_msg) {
+    if (_ca && !_ca->has_ca_cert()) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+    if (_client && !_client->has_client_cert()) {
         return IOT_CONNECT_ERROR_INVAL;
     }
 
-    if (_msg->payloadlen <= 0) {
+    ca_store = _ca;
+    client_store = _client;
+
+    return 0;
+}
+
+int IoTConnectClient::set_tls_profile(const IoTConnectTlsProfile* _profile)
+{
+    tls_profile = _profile;
+
+    return 0;
+}
+
+int IoTConnectClient::connect_async(Callback<void(IoTConnectPhase, int)> _on_phase)
+{
+    if (!thread && !queue) {
         return IOT_CONNECT_ERROR_INVAL;
     }
 
-    if (pubs.full()) {
-        return IOT_CONNECT_ERROR_CLIENT_PUB_FULL;
+    if (connecting) {
+        return IOT_CONNECT_ERROR_NS_ALREADY;
     }
 
-    buf_len = _msg->payloadlen;
-    buf = (char*)malloc(buf_len);
-    if (!buf) {
-        return IOT_CONNECT_ERROR_OUT_OF_MEM;
+    if (is_connected()) {
+        return IOT_CONNECT_ERROR_NS_IS_CONNECTED;
     }
-    memcpy(buf, _msg->payload, _msg->payloadlen);
 
-    msg_to_pub = (MQTT::Message*)malloc(sizeof(MQTT::Message));
-    memcpy(msg_to_pub, _msg, sizeof(MQTT::Message));
-    msg_to_pub->payload = buf;
+    on_phase = _on_phase;
+    connect_next = IOT_CONNECT_PHASE_CERT;
+    connecting = true;
 
-    pubs.push(msg_to_pub);
+    if (queue) {
+        event_loop_post();
+    }
 
     return 0;
 }
 
-int IoTConnectClient::start_main_loop()
+bool IoTConnectClient::is_connecting() const
 {
-    osStatus ret;
-    ret = thread.start(callback(this, &IoTConnectClient::thread_main_loop));
+    return connecting;
+}
 
-    if (ret != osOK) {
-        tr_error("Start thread failed with osStatus: %d", ret);
-        return IOT_CONNECT_ERROR_CLIENT_THREAD;
+// One phase of connect_async(), in the main loop or event loop
+void IoTConnectClient::connect_step()
+{
+    IoTConnectPhase phase = connect_next;
+    int ret = connect_phase(phase);
+
+    if (ret != 0) {
+        tr_error("Connect failed in phase %d with %d", phase, ret);
+        connecting = false;
+    } else if (phase + 1 == IOT_CONNECT_PHASES) {
+        connecting = false;
+    } else {
+        connect_next = (IoTConnectPhase)(phase + 1);
+    }
+
+    if (on_phase) {
+        on_phase(phase, ret);
     }
+}
+
+int IoTConnectClient::disconnect()
+{
+    if (is_connected()) {
+        mqtt_client->disconnect();
+    }
+
+    transport->disconnect();
 
     return 0;
 }
 
-void IoTConnectClient::thread_main_loop()
+int IoTConnectClient::reconnect()
 {
-    const char* topic_pub = device->get_mqtt_topic_pub();
-    while (1) {
-        if (!is_connected()) {
-            // Disconneted, call a callback then sleep or terminal thread?
-            tr_error("Connection lost");
-            if (on_connection_lost) {
-                on_connection_lost();
-            }
-        }
+    int ret;
 
-        if (mqtt_client->yield(100) != MQTT::SUCCESS) {
-            // error occurs when yield, coninue to check is the connection is lost.
-            continue;
-        }
+    tr_info("Reconnect to the service");
 
-        if (!pubs.empty()) {
-            MQTT::Message* pub_msg = NULL;
-            pubs.pop(pub_msg);
+    stats_mutex.lock();
+    stats.reconnects++;
+    stats_mutex.unlock();
 
-            if (pub_msg == NULL) {
-                continue;
-            }
+    disconnect();
 
-            int rc = mqtt_client->publish(topic_pub, *pub_msg);
-            if(rc != MQTT::SUCCESS) {
-                tr_error("Topic[%s] publish message#%d failed\n", topic_pub, pub_msg->id);
-            }
-            tr_info("Topic[%s] publish message#%d succeed", topic_pub, pub_msg->id);
-            #if MBED_TRACE_MAX_LEVEL >= TRACE_LEVEL_DEBUG
-            tr_array((uint8_t*)pub_msg->payload, pub_msg->payloadlen);
-            #endif
-
-            // destrory the message
-            if (pub_msg->payload) {
-                free(pub_msg->payload);
-            }
-            free(pub_msg);
-            pub_msg = NULL;
-        }
+    // Start over with a clean session state
+    delete_mqtt_client();
+    mqtt_client = new_mqtt_client();
+
+    ret = connect();
+    if (ret != 0) {
+        return ret;
+    }
 
+    if (subscribed) {
+        ret = subscribe(sub_qos, on_received);
     }
+
+    return ret;
 }
 
-void IoTConnectClient::update_props_on_recieved(MQTT::Message* _msg)
+bool IoTConnectClient::is_connected()
 {
-    const char* js = (const char*)_msg->payload;
-    device->update(js);
+    return mqtt_client && mqtt_client->is_connected();
 }
 
-void IoTConnectClient::set_event_handler(Callback<void()> _on_connection_lost)
+int IoTConnectClient::set_keepalive(int _interval_s, int _ping_timeout_ms)
 {
-    if (_on_connection_lost) {
-        on_connection_lost = _on_connection_lost;
+    // two bytes in CONNECT
+    if (_interval_s < 0 || _interval_s > 65535 || _ping_timeout_ms < 0) {
+        return IOT_CONNECT_ERROR_INVAL;
     }
+
+    keepalive_s = _interval_s;
+    ping_timeout_ms = _ping_timeout_ms;
+
+    return 0;
 }
 
-int IoTConnectClient::pub_props(MQTT::QoS _qos)
+int IoTConnectClient::set_mqtt_version(int _version)
 {
-    int r;
-    const char* json = NULL;
-    MQTT::Message pub_msg;
+    if (_version != 4 && _version != IOT_CONNECT_MQTT5_VERSION) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
 
-    r = device->to_json(&json);
+    mqtt_version = _version;
 
-    if (r != 0) {
-        return r;
+    return 0;
+}
+
+
+int IoTConnectClient::subscribe_topic(const char* _topic)
+{
+    if (!mqtt_client) {
+        return IOT_CONNECT_ERROR_OUT_OF_MEM;
     }
 
-    pub_msg.qos = _qos;
-    pub_msg.retained = false;
-    pub_msg.dup = false;
-    pub_msg.id = msg_id_pub_props++;
-    pub_msg.payload = (void*)json;
-    pub_msg.payloadlen = strlen(json);
+    // Every topic takes a message handler in the MQTT session, see IOT_CONNECT_MQTT_MAX_HANDLERS
+    int rc = mqtt_client->subscribe(_topic, sub_qos, client_sub_handle_internal, this);
+    if (rc != MQTT::SUCCESS) {
+        tr_error("Subscribe topic:%s with QoS:%d failed", _topic, sub_qos);
+        return IOT_CONNECT_ERROR_CLIENT_SUB;
+    }
 
-    r = pub(&pub_msg);
+    return 0;
+}
 
-    return r;
+int IoTConnectClient::subscribe(MQTT::QoS qos, Callback<void(MQTT::Message*)> _on_received)
+{
+    const char* topic_sub = device->get_mqtt_topic_sub();
+    int i;
+    int rc;
+
+    sub_qos = qos;
+
+    rc = subscribe_topic(topic_sub);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // a new session, every downstream device again
+    devices_mutex.lock();
+    for (i = 0; i < children_num; i++) {
+        children[i].subscribed = false;
+    }
+    children_unsubscribed = children_num;
+    devices_mutex.unlock();
+
+    rc = subscribe_added();
+    if (rc != 0) {
+        return rc;
+    }
+
+    on_received = _on_received;
+    subscribed = true;
+
+    client_sub_topic_bind(this, topic_sub);
+
+    return 0;
+}
+
+// Subscribe downstream devices added since, in the client's context. The session isn't
+// called with devices_mutex held, a device removed meanwhile leaves its topic in unsubs.
+int IoTConnectClient::subscribe_added()
+{
+    IoTConnectTopicNode* sub;
+    int ret = 0;
+    int rc;
+    int i;
+
+    while (true) {
+        sub = NULL;
+        devices_mutex.lock();
+        for (i = 0; children_unsubscribed > 0 && i < children_num; i++) {
+            if (!children[i].subscribed) {
+                sub = children[i].sub;
+                break;
+            }
+        }
+        devices_mutex.unlock();
+
+        if (!sub) {
+            return ret;
+        }
+
+        rc = subscribe_topic(sub->topic);
+        if (rc != 0 && ret == 0) {
+            ret = rc;
+        }
+
+        // not tried again until the next subscribe(), it failed with the connection
+        devices_mutex.lock();
+        for (i = 0; i < children_num; i++) {
+            if (children[i].sub == sub) {
+                children[i].subscribed = true;
+                children_unsubscribed--;
+                break;
+            }
+        }
+        devices_mutex.unlock();
+    }
+}
+
+// Unsubscribe removed downstream devices and free their topics, in the client's context
+void IoTConnectClient::unsubscribe_removed()
+{
+    IoTConnectTopicNode* node;
+    IoTConnectTopicNode* next;
+
+    devices_mutex.lock();
+    node = unsubs;
+    unsubs = NULL;
+    devices_mutex.unlock();
+
+    while (node) {
+        next = node->next;
+        // the session drops the handler even if disconnected
+        if (mqtt_client) {
+            mqtt_client->unsubscribe(node->topic);
+        }
+        mem_free(node, IOT_CONNECT_MEM_CLIENT);
+        node = next;
+    }
+}
+
+// Topics of downstream devices added or removed since, in the main loop or event loop
+void IoTConnectClient::sync_device_subs()
+{
+    unsubscribe_removed();
+
+    if (subscribed && is_connected()) {
+        subscribe_added();
+    }
+}
+
+int IoTConnectClient::add_device(IoTConnectDevice* _device)
+{
+    const char* id;
+    const char* topic;
+    IoTConnectTopicNode* sub;
+    int lo = 0;
+    int hi;
+
+    if (!_device || _device == device) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    id = _device->get_client_id();
+    topic = _device->get_mqtt_topic_sub();
+
+    devices_mutex.lock();
+    if (find_device(id, strlen(id))) {
+        devices_mutex.unlock();
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    if (children_num == children_cap) {
+        int cap = children_cap ? children_cap * 2 : 4;
+        IoTConnectChild* p = (IoTConnectChild*)mem_alloc(cap * sizeof(IoTConnectChild), IOT_CONNECT_MEM_CLIENT);
+        if (!p) {
+            devices_mutex.unlock();
+            return IOT_CONNECT_ERROR_OUT_OF_MEM;
+        }
+        if (children) {
+            memcpy(p, children, children_num * sizeof(IoTConnectChild));
+            mem_free(children, IOT_CONNECT_MEM_CLIENT);
+        }
+        children = p;
+        children_cap = cap;
+    }
+
+    sub = (IoTConnectTopicNode*)mem_alloc(sizeof(IoTConnectTopicNode) + strlen(topic), IOT_CONNECT_MEM_CLIENT);
+    if (!sub) {
+        devices_mutex.unlock();
+        return IOT_CONNECT_ERROR_OUT_OF_MEM;
+    }
+    sub->next = NULL;
+    strcpy(sub->topic, topic);
+
+    // keep sorted by client id
+    hi = children_num;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(children[mid].device->get_client_id(), id) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    memmove(&children[lo + 1], &children[lo], (children_num - lo) * sizeof(IoTConnectChild));
+    children[lo].device = _device;
+    children[lo].sub = sub;
+    children[lo].subscribed = false;
+    children_num++;
+    children_unsubscribed++;
+    devices_mutex.unlock();
+
+    if (queue) {
+        event_loop_post();
+    }
+
+    return 0;
+}
+
+int IoTConnectClient::remove_device(IoTConnectDevice* _device)
+{
+    IoTConnectPubMsg* msg = NULL;
+    uint32_t n;
+    int i;
+
+    devices_mutex.lock();
+    for (i = 0; i < children_num; i++) {
+        if (children[i].device == _device) {
+            break;
+        }
+    }
+    if (i == children_num) {
+        devices_mutex.unlock();
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    // a subscribe may be on the way, the topic is freed once unsubscribed
+    children[i].sub->next = unsubs;
+    unsubs = children[i].sub;
+    if (!children[i].subscribed) {
+        children_unsubscribed--;
+    }
+    memmove(&children[i], &children[i + 1], (children_num - i - 1) * sizeof(IoTConnectChild));
+    children_num--;
+
+    // its messages still in the buffer, the one being published checks again
+    stats_mutex.lock();
+    for (n = pubs.size(); n > 0; n--) {
+        pubs.pop(msg);
+        if (msg && msg->device == _device) {
+            // reportable if added again
+            if (msg->report) {
+                _device->clear_in_flight(msg->report);
+            }
+            free_pub_msg(msg);
+            stats.queue_depth--;
+        } else {
+            pubs.push(msg);
+        }
+    }
+    stats_mutex.unlock();
+    devices_mutex.unlock();
+
+    if (queue) {
+        event_loop_post();
+    }
+
+    return 0;
+}
+
+// Index of the downstream device with the client id, -1 if none. With devices_mutex held.
+int IoTConnectClient::find_child(const char* _client_id, size_t _len)
+{
+    const char* id;
+    int lo = 0;
+    int hi = children_num - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int r;
+
+        id = children[mid].device->get_client_id();
+        r = strncmp(id, _client_id, _len);
+        if (r == 0 && id[_len] != '\0') {
+            // longer id with the same prefix
+            r = 1;
+        }
+
+        if (r == 0) {
+            return mid;
+        } else if (r < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return -1;
+}
+
+// _device is still a downstream device, it isn't dereferenced. With devices_mutex held.
+bool IoTConnectClient::has_child(const IoTConnectDevice* _device) const
+{
+    int i;
+
+    for (i = 0; i < children_num; i++) {
+        if (children[i].device == _device) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+IoTConnectDevice* IoTConnectClient::find_device(const char* _client_id, size_t _len)
+{
+    const char* id = device->get_client_id();
+    IoTConnectDevice* found = NULL;
+    int i;
+
+    if (strncmp(id, _client_id, _len) == 0 && id[_len] == '\0') {
+        return device;
+    }
+
+    devices_mutex.lock();
+    i = find_child(_client_id, _len);
+    if (i >= 0) {
+        found = children[i].device;
+    }
+    devices_mutex.unlock();
+
+    return found;
+}
+
+void IoTConnectClient::dispatch_downstream(MQTT::Message& _msg, const char* _client_id, size_t _len)
+{
+    int i;
+
+    // remove_device() waits until it's dispatched
+    devices_mutex.lock();
+    i = find_child(_client_id, _len);
+    if (i >= 0) {
+        dispatch_received(_msg, children[i].device);
+    } else {
+        tr_warn("No downstream device %.*s", (int)_len, _client_id);
+    }
+    devices_mutex.unlock();
+}
+
+int IoTConnectClient::pub(MQTT::Message* _msg, IoTConnectDevice* _device, uint32_t _expiry_s)
+{
+    return pub(_msg, NULL, 0, _device, _expiry_s);
+}
+
+int IoTConnectClient::pub(MQTT::Message* _msg, const IoTConnectMsgProperty* _props, int _props_num,
+                          IoTConnectDevice* _device, uint32_t _expiry_s)
+{
+    return copy_pub(_msg, _props, _props_num, _device, _expiry_s, NULL);
+}
+
+// Copies the message into the publish buffer, with the pub_props() snapshot if any
+int IoTConnectClient::copy_pub(MQTT::Message* _msg, const IoTConnectMsgProperty* _props, int _props_num,
+                               IoTConnectDevice* _device, uint32_t _expiry_s, const IoTConnectReportSnapshot* _report)
+{
+    IoTConnectPubMsg* msg_to_pub;
+    char* buf = NULL;
+    size_t buf_len = 0;
+    size_t props_len = 0;
+
+    if (!_msg) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    if (_props_num < 0 || (_props_num > 0 && !_props)) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+    props_len = iot_connect_msg_props_len(_props, _props_num);
+    if (props_len > IOT_CONNECT_MSG_PROPS_MAX) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    if (_msg->payloadlen <= 0) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    if (pubs.full()) {
+        stats_mutex.lock();
+        stats.pub_full++;
+        stats_mutex.unlock();
+        return IOT_CONNECT_ERROR_CLIENT_PUB_FULL;
+    }
+
+    buf_len = _msg->payloadlen + (props_len ? props_len + 1 : 0);
+    buf = (char*)mem_alloc(buf_len, IOT_CONNECT_MEM_PUB);
+    if (!buf) {
+        return IOT_CONNECT_ERROR_OUT_OF_MEM;
+    }
+    memcpy(buf, _msg->payload, _msg->payloadlen);
+    if (props_len) {
+        iot_connect_msg_props_encode(buf + _msg->payloadlen, _props, _props_num);
+    }
+
+    // the snapshot is kept after the message
+    msg_to_pub = (IoTConnectPubMsg*)mem_alloc(sizeof(IoTConnectPubMsg) +
+                                              (_report ? sizeof(IoTConnectReportSnapshot) : 0),
+                                              IOT_CONNECT_MEM_PUB);
+    if (!msg_to_pub) {
+        mem_free(buf, IOT_CONNECT_MEM_PUB);
+        return IOT_CONNECT_ERROR_OUT_OF_MEM;
+    }
+    memcpy(&msg_to_pub->msg, _msg, sizeof(MQTT::Message));
+    msg_to_pub->msg.payload = buf;
+    msg_to_pub->reader = NULL;
+    msg_to_pub->report = NULL;
+    if (_report) {
+        msg_to_pub->report = (IoTConnectReportSnapshot*)(msg_to_pub + 1);
+        memcpy(msg_to_pub->report, _report, sizeof(IoTConnectReportSnapshot));
+    }
+    msg_to_pub->topic_props = props_len ? buf + _msg->payloadlen : NULL;
+    enqueue_pub(msg_to_pub, _device, _expiry_s);
+
+    return 0;
+}
+
+int IoTConnectClient::pub_stream(MQTT::Message* _msg, IoTConnectPayloadReader _reader, IoTConnectDevice* _device,
+                                 uint32_t _expiry_s)
+{
+    IoTConnectPubMsg* msg_to_pub;
+
+    if (!_msg || _msg->payloadlen <= 0 || !_reader) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    if (pubs.full()) {
+        stats_mutex.lock();
+        stats.pub_full++;
+        stats_mutex.unlock();
+        return IOT_CONNECT_ERROR_CLIENT_PUB_FULL;
+    }
+
+    // the reader is kept after the message
+    msg_to_pub = (IoTConnectPubMsg*)mem_alloc(sizeof(IoTConnectPubMsg) + sizeof(IoTConnectPayloadReader),
+                                              IOT_CONNECT_MEM_PUB);
+    if (!msg_to_pub) {
+        return IOT_CONNECT_ERROR_OUT_OF_MEM;
+    }
+    memcpy(&msg_to_pub->msg, _msg, sizeof(MQTT::Message));
+    msg_to_pub->msg.payload = NULL;
+    msg_to_pub->reader = new (msg_to_pub + 1) IoTConnectPayloadReader(_reader);
+    msg_to_pub->report = NULL;
+    msg_to_pub->topic_props = NULL;
+    enqueue_pub(msg_to_pub, _device, _expiry_s);
+
+    return 0;
+}
+
+void IoTConnectClient::enqueue_pub(IoTConnectPubMsg* _msg, IoTConnectDevice* _device, uint32_t _expiry_s)
+{
+    _msg->device = (_device == device) ? NULL : _device;
+    _msg->expiry_s = _expiry_s;
+    _msg->enqueue_us = iot_connect_us_now();
+    _msg->dequeue_us = 0;
+    _msg->write_us = 0;
+    _msg->ack_us = 0;
+    _msg->throttle_us = 0;
+
+    stats_mutex.lock();
+    pubs.push(_msg);
+    stats.queue_depth++;
+    if (stats.queue_depth > stats.queue_high) {
+        stats.queue_high = stats.queue_depth;
+    }
+    stats_mutex.unlock();
+
+    if (queue) {
+        event_loop_post();
+    }
+}
+
+void IoTConnectClient::free_pub_msg(IoTConnectPubMsg* _msg)
+{
+    if (_msg->reader) {
+        _msg->reader->~IoTConnectPayloadReader();
+    }
+    mem_free(_msg->msg.payload, IOT_CONNECT_MEM_PUB);
+    mem_free(_msg, IOT_CONNECT_MEM_PUB);
+}
+
+int IoTConnectClient::start_main_loop()
+{
+    osStatus ret;
+    void* mem;
+
+    if (thread || queue) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    stack_mem = (unsigned char*)mem_alloc(CLIENT_STACK_BYTES, IOT_CONNECT_MEM_CLIENT);
+    mem = mem_alloc(sizeof(Thread), IOT_CONNECT_MEM_CLIENT);
+    if (!stack_mem || !mem) {
+        tr_error("Out of memory when create client thread");
+        mem_free(mem, IOT_CONNECT_MEM_CLIENT);
+        mem_free(stack_mem, IOT_CONNECT_MEM_CLIENT);
+        stack_mem = NULL;
+        return IOT_CONNECT_ERROR_OUT_OF_MEM;
+    }
+
+    stack_size = CLIENT_STACK_BYTES;
+    memset(stack_mem, CLIENT_STACK_PATTERN, stack_size);
+    thread = new (mem) Thread(osPriorityNormal, stack_size, stack_mem);
+
+    running = true;
+    ret = thread->start(callback(this, &IoTConnectClient::thread_main_loop));
+
+    if (ret != osOK) {
+        tr_error("Start thread failed with osStatus: %d", ret);
+        running = false;
+        return IOT_CONNECT_ERROR_CLIENT_THREAD;
+    }
+
+    return 0;
+}
+
+void IoTConnectClient::thread_main_loop()
+{
+    while (running) {
+        if (connecting) {
+            connect_step();
+            continue;
+        }
+
+        report_connection_lost();
+
+        sync_device_subs();
+        renew_pwd_on_schedule();
+        pub_props_on_schedule();
+        pub_stats_on_schedule();
+        ota_on_schedule();
+
+        if (!is_connected()) {
+            // nothing to read until connect_async(), don't spin on yield errors
+            if (!connecting) {
+                ThisThread::sleep_for(CLIENT_MAIN_YIELD_MS);
+            }
+            continue;
+        }
+
+        if (!mqtt_client || mqtt_client->yield(main_loop_yield_ms()) != MQTT::SUCCESS) {
+            stats_mutex.lock();
+            stats.yield_errors++;
+            stats_mutex.unlock();
+            // error occurs when yield, coninue to check is the connection is lost.
+            continue;
+        }
+
+        if (pub_next() && (pub_rate_msgs.is_limited() || pub_rate_bytes.is_limited())) {
+            // paced by the rate limit rather than a message a yield
+            while (is_connected() && pub_next()) {
+            }
+        }
+    }
+}
+
+// Call on_connection_lost once a connection is lost, not again until connected
+void IoTConnectClient::report_connection_lost()
+{
+    if (is_connected()) {
+        lost_reported = false;
+        return;
+    }
+
+    if (lost_reported) {
+        return;
+    }
+
+    lost_reported = true;
+    tr_error("Connection lost");
+    if (on_connection_lost) {
+        on_connection_lost();
+    }
+}
+
+int IoTConnectClient::start_event_loop(EventQueue* _queue)
+{
+    if (!_queue) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    if (thread || queue) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    queue = _queue;
+    queue_sigio = tap.sigio(callback(this, &IoTConnectClient::event_loop_post)) == 0;
+    if (!queue_sigio) {
+        tr_warn("No sigio from the transport, poll every %d ms", CLIENT_EVENT_POLL_MS);
+    }
+
+    event_loop_post();
+
+    return 0;
+}
+
+// Called by sigio, maybe in an interrupt, and pub()
+void IoTConnectClient::event_loop_post()
+{
+    if (queue_pending) {
+        return;
+    }
+
+    queue_pending = true;
+    queue_call_id = queue->call(callback(this, &IoTConnectClient::event_loop_run));
+    if (queue_call_id == 0) {
+        // the queue is full, the timer still comes
+        queue_pending = false;
+    }
+}
+
+void IoTConnectClient::event_loop_run()
+{
+    bool was_connected;
+    uint32_t rx;
+
+    queue_pending = false;
+    queue_call_id = 0;
+
+    // a phase a run, other events go in between
+    if (connecting) {
+        connect_step();
+        if (connecting) {
+            event_loop_post();
+            return;
+        }
+    }
+
+    report_connection_lost();
+
+    sync_device_subs();
+    renew_pwd_on_schedule();
+    pub_props_on_schedule();
+    pub_stats_on_schedule();
+    ota_on_schedule();
+
+    was_connected = is_connected();
+    while (is_connected() && pub_next()) {
+    }
+
+    // sigio only tells something arrived, read until nothing is left
+    while (is_connected()) {
+        rx = tap.get_rx_bytes();
+        if (mqtt_client->yield(CLIENT_EVENT_YIELD_MS) != MQTT::SUCCESS) {
+            stats_mutex.lock();
+            stats.yield_errors++;
+            stats_mutex.unlock();
+            break;
+        }
+        if (tap.get_rx_bytes() == rx) {
+            break;
+        }
+    }
+
+    if (was_connected && !is_connected()) {
+        // report it in the next run
+        event_loop_post();
+    }
+
+    if (queue_timer_id) {
+        queue->cancel(queue_timer_id);
+    }
+    queue_timer_id = queue->call_in(event_loop_next_ms(), callback(this, &IoTConnectClient::event_loop_run));
+}
+
+// Until the keepalive, a schedule or a retry is due
+int IoTConnectClient::event_loop_next_ms()
+{
+    uint64_t now = Kernel::get_ms_count();
+    uint64_t next = now + (queue_sigio ? CLIENT_EVENT_IDLE_MS : CLIENT_EVENT_POLL_MS);
+    uint64_t due;
+
+    if (!is_connected()) {
+        due = now + CLIENT_RECONNECT_RETRY_MS;
+        next = due < next ? due : next;
+    } else {
+        // a ping to send or its timeout, 0 without keepalive
+        due = mqtt_client->next_keepalive_ms();
+        if (due != 0 && due <= now) {
+            due = now + CLIENT_EVENT_POLL_MS;
+        }
+        if (due != 0) {
+            next = due < next ? due : next;
+        }
+    }
+
+    if (pub_props_period_ms) {
+        due = pub_props_last_ms + pub_props_period_ms;
+        next = due < next ? due : next;
+    }
+
+    if (pub_stats_period_ms) {
+        due = pub_stats_last_ms + pub_stats_period_ms;
+        next = due < next ? due : next;
+    }
+
+    if (ota) {
+        due = ota->next_poll_ms();
+        if (due != 0) {
+            next = due < next ? due : next;
+        }
+    }
+
+    if (pub_rate_due_ms) {
+        next = pub_rate_due_ms < next ? pub_rate_due_ms : next;
+    }
+
+    if (device->is_pwd_expiring()) {
+        next = renew_retry_ms < next ? renew_retry_ms : next;
+    }
+
+    return next > now ? (int)(next - now) : 0;
+}
+
+// Renew the SAS token in advance, rather than be kicked off when it expires
+void IoTConnectClient::renew_pwd_on_schedule()
+{
+    if (device->is_pwd_expiring() && Kernel::get_ms_count() >= renew_retry_ms) {
+        int rc = reconnect();
+        if (rc != 0) {
+            tr_error("Reconnect to renew SAS token failed with %d", rc);
+            renew_retry_ms = Kernel::get_ms_count() + CLIENT_RECONNECT_RETRY_MS;
+        }
+    }
+}
+
+// Publish the oldest message in the buffer, false if it's empty
+bool IoTConnectClient::pub_next()
+{
+    IoTConnectPubMsg* pub_msg = NULL;
+
+    stats_mutex.lock();
+    if (!pubs.peek(pub_msg)) {
+        pub_rate_due_ms = 0;
+        stats_mutex.unlock();
+        return false;
+    }
+    if (pub_msg && pub_rate_hold(pub_msg)) {
+        stats_mutex.unlock();
+        return false;
+    }
+    pubs.pop(pub_msg);
+    stats.queue_depth--;
+    stats_mutex.unlock();
+
+    if (pub_msg == NULL) {
+        return true;
+    }
+
+#if MQTT_CLIENT_PROFILE
+    IoTConnectProfileMark mark;
+    profile_mark(&mark);
+#endif
+    pub_send(pub_msg);
+#if MQTT_CLIENT_PROFILE
+    profile_add(IOT_CONNECT_PROFILE_PUBLISH, &mark);
+#endif
+
+    return true;
+}
+
+// The rate limit holds _msg at the head of the buffer, or takes its tokens. With stats_mutex held.
+bool IoTConnectClient::pub_rate_hold(IoTConnectPubMsg* _msg)
+{
+    uint64_t now = Kernel::get_ms_count();
+    uint32_t wait = pub_rate_msgs.wait_ms(1, now);
+    uint32_t wait_bytes = pub_rate_bytes.wait_ms(_msg->msg.payloadlen, now);
+
+    if (wait_bytes > wait) {
+        wait = wait_bytes;
+    }
+
+    if (wait) {
+        if (!_msg->throttle_us) {
+            _msg->throttle_us = iot_connect_us_now();
+            stats.pub_throttled++;
+        }
+        pub_rate_due_ms = now + wait;
+        return true;
+    }
+
+    pub_rate_msgs.take(1, now);
+    pub_rate_bytes.take(_msg->msg.payloadlen, now);
+    pub_rate_due_ms = 0;
+
+    return false;
+}
+
+// A yield of the main loop, shorter when a message held by the rate limit could go
+int IoTConnectClient::main_loop_yield_ms()
+{
+    uint64_t due = pub_rate_due_ms;
+    uint64_t now = Kernel::get_ms_count();
+
+    if (due == 0 || due >= now + CLIENT_MAIN_YIELD_MS) {
+        return CLIENT_MAIN_YIELD_MS;
+    }
+
+    return due > now ? (int)(due - now) : 1;
+}
+
+// Publish a message taken from the buffer and free it
+void IoTConnectClient::pub_send(IoTConnectPubMsg* _pub_msg)
+{
+    const char* topic_pub;
+
+    if (_pub_msg->device) {
+        // a downstream device may be removed while it's published, its topic is copied
+        devices_mutex.lock();
+        topic_pub = NULL;
+        if (has_child(_pub_msg->device)) {
+            topic_pub = topic_with_props(_pub_msg->device->get_mqtt_topic_pub(), _pub_msg->topic_props);
+        }
+        devices_mutex.unlock();
+        if (!topic_pub) {
+            tr_warn("Message#%d of a removed device or no memory for its topic", _pub_msg->msg.id);
+            stats_mutex.lock();
+            stats.pub_errors++;
+            stats_mutex.unlock();
+            clear_report(_pub_msg);
+            free_pub_msg(_pub_msg);
+            return;
+        }
+    } else {
+        topic_pub = device->get_mqtt_topic_pub();
+    }
+
+    _pub_msg->dequeue_us = iot_connect_us_now();
+    if (_pub_msg->expiry_s) {
+        uint64_t queued_s = (_pub_msg->dequeue_us - _pub_msg->enqueue_us) / 1000000;
+
+        if (queued_s >= _pub_msg->expiry_s) {
+            tr_warn("Topic[%s] message#%d expired in the buffer", topic_pub, _pub_msg->msg.id);
+            stats_mutex.lock();
+            stats.pub_expired++;
+            stats_mutex.unlock();
+            clear_report(_pub_msg);
+            free_pub_msg(_pub_msg);
+            return;
+        }
+        // the broker counts the rest
+        _pub_msg->expiry_s -= queued_s;
+    }
+
+    if (_pub_msg->topic_props && !_pub_msg->device) {
+        topic_pub = topic_with_props(topic_pub, _pub_msg->topic_props);
+        if (!topic_pub) {
+            tr_error("No memory for the topic of message#%d", _pub_msg->msg.id);
+            stats_mutex.lock();
+            stats.pub_errors++;
+            stats_mutex.unlock();
+            clear_report(_pub_msg);
+            free_pub_msg(_pub_msg);
+            return;
+        }
+    }
+
+    // the own device's topic stays put, it may get a topic alias
+    bool fixed_topic = topic_pub != topic_buf;
+    int rc;
+    if (_pub_msg->reader) {
+        rc = mqtt_client->publish_stream(topic_pub, _pub_msg->msg, *_pub_msg->reader, _pub_msg->expiry_s,
+                                         fixed_topic);
+    } else {
+        rc = mqtt_client->publish(topic_pub, _pub_msg->msg, _pub_msg->expiry_s, fixed_topic);
+    }
+    if(rc != MQTT::SUCCESS) {
+        tr_error("Topic[%s] publish message#%d failed\n", topic_pub, _pub_msg->msg.id);
+        stats_mutex.lock();
+        stats.pub_errors++;
+        stats_mutex.unlock();
+        clear_report(_pub_msg);
+    } else {
+        // publish() returns once written for QoS0, or once acked
+        _pub_msg->write_us = tap.get_last_write_us();
+        _pub_msg->ack_us = _pub_msg->msg.qos == MQTT::QOS0 ? _pub_msg->write_us : iot_connect_us_now();
+        record_latency(_pub_msg);
+
+        if (_pub_msg->report && !_pub_msg->device) {
+            device->mark_reported(_pub_msg->report);
+        } else if (_pub_msg->report) {
+            devices_mutex.lock();
+            if (has_child(_pub_msg->device)) {
+                _pub_msg->device->mark_reported(_pub_msg->report);
+            }
+            devices_mutex.unlock();
+        }
+
+        stats_mutex.lock();
+        stats.pub_msgs++;
+        stats.pub_bytes += _pub_msg->msg.payloadlen;
+        stats_mutex.unlock();
+    }
+    tr_info("Topic[%s] publish message#%d succeed", topic_pub, _pub_msg->msg.id);
+    #if MBED_TRACE_MAX_LEVEL >= TRACE_LEVEL_DEBUG
+    if (_pub_msg->msg.payload) {
+        tr_array((uint8_t*)_pub_msg->msg.payload, _pub_msg->msg.payloadlen);
+    }
+    #endif
+
+    // destrory the message
+    free_pub_msg(_pub_msg);
+}
+
+// The properties of a pub_props() message not published are reportable again
+void IoTConnectClient::clear_report(IoTConnectPubMsg* _pub_msg)
+{
+    if (!_pub_msg->report) {
+        return;
+    }
+
+    if (!_pub_msg->device) {
+        device->clear_in_flight(_pub_msg->report);
+        return;
+    }
+
+    devices_mutex.lock();
+    if (has_child(_pub_msg->device)) {
+        _pub_msg->device->clear_in_flight(_pub_msg->report);
+    }
+    devices_mutex.unlock();
+}
+
+// _topic_pub followed by _props, if any, in topic_buf, NULL if it couldn't grow
+const char* IoTConnectClient::topic_with_props(const char* _topic_pub, const char* _props)
+{
+    size_t prefix_len = strlen(_topic_pub);
+    size_t size = prefix_len + (_props ? strlen(_props) : 0) + 1;
+
+    if (size > topic_buf_size) {
+        mem_free(topic_buf, IOT_CONNECT_MEM_CLIENT);
+        topic_buf = (char*)mem_alloc(size, IOT_CONNECT_MEM_CLIENT);
+        topic_buf_size = topic_buf ? size : 0;
+        if (!topic_buf) {
+            return NULL;
+        }
+    }
+
+    memcpy(topic_buf, _topic_pub, prefix_len);
+    strcpy(topic_buf + prefix_len, _props ? _props : "");
+
+    return topic_buf;
+}
+
+void IoTConnectClient::record_latency(const IoTConnectPubMsg* _msg)
+{
+    latency_mutex.lock();
+    latency[IOT_CONNECT_LATENCY_QUEUE].record(_msg->dequeue_us - _msg->enqueue_us);
+    latency[IOT_CONNECT_LATENCY_WRITE].record(_msg->write_us - _msg->dequeue_us);
+    if (_msg->msg.qos != MQTT::QOS0) {
+        latency[IOT_CONNECT_LATENCY_ACK].record(_msg->ack_us - _msg->write_us);
+    }
+    latency[IOT_CONNECT_LATENCY_TOTAL].record(_msg->ack_us - _msg->enqueue_us);
+    if (_msg->throttle_us) {
+        latency[IOT_CONNECT_LATENCY_THROTTLE].record(_msg->dequeue_us - _msg->throttle_us);
+    }
+    latency_mutex.unlock();
+}
+
+int IoTConnectClient::get_latency(IoTConnectLatencyStage _stage, IoTConnectHistogram* _hist)
+{
+    if (_stage < 0 || _stage >= IOT_CONNECT_LATENCY_STAGES || !_hist) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    latency_mutex.lock();
+    *_hist = latency[_stage];
+    latency_mutex.unlock();
+
+    return 0;
+}
+
+void IoTConnectClient::reset_latency()
+{
+    int i;
+
+    latency_mutex.lock();
+    for (i = 0; i < IOT_CONNECT_LATENCY_STAGES; i++) {
+        latency[i].reset();
+    }
+    latency_mutex.unlock();
+}
+
+int IoTConnectClient::get_stats(IoTConnectClientStats* _stats)
+{
+    if (!_stats) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    stats_mutex.lock();
+    *_stats = stats;
+    if (mqtt_client) {
+        _stats->pings += mqtt_client->get_pings();
+        _stats->ping_timeouts += mqtt_client->get_ping_timeouts();
+    }
+    stats_mutex.unlock();
+
+    _stats->connect_ms = tap.get_connect_ms();
+    _stats->tls_handshake_ms = tap.get_tls_handshake_ms();
+    _stats->rx_bytes = tap.get_rx_bytes();
+    _stats->tx_bytes = tap.get_tx_bytes();
+
+    return 0;
+}
+
+void IoTConnectClient::reset_stats()
+{
+    uint32_t depth;
+
+    stats_mutex.lock();
+    depth = stats.queue_depth;
+    memset(&stats, 0, sizeof(stats));
+    stats.queue_depth = depth;
+    stats.queue_high = depth;
+    if (mqtt_client) {
+        // offsets the live session's counters added in get_stats(), they wrap around
+        stats.pings = 0 - mqtt_client->get_pings();
+        stats.ping_timeouts = 0 - mqtt_client->get_ping_timeouts();
+    }
+    stats_mutex.unlock();
+}
+
+int IoTConnectClient::pub_stats_every(int _period_ms, MQTT::QoS _qos)
+{
+    if (_period_ms < 0) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    pub_stats_qos = _qos;
+    pub_stats_last_ms = Kernel::get_ms_count();
+    pub_stats_period_ms = _period_ms;
+
+    return 0;
+}
+
+void IoTConnectClient::pub_stats_on_schedule()
+{
+    IoTConnectClientStats st;
+    IoTConnectClientFootprint fp;
+    MQTT::Message pub_msg;
+    char json[480];
+    uint64_t now;
+    int len;
+    int r;
+
+    if (pub_stats_period_ms == 0) {
+        return;
+    }
+
+    now = Kernel::get_ms_count();
+    if (now - pub_stats_last_ms < (uint64_t)pub_stats_period_ms) {
+        return;
+    }
+    pub_stats_last_ms = now;
+
+    get_stats(&st);
+    get_footprint(&fp);
+
+    len = snprintf(json, sizeof(json),
+                   "{\"stats\":{\"pub\":%lu,\"pub_bytes\":%lu,\"pub_full\":%lu,\"pub_err\":%lu,"
+                   "\"recv\":%lu,\"recv_bytes\":%lu,\"parse_err\":%lu,\"queue\":%lu,\"queue_high\":%lu,"
+                   "\"yield_err\":%lu,\"reconnects\":%lu,\"connect_ms\":%lu,\"tls_ms\":%lu,\"rx\":%lu,\"tx\":%lu,"
+                   "\"pings\":%lu,\"ping_to\":%lu,\"pub_expired\":%lu,\"pub_throttled\":%lu,"
+                   "\"stack_max\":%lu,\"cb_stack_max\":%lu}}",
+                   (unsigned long)st.pub_msgs, (unsigned long)st.pub_bytes, (unsigned long)st.pub_full,
+                   (unsigned long)st.pub_errors, (unsigned long)st.recv_msgs, (unsigned long)st.recv_bytes,
+                   (unsigned long)st.parse_errors, (unsigned long)st.queue_depth, (unsigned long)st.queue_high,
+                   (unsigned long)st.yield_errors, (unsigned long)st.reconnects, (unsigned long)st.connect_ms,
+                   (unsigned long)st.tls_handshake_ms, (unsigned long)st.rx_bytes, (unsigned long)st.tx_bytes,
+                   (unsigned long)st.pings, (unsigned long)st.ping_timeouts,
+                   (unsigned long)st.pub_expired, (unsigned long)st.pub_throttled,
+                   (unsigned long)fp.stack_max, (unsigned long)fp.callback_stack_max);
+
+    pub_msg.qos = pub_stats_qos;
+    pub_msg.retained = false;
+    pub_msg.dup = false;
+    pub_msg.id = msg_id_pub_props++;
+    pub_msg.payload = json;
+    pub_msg.payloadlen = len;
+
+    r = pub(&pub_msg);
+    if (r != 0) {
+        tr_error("Publish stats on schedule failed with %d", r);
+    }
+}
+
+int IoTConnectClient::get_footprint(IoTConnectClientFootprint* _footprint)
+{
+    IoTConnectMemStats mem;
+
+    if (!_footprint) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    memset(_footprint, 0, sizeof(IoTConnectClientFootprint));
+
+    if (stack_mem) {
+        _footprint->stack_size = stack_size;
+        _footprint->stack_max = stack_size - stack_untouched(stack_mem, stack_mem + stack_size);
+        if (stack_max > _footprint->stack_max) {
+            _footprint->stack_max = stack_max;
+        }
+    }
+    _footprint->callback_stack_max = callback_stack_max;
+
+    if ((allocator ? allocator : iot_connect_get_allocator())->get_stats(IOT_CONNECT_MEM_TAGS, &mem) == 0) {
+        _footprint->heap_live = mem.live_bytes;
+        _footprint->heap_peak = mem.peak_bytes;
+    }
+
+    _footprint->tls_heap = tls_heap;
+    _footprint->tls_heap_handshake = tls_heap_handshake;
+
+    return 0;
+}
+
+int IoTConnectClient::get_profile(IoTConnectProfileSection _section, IoTConnectProfile* _profile)
+{
+#if MQTT_CLIENT_PROFILE
+    if (_section < 0 || _section >= IOT_CONNECT_PROFILE_SECTIONS || !_profile) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    stats_mutex.lock();
+    *_profile = profile[_section];
+    stats_mutex.unlock();
+
+    return 0;
+#else
+    return IOT_CONNECT_ERROR_NS_UNSUPPORTED;
+#endif
+}
+
+void IoTConnectClient::reset_profile()
+{
+    stats_mutex.lock();
+    memset(profile, 0, sizeof(profile));
+    stats_mutex.unlock();
+}
+
+static uint32_t allocator_allocs(IoTConnectAllocator* _allocator)
+{
+    IoTConnectMemStats mem;
+
+    return _allocator->get_stats(IOT_CONNECT_MEM_TAGS, &mem) == 0 ? mem.allocs : 0;
+}
+
+void IoTConnectClient::profile_mark(IoTConnectProfileMark* _mark)
+{
+    IoTConnectAllocator* global = iot_connect_get_allocator();
+
+    // devices and properties take from the global one
+    _mark->allocs = allocator_allocs(global);
+    if (allocator && allocator != global) {
+        _mark->allocs += allocator_allocs(allocator);
+    }
+    _mark->cpu_us = iot_connect_cpu_us();
+}
+
+void IoTConnectClient::profile_add(IoTConnectProfileSection _section, const IoTConnectProfileMark* _mark)
+{
+    IoTConnectProfileMark now;
+    uint32_t cpu_us;
+
+    profile_mark(&now);
+    cpu_us = (uint32_t)(now.cpu_us - _mark->cpu_us);
+
+    stats_mutex.lock();
+    profile[_section].calls++;
+    profile[_section].cpu_us += cpu_us;
+    if (cpu_us > profile[_section].cpu_max_us) {
+        profile[_section].cpu_max_us = cpu_us;
+    }
+    profile[_section].allocs += now.allocs - _mark->allocs;
+    stats_mutex.unlock();
+}
+
+void IoTConnectClient::dispatch_received(MQTT::Message& _msg, IoTConnectDevice* _device)
+{
+    char* buf;
+    MQTT::Message* msg_new;
+
+    stats_mutex.lock();
+    stats.recv_msgs++;
+    stats.recv_bytes += _msg.payloadlen;
+    stats_mutex.unlock();
+
+    // chunks are programmed from the receive buffer, not copied
+    if (ota && !_device && ota->handle(&_msg)) {
+        return;
+    }
+
+    buf = (char*)mem_alloc(_msg.payloadlen + 1, IOT_CONNECT_MEM_RECV);
+    if (!buf) {
+        tr_error("Out of memory when buffer message");
+        return;
+    }
+    memcpy(buf, _msg.payload, _msg.payloadlen);
+    buf[_msg.payloadlen] = '\0';
+
+    msg_new = (MQTT::Message*)mem_alloc(sizeof(MQTT::Message), IOT_CONNECT_MEM_RECV);
+    if (!msg_new) {
+        tr_error("Out of memory when buffer message");
+        mem_free(buf, IOT_CONNECT_MEM_RECV);
+        return;
+    }
+    memset(msg_new, 0, sizeof(MQTT::Message));
+    msg_new->qos = _msg.qos;
+    msg_new->retained = _msg.retained;
+    msg_new->dup = _msg.dup;
+    msg_new->id = _msg.id;
+    msg_new->payload = buf;
+    msg_new->payloadlen = _msg.payloadlen;
+
+#if MQTT_CLIENT_STACK_STATS
+    // Only in the client thread, messages may arrive while subscribing in another thread
+    unsigned char* entry = (unsigned char*)&buf;
+    bool in_thread = stack_mem && entry > stack_mem && entry < stack_mem + stack_size;
+    unsigned char* painted = NULL;
+
+    if (in_thread) {
+        // repainting wipes out the thread's high-water, keep it first
+        uint32_t used = stack_size - stack_untouched(stack_mem, entry);
+        if (used > stack_max) {
+            stack_max = used;
+        }
+        painted = stack_paint_below(stack_mem);
+    }
+#endif
+
+    if (on_received) {
+        tr_info("Client has a customized on_received callback");
+        tr_debug("NOTE: This won't update device properties because client has handler this message");
+        on_received(msg_new);
+    } else {
+        tr_debug("Update device properties according to the message");
+        update_props_on_recieved(msg_new, _device);
+    }
+
+#if MQTT_CLIENT_STACK_STATS
+    if (in_thread) {
+        // rounded up to where painting stopped
+        unsigned char* deepest = stack_mem + stack_untouched(stack_mem, painted);
+        if ((uint32_t)(entry - deepest) > callback_stack_max) {
+            callback_stack_max = entry - deepest;
+        }
+    }
+#endif
+
+    // Free buffer
+    mem_free(msg_new, IOT_CONNECT_MEM_RECV);
+    mem_free(buf, IOT_CONNECT_MEM_RECV);
+}
+
+int IoTConnectClient::set_pub_rate(uint32_t _msgs_per_s, uint32_t _msg_burst, uint32_t _bytes_per_s,
+                                   uint32_t _byte_burst)
+{
+    uint64_t now = Kernel::get_ms_count();
+
+    stats_mutex.lock();
+    pub_rate_msgs.set(_msgs_per_s, _msg_burst, now);
+    pub_rate_bytes.set(_bytes_per_s, _byte_burst, now);
+    pub_rate_due_ms = 0;
+    stats_mutex.unlock();
+
+    if (queue) {
+        event_loop_post();
+    }
+
+    return 0;
+}
+
+int IoTConnectClient::set_ota(IoTConnectOta* _ota)
+{
+    ota = _ota;
+
+    return 0;
+}
+
+void IoTConnectClient::ota_on_schedule()
+{
+    if (ota) {
+        ota->poll();
+    }
+}
+
+void IoTConnectClient::update_props_on_recieved(MQTT::Message* _msg, IoTConnectDevice* _device)
+{
+    const char* js = (const char*)_msg->payload;
+    int r;
+#if MQTT_CLIENT_PROFILE
+    IoTConnectProfileMark mark;
+    profile_mark(&mark);
+#endif
+
+    r = (_device ? _device : device)->update(js);
+#if MQTT_CLIENT_PROFILE
+    profile_add(IOT_CONNECT_PROFILE_UPDATE, &mark);
+#endif
+    if (r < 0) {
+        stats_mutex.lock();
+        stats.parse_errors++;
+        stats_mutex.unlock();
+    }
+}
+
+void IoTConnectClient::set_event_handler(Callback<void()> _on_connection_lost)
+{
+    if (_on_connection_lost) {
+        on_connection_lost = _on_connection_lost;
+    }
+}
+
+int IoTConnectClient::pub_props(MQTT::QoS _qos, IoTConnectDevice* _device)
+{
+    int r;
+    char* json = NULL;
+    MQTT::Message pub_msg;
+    IoTConnectReportSnapshot report;
+
+    if (!_device) {
+        _device = device;
+    }
+
+    // in flight until published, a message lost on the way is reported again
+    r = _device->report_json(&json, &report);
+    if (r != 0) {
+        return r;
+    }
+    if (!json) {
+        tr_debug("No property is worth to report");
+        return 0;
+    }
+
+    pub_msg.qos = _qos;
+    pub_msg.retained = false;
+    pub_msg.dup = false;
+    pub_msg.id = msg_id_pub_props++;
+    pub_msg.payload = (void*)json;
+    pub_msg.payloadlen = strlen(json);
+
+    r = copy_pub(&pub_msg, NULL, 0, _device, MQTT_MESSAGE_EXPIRY, &report);
+    iot_connect_free(json, IOT_CONNECT_MEM_JSON);
+    if (r != 0) {
+        _device->clear_in_flight(&report);
+    }
+
+    return r;
+}
+
+int IoTConnectClient::pub_props_every(int _period_ms, MQTT::QoS _qos)
+{
+    if (_period_ms < 0) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    pub_props_qos = _qos;
+    pub_props_last_ms = Kernel::get_ms_count();
+    pub_props_period_ms = _period_ms;
+
+    return 0;
+}
+
+void IoTConnectClient::pub_props_on_schedule()
+{
+    uint64_t now;
+    int r;
+    int i;
+
+    if (pub_props_period_ms == 0) {
+        return;
+    }
+
+    now = Kernel::get_ms_count();
+    if (now - pub_props_last_ms < (uint64_t)pub_props_period_ms) {
+        return;
+    }
+    pub_props_last_ms = now;
+
+    device->close_series_windows();
+
+    r = pub_props(pub_props_qos);
+    if (r != 0) {
+        tr_error("Publish properties on schedule failed with %d", r);
+    }
+
+    // pub_props() only queues
+    devices_mutex.lock();
+    for (i = 0; i < children_num; i++) {
+        IoTConnectDevice* child = children[i].device;
+
+        child->close_series_windows();
+
+        r = pub_props(pub_props_qos, child);
+        if (r != 0) {
+            tr_error("Publish properties of %s on schedule failed with %d", child->get_client_id(), r);
+        }
+    }
+    devices_mutex.unlock();
 }
\ No newline at end of file
@@ -1,59 +1,380 @@
 #ifndef __IOT_CONNECT_CLIENT_H__
 #define __IOT_CONNECT_CLIENT_H__
 
-#include "mbed.h"
+#include "IoTConnectPlatform.h"
 #include "IoTConnectEntry.h"
 #include "IoTConnectDevice.h"
-#include <MQTTClientMbedOs.h>
+#include "IoTConnectNetwork.h"
+#include "IoTConnectNetworkTap.h"
+#include "IoTConnectHistogram.h"
+#include "IoTConnectTokenBucket.h"
+#include "IoTConnectAllocator.h"
+#include "IoTConnectMqttSession.h"
+#include "IoTConnectTrustStore.h"
+#include "IoTConnectTlsProfile.h"
+#include "IoTConnectTlsHeap.h"
+#include "IoTConnectMsgProps.h"
 #include "IoTConnectError.h"
 
 #define MQTT_PUB_BUFFER_MSG_NUMBER MBED_CONF_IOT_CONNECT_MQTT_PUB_BUFFER_MAX
 #define MQTT_SUB_BUFFER_MSG_NUMBER MBED_CONF_IOT_CONNECT_MQTT_SUB_BUFFER_MAX
 #define MQTT_CLIENT_THREAD_STACK_SIZE MBED_CONF_IOT_CONNECT_MQTT_CLIENT_THREAD_STACK_SIZE
+#define MQTT_CLIENT_STACK_STATS MBED_CONF_IOT_CONNECT_MQTT_CLIENT_STACK_STATS
+#define MQTT_CLIENT_PROFILE MBED_CONF_IOT_CONNECT_MQTT_CLIENT_PROFILE
+#define MQTT_KEEPALIVE MBED_CONF_IOT_CONNECT_MQTT_KEEPALIVE
+#define MQTT_PING_TIMEOUT_MS MBED_CONF_IOT_CONNECT_MQTT_PING_TIMEOUT_MS
+#define MQTT_VERSION MBED_CONF_IOT_CONNECT_MQTT_VERSION
+#define MQTT_MESSAGE_EXPIRY MBED_CONF_IOT_CONNECT_MQTT_MESSAGE_EXPIRY
+#define MQTT_PUB_RATE_MSGS MBED_CONF_IOT_CONNECT_MQTT_PUB_RATE_MSGS
+#define MQTT_PUB_RATE_MSG_BURST MBED_CONF_IOT_CONNECT_MQTT_PUB_RATE_MSG_BURST
+#define MQTT_PUB_RATE_BYTES MBED_CONF_IOT_CONNECT_MQTT_PUB_RATE_BYTES
+#define MQTT_PUB_RATE_BYTE_BURST MBED_CONF_IOT_CONNECT_MQTT_PUB_RATE_BYTE_BURST
 
+class IoTConnectOta;
+
+// A message in the publish buffer
+typedef struct {
+    MQTT::Message msg;
+    // Publish to this device's topic, NULL for the client's own device
+    IoTConnectDevice* device;
+    // Seconds the message is worth publishing after pub(), 0 for ever
+    uint32_t expiry_s;
+    // URL encoded application properties, after the payload in its buffer, NULL for none
+    const char* topic_props;
+    // Pulls the payload when it's published, msg.payload is NULL then
+    IoTConnectPayloadReader* reader;
+    // pub_props() values, marked as reported once published, NULL for other messages
+    IoTConnectReportSnapshot* report;
+    // iot_connect_us_now() when pub() queued it, the main loop took it, it was written,
+    // and PUBACK arrived (written for QoS0)
+    uint64_t enqueue_us;
+    uint64_t dequeue_us;
+    uint64_t write_us;
+    uint64_t ack_us;
+    // when the publish rate limit first held it at the head of the buffer, 0 if it didn't
+    uint64_t throttle_us;
+} IoTConnectPubMsg;
+
+typedef enum {
+    IOT_CONNECT_LATENCY_QUEUE = 0,  // enqueue -> dequeue
+    IOT_CONNECT_LATENCY_WRITE,      // dequeue -> written, serialization and socket write
+    IOT_CONNECT_LATENCY_ACK,        // written -> PUBACK, QoS > 0 only
+    IOT_CONNECT_LATENCY_TOTAL,      // enqueue -> PUBACK, or written for QoS0
+    IOT_CONNECT_LATENCY_THROTTLE,   // held by the publish rate limit -> dequeue, held ones only
+    IOT_CONNECT_LATENCY_STAGES
+} IoTConnectLatencyStage;
+
+// Client counters, they wrap around
+typedef struct {
+    uint32_t pub_msgs;          // published, written for QoS0 or acked
+    uint32_t pub_bytes;         // payload bytes of pub_msgs
+    uint32_t pub_full;          // pub() returned IOT_CONNECT_ERROR_CLIENT_PUB_FULL
+    uint32_t pub_errors;        // MQTT publish failed, the message is dropped
+    uint32_t recv_msgs;
+    uint32_t recv_bytes;        // payload bytes of recv_msgs
+    uint32_t parse_errors;      // inbound messages the device couldn't be updated from
+    uint32_t queue_depth;       // messages in pubs
+    uint32_t queue_high;        // high-water mark of queue_depth, vs mqtt-pub-buffer-max
+    uint32_t yield_errors;
+    uint32_t reconnects;
+    uint32_t connect_ms;        // last connect of the transport, DNS, TCP and TLS handshake
+    uint32_t rx_bytes;          // transport bytes, MQTT and TLS overhead included
+    uint32_t tx_bytes;
+    uint32_t pings;             // PINGREQs sent, only when the connection was quiet
+    uint32_t ping_timeouts;     // PINGREQs unanswered, the connection was dropped as half-open
+    uint32_t pub_expired;       // dropped from pubs, older than their expiry
+    uint32_t pub_throttled;     // held at the head of pubs by the publish rate limit
+    uint32_t tls_handshake_ms;  // TLS handshake of the last connect, part of connect_ms
+} IoTConnectClientStats;
+
+// Sections of the client profiled with mqtt-client-profile
+typedef enum {
+    IOT_CONNECT_PROFILE_RECEIVE = 0,    // a message in the subscribe handler, on_received or the update included
+    IOT_CONNECT_PROFILE_UPDATE,         // device properties updated from a message
+    IOT_CONNECT_PROFILE_PUBLISH,        // a message of the publish buffer, serialized and written, until acked for QoS > 0,
+                                        // messages received meanwhile included
+    IOT_CONNECT_PROFILE_SECTIONS
+} IoTConnectProfileSection;
+
+// CPU time of the thread in a section, see iot_connect_cpu_us(), and allocations
+// through the library's allocators, if they keep accounts. Other threads allocating
+// at the same time are counted too.
+typedef struct {
+    uint32_t calls;
+    uint64_t cpu_us;
+    uint32_t cpu_max_us;
+    uint32_t allocs;
+} IoTConnectProfile;
+
+// Where a profiled section started
+typedef struct {
+    uint64_t cpu_us;
+    uint32_t allocs;
+} IoTConnectProfileMark;
+
+// A subscribe topic of a downstream device, copied: the MQTT session keeps it as the
+// filter until it's unsubscribed in the client's context, after the device is removed
+typedef struct IoTConnectTopicNode {
+    struct IoTConnectTopicNode* next;
+    char topic[1];
+} IoTConnectTopicNode;
+
+typedef struct {
+    IoTConnectDevice* device;
+    IoTConnectTopicNode* sub;
+    bool subscribed;
+} IoTConnectChild;
+
+// Memory used by a client, in bytes
+typedef struct {
+    uint32_t stack_size;            // client thread stack
+    uint32_t stack_max;             // high-water of the client thread stack
+    uint32_t callback_stack_max;    // deepest on_received / on_change went, with mqtt-client-stack-stats
+    size_t heap_live;               // library allocations, if the allocator keeps accounts
+    size_t heap_peak;
+    size_t tls_heap;                // mbedTLS heap of the connection after the handshake, see IoTConnectTlsHeap.h
+    size_t tls_heap_handshake;      // most during the handshake, handshakes of other clients are held off
+} IoTConnectClientFootprint;
 
 class IoTConnectClient
 {
 
 public:
-    CircularBuffer<MQTT::Message*, MQTT_PUB_BUFFER_MSG_NUMBER> pubs;
+    CircularBuffer<IoTConnectPubMsg*, MQTT_PUB_BUFFER_MSG_NUMBER> pubs;
 
     Callback<void(MQTT::Message*)> on_received;
 
 public:
+#if !defined(IOT_CONNECT_PLATFORM_POSIX)
     IoTConnectClient(NetworkInterface *_network, IoTConnectDevice *_device);
+#endif
+    // The transport isn't owned by the client
+    IoTConnectClient(IoTConnectNetwork *_transport, IoTConnectDevice *_device);
     ~IoTConnectClient();
 
     int connect();
+    // Connect a phase at a time in the main loop or event loop, which should be started.
+    // Returns at once, _on_phase is called in the client's context as each phase ends,
+    // with 0 or the error that stopped the connect; subscribe once the MQTT phase is done.
+    int connect_async(Callback<void(IoTConnectPhase, int)> _on_phase = NULL);
+    bool is_connecting() const;
     int disconnect();
     bool is_connected();
     void set_event_handler(Callback<void()> _on_connection_lost);
+    // MQTT keepalive in seconds, 0 for none, and how long a PINGREQ may go unanswered
+    // before the connection is taken as half-open and lost. From the next connect.
+    int set_keepalive(int _interval_s, int _ping_timeout_ms = MQTT_PING_TIMEOUT_MS);
+    // 4 for MQTT 3.1.1, which IoT Hub speaks, or 5 for MQTT 5 brokers. From the next connect.
+    int set_mqtt_version(int _version);
+    // Certificates parsed once, shared by clients, from the next connect. NULL _ca for
+    // the Azure roots, NULL _client for the device's PEM parsed at the first connect.
+    // The stores should outlive the client.
+    int set_trust_store(IoTConnectTrustStore* _ca, IoTConnectTrustStore* _client = NULL);
+    // Cipher suites, curves and max fragment length offered, from the next connect.
+    // iot_connect_tls_profile_default() unless set, NULL for mbedTLS's defaults.
+    int set_tls_profile(const IoTConnectTlsProfile* _profile);
 
     int subscribe(MQTT::QoS qos, Callback<void(MQTT::Message*)> _on_received = NULL);
-    int pub(MQTT::Message* _msg);
+    // _expiry_s > 0: dropped if still queued that long after, and with MQTT 5 the
+    // broker drops it too once it has been that long undelivered
+    int pub(MQTT::Message* _msg, IoTConnectDevice* _device = NULL, uint32_t _expiry_s = MQTT_MESSAGE_EXPIRY);
+    // With application properties appended to the topic, encoded at most mqtt-topic-props-max
+    // bytes. They are copied, with the payload in the same buffer.
+    int pub(MQTT::Message* _msg, const IoTConnectMsgProperty* _props, int _props_num,
+            IoTConnectDevice* _device = NULL, uint32_t _expiry_s = MQTT_MESSAGE_EXPIRY);
+    // A payload of _msg->payloadlen bytes, _msg->payload isn't used: _reader is called in the
+    // client's context when the message is published, for a chunk at a time, and the chunks
+    // are written to the connection as they come, nothing is copied. Whatever it reads from
+    // should stay valid until then. A reader failing halfway drops the connection.
+    int pub_stream(MQTT::Message* _msg, IoTConnectPayloadReader _reader, IoTConnectDevice* _device = NULL,
+                   uint32_t _expiry_s = MQTT_MESSAGE_EXPIRY);
+
+    // Publish at most _msgs_per_s messages and _bytes_per_s payload bytes a second, 0 for
+    // no limit, in bursts of at most _msg_burst / _byte_burst, 0 for a second's worth.
+    // Messages wait in pubs meanwhile, the buckets fill up while disconnected too.
+    int set_pub_rate(uint32_t _msgs_per_s, uint32_t _msg_burst = 0, uint32_t _bytes_per_s = 0,
+                     uint32_t _byte_burst = 0);
+
+    // Hand OTA notifications and chunks of the client's own device to _ota, before
+    // on_received, and poll it in the main loop. NULL to stop.
+    int set_ota(IoTConnectOta* _ota);
 
     int start_main_loop();
+    // Run the client on _queue instead of its own thread, when the transport signals
+    // or a timer for the keepalive and schedules is due, so it takes no stack and
+    // sleeps in between. Without sigio() on the transport, it polls. Connect and
+    // subscribe in the queue's thread or before, QoS1 publishes block the queue until
+    // acked. The client should be destroyed in the queue's thread.
+    int start_event_loop(EventQueue* _queue);
+
+    // Allocator of the client's buffers and MQTT session, NULL for the global one.
+    // Set before connecting, adding devices or publishing.
+    int set_allocator(IoTConnectAllocator* _allocator);
+
+    void update_props_on_recieved(MQTT::Message* _msg, IoTConnectDevice* _device = NULL);
+    // Called by the subscribe handler, to on_received or update_props_on_recieved()
+    void dispatch_received(MQTT::Message& _msg, IoTConnectDevice* _device);
+    int pub_props(MQTT::QoS _qos = MQTT::QOS0, IoTConnectDevice* _device = NULL);
+    // Close series windows and publish properties periodically in the main loop, 0 to stop
+    int pub_props_every(int _period_ms, MQTT::QoS _qos = MQTT::QOS0);
+
+    // Gateway mode, downstream devices share this client's connection,
+    // they are routed by device id and never connect by themselves.
+    // Could be called in any thread, the topic is subscribed / unsubscribed in the
+    // client's context. Once remove_device() returns, the client won't touch the device.
+    int add_device(IoTConnectDevice* _device);
+    int remove_device(IoTConnectDevice* _device);
+    // Client's own device or a downstream device with the client id
+    IoTConnectDevice* find_device(const char* _client_id, size_t _len);
+    // Called by the subscribe handler, for a downstream device which may be removed meanwhile
+    void dispatch_downstream(MQTT::Message& _msg, const char* _client_id, size_t _len);
+
+    // Copy the latency histogram of a stage of published messages
+    int get_latency(IoTConnectLatencyStage _stage, IoTConnectHistogram* _hist);
+    void reset_latency();
 
-    void update_props_on_recieved(MQTT::Message* _msg);
-    int pub_props(MQTT::QoS _qos = MQTT::QOS0);
+    int get_stats(IoTConnectClientStats* _stats);
+    // Zero the counters, but queue_depth
+    void reset_stats();
+    // Publish a stats snapshot as telemetry periodically in the main loop, 0 to stop
+    int pub_stats_every(int _period_ms, MQTT::QoS _qos = MQTT::QOS0);
+
+    int get_footprint(IoTConnectClientFootprint* _footprint);
+
+    // Copy the profile of a section, IOT_CONNECT_ERROR_NS_UNSUPPORTED without mqtt-client-profile
+    int get_profile(IoTConnectProfileSection _section, IoTConnectProfile* _profile);
+    void reset_profile();
+    // Called by the subscribe handler, around a section
+    void profile_mark(IoTConnectProfileMark* _mark);
+    void profile_add(IoTConnectProfileSection _section, const IoTConnectProfileMark* _mark);
 
 private:
     IoTConnectAuthType auth_type;
     const IoTConnectEntry* entry;
     IoTConnectDevice* device;
-    TLSSocket* socket;
-    NetworkInterface* network;
-    MQTTClient* mqtt_client;
+    IoTConnectNetwork* transport;
+    bool own_transport;
+    IoTConnectNetworkTap tap;
+    IoTConnectAllocator* allocator;
+    IoTConnectMqttSession* mqtt_client;
+
+    IoTConnectTrustStore* ca_store;
+    IoTConnectTrustStore* client_store;
+    // the device's certificate, kept over reconnects
+    IoTConnectTrustStore* device_store;
+    const IoTConnectTlsProfile* tls_profile;
+    // measured at the last handshake
+    size_t tls_heap;
+    size_t tls_heap_handshake;
+
+    // painted, to find the high-water
+    unsigned char* stack_mem;
+    uint32_t stack_size;
+    volatile uint32_t stack_max;
+    volatile uint32_t callback_stack_max;
+    Thread* thread;
+    volatile bool running;
+
+    EventQueue* queue;
+    int queue_timer_id;
+    int queue_call_id;
+    volatile bool queue_pending;
+    bool queue_sigio;
 
-    Thread thread;
+    int keepalive_s;
+    int ping_timeout_ms;
+    int mqtt_version;
+
+    IoTConnectOta* ota;
+
+    IoTConnectTokenBucket pub_rate_msgs;
+    IoTConnectTokenBucket pub_rate_bytes;
+    // Kernel ms the message held at the head of pubs could go, 0 for none
+    uint64_t pub_rate_due_ms;
 
     Callback<void()> on_connection_lost;
+    // on_connection_lost was called since the last time connected
+    bool lost_reported;
+
+    Callback<void(IoTConnectPhase, int)> on_phase;
+    IoTConnectPhase connect_next;
+    volatile bool connecting;
 
     int msg_id_pub_props;
 
+    int pub_props_period_ms;
+    MQTT::QoS pub_props_qos;
+    uint64_t pub_props_last_ms;
+
+    bool subscribed;
+    MQTT::QoS sub_qos;
+
+    uint64_t renew_retry_ms;
+
+    IoTConnectHistogram latency[IOT_CONNECT_LATENCY_STAGES];
+    Mutex latency_mutex;
+
+    IoTConnectClientStats stats;
+    Mutex stats_mutex;
+
+    IoTConnectProfile profile[IOT_CONNECT_PROFILE_SECTIONS];
+
+    int pub_stats_period_ms;
+    MQTT::QoS pub_stats_qos;
+    uint64_t pub_stats_last_ms;
+
+    // downstream devices, sorted by client id, with devices_mutex. Held while a
+    // message is dispatched to one, never over MQTT session calls.
+    IoTConnectChild* children;
+    int children_num;
+    int children_cap;
+    // children not subscribed yet, and topics of the removed ones to unsubscribe
+    int children_unsubscribed;
+    IoTConnectTopicNode* unsubs;
+    Mutex devices_mutex;
+
+    // topic of the message being published, with properties or of a downstream device,
+    // grows to the longest
+    char* topic_buf;
+    size_t topic_buf_size;
+
 private:
 
+    int reconnect();
+    int connect_phase(IoTConnectPhase _phase);
+    int load_certs();
+    int tls_connect();
+    void connect_step();
+    int subscribe_topic(const char* _topic);
+    int subscribe_added();
+    void unsubscribe_removed();
+    void sync_device_subs();
+    int find_child(const char* _client_id, size_t _len);
+    bool has_child(const IoTConnectDevice* _device) const;
     void thread_main_loop();
+    void report_connection_lost();
+    void event_loop_run();
+    void event_loop_post();
+    int event_loop_next_ms();
+    void renew_pwd_on_schedule();
+    bool pub_next();
+    bool pub_rate_hold(IoTConnectPubMsg* _msg);
+    int main_loop_yield_ms();
+    void pub_send(IoTConnectPubMsg* _pub_msg);
+    int copy_pub(MQTT::Message* _msg, const IoTConnectMsgProperty* _props, int _props_num,
+                 IoTConnectDevice* _device, uint32_t _expiry_s, const IoTConnectReportSnapshot* _report);
+    void enqueue_pub(IoTConnectPubMsg* _msg, IoTConnectDevice* _device, uint32_t _expiry_s);
+    void free_pub_msg(IoTConnectPubMsg* _msg);
+    void clear_report(IoTConnectPubMsg* _pub_msg);
+    const char* topic_with_props(const char* _topic_pub, const char* _props);
+    void pub_props_on_schedule();
+    void record_latency(const IoTConnectPubMsg* _msg);
+    void pub_stats_on_schedule();
+    void ota_on_schedule();
+    void* mem_alloc(size_t _size, IoTConnectMemTag _tag);
+    void mem_free(void* _ptr, IoTConnectMemTag _tag);
+    IoTConnectMqttSession* new_mqtt_client();
+    void delete_mqtt_client();
 
 };
 
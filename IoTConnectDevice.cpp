@@ -1,6 +1,8 @@
-#include "mbed.h"
+#include "IoTConnectPlatform.h"
 #include "IoTConnectEntry.h"
 #include "IoTConnectDevice.h"
+#include "IoTConnectAllocator.h"
+#include <new>
 
 
 IoTConnectDevice::IoTConnectDevice(const char* _device_id, const char* _device_name,
@@ -14,7 +16,8 @@ IoTConnectDevice::IoTConnectDevice(const char* _device_id, const char* _device_n
     user_name(NULL),
     entry(_entry),
     topic_pub(NULL),
-    topic_sub(NULL)
+    topic_sub(NULL),
+    sas(NULL)
 {
     client_id = init_client_id(_device_id, _entry);
     user_name = init_user_name(client_id, _entry);
@@ -25,19 +28,24 @@ IoTConnectDevice::IoTConnectDevice(const char* _device_id, const char* _device_n
 IoTConnectDevice::~IoTConnectDevice()
 {
     if (client_id) {
-        delete[] client_id;
+        iot_connect_free(client_id, IOT_CONNECT_MEM_DEVICE);
     }
 
     if (user_name) {
-        delete[] user_name;
+        iot_connect_free(user_name, IOT_CONNECT_MEM_DEVICE);
     }
 
     if (topic_pub) {
-        delete[] topic_pub;
+        iot_connect_free((char*)topic_pub, IOT_CONNECT_MEM_DEVICE);
     }
 
     if (topic_sub) {
-        delete[] topic_sub;
+        iot_connect_free((char*)topic_sub, IOT_CONNECT_MEM_DEVICE);
+    }
+
+    if (sas) {
+        sas->~IoTConnectSasToken();
+        iot_connect_free(sas, IOT_CONNECT_MEM_DEVICE);
     }
 }
 
@@ -53,9 +61,58 @@ const char* IoTConnectDevice::get_user_name() const
 
 const char* IoTConnectDevice::get_pwd() const
 {
+    if (sas) {
+        return sas->get_token();
+    }
+
     return pwd;
 }
 
+int IoTConnectDevice::set_symmetric_key(const char* _key, uint32_t _ttl_s)
+{
+    int r;
+
+    if (!sas) {
+        void* mem = iot_connect_malloc(sizeof(IoTConnectSasToken), IOT_CONNECT_MEM_DEVICE);
+        if (!mem) {
+            return IOT_CONNECT_ERROR_OUT_OF_MEM;
+        }
+        sas = new (mem) IoTConnectSasToken();
+    }
+
+    r = sas->init(entry->get_mqtt_server_host_name(), client_id, _key, _ttl_s);
+    if (r != 0) {
+        sas->~IoTConnectSasToken();
+        iot_connect_free(sas, IOT_CONNECT_MEM_DEVICE);
+        sas = NULL;
+    }
+
+    return r;
+}
+
+bool IoTConnectDevice::has_symmetric_key() const
+{
+    return sas != NULL;
+}
+
+int IoTConnectDevice::renew_pwd()
+{
+    if (!sas) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    return sas->generate(time(NULL));
+}
+
+bool IoTConnectDevice::is_pwd_expiring() const
+{
+    if (!sas || sas->get_expiry() == 0) {
+        return false;
+    }
+
+    return time(NULL) + IOT_CONNECT_SAS_TOKEN_RENEW_MARGIN >= sas->get_expiry();
+}
+
 void IoTConnectDevice::set_cert(const char *_cert_pem, const char *_private_key_pem)
 {
     cert_pem = _cert_pem;
@@ -78,7 +135,10 @@ char* IoTConnectDevice::init_client_id(const char* _device_id, const IoTConnectE
     // "{cpid}-{_device_id}"
     size_t buf_size = strlen(cpid) + strlen(_device_id) + 1 + 1;
 
-    char* _client_id = new char[buf_size];
+    char* _client_id = (char*)iot_connect_malloc(buf_size, IOT_CONNECT_MEM_DEVICE);
+    if (!_client_id) {
+        return NULL;
+    }
     memset(_client_id, 0, buf_size);
 
     if (strlen(cpid) > 0) {
@@ -92,11 +152,18 @@ char* IoTConnectDevice::init_client_id(const char* _device_id, const IoTConnectE
 
 char* IoTConnectDevice::init_user_name(const char* _client_id, const IoTConnectEntry* _entry)
 {
+    if (!_client_id) {
+        return NULL;
+    }
+
     const char* mqtt_server = _entry->get_mqtt_server_host_name();
     // "{mqtt_server_host_name}/{client_id}/?api-version=2018-06-30"
     size_t buf_size = strlen(mqtt_server) + strlen(_client_id) + 26;
 
-    char* _user_name = new char[buf_size];
+    char* _user_name = (char*)iot_connect_malloc(buf_size, IOT_CONNECT_MEM_DEVICE);
+    if (!_user_name) {
+        return NULL;
+    }
     memset(_user_name, 0, buf_size);
     sprintf(_user_name, "%s/%s/?api-version=2018-06-30", mqtt_server, _client_id);
 
@@ -110,9 +177,16 @@ const IoTConnectEntry* IoTConnectDevice::get_entry() const
 
 char* IoTConnectDevice::init_mqtt_topic_pub(const char* _client_id)
 {
+    if (!_client_id) {
+        return NULL;
+    }
+
     size_t buf_size = strlen(_client_id) + 30;
 
-    char* _topic_pub = new char[buf_size];
+    char* _topic_pub = (char*)iot_connect_malloc(buf_size, IOT_CONNECT_MEM_DEVICE);
+    if (!_topic_pub) {
+        return NULL;
+    }
     memset(_topic_pub, 0, buf_size);
     sprintf(_topic_pub, "devices/%s/messages/events/", _client_id);
 
@@ -121,9 +195,16 @@ char* IoTConnectDevice::init_mqtt_topic_pub(const char* _client_id)
 
 char* IoTConnectDevice::init_mqtt_topic_sub(const char* _client_id)
 {
+    if (!_client_id) {
+        return NULL;
+    }
+
     size_t buf_size = strlen(_client_id) + 36;
 
-    char* _topic_sub = new char[buf_size];
+    char* _topic_sub = (char*)iot_connect_malloc(buf_size, IOT_CONNECT_MEM_DEVICE);
+    if (!_topic_sub) {
+        return NULL;
+    }
     memset(_topic_sub, 0, buf_size);
     sprintf(_topic_sub, "devices/%s/messages/devicebound/#", _client_id);
 
@@ -4,6 +4,7 @@
 #include "IoTConnectCommon.h"
 #include "IoTConnectEntry.h"
 #include "IoTConnectProperty.h"
+#include "IoTConnectSasToken.h"
 
 typedef enum {
     IOT_CONNECT_AUTH_SYMMETRIC_KEY = 0,
@@ -27,6 +28,7 @@ private:
     const char* topic_pub;
     const char* topic_sub;
 
+    IoTConnectSasToken* sas;
 
 public:
     IoTConnectDevice(const char* _device_id, const char* _device_name, const char* _pwd, const IoTConnectEntry* _entry);
@@ -35,6 +37,13 @@ public:
     const char* get_user_name() const;
     const char* get_pwd() const;
 
+    // Generate SAS tokens on device with the base64 symmetric key instead of a precomputed pwd
+    int set_symmetric_key(const char* _key, uint32_t _ttl_s = IOT_CONNECT_SAS_TOKEN_TTL);
+    bool has_symmetric_key() const;
+    int renew_pwd();
+    // pwd expires within the renew margin
+    bool is_pwd_expiring() const;
+
     void set_cert(const char *_cert_pem, const char *_private_key_pem);
     const char* get_cert_pem() const;
     const char* get_private_key_pem() const;
@@ -1,4 +1,4 @@
-#include "mbed.h"
+#include "IoTConnectPlatform.h"
 #include "IoTConnectEntry.h"
 
 IoTConnectEntry::IoTConnectEntry(const char* _company_name, const char* _cpid) :
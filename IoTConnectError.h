@@ -18,6 +18,15 @@ typedef enum {
     IOT_CONNECT_ERROR_PROPERTY_NOT_FOUND     = -1202,
     IOT_CONNECT_ERROR_PROPERTY_JSON_FORMAT   = -1203,
     IOT_CONNECT_ERROR_PROPERTY_JSON_PARSE    = -1204,
+    IOT_CONNECT_ERROR_PROPERTY_JSON_ENCODING = -1206,
+
+    IOT_CONNECT_ERROR_SAS_KEY                = -1301,
+    IOT_CONNECT_ERROR_SAS_TIME               = -1302,
+
+    IOT_CONNECT_ERROR_OTA_SIZE               = -1401,     /*!< the image doesn't fit the slot */
+    IOT_CONNECT_ERROR_OTA_FLASH              = -1402,     /*!< erase, program or read of the slot failed */
+    IOT_CONNECT_ERROR_OTA_DIGEST             = -1403,     /*!< SHA-256 of the image doesn't match */
+    IOT_CONNECT_ERROR_OTA_TIMEOUT            = -1404,     /*!< chunks stopped coming */
 
 
     IOT_CONNECT_ERROR_NS_WOULD_BLOCK         = -3001,     /*!< no data is not available but call is non-blocking */
@@ -0,0 +1,94 @@
+#include <string.h>
+#include "IoTConnectHistogram.h"
+
+IoTConnectHistogram::IoTConnectHistogram()
+{
+    reset();
+}
+
+void IoTConnectHistogram::record(uint32_t _us)
+{
+    int i = _us < 2 ? 0 : 31 - __builtin_clz(_us);
+
+    buckets[i]++;
+    count++;
+    sum += _us;
+    if (_us > max) {
+        max = _us;
+    }
+}
+
+void IoTConnectHistogram::reset()
+{
+    memset(buckets, 0, sizeof(buckets));
+    count = 0;
+    max = 0;
+    sum = 0;
+}
+
+void IoTConnectHistogram::merge(const IoTConnectHistogram& _other)
+{
+    int i;
+
+    for (i = 0; i < IOT_CONNECT_HISTOGRAM_BUCKETS; i++) {
+        buckets[i] += _other.buckets[i];
+    }
+    count += _other.count;
+    sum += _other.sum;
+    if (_other.max > max) {
+        max = _other.max;
+    }
+}
+
+uint32_t IoTConnectHistogram::get_count() const
+{
+    return count;
+}
+
+uint32_t IoTConnectHistogram::get_max() const
+{
+    return max;
+}
+
+uint32_t IoTConnectHistogram::get_mean() const
+{
+    return count ? (uint32_t)(sum / count) : 0;
+}
+
+uint32_t IoTConnectHistogram::get_percentile(float _percentile) const
+{
+    double exact;
+    uint64_t rank;
+    uint64_t seen = 0;
+    int i;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // nearest rank, 1-based
+    exact = count * (double)_percentile / 100;
+    rank = (uint64_t)exact;
+    if (rank < exact || rank == 0) {
+        rank++;
+    }
+
+    for (i = 0; i < IOT_CONNECT_HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            uint32_t upper = i == IOT_CONNECT_HISTOGRAM_BUCKETS - 1 ? 0xFFFFFFFF : (2u << i) - 1;
+            return upper < max ? upper : max;
+        }
+    }
+
+    return max;
+}
+
+uint32_t IoTConnectHistogram::get_bucket(int _index) const
+{
+    if (_index < 0 || _index >= IOT_CONNECT_HISTOGRAM_BUCKETS) {
+        return 0;
+    }
+
+    return buckets[_index];
+}
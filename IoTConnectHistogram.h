@@ -0,0 +1,35 @@
+#ifndef __IOT_CONNECT_HISTOGRAM_H__
+#define __IOT_CONNECT_HISTOGRAM_H__
+
+#include <stdint.h>
+
+// Bucket 0 holds [0, 2), bucket i holds [2^i, 2^(i+1))
+#define IOT_CONNECT_HISTOGRAM_BUCKETS 32
+
+// Fixed size log2 histogram of latencies in microseconds, recording is O(1)
+// and never allocates, percentiles are resolved to the bucket.
+class IoTConnectHistogram {
+
+public:
+    IoTConnectHistogram();
+
+    void record(uint32_t _us);
+    void reset();
+    // Add the other histogram's records to this one
+    void merge(const IoTConnectHistogram& _other);
+
+    uint32_t get_count() const;
+    uint32_t get_max() const;
+    uint32_t get_mean() const;
+    // Upper bound of the bucket holding the percentile (e.g. 99.9), capped by the max, 0 if empty
+    uint32_t get_percentile(float _percentile) const;
+    uint32_t get_bucket(int _index) const;
+
+private:
+    uint32_t buckets[IOT_CONNECT_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+};
+
+#endif
@@ -0,0 +1,372 @@
+#include <string.h>
+#include "IoTConnectJson.h"
+#include "IoTConnectError.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define IOT_CONNECT_JSON_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define IOT_CONNECT_JSON_NEON
+#endif
+
+// SWAR, see "Determine if a word has a byte less than n" in Bit Twiddling Hacks.
+// A match may flag some higher bytes as well, so a flagged word is always
+// rescanned byte by byte.
+#define WORD_ONES  ((size_t)-1 / 0xFF)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+#define WORD_HAS_LESS(x, n) (((x) - WORD_ONES * (n)) & ~(x) & WORD_HIGHS)
+#define WORD_HAS_ZERO(x) WORD_HAS_LESS(x, 1)
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static inline size_t load_word(const uint8_t* p)
+{
+    size_t w;
+    // unaligned safe, compiles to a single load
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+static inline bool needs_escape(uint8_t c)
+{
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+#if defined(IOT_CONNECT_JSON_NEON)
+static inline bool neon_any(uint8x16_t v)
+{
+#if defined(__aarch64__)
+    return vmaxvq_u8(v) != 0;
+#else
+    uint64x2_t v64 = vreinterpretq_u64_u8(v);
+    return (vgetq_lane_u64(v64, 0) | vgetq_lane_u64(v64, 1)) != 0;
+#endif
+}
+#endif
+
+size_t iot_connect_json_find_escape(const char* _str, size_t _len)
+{
+    const uint8_t* p = (const uint8_t*)_str;
+    size_t i = 0;
+
+#if defined(IOT_CONNECT_JSON_SSE2)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i ctrl_max = _mm_set1_epi8(0x1F);
+
+    for (; i + 16 <= _len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+        // v <= 0x1F
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl_max), v));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(IOT_CONNECT_JSON_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t ctrl_end = vdupq_n_u8(0x20);
+
+    for (; i + 16 <= _len; i += 16) {
+        uint8x16_t v = vld1q_u8(p + i);
+        uint8x16_t m = vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash));
+        m = vorrq_u8(m, vcltq_u8(v, ctrl_end));
+        if (neon_any(m)) {
+            break;
+        }
+    }
+#endif
+
+    for (; i + sizeof(size_t) <= _len; i += sizeof(size_t)) {
+        size_t w = load_word(p + i);
+        if (WORD_HAS_ZERO(w ^ (WORD_ONES * '"')) |
+            WORD_HAS_ZERO(w ^ (WORD_ONES * '\\')) |
+            WORD_HAS_LESS(w, 0x20)) {
+            break;
+        }
+    }
+
+    for (; i < _len; i++) {
+        if (needs_escape(p[i])) {
+            return i;
+        }
+    }
+
+    return _len;
+}
+
+size_t iot_connect_json_escaped_len(const char* _str, size_t _len)
+{
+    size_t len = _len;
+    size_t i = iot_connect_json_find_escape(_str, _len);
+
+    while (i < _len) {
+        switch (_str[i]) {
+            case '"':
+            case '\\':
+            case '\b':
+            case '\f':
+            case '\n':
+            case '\r':
+            case '\t':
+                len += 1;   // \x
+                break;
+            default:
+                len += 5;   // \u00xx
+                break;
+        }
+        i++;
+        i += iot_connect_json_find_escape(_str + i, _len - i);
+    }
+
+    return len;
+}
+
+char* iot_connect_json_escape(char* _dst, const char* _str, size_t _len)
+{
+    char* d = _dst;
+    size_t i = 0;
+
+    while (i < _len) {
+        size_t clean = iot_connect_json_find_escape(_str + i, _len - i);
+        uint8_t c;
+
+        memcpy(d, _str + i, clean);
+        d += clean;
+        i += clean;
+        if (i == _len) {
+            break;
+        }
+
+        c = (uint8_t)_str[i++];
+        *d++ = '\\';
+        switch (c) {
+            case '"':  *d++ = '"';  break;
+            case '\\': *d++ = '\\'; break;
+            case '\b': *d++ = 'b';  break;
+            case '\f': *d++ = 'f';  break;
+            case '\n': *d++ = 'n';  break;
+            case '\r': *d++ = 'r';  break;
+            case '\t': *d++ = 't';  break;
+            default:
+                *d++ = 'u';
+                *d++ = '0';
+                *d++ = '0';
+                *d++ = hex_digits[c >> 4];
+                *d++ = hex_digits[c & 0x0F];
+                break;
+        }
+    }
+
+    return d;
+}
+
+static int parse_hex4(const char* _str, const char* _end, uint32_t* _val)
+{
+    int i;
+    uint32_t val = 0;
+
+    if (_end - _str < 4) {
+        return -1;
+    }
+
+    for (i = 0; i < 4; i++) {
+        char c = _str[i];
+        val <<= 4;
+        if (c >= '0' && c <= '9') {
+            val |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            val |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            val |= c - 'A' + 10;
+        } else {
+            return -1;
+        }
+    }
+
+    *_val = val;
+
+    return 0;
+}
+
+static int utf8_encode(char* _dst, uint32_t _cp)
+{
+    if (_cp < 0x80) {
+        _dst[0] = (char)_cp;
+        return 1;
+    }
+    if (_cp < 0x800) {
+        _dst[0] = (char)(0xC0 | (_cp >> 6));
+        _dst[1] = (char)(0x80 | (_cp & 0x3F));
+        return 2;
+    }
+    if (_cp < 0x10000) {
+        _dst[0] = (char)(0xE0 | (_cp >> 12));
+        _dst[1] = (char)(0x80 | ((_cp >> 6) & 0x3F));
+        _dst[2] = (char)(0x80 | (_cp & 0x3F));
+        return 3;
+    }
+    _dst[0] = (char)(0xF0 | (_cp >> 18));
+    _dst[1] = (char)(0x80 | ((_cp >> 12) & 0x3F));
+    _dst[2] = (char)(0x80 | ((_cp >> 6) & 0x3F));
+    _dst[3] = (char)(0x80 | (_cp & 0x3F));
+    return 4;
+}
+
+int iot_connect_json_unescape(char* _dst, const char* _str, size_t _len)
+{
+    char* d = _dst;
+    const char* s = _str;
+    const char* end = _str + _len;
+
+    while (s < end) {
+        const char* bs = (const char*)memchr(s, '\\', end - s);
+        size_t clean = bs ? (size_t)(bs - s) : (size_t)(end - s);
+
+        memcpy(d, s, clean);
+        d += clean;
+        s += clean;
+        if (!bs) {
+            break;
+        }
+
+        // skip '\'
+        if (++s >= end) {
+            return IOT_CONNECT_ERROR_PROPERTY_JSON_ENCODING;
+        }
+
+        switch (*s++) {
+            case '"':  *d++ = '"';  break;
+            case '\\': *d++ = '\\'; break;
+            case '/':  *d++ = '/';  break;
+            case 'b':  *d++ = '\b'; break;
+            case 'f':  *d++ = '\f'; break;
+            case 'n':  *d++ = '\n'; break;
+            case 'r':  *d++ = '\r'; break;
+            case 't':  *d++ = '\t'; break;
+            case 'u':
+            {
+                uint32_t cp;
+                uint32_t lo;
+
+                if (parse_hex4(s, end, &cp) != 0) {
+                    return IOT_CONNECT_ERROR_PROPERTY_JSON_ENCODING;
+                }
+                s += 4;
+
+                if (cp >= 0xD800 && cp <= 0xDBFF) {
+                    // high surrogate should be followed by a low one
+                    if (end - s < 6 || s[0] != '\\' || s[1] != 'u' ||
+                        parse_hex4(s + 2, end, &lo) != 0 || lo < 0xDC00 || lo > 0xDFFF) {
+                        return IOT_CONNECT_ERROR_PROPERTY_JSON_ENCODING;
+                    }
+                    s += 6;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                    return IOT_CONNECT_ERROR_PROPERTY_JSON_ENCODING;
+                }
+
+                d += utf8_encode(d, cp);
+                break;
+            }
+            default:
+                return IOT_CONNECT_ERROR_PROPERTY_JSON_ENCODING;
+        }
+    }
+
+    return d - _dst;
+}
+
+// Offset of the first non-ascii byte, _len if none
+static size_t find_non_ascii(const uint8_t* p, size_t _len)
+{
+    size_t i = 0;
+
+#if defined(IOT_CONNECT_JSON_SSE2)
+    for (; i + 16 <= _len; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p + i)));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(IOT_CONNECT_JSON_NEON)
+    for (; i + 16 <= _len; i += 16) {
+        if (neon_any(vandq_u8(vld1q_u8(p + i), vdupq_n_u8(0x80)))) {
+            break;
+        }
+    }
+#endif
+
+    for (; i + sizeof(size_t) <= _len; i += sizeof(size_t)) {
+        if (load_word(p + i) & WORD_HIGHS) {
+            break;
+        }
+    }
+
+    for (; i < _len; i++) {
+        if (p[i] & 0x80) {
+            return i;
+        }
+    }
+
+    return _len;
+}
+
+bool iot_connect_utf8_is_valid(const char* _str, size_t _len)
+{
+    const uint8_t* p = (const uint8_t*)_str;
+    size_t i = 0;
+
+    while (1) {
+        uint8_t c;
+        uint8_t lo = 0x80;
+        uint8_t hi = 0xBF;
+        int n;
+        int j;
+
+        i += find_non_ascii(p + i, _len - i);
+        if (i >= _len) {
+            return true;
+        }
+
+        c = p[i];
+        if (c >= 0xC2 && c <= 0xDF) {
+            n = 1;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            n = 2;
+            if (c == 0xE0) {
+                lo = 0xA0;      // overlong
+            } else if (c == 0xED) {
+                hi = 0x9F;      // surrogates
+            }
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            n = 3;
+            if (c == 0xF0) {
+                lo = 0x90;      // overlong
+            } else if (c == 0xF4) {
+                hi = 0x8F;      // > U+10FFFF
+            }
+        } else {
+            return false;
+        }
+
+        if (_len - i <= (size_t)n) {
+            return false;
+        }
+
+        // only the first continuation byte has a narrower range
+        for (j = 1; j <= n; j++) {
+            uint8_t cc = p[i + j];
+            if (cc < lo || cc > hi) {
+                return false;
+            }
+            lo = 0x80;
+            hi = 0xBF;
+        }
+
+        i += n + 1;
+    }
+}
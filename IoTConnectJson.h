@@ -0,0 +1,27 @@
+#ifndef __IOT_CONNECT_JSON_H__
+#define __IOT_CONNECT_JSON_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// JSON string helpers used by the property serializer and parser.
+// Clean strings are scanned a word (or a SIMD vector if the target has
+// SSE2 / NEON) at a time, only the bytes to escape take the slow path.
+
+// Offset of the first byte needs to be escaped, _len if none
+size_t iot_connect_json_find_escape(const char* _str, size_t _len);
+
+// Length of _str after escaped, the quotes are not included
+size_t iot_connect_json_escaped_len(const char* _str, size_t _len);
+
+// Escape _str into _dst, which should have iot_connect_json_escaped_len() bytes,
+// returns the end of the escaped string (not '\0' terminated)
+char* iot_connect_json_escape(char* _dst, const char* _str, size_t _len);
+
+// Unescape a json string token (without quotes) into _dst, which should have _len bytes,
+// returns the unescaped length or IOT_CONNECT_ERROR_PROPERTY_JSON_ENCODING
+int iot_connect_json_unescape(char* _dst, const char* _str, size_t _len);
+
+bool iot_connect_utf8_is_valid(const char* _str, size_t _len);
+
+#endif
@@ -0,0 +1,177 @@
+#include <string.h>
+#include "IoTConnectMqtt5.h"
+
+#define MQTT5_VBI_BYTES_MAX 4
+
+int iot_connect_mqtt5_vbi_len(uint32_t _value)
+{
+    int len = 1;
+
+    while (_value >= 128) {
+        _value /= 128;
+        len++;
+    }
+
+    return len;
+}
+
+unsigned char* iot_connect_mqtt5_write_vbi(unsigned char* _p, uint32_t _value)
+{
+    do {
+        unsigned char b = _value % 128;
+        _value /= 128;
+        *_p++ = _value ? (b | 128) : b;
+    } while (_value);
+
+    return _p;
+}
+
+int iot_connect_mqtt5_read_vbi(const unsigned char* _p, const unsigned char* _end, uint32_t* _value)
+{
+    uint32_t multiplier = 1;
+    int len = 0;
+
+    *_value = 0;
+    do {
+        if (len == MQTT5_VBI_BYTES_MAX || _p + len >= _end) {
+            return -1;
+        }
+        *_value += (_p[len] & 127) * multiplier;
+        multiplier *= 128;
+    } while (_p[len++] & 128);
+
+    return len;
+}
+
+unsigned char* iot_connect_mqtt5_write_u16(unsigned char* _p, uint16_t _value)
+{
+    *_p++ = _value >> 8;
+    *_p++ = _value & 0xFF;
+    return _p;
+}
+
+unsigned char* iot_connect_mqtt5_write_u32(unsigned char* _p, uint32_t _value)
+{
+    _p = iot_connect_mqtt5_write_u16(_p, _value >> 16);
+    return iot_connect_mqtt5_write_u16(_p, _value & 0xFFFF);
+}
+
+unsigned char* iot_connect_mqtt5_write_str(unsigned char* _p, const char* _str, int _len)
+{
+    _p = iot_connect_mqtt5_write_u16(_p, _len);
+    memcpy(_p, _str, _len);
+    return _p + _len;
+}
+
+static uint16_t read_u16(const unsigned char* _p)
+{
+    return (_p[0] << 8) | _p[1];
+}
+
+static uint32_t read_u32(const unsigned char* _p)
+{
+    return ((uint32_t)read_u16(_p) << 16) | read_u16(_p + 2);
+}
+
+int iot_connect_mqtt5_read_props(const unsigned char* _p, const unsigned char* _end, IoTConnectMqtt5Props* _props)
+{
+    uint32_t props_len;
+    const unsigned char* p;
+    const unsigned char* end;
+    int len;
+
+    memset(_props, 0, sizeof(IoTConnectMqtt5Props));
+
+    len = iot_connect_mqtt5_read_vbi(_p, _end, &props_len);
+    if (len < 0 || props_len > (uint32_t)(_end - _p - len)) {
+        return -1;
+    }
+    p = _p + len;
+    end = p + props_len;
+
+    while (p < end) {
+        uint32_t id;
+        uint32_t value;
+        int n = iot_connect_mqtt5_read_vbi(p, end, &id);
+
+        if (n < 0) {
+            return -1;
+        }
+        p += n;
+
+        switch (id) {
+            // byte
+            case 0x01: case 0x17: case 0x19: case MQTT5_PROP_MAX_QOS: case 0x25: case 0x28: case 0x29: case 0x2A:
+                if (end - p < 1) {
+                    return -1;
+                }
+                if (id == MQTT5_PROP_MAX_QOS) {
+                    _props->has_max_qos = true;
+                    _props->max_qos = *p;
+                }
+                p += 1;
+                break;
+            // two byte integer
+            case MQTT5_PROP_SERVER_KEEPALIVE: case MQTT5_PROP_RECEIVE_MAX: case MQTT5_PROP_TOPIC_ALIAS_MAX:
+            case MQTT5_PROP_TOPIC_ALIAS:
+                if (end - p < 2) {
+                    return -1;
+                }
+                value = read_u16(p);
+                if (id == MQTT5_PROP_SERVER_KEEPALIVE) {
+                    _props->has_server_keepalive = true;
+                    _props->server_keepalive = value;
+                } else if (id == MQTT5_PROP_RECEIVE_MAX) {
+                    _props->receive_max = value;
+                } else if (id == MQTT5_PROP_TOPIC_ALIAS_MAX) {
+                    _props->topic_alias_max = value;
+                } else {
+                    _props->topic_alias = value;
+                }
+                p += 2;
+                break;
+            // four byte integer
+            case MQTT5_PROP_MESSAGE_EXPIRY: case 0x11: case 0x18: case MQTT5_PROP_MAX_PACKET_SIZE:
+                if (end - p < 4) {
+                    return -1;
+                }
+                value = read_u32(p);
+                if (id == MQTT5_PROP_MESSAGE_EXPIRY) {
+                    _props->message_expiry = value;
+                } else if (id == MQTT5_PROP_MAX_PACKET_SIZE) {
+                    _props->max_packet_size = value;
+                }
+                p += 4;
+                break;
+            // subscription identifier
+            case 0x0B:
+                n = iot_connect_mqtt5_read_vbi(p, end, &value);
+                if (n < 0) {
+                    return -1;
+                }
+                p += n;
+                break;
+            // string or binary data
+            case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C:
+            case MQTT5_PROP_REASON_STRING:
+                if (end - p < 2 || end - p - 2 < read_u16(p)) {
+                    return -1;
+                }
+                p += 2 + read_u16(p);
+                break;
+            // user property, a string pair
+            case 0x26:
+                for (n = 0; n < 2; n++) {
+                    if (end - p < 2 || end - p - 2 < read_u16(p)) {
+                        return -1;
+                    }
+                    p += 2 + read_u16(p);
+                }
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    return len + props_len;
+}
@@ -0,0 +1,50 @@
+#ifndef __IOT_CONNECT_MQTT5_H__
+#define __IOT_CONNECT_MQTT5_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// MQTTPacket_connectData.MQTTVersion of MQTT 5
+#define IOT_CONNECT_MQTT5_VERSION 5
+
+// Properties the library sends or reads
+#define MQTT5_PROP_MESSAGE_EXPIRY       0x02
+#define MQTT5_PROP_SERVER_KEEPALIVE     0x13
+#define MQTT5_PROP_REASON_STRING        0x1F
+#define MQTT5_PROP_RECEIVE_MAX          0x21
+#define MQTT5_PROP_TOPIC_ALIAS_MAX      0x22
+#define MQTT5_PROP_TOPIC_ALIAS          0x23
+#define MQTT5_PROP_MAX_QOS              0x24
+#define MQTT5_PROP_MAX_PACKET_SIZE      0x27
+
+// Reason codes from 0x80 are failures
+#define MQTT5_REASON_FAILURE            0x80
+
+// What read_props() found, 0 for the absent ones
+typedef struct {
+    uint32_t message_expiry;
+    uint32_t max_packet_size;
+    uint16_t receive_max;
+    uint16_t topic_alias_max;
+    uint16_t topic_alias;
+    uint16_t server_keepalive;
+    bool has_server_keepalive;
+    bool has_max_qos;
+    uint8_t max_qos;
+} IoTConnectMqtt5Props;
+
+// Variable byte integer, 1 to 4 bytes
+int iot_connect_mqtt5_vbi_len(uint32_t _value);
+unsigned char* iot_connect_mqtt5_write_vbi(unsigned char* _p, uint32_t _value);
+// Bytes read, -1 if malformed
+int iot_connect_mqtt5_read_vbi(const unsigned char* _p, const unsigned char* _end, uint32_t* _value);
+
+unsigned char* iot_connect_mqtt5_write_u16(unsigned char* _p, uint16_t _value);
+unsigned char* iot_connect_mqtt5_write_u32(unsigned char* _p, uint32_t _value);
+unsigned char* iot_connect_mqtt5_write_str(unsigned char* _p, const char* _str, int _len);
+
+// The property length and properties at _p, unknown ones are skipped.
+// Bytes read, -1 if malformed.
+int iot_connect_mqtt5_read_props(const unsigned char* _p, const unsigned char* _end, IoTConnectMqtt5Props* _props);
+
+#endif
@@ -0,0 +1,993 @@
+#include "IoTConnectMqttSession.h"
+#include "MQTTPacket.h"
+
+#define TRACE_GROUP  "IoTConnectMqtt"
+#define MQTT_MAX_PACKET_ID 65535
+// remaining length takes 1 to 4 bytes
+#define MQTT_REMAINING_LENGTH_BYTES_MAX 4
+#define MQTT_SUBACK_FAILURE 0x80
+#define MQTT_REMAINING_LENGTH_MAX 268435455
+
+MBED_STATIC_ASSERT(IOT_CONNECT_MQTT_QOS2_RECEIVE_MAX > 0 && IOT_CONNECT_MQTT_QOS2_RECEIVE_MAX <= 65535,
+                   "QoS2 receive max is 1 to 65535");
+
+bool mqtt_is_topic_matched(const char* topicFilter, MQTTString& topicName)
+{
+    const char* curf = topicFilter;
+    char* curn = topicName.lenstring.data;
+    char* curn_end = curn + topicName.lenstring.len;
+
+    while (*curf && curn < curn_end)
+    {
+        if (*curn == '/' && *curf != '/')
+            break;
+        if (*curf != '+' && *curf != '#' && *curf != *curn)
+            break;
+        if (*curf == '+')
+        {   // skip until we meet the next separator, or end of string
+            char* nextpos = curn + 1;
+            while (nextpos < curn_end && *nextpos != '/')
+                nextpos = ++curn + 1;
+        }
+        else if (*curf == '#')
+            curn = curn_end - 1;    // skip until end of string
+        curf++;
+        curn++;
+    };
+
+    return (curn == curn_end) && (*curf == '\0');
+}
+
+IoTConnectMqttSession::IoTConnectMqttSession(IoTConnectNetwork& _network, int _command_timeout_ms) :
+    network(_network),
+    command_timeout_ms(_command_timeout_ms),
+    connected(false),
+    next_id(0),
+    keepalive_ms(0),
+    ping_timeout_ms(0),
+    ping_outstanding(false),
+    ping_sent_ms(0),
+    last_rx_ms(0),
+    last_tx_ms(0),
+    pings(0),
+    ping_timeouts(0),
+    v5(false),
+    receive_max(0),
+    alias_max(0),
+    alias_new(0),
+    qos2_num(0)
+{
+    memset(handlers, 0, sizeof(handlers));
+    memset(aliases, 0, sizeof(aliases));
+}
+
+static const char* mqtt_string_data(MQTTString& _str)
+{
+    return _str.cstring ? _str.cstring : _str.lenstring.data;
+}
+
+static uint16_t read_u16(const unsigned char* _p)
+{
+    return (_p[0] << 8) | _p[1];
+}
+
+unsigned short IoTConnectMqttSession::get_next_id()
+{
+    next_id = (next_id == MQTT_MAX_PACKET_ID) ? 1 : next_id + 1;
+    return next_id;
+}
+
+int IoTConnectMqttSession::send_packet(int _len, IoTConnectCountdown& _timer)
+{
+    int sent = 0;
+
+    while (sent < _len && !_timer.expired()) {
+        int rc = network.write(sendbuf + sent, _len - sent, _timer.left_ms());
+        if (rc < 0) {
+            break;
+        }
+        sent += rc;
+    }
+
+    if (sent != _len) {
+        connected = false;
+        return MQTT::FAILURE;
+    }
+
+    last_tx_ms = Kernel::get_ms_count();
+
+    return MQTT::SUCCESS;
+}
+
+// The rest of a packet, once its first byte arrived
+int IoTConnectMqttSession::read_bytes(unsigned char* _buf, int _len, IoTConnectCountdown& _timer)
+{
+    int got = 0;
+
+    while (got < _len) {
+        int rc = network.read(_buf + got, _len - got, _timer.left_ms());
+        if (rc <= 0) {
+            return MQTT::FAILURE;
+        }
+        got += rc;
+    }
+
+    return MQTT::SUCCESS;
+}
+
+// Packet type, 0 if nothing arrived in time, or a negative error
+int IoTConnectMqttSession::read_packet(IoTConnectCountdown& _timer)
+{
+    uint32_t rem_len = 0;
+    uint32_t multiplier = 1;
+    int len = 1;
+    int rc;
+
+    rc = network.read(readbuf, 1, _timer.left_ms());
+    if (rc == 0) {
+        return 0;
+    } else if (rc != 1) {
+        return MQTT::FAILURE;
+    }
+
+    do {
+        if (len > MQTT_REMAINING_LENGTH_BYTES_MAX ||
+            read_bytes(readbuf + len, 1, _timer) != MQTT::SUCCESS) {
+            return MQTT::FAILURE;
+        }
+        rem_len += (readbuf[len] & 127) * multiplier;
+        multiplier *= 128;
+    } while (readbuf[len++] & 128);
+
+    if (len + rem_len > sizeof(readbuf)) {
+        // skip it, the stream stays in step
+        tr_warn("Inbound packet of %lu bytes is too large, dropped", (unsigned long)(len + rem_len));
+        while (rem_len > 0) {
+            int chunk = rem_len < sizeof(readbuf) ? rem_len : sizeof(readbuf);
+            if (read_bytes(readbuf, chunk, _timer) != MQTT::SUCCESS) {
+                return MQTT::FAILURE;
+            }
+            rem_len -= chunk;
+        }
+        last_rx_ms = Kernel::get_ms_count();
+        ping_outstanding = false;
+        return 0;
+    }
+
+    if (rem_len > 0 && read_bytes(readbuf + len, rem_len, _timer) != MQTT::SUCCESS) {
+        return MQTT::FAILURE;
+    }
+
+    // any packet shows the broker is there
+    last_rx_ms = Kernel::get_ms_count();
+    ping_outstanding = false;
+
+    return readbuf[0] >> 4;
+}
+
+void IoTConnectMqttSession::deliver(MQTTString& _topic, MQTT::Message& _msg)
+{
+    int i;
+
+    for (i = 0; i < IOT_CONNECT_MQTT_MAX_HANDLERS; i++) {
+        if (handlers[i].filter && (MQTTPacket_equals(&_topic, (char*)handlers[i].filter) ||
+                                   mqtt_is_topic_matched(handlers[i].filter, _topic))) {
+            MQTT::MessageData data(_topic, _msg);
+            handlers[i].handler(data, handlers[i].context);
+        }
+    }
+}
+
+// Deliver a QoS2 message unless its id is still unreleased, i.e. it's a retransmit
+int IoTConnectMqttSession::receive_qos2(MQTTString& _topic, MQTT::Message& _msg)
+{
+    int i;
+
+    for (i = 0; i < qos2_num; i++) {
+        if (qos2_ids[i] == _msg.id) {
+            tr_debug("QoS2 message %u again, not delivered", _msg.id);
+            return MQTT::SUCCESS;
+        }
+    }
+
+    if (qos2_num == IOT_CONNECT_MQTT_QOS2_RECEIVE_MAX) {
+        tr_error("More than %d QoS2 messages unreleased", IOT_CONNECT_MQTT_QOS2_RECEIVE_MAX);
+        return MQTT::FAILURE;
+    }
+
+    qos2_ids[qos2_num++] = _msg.id;
+    deliver(_topic, _msg);
+
+    return MQTT::SUCCESS;
+}
+
+void IoTConnectMqttSession::release_qos2(unsigned short _id)
+{
+    int i;
+
+    for (i = 0; i < qos2_num; i++) {
+        if (qos2_ids[i] == _id) {
+            qos2_ids[i] = qos2_ids[--qos2_num];
+            return;
+        }
+    }
+}
+
+// Read and handle one packet, returns its type, 0 for none, or a negative error
+int IoTConnectMqttSession::cycle(IoTConnectCountdown& _timer)
+{
+    int type = read_packet(_timer);
+    int len = 0;
+
+    if (type < 0) {
+        connected = false;
+        return type;
+    }
+
+    switch (type) {
+        case PUBLISH:
+        {
+            MQTTString topic = MQTTString_initializer;
+            MQTT::Message msg;
+            unsigned char dup;
+            unsigned char retained;
+            unsigned char* payload;
+            int payload_len;
+            int qos;
+
+            if (v5) {
+                if (!read_publish5(topic, msg)) {
+                    tr_error("Malformed PUBLISH");
+                    break;
+                }
+                qos = msg.qos;
+            } else {
+                if (MQTTDeserialize_publish(&dup, &qos, &retained, &msg.id, &topic, &payload, &payload_len,
+                                            readbuf, sizeof(readbuf)) != 1) {
+                    tr_error("Malformed PUBLISH");
+                    break;
+                }
+                msg.qos = (MQTT::QoS)qos;
+                msg.dup = dup;
+                msg.retained = retained;
+                msg.payload = payload;
+                msg.payloadlen = payload_len;
+            }
+            if (qos == MQTT::QOS2) {
+                if (receive_qos2(topic, msg) != MQTT::SUCCESS) {
+                    connected = false;
+                    return MQTT::FAILURE;
+                }
+                len = MQTTSerialize_ack(sendbuf, sizeof(sendbuf), PUBREC, 0, msg.id);
+                break;
+            }
+
+            deliver(topic, msg);
+            if (qos == MQTT::QOS1) {
+                len = MQTTSerialize_ack(sendbuf, sizeof(sendbuf), PUBACK, 0, msg.id);
+            }
+            break;
+        }
+        case PUBREL:
+        {
+            unsigned char ack_type;
+            unsigned char dup;
+            unsigned short id;
+
+            if (MQTTDeserialize_ack(&ack_type, &dup, &id, readbuf, sizeof(readbuf)) == 1) {
+                release_qos2(id);
+                len = MQTTSerialize_ack(sendbuf, sizeof(sendbuf), PUBCOMP, 0, id);
+            }
+            break;
+        }
+        case DISCONNECT:
+        {
+            // MQTT 5 brokers say why they close
+            const unsigned char* end;
+            const unsigned char* p = packet_body(&end);
+
+            tr_warn("Disconnected by the broker, reason 0x%02X", end > p ? p[0] : 0);
+            connected = false;
+            return MQTT::FAILURE;
+        }
+        default:
+            break;
+    }
+
+    if (len > 0) {
+        // a short yield() may have run out already
+        IoTConnectCountdown timer(command_timeout_ms);
+        if (send_packet(len, timer) != MQTT::SUCCESS) {
+            return MQTT::FAILURE;
+        }
+    }
+
+    if (keepalive() != MQTT::SUCCESS) {
+        return MQTT::FAILURE;
+    }
+
+    return type;
+}
+
+// Until a packet of _type with _id arrives, handling the others
+int IoTConnectMqttSession::wait_for(int _type, unsigned short _id, IoTConnectCountdown& _timer)
+{
+    unsigned char type;
+    unsigned char dup;
+    unsigned short id;
+    int rc;
+
+    while (!_timer.expired()) {
+        rc = cycle(_timer);
+        if (rc < 0) {
+            return rc;
+        }
+        if (rc != _type) {
+            continue;
+        }
+
+        if (_type == CONNACK) {
+            return MQTT::SUCCESS;
+        } else if (v5) {
+            rc = read_ack5(_type, _id);
+            if (rc != 1) {
+                return rc;
+            }
+        } else if (_type == SUBACK) {
+            int count = 0;
+            int granted = MQTT_SUBACK_FAILURE;
+
+            if (MQTTDeserialize_suback(&id, 1, &count, &granted, readbuf, sizeof(readbuf)) == 1 && id == _id) {
+                return (count == 1 && granted != MQTT_SUBACK_FAILURE) ? MQTT::SUCCESS : MQTT::FAILURE;
+            }
+        } else if (MQTTDeserialize_ack(&type, &dup, &id, readbuf, sizeof(readbuf)) == 1 && id == _id) {
+            return MQTT::SUCCESS;
+        }
+    }
+
+    return MQTT::FAILURE;
+}
+
+// Ping when nothing was sent, so the broker keeps the session, or nothing was
+// received, to make sure the broker is still there
+int IoTConnectMqttSession::keepalive()
+{
+    uint64_t now;
+    int len;
+
+    if (!connected || keepalive_ms == 0) {
+        return MQTT::SUCCESS;
+    }
+
+    now = Kernel::get_ms_count();
+
+    if (ping_outstanding) {
+        if (now - ping_sent_ms < ping_wait_ms()) {
+            return MQTT::SUCCESS;
+        }
+        tr_warn("No PINGRESP in %lu ms, the connection is half-open", (unsigned long)ping_wait_ms());
+        ping_timeouts++;
+        ping_outstanding = false;
+        connected = false;
+        return MQTT::FAILURE;
+    }
+
+    if (now - last_tx_ms < keepalive_ms && now - last_rx_ms < keepalive_ms) {
+        return MQTT::SUCCESS;
+    }
+
+    len = MQTTSerialize_pingreq(sendbuf, sizeof(sendbuf));
+    {
+        IoTConnectCountdown timer(command_timeout_ms);
+        if (send_packet(len, timer) != MQTT::SUCCESS) {
+            return MQTT::FAILURE;
+        }
+    }
+
+    ping_outstanding = true;
+    ping_sent_ms = now;
+    pings++;
+
+    return MQTT::SUCCESS;
+}
+
+int IoTConnectMqttSession::connect(MQTTPacket_connectData& _options)
+{
+    IoTConnectCountdown timer(command_timeout_ms);
+    unsigned char session_present;
+    unsigned char rc;
+    int len;
+
+    if (connected) {
+        return MQTT::FAILURE;
+    }
+
+    v5 = _options.MQTTVersion == IOT_CONNECT_MQTT5_VERSION;
+    receive_max = 0;
+    alias_max = 0;
+    alias_new = 0;
+    memset(aliases, 0, sizeof(aliases));
+    if (_options.cleansession) {
+        qos2_num = 0;
+    }
+
+    if (v5) {
+        len = serialize_connect5(_options);
+    } else {
+        len = MQTTSerialize_connect(sendbuf, sizeof(sendbuf), &_options);
+    }
+    if (len <= 0) {
+        return MQTT::BUFFER_OVERFLOW;
+    }
+
+    keepalive_ms = (uint32_t)_options.keepAliveInterval * 1000;
+    ping_outstanding = false;
+
+    if (send_packet(len, timer) != MQTT::SUCCESS) {
+        return MQTT::FAILURE;
+    }
+
+    if (wait_for(CONNACK, 0, timer) != MQTT::SUCCESS) {
+        return MQTT::FAILURE;
+    }
+
+    if (v5) {
+        int rc5 = read_connack5();
+        if (rc5 != MQTT::SUCCESS) {
+            return rc5;
+        }
+    } else {
+        if (MQTTDeserialize_connack(&session_present, &rc, readbuf, sizeof(readbuf)) != 1) {
+            return MQTT::FAILURE;
+        }
+        if (rc != MQTT_CONNECTION_ACCEPTED) {
+            return rc;
+        }
+    }
+
+    connected = true;
+
+    return MQTT::SUCCESS;
+}
+
+int IoTConnectMqttSession::disconnect()
+{
+    IoTConnectCountdown timer(command_timeout_ms);
+    int len = MQTTSerialize_disconnect(sendbuf, sizeof(sendbuf));
+    int rc = send_packet(len, timer);
+
+    connected = false;
+    ping_outstanding = false;
+
+    return rc;
+}
+
+bool IoTConnectMqttSession::is_connected() const
+{
+    return connected;
+}
+
+int IoTConnectMqttSession::subscribe(const char* _filter, MQTT::QoS _qos, MessageHandler _handler, void* _context)
+{
+    IoTConnectCountdown timer(command_timeout_ms);
+    MQTTString topic = MQTTString_initializer;
+    unsigned short id;
+    int qos = _qos;
+    int free_slot = -1;
+    int len;
+    int i;
+
+    if (!connected || !_filter || !_handler) {
+        return MQTT::FAILURE;
+    }
+
+    for (i = 0; i < IOT_CONNECT_MQTT_MAX_HANDLERS; i++) {
+        if (handlers[i].filter && strcmp(handlers[i].filter, _filter) == 0) {
+            free_slot = i;
+            break;
+        }
+        if (!handlers[i].filter && free_slot < 0) {
+            free_slot = i;
+        }
+    }
+    if (free_slot < 0) {
+        tr_error("No message handler left for %s", _filter);
+        return MQTT::FAILURE;
+    }
+
+    id = get_next_id();
+    topic.cstring = (char*)_filter;
+    if (v5) {
+        len = serialize_subscribe5(SUBSCRIBE, id, _filter, qos);
+    } else {
+        len = MQTTSerialize_subscribe(sendbuf, sizeof(sendbuf), 0, id, 1, &topic, &qos);
+    }
+    if (len <= 0) {
+        return MQTT::BUFFER_OVERFLOW;
+    }
+
+    if (send_packet(len, timer) != MQTT::SUCCESS || wait_for(SUBACK, id, timer) != MQTT::SUCCESS) {
+        return MQTT::FAILURE;
+    }
+
+    handlers[free_slot].filter = _filter;
+    handlers[free_slot].handler = _handler;
+    handlers[free_slot].context = _context;
+
+    return MQTT::SUCCESS;
+}
+
+int IoTConnectMqttSession::unsubscribe(const char* _filter)
+{
+    IoTConnectCountdown timer(command_timeout_ms);
+    MQTTString topic = MQTTString_initializer;
+    unsigned short id;
+    int len;
+    int i;
+
+    if (!_filter) {
+        return MQTT::FAILURE;
+    }
+
+    // the filter may be freed once this returns
+    for (i = 0; i < IOT_CONNECT_MQTT_MAX_HANDLERS; i++) {
+        if (handlers[i].filter && strcmp(handlers[i].filter, _filter) == 0) {
+            handlers[i].filter = NULL;
+            handlers[i].handler = NULL;
+            handlers[i].context = NULL;
+        }
+    }
+
+    if (!connected) {
+        return MQTT::FAILURE;
+    }
+
+    id = get_next_id();
+    topic.cstring = (char*)_filter;
+    if (v5) {
+        len = serialize_subscribe5(UNSUBSCRIBE, id, _filter, 0);
+    } else {
+        len = MQTTSerialize_unsubscribe(sendbuf, sizeof(sendbuf), 0, id, 1, &topic);
+    }
+    if (len <= 0) {
+        return MQTT::BUFFER_OVERFLOW;
+    }
+
+    if (send_packet(len, timer) != MQTT::SUCCESS || wait_for(UNSUBACK, id, timer) != MQTT::SUCCESS) {
+        return MQTT::FAILURE;
+    }
+
+    return MQTT::SUCCESS;
+}
+
+int IoTConnectMqttSession::publish(const char* _topic, MQTT::Message& _msg, uint32_t _expiry_s, bool _fixed_topic)
+{
+    IoTConnectCountdown timer(command_timeout_ms);
+    MQTTString topic = MQTTString_initializer;
+    int len;
+
+    if (!connected) {
+        return MQTT::FAILURE;
+    }
+
+    _msg.id = _msg.qos == MQTT::QOS0 ? 0 : get_next_id();
+    topic.cstring = (char*)_topic;
+    if (v5) {
+        len = serialize_publish_header(_topic, _msg, _msg.payloadlen, _msg.payloadlen, _expiry_s, _fixed_topic);
+        if (len > 0) {
+            memcpy(sendbuf + len, _msg.payload, _msg.payloadlen);
+            len += _msg.payloadlen;
+        }
+    } else {
+        len = MQTTSerialize_publish(sendbuf, sizeof(sendbuf), 0, _msg.qos, _msg.retained, _msg.id, topic,
+                                    (unsigned char*)_msg.payload, _msg.payloadlen);
+    }
+    if (len <= 0) {
+        return MQTT::BUFFER_OVERFLOW;
+    }
+
+    if (send_packet(len, timer) != MQTT::SUCCESS) {
+        return MQTT::FAILURE;
+    }
+    if (v5 && alias_new) {
+        aliases[alias_new - 1] = _topic;
+        alias_new = 0;
+    }
+
+    return wait_for_acks(_msg, timer);
+}
+
+int IoTConnectMqttSession::publish_stream(const char* _topic, MQTT::Message& _msg, IoTConnectPayloadReader _reader,
+                                          uint32_t _expiry_s, bool _fixed_topic)
+{
+    uint32_t left = _msg.payloadlen;
+    int len;
+
+    if (!connected || _msg.payloadlen < 0 || !_reader) {
+        return MQTT::FAILURE;
+    }
+
+    _msg.id = _msg.qos == MQTT::QOS0 ? 0 : get_next_id();
+    len = serialize_publish_header(_topic, _msg, _msg.payloadlen, 0, _expiry_s, _fixed_topic);
+    if (len <= 0) {
+        return MQTT::BUFFER_OVERFLOW;
+    }
+
+    // sendbuf is the chunk, the first one goes with the header
+    do {
+        int chunk = sizeof(sendbuf) - len;
+        int got;
+
+        if ((uint32_t)chunk > left) {
+            chunk = left;
+        }
+        got = chunk > 0 ? _reader(sendbuf + len, chunk) : 0;
+        if (got < 0 || got > chunk || (got == 0 && chunk > 0)) {
+            tr_error("Payload reader failed, %lu bytes short", (unsigned long)left);
+            if (len == 0) {
+                // the packet is cut short, the stream is out of step
+                connected = false;
+            }
+            return MQTT::FAILURE;
+        }
+        left -= got;
+        len += got;
+
+        IoTConnectCountdown timer(command_timeout_ms);
+        if (send_packet(len, timer) != MQTT::SUCCESS) {
+            return MQTT::FAILURE;
+        }
+        if (alias_new) {
+            aliases[alias_new - 1] = _topic;
+            alias_new = 0;
+        }
+        len = 0;
+    } while (left > 0);
+
+    IoTConnectCountdown timer(command_timeout_ms);
+
+    return wait_for_acks(_msg, timer);
+}
+
+// After a PUBLISH was written, its acks for QoS > 0
+int IoTConnectMqttSession::wait_for_acks(MQTT::Message& _msg, IoTConnectCountdown& _timer)
+{
+    int len;
+
+    if (_msg.qos == MQTT::QOS1) {
+        return wait_for(PUBACK, _msg.id, _timer);
+    } else if (_msg.qos == MQTT::QOS2) {
+        if (wait_for(PUBREC, _msg.id, _timer) != MQTT::SUCCESS) {
+            return MQTT::FAILURE;
+        }
+        len = MQTTSerialize_ack(sendbuf, sizeof(sendbuf), PUBREL, 0, _msg.id);
+        if (send_packet(len, _timer) != MQTT::SUCCESS) {
+            return MQTT::FAILURE;
+        }
+        return wait_for(PUBCOMP, _msg.id, _timer);
+    }
+
+    return MQTT::SUCCESS;
+}
+
+int IoTConnectMqttSession::yield(int _timeout_ms)
+{
+    IoTConnectCountdown timer(_timeout_ms);
+    int rc;
+
+    do {
+        rc = cycle(timer);
+        if (rc < 0) {
+            return MQTT::FAILURE;
+        }
+    } while (!timer.expired());
+
+    return MQTT::SUCCESS;
+}
+
+void IoTConnectMqttSession::set_ping_timeout(int _ms)
+{
+    ping_timeout_ms = _ms;
+}
+
+// The ping timeout, no longer than the keepalive
+uint32_t IoTConnectMqttSession::ping_wait_ms() const
+{
+    if (ping_timeout_ms > 0 && (uint32_t)ping_timeout_ms < keepalive_ms) {
+        return ping_timeout_ms;
+    }
+
+    return keepalive_ms;
+}
+
+uint64_t IoTConnectMqttSession::next_keepalive_ms() const
+{
+    if (!connected || keepalive_ms == 0) {
+        return 0;
+    }
+
+    if (ping_outstanding) {
+        return ping_sent_ms + ping_wait_ms();
+    }
+
+    return (last_rx_ms < last_tx_ms ? last_rx_ms : last_tx_ms) + keepalive_ms;
+}
+
+uint32_t IoTConnectMqttSession::get_pings() const
+{
+    return pings;
+}
+
+uint32_t IoTConnectMqttSession::get_ping_timeouts() const
+{
+    return ping_timeouts;
+}
+
+bool IoTConnectMqttSession::is_mqtt5() const
+{
+    return v5;
+}
+
+uint16_t IoTConnectMqttSession::get_receive_max() const
+{
+    return receive_max;
+}
+
+uint16_t IoTConnectMqttSession::get_topic_alias_max() const
+{
+    return alias_max;
+}
+
+// Past the fixed header of the packet in readbuf, read_packet() checked its length
+const unsigned char* IoTConnectMqttSession::packet_body(const unsigned char** _end) const
+{
+    uint32_t rem_len;
+    int len = iot_connect_mqtt5_read_vbi(readbuf + 1, readbuf + sizeof(readbuf), &rem_len);
+
+    *_end = readbuf + 1 + len + rem_len;
+
+    return readbuf + 1 + len;
+}
+
+int IoTConnectMqttSession::serialize_connect5(MQTTPacket_connectData& _options)
+{
+    int id_len = MQTTstrlen(_options.clientID);
+    int user_len = MQTTstrlen(_options.username);
+    int pwd_len = MQTTstrlen(_options.password);
+    // Maximum Packet Size, the broker drops what we couldn't read, and Receive Maximum
+    int props_len = 5 + 3;
+    // protocol name, level, flags and keepalive
+    uint32_t rem_len = 10 + 1 + props_len + 2 + id_len;
+    unsigned char flags = _options.cleansession ? 0x02 : 0;
+    unsigned char* p = sendbuf;
+
+    if (_options.willFlag) {
+        return -1;
+    }
+    if (user_len > 0) {
+        flags |= 0x80;
+        rem_len += 2 + user_len;
+    }
+    if (pwd_len > 0) {
+        flags |= 0x40;
+        rem_len += 2 + pwd_len;
+    }
+    if (1 + iot_connect_mqtt5_vbi_len(rem_len) + rem_len > sizeof(sendbuf)) {
+        return -1;
+    }
+
+    *p++ = CONNECT << 4;
+    p = iot_connect_mqtt5_write_vbi(p, rem_len);
+    p = iot_connect_mqtt5_write_str(p, "MQTT", 4);
+    *p++ = IOT_CONNECT_MQTT5_VERSION;
+    *p++ = flags;
+    p = iot_connect_mqtt5_write_u16(p, _options.keepAliveInterval);
+    *p++ = props_len;
+    *p++ = MQTT5_PROP_MAX_PACKET_SIZE;
+    p = iot_connect_mqtt5_write_u32(p, sizeof(readbuf));
+    *p++ = MQTT5_PROP_RECEIVE_MAX;
+    p = iot_connect_mqtt5_write_u16(p, IOT_CONNECT_MQTT_QOS2_RECEIVE_MAX);
+    p = iot_connect_mqtt5_write_str(p, mqtt_string_data(_options.clientID), id_len);
+    if (user_len > 0) {
+        p = iot_connect_mqtt5_write_str(p, mqtt_string_data(_options.username), user_len);
+    }
+    if (pwd_len > 0) {
+        p = iot_connect_mqtt5_write_str(p, mqtt_string_data(_options.password), pwd_len);
+    }
+
+    return p - sendbuf;
+}
+
+int IoTConnectMqttSession::read_connack5()
+{
+    IoTConnectMqtt5Props props;
+    const unsigned char* end;
+    const unsigned char* p = packet_body(&end);
+
+    // flags and reason code, then properties
+    if (end - p < 2) {
+        return MQTT::FAILURE;
+    }
+    if (p[1] != MQTT_CONNECTION_ACCEPTED) {
+        return p[1];
+    }
+    memset(&props, 0, sizeof(props));
+    if (end - p > 2 && iot_connect_mqtt5_read_props(p + 2, end, &props) < 0) {
+        return MQTT::FAILURE;
+    }
+
+    receive_max = props.receive_max ? props.receive_max : 65535;
+    alias_max = props.topic_alias_max < IOT_CONNECT_MQTT_TOPIC_ALIASES ?
+                props.topic_alias_max : IOT_CONNECT_MQTT_TOPIC_ALIASES;
+    if (props.has_server_keepalive) {
+        keepalive_ms = (uint32_t)props.server_keepalive * 1000;
+    }
+
+    return MQTT::SUCCESS;
+}
+
+// Fixed and variable header of a PUBLISH of _payload_len bytes in sendbuf, with
+// room for _room of them after it. The header length, or -1 if it doesn't fit.
+int IoTConnectMqttSession::serialize_publish_header(const char* _topic, MQTT::Message& _msg, uint32_t _payload_len,
+                                                    int _room, uint32_t _expiry_s, bool _fixed_topic)
+{
+    int topic_len = strlen(_topic);
+    uint16_t alias = 0;
+    bool has_alias = false;
+    int props_len = 0;
+    uint32_t rem_len;
+    unsigned char* p = sendbuf;
+    int i;
+
+    if (v5 && _fixed_topic) {
+        for (i = 0; i < alias_max; i++) {
+            if (aliases[i] == _topic) {
+                alias = i + 1;
+                has_alias = true;
+                break;
+            }
+            if (!aliases[i] && !alias) {
+                alias = i + 1;
+            }
+        }
+    }
+
+    if (_expiry_s && v5) {
+        props_len += 5;
+    }
+    if (alias) {
+        props_len += 3;
+    }
+    rem_len = 2 + (has_alias ? 0 : topic_len) + (_msg.qos ? 2 : 0) + _payload_len;
+    if (v5) {
+        rem_len += iot_connect_mqtt5_vbi_len(props_len) + props_len;
+    }
+    if (rem_len > MQTT_REMAINING_LENGTH_MAX ||
+        1 + iot_connect_mqtt5_vbi_len(rem_len) + rem_len - _payload_len + _room > sizeof(sendbuf)) {
+        return -1;
+    }
+
+    *p++ = (PUBLISH << 4) | (_msg.qos << 1) | (_msg.retained ? 1 : 0);
+    p = iot_connect_mqtt5_write_vbi(p, rem_len);
+    // an empty topic with a known alias
+    p = iot_connect_mqtt5_write_str(p, _topic, has_alias ? 0 : topic_len);
+    if (_msg.qos) {
+        p = iot_connect_mqtt5_write_u16(p, _msg.id);
+    }
+    if (v5) {
+        p = iot_connect_mqtt5_write_vbi(p, props_len);
+        if (_expiry_s) {
+            *p++ = MQTT5_PROP_MESSAGE_EXPIRY;
+            p = iot_connect_mqtt5_write_u32(p, _expiry_s);
+        }
+        if (alias) {
+            *p++ = MQTT5_PROP_TOPIC_ALIAS;
+            p = iot_connect_mqtt5_write_u16(p, alias);
+        }
+    }
+    // the broker knows the alias once this is sent
+    alias_new = has_alias ? 0 : alias;
+
+    return p - sendbuf;
+}
+
+int IoTConnectMqttSession::serialize_subscribe5(int _type, unsigned short _id, const char* _filter, int _qos)
+{
+    int filter_len = strlen(_filter);
+    // no properties, subscription options of SUBSCRIBE
+    uint32_t rem_len = 2 + 1 + 2 + filter_len + (_type == SUBSCRIBE ? 1 : 0);
+    unsigned char* p = sendbuf;
+
+    if (1 + iot_connect_mqtt5_vbi_len(rem_len) + rem_len > sizeof(sendbuf)) {
+        return -1;
+    }
+
+    *p++ = (_type << 4) | 0x02;
+    p = iot_connect_mqtt5_write_vbi(p, rem_len);
+    p = iot_connect_mqtt5_write_u16(p, _id);
+    *p++ = 0;
+    p = iot_connect_mqtt5_write_str(p, _filter, filter_len);
+    if (_type == SUBSCRIBE) {
+        *p++ = _qos;
+    }
+
+    return p - sendbuf;
+}
+
+// The ack in readbuf, 1 if it isn't the one for _id
+int IoTConnectMqttSession::read_ack5(int _type, unsigned short _id)
+{
+    IoTConnectMqtt5Props props;
+    const unsigned char* end;
+    const unsigned char* p = packet_body(&end);
+    unsigned char reason = 0;
+    int n;
+
+    if (end - p < 2 || read_u16(p) != _id) {
+        return 1;
+    }
+    p += 2;
+
+    if (_type == SUBACK || _type == UNSUBACK) {
+        // properties, then a reason code per filter
+        n = iot_connect_mqtt5_read_props(p, end, &props);
+        if (n < 0 || end - p - n != 1) {
+            return MQTT::FAILURE;
+        }
+        reason = p[n];
+    } else if (p < end) {
+        // none means success
+        reason = p[0];
+    }
+
+    if (reason >= MQTT5_REASON_FAILURE) {
+        tr_warn("Packet %u refused, reason 0x%02X", _id, reason);
+        return MQTT::FAILURE;
+    }
+
+    return MQTT::SUCCESS;
+}
+
+bool IoTConnectMqttSession::read_publish5(MQTTString& _topic, MQTT::Message& _msg)
+{
+    IoTConnectMqtt5Props props;
+    const unsigned char* end;
+    const unsigned char* p = packet_body(&end);
+    int len;
+
+    if (end - p < 2 || end - p - 2 < read_u16(p)) {
+        return false;
+    }
+    len = read_u16(p);
+    // no topic alias maximum was given, every topic is sent in full
+    if (len == 0) {
+        return false;
+    }
+    _topic.cstring = NULL;
+    _topic.lenstring.len = len;
+    _topic.lenstring.data = (char*)p + 2;
+    p += 2 + len;
+
+    _msg.qos = (MQTT::QoS)((readbuf[0] >> 1) & 0x03);
+    _msg.dup = (readbuf[0] >> 3) & 0x01;
+    _msg.retained = readbuf[0] & 0x01;
+    _msg.id = 0;
+    if (_msg.qos != MQTT::QOS0) {
+        if (end - p < 2) {
+            return false;
+        }
+        _msg.id = read_u16(p);
+        p += 2;
+    }
+
+    len = iot_connect_mqtt5_read_props(p, end, &props);
+    if (len < 0) {
+        return false;
+    }
+    p += len;
+
+    _msg.payload = (void*)p;
+    _msg.payloadlen = end - p;
+
+    return true;
+}
@@ -0,0 +1,134 @@
+#ifndef __IOT_CONNECT_MQTT_SESSION_H__
+#define __IOT_CONNECT_MQTT_SESSION_H__
+
+#include "IoTConnectPlatform.h"
+#include "IoTConnectNetwork.h"
+#include "MQTTClient.h"
+#include "IoTConnectMqtt5.h"
+
+#define IOT_CONNECT_MQTT_COMMAND_TIMEOUT_MS 30000
+#define IOT_CONNECT_MQTT_TOPIC_ALIASES MBED_CONF_IOT_CONNECT_MQTT_TOPIC_ALIASES
+#define IOT_CONNECT_MQTT_QOS2_RECEIVE_MAX MBED_CONF_IOT_CONNECT_MQTT_QOS2_RECEIVE_MAX
+
+// Reads up to _len bytes of a payload into _buf, the bytes read, <= 0 if it failed
+typedef Callback<int(unsigned char* _buf, int _len)> IoTConnectPayloadReader;
+
+// MQTT topic filter match, used to route subscribed messages
+bool mqtt_is_topic_matched(const char* topicFilter, MQTTString& topicName);
+
+// MQTT 3.1.1 or 5 session over a transport, the part of MQTT::Client the library uses,
+// with its own keepalive: a PINGREQ only goes out when nothing has been sent or
+// nothing received for the keepalive interval, and a PINGREQ unanswered for the
+// ping timeout drops the session, so a half-open connection is found in seconds.
+// An inbound QoS2 message is delivered once, its retransmits until the broker
+// releases it are only acknowledged; with MQTT 5 the broker is told how many it
+// may send at a time, with 3.1.1 one more drops the session.
+// Returns MQTT::returnCode. Not thread safe.
+class IoTConnectMqttSession {
+
+public:
+    // _context is the one given to subscribe()
+    typedef void (*MessageHandler)(MQTT::MessageData&, void* _context);
+
+    IoTConnectMqttSession(IoTConnectNetwork& _network, int _command_timeout_ms = IOT_CONNECT_MQTT_COMMAND_TIMEOUT_MS);
+
+    // keepAliveInterval of _options is the keepalive in seconds, 0 for none.
+    // MQTTVersion IOT_CONNECT_MQTT5_VERSION for MQTT 5, without a will.
+    int connect(MQTTPacket_connectData& _options);
+    int disconnect();
+    bool is_connected() const;
+
+    // Every filter takes a handler slot, see IOT_CONNECT_MQTT_MAX_HANDLERS. The filter is
+    // kept until unsubscribed.
+    int subscribe(const char* _filter, MQTT::QoS _qos, MessageHandler _handler, void* _context = NULL);
+    // The handler is dropped even if the broker couldn't be told
+    int unsubscribe(const char* _filter);
+    // Returns once written for QoS0, or acknowledged. _msg.id is set to the packet id.
+    // With MQTT 5, the broker drops the message if it can't deliver it in _expiry_s, 0 for
+    // never, and a _fixed_topic, a string kept unchanged while connected, gets a topic alias:
+    // it's sent once per connection and a 2 byte alias afterwards.
+    int publish(const char* _topic, MQTT::Message& _msg, uint32_t _expiry_s = 0, bool _fixed_topic = false);
+    // A payload of _msg.payloadlen bytes pulled from _reader into the send buffer a chunk at
+    // a time and written as it comes, so it may be larger than the buffer. A reader failing
+    // after the first chunk leaves the packet cut short, the session is then disconnected.
+    int publish_stream(const char* _topic, MQTT::Message& _msg, IoTConnectPayloadReader _reader,
+                       uint32_t _expiry_s = 0, bool _fixed_topic = false);
+    // Handle inbound packets and the keepalive for _timeout_ms, at least one read
+    int yield(int _timeout_ms);
+
+    // How long to wait for PINGRESP, 0 or more than the keepalive interval for the interval
+    void set_ping_timeout(int _ms);
+    // Kernel::get_ms_count() when yield() has a ping to send or a ping timeout to check,
+    // 0 without keepalive
+    uint64_t next_keepalive_ms() const;
+
+    // PINGREQs sent and unanswered since created
+    uint32_t get_pings() const;
+    uint32_t get_ping_timeouts() const;
+
+    // MQTT 5, from CONNACK: QoS > 0 publishes the broker takes unacknowledged (publish()
+    // has one at a time), and topic aliases in use, at most IOT_CONNECT_MQTT_TOPIC_ALIASES
+    bool is_mqtt5() const;
+    uint16_t get_receive_max() const;
+    uint16_t get_topic_alias_max() const;
+
+private:
+    IoTConnectNetwork& network;
+    int command_timeout_ms;
+    bool connected;
+    unsigned short next_id;
+
+    uint32_t keepalive_ms;
+    int ping_timeout_ms;
+    bool ping_outstanding;
+    uint64_t ping_sent_ms;
+    uint64_t last_rx_ms;
+    uint64_t last_tx_ms;
+    uint32_t pings;
+    uint32_t ping_timeouts;
+
+    bool v5;
+    uint16_t receive_max;
+    uint16_t alias_max;
+    // topic of alias i + 1 on this connection
+    const char* aliases[IOT_CONNECT_MQTT_TOPIC_ALIASES > 0 ? IOT_CONNECT_MQTT_TOPIC_ALIASES : 1];
+    // alias of the PUBLISH in sendbuf, to be taken once it's sent
+    uint16_t alias_new;
+
+    // packet ids of the QoS2 messages delivered and not released yet
+    unsigned short qos2_ids[IOT_CONNECT_MQTT_QOS2_RECEIVE_MAX];
+    int qos2_num;
+
+    struct {
+        const char* filter;
+        MessageHandler handler;
+        void* context;
+    } handlers[IOT_CONNECT_MQTT_MAX_HANDLERS];
+
+    unsigned char sendbuf[IOT_CONNECT_MQTT_MAX_PACKET_SIZE];
+    unsigned char readbuf[IOT_CONNECT_MQTT_MAX_PACKET_SIZE];
+
+private:
+    unsigned short get_next_id();
+    int send_packet(int _len, IoTConnectCountdown& _timer);
+    int read_bytes(unsigned char* _buf, int _len, IoTConnectCountdown& _timer);
+    int read_packet(IoTConnectCountdown& _timer);
+    int cycle(IoTConnectCountdown& _timer);
+    int wait_for(int _type, unsigned short _id, IoTConnectCountdown& _timer);
+    void deliver(MQTTString& _topic, MQTT::Message& _msg);
+    int receive_qos2(MQTTString& _topic, MQTT::Message& _msg);
+    void release_qos2(unsigned short _id);
+    int keepalive();
+    uint32_t ping_wait_ms() const;
+    int serialize_connect5(MQTTPacket_connectData& _options);
+    int serialize_publish_header(const char* _topic, MQTT::Message& _msg, uint32_t _payload_len, int _room,
+                                 uint32_t _expiry_s, bool _fixed_topic);
+    int wait_for_acks(MQTT::Message& _msg, IoTConnectCountdown& _timer);
+    int serialize_subscribe5(int _type, unsigned short _id, const char* _filter, int _qos);
+    int read_connack5();
+    int read_ack5(int _type, unsigned short _id);
+    bool read_publish5(MQTTString& _topic, MQTT::Message& _msg);
+    const unsigned char* packet_body(const unsigned char** _end) const;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include "IoTConnectMsgProps.h"
+
+// '$' of system property keys stays as is
+static bool url_is_unreserved(char c, bool _key)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '-' || c == '_' || c == '.' || c == '~' || (_key && c == '$');
+}
+
+static size_t url_encoded_len(const char* _src, bool _key)
+{
+    size_t len = 0;
+
+    for (; *_src; _src++) {
+        len += url_is_unreserved(*_src, _key) ? 1 : 3;
+    }
+
+    return len;
+}
+
+static char* url_encode(char* _dst, const char* _src, bool _key)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    for (; *_src; _src++) {
+        if (url_is_unreserved(*_src, _key)) {
+            *_dst++ = *_src;
+        } else {
+            *_dst++ = '%';
+            *_dst++ = hex[(uint8_t)*_src >> 4];
+            *_dst++ = hex[(uint8_t)*_src & 0x0F];
+        }
+    }
+
+    return _dst;
+}
+
+size_t iot_connect_msg_props_len(const IoTConnectMsgProperty* _props, int _num)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < _num; i++) {
+        // '&' before all but the first, '='
+        len += (i > 0) + url_encoded_len(_props[i].key, true) + 1 + url_encoded_len(_props[i].value, false);
+    }
+
+    return len;
+}
+
+size_t iot_connect_msg_props_encode(char* _dst, const IoTConnectMsgProperty* _props, int _num)
+{
+    char* d = _dst;
+    int i;
+
+    for (i = 0; i < _num; i++) {
+        if (i > 0) {
+            *d++ = '&';
+        }
+        d = url_encode(d, _props[i].key, true);
+        *d++ = '=';
+        d = url_encode(d, _props[i].value, false);
+    }
+    *d = '\0';
+
+    return d - _dst;
+}
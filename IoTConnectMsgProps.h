@@ -0,0 +1,20 @@
+#ifndef __IOT_CONNECT_MSG_PROPS_H__
+#define __IOT_CONNECT_MSG_PROPS_H__
+
+#include <stddef.h>
+
+#define IOT_CONNECT_MSG_PROPS_MAX MBED_CONF_IOT_CONNECT_MQTT_TOPIC_PROPS_MAX
+
+// An application property of a device to cloud message, IoT Hub routes on it.
+// Keys starting with "$." are system properties, e.g. "$.ct" the content type.
+typedef struct {
+    const char* key;
+    const char* value;
+} IoTConnectMsgProperty;
+
+// Length of _props URL encoded as "k1=v1&k2=v2", without '\0'
+size_t iot_connect_msg_props_len(const IoTConnectMsgProperty* _props, int _num);
+// _dst should have iot_connect_msg_props_len() + 1 bytes, returns the length
+size_t iot_connect_msg_props_encode(char* _dst, const IoTConnectMsgProperty* _props, int _num);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef __IOT_CONNECT_NETWORK_H__
+#define __IOT_CONNECT_NETWORK_H__
+
+#include "IoTConnectPlatform.h"
+#include "IoTConnectError.h"
+
+class IoTConnectTrustStore;
+struct IoTConnectTlsProfile;
+
+// Phases of a connect, see IoTConnectClient::connect_async()
+typedef enum {
+    IOT_CONNECT_PHASE_CERT = 0,     // give the root CA and client certificate to the transport
+    IOT_CONNECT_PHASE_DNS,          // resolve the host name
+    IOT_CONNECT_PHASE_TCP,          // open a socket and connect
+    IOT_CONNECT_PHASE_TLS,          // TLS handshake
+    IOT_CONNECT_PHASE_MQTT,         // SAS token, MQTT CONNECT and CONNACK
+    IOT_CONNECT_PHASES
+} IoTConnectPhase;
+
+// TLS transport under IoTConnectClient and its MQTT session.
+// A transport could connect again after disconnected.
+class IoTConnectNetwork {
+
+public:
+    virtual ~IoTConnectNetwork() {}
+
+    // PEM strings should be kept until the transport is destroyed
+    virtual int set_root_ca_cert(const char* _root_ca_pem) = 0;
+    virtual int set_client_cert_key(const char* _cert_pem, const char* _key_pem) = 0;
+    // Certificates parsed once and shared, used instead of the PEM ones from then on.
+    // _client is NULL without a client certificate. Stores should outlive the transport.
+    virtual int set_trust_store(IoTConnectTrustStore* _ca, IoTConnectTrustStore* _client)
+    {
+        return IOT_CONNECT_ERROR_NS_UNSUPPORTED;
+    }
+    // Cipher suites, curves and max fragment length offered from the next handshake,
+    // NULL for mbedTLS's defaults. The profile should outlive the transport.
+    virtual int set_tls_profile(const IoTConnectTlsProfile* _profile)
+    {
+        return IOT_CONNECT_ERROR_NS_UNSUPPORTED;
+    }
+
+    // DNS, TCP connect and TLS handshake
+    virtual int connect(const char* _host_name, uint16_t _port, int _timeout_ms) = 0;
+    virtual int disconnect() = 0;
+
+    // One of the DNS / TCP / TLS phases of connect(), called in that order, so a connect
+    // could be spread over several calls. By default, it all happens in the TLS phase.
+    virtual int connect_phase(IoTConnectPhase _phase, const char* _host_name, uint16_t _port, int _timeout_ms)
+    {
+        return _phase == IOT_CONNECT_PHASE_TLS ? connect(_host_name, _port, _timeout_ms) : 0;
+    }
+
+    // Read _len bytes within _timeout_ms, returns the bytes read, 0 if timeout without any data,
+    // or a negative error
+    virtual int read(unsigned char* _buf, int _len, int _timeout_ms) = 0;
+    // Returns the bytes written or a negative error
+    virtual int write(unsigned char* _buf, int _len, int _timeout_ms) = 0;
+
+    // _func is called when the transport may be read or written again, possibly in an
+    // interrupt, so it should only defer the work. Kept over reconnects, NULL to remove.
+    virtual int sigio(Callback<void()> _func)
+    {
+        return IOT_CONNECT_ERROR_NS_UNSUPPORTED;
+    }
+
+protected:
+    // connect() of a transport that implements connect_phase()
+    int connect_by_phases(const char* _host_name, uint16_t _port, int _timeout_ms)
+    {
+        uint64_t deadline = Kernel::get_ms_count() + _timeout_ms;
+        int phase;
+        int ret;
+
+        for (phase = IOT_CONNECT_PHASE_DNS; phase <= IOT_CONNECT_PHASE_TLS; phase++) {
+            uint64_t now = Kernel::get_ms_count();
+
+            ret = connect_phase((IoTConnectPhase)phase, _host_name, _port, now < deadline ? (int)(deadline - now) : 0);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+
+        return 0;
+    }
+};
+
+#endif
@@ -0,0 +1,253 @@
+#if !defined(IOT_CONNECT_PLATFORM_POSIX)
+
+#include "IoTConnectNetworkMbed.h"
+#include "IoTConnectTrustStore.h"
+#include "IoTConnectTlsProfile.h"
+#include "IoTConnectError.h"
+
+
+#define TRACE_GROUP  "IoTConnectNetworkMbed"
+
+IoTConnectNetworkMbed::IoTConnectNetworkMbed(NetworkInterface* _network) :
+    network(_network),
+    tcp(NULL),
+    socket(NULL),
+    root_ca_pem(NULL),
+    client_cert_pem(NULL),
+    client_key_pem(NULL),
+    ca_store(NULL),
+    client_store(NULL),
+    tls_profile(NULL),
+    sigio_func(NULL)
+{
+
+}
+
+IoTConnectNetworkMbed::~IoTConnectNetworkMbed()
+{
+    disconnect();
+}
+
+int IoTConnectNetworkMbed::set_root_ca_cert(const char* _root_ca_pem)
+{
+    root_ca_pem = _root_ca_pem;
+    return 0;
+}
+
+int IoTConnectNetworkMbed::set_client_cert_key(const char* _cert_pem, const char* _key_pem)
+{
+    if (!_cert_pem || !_key_pem) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    client_cert_pem = _cert_pem;
+    client_key_pem = _key_pem;
+    return 0;
+}
+
+int IoTConnectNetworkMbed::set_trust_store(IoTConnectTrustStore* _ca, IoTConnectTrustStore* _client)
+{
+    if (_ca && !_ca->has_ca_cert()) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+    if (_client && !_client->has_client_cert()) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    ca_store = _ca;
+    client_store = _client;
+    return 0;
+}
+
+int IoTConnectNetworkMbed::set_tls_profile(const IoTConnectTlsProfile* _profile)
+{
+    tls_profile = _profile;
+    return 0;
+}
+
+int IoTConnectNetworkMbed::connect(const char* _host_name, uint16_t _port, int _timeout_ms)
+{
+    return connect_by_phases(_host_name, _port, _timeout_ms);
+}
+
+int IoTConnectNetworkMbed::connect_phase(IoTConnectPhase _phase, const char* _host_name, uint16_t _port,
+                                         int _timeout_ms)
+{
+    int ret;
+
+    switch (_phase) {
+        case IOT_CONNECT_PHASE_DNS:
+            // A closed socket could not be opened again
+            disconnect();
+
+            ret = network->gethostbyname(_host_name, &address);
+            if (ret != NSAPI_ERROR_OK) {
+                tr_error("Could not resolve %s! Returned %d\n", _host_name, ret);
+                return ret;
+            }
+            address.set_port(_port);
+            return 0;
+
+        case IOT_CONNECT_PHASE_TCP:
+            tcp = new TCPSocket;
+
+            ret = tcp->open(network);
+            if (ret != NSAPI_ERROR_OK) {
+                tr_error("Could not open socket! Error code: %d", ret);
+                return ret;
+            }
+            if (sigio_func) {
+                tcp->sigio(sigio_func);
+            }
+
+            tr_info("Try to connect to %s(ip: %s):%d", _host_name, address.get_ip_address(), address.get_port());
+            tcp->set_timeout(_timeout_ms);
+            ret = tcp->connect(address);
+            if (ret != NSAPI_ERROR_OK) {
+                tr_error("Could not connect! Returned %d\n", ret);
+                return ret;
+            }
+            return 0;
+
+        case IOT_CONNECT_PHASE_TLS:
+            if (!tcp) {
+                return NSAPI_ERROR_NO_SOCKET;
+            }
+
+            // the TCP socket is closed by disconnect()
+            socket = new TLSSocketWrapper(tcp, NULL, TLSSocketWrapper::TRANSPORT_KEEP);
+
+            if (ca_store) {
+                // referenced, the socket doesn't free it
+                socket->set_ca_chain(ca_store->get_ca_chain());
+            } else if (root_ca_pem) {
+                ret = socket->set_root_ca_cert(root_ca_pem);
+                if (ret != NSAPI_ERROR_OK) {
+                    tr_error("Could not set ca cert! Returned %d\n", ret);
+                    return ret;
+                }
+            }
+
+            if (client_store) {
+                ret = mbedtls_ssl_conf_own_cert(socket->get_ssl_config(), client_store->get_client_cert(),
+                                                client_store->get_client_key());
+                if (ret != 0) {
+                    tr_error("Could not set keys! Returned -0x%04X\n", -ret);
+                    return ret;
+                }
+            } else if (client_cert_pem) {
+                ret = socket->set_client_cert_key(client_cert_pem, client_key_pem);
+                if (ret != NSAPI_ERROR_OK) {
+                    tr_error("Could not set keys! Returned %d\n", ret);
+                    return ret;
+                }
+            }
+
+            if (tls_profile) {
+                ret = iot_connect_tls_profile_apply(tls_profile, socket->get_ssl_config());
+                if (ret != 0) {
+                    return ret;
+                }
+            }
+
+            socket->set_timeout(_timeout_ms);
+            ret = socket->connect(address);
+            if (ret != NSAPI_ERROR_OK) {
+                tr_error("TLS handshake failed! Returned %d\n", ret);
+                return ret;
+            }
+
+            tr_info("Connection established");
+            return 0;
+
+        default:
+            return 0;
+    }
+}
+
+int IoTConnectNetworkMbed::disconnect()
+{
+    if (socket) {
+        socket->close();
+        delete socket;
+        socket = NULL;
+    }
+
+    if (tcp) {
+        tcp->close();
+        delete tcp;
+        tcp = NULL;
+    }
+
+    return 0;
+}
+
+int IoTConnectNetworkMbed::sigio(Callback<void()> _func)
+{
+    sigio_func = _func;
+    if (tcp) {
+        tcp->sigio(_func);
+    }
+
+    return 0;
+}
+
+int IoTConnectNetworkMbed::read(unsigned char* _buf, int _len, int _timeout_ms)
+{
+    uint64_t deadline = Kernel::get_ms_count() + _timeout_ms;
+    int got = 0;
+
+    if (!socket) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    // the MQTT session expects the whole packet once the first byte arrived
+    while (got < _len) {
+        uint64_t now = Kernel::get_ms_count();
+        nsapi_size_or_error_t rc;
+
+        socket->set_timeout(now < deadline ? (int)(deadline - now) : 0);
+        rc = socket->recv(_buf + got, _len - got);
+        if (rc == NSAPI_ERROR_WOULD_BLOCK) {
+            break;
+        }
+        if (rc < 0) {
+            return rc;
+        }
+        if (rc == 0) {
+            return NSAPI_ERROR_CONNECTION_LOST;
+        }
+        got += rc;
+    }
+
+    return got;
+}
+
+int IoTConnectNetworkMbed::write(unsigned char* _buf, int _len, int _timeout_ms)
+{
+    uint64_t deadline = Kernel::get_ms_count() + _timeout_ms;
+    int sent = 0;
+
+    if (!socket) {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+
+    while (sent < _len) {
+        uint64_t now = Kernel::get_ms_count();
+        nsapi_size_or_error_t rc;
+
+        socket->set_timeout(now < deadline ? (int)(deadline - now) : 0);
+        rc = socket->send(_buf + sent, _len - sent);
+        if (rc == NSAPI_ERROR_WOULD_BLOCK) {
+            break;
+        }
+        if (rc < 0) {
+            return rc;
+        }
+        sent += rc;
+    }
+
+    return sent;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef __IOT_CONNECT_NETWORK_MBED_H__
+#define __IOT_CONNECT_NETWORK_MBED_H__
+
+#include "IoTConnectNetwork.h"
+
+// TLSSocketWrapper on a TCPSocket over an mbed NetworkInterface
+class IoTConnectNetworkMbed : public IoTConnectNetwork {
+
+public:
+    IoTConnectNetworkMbed(NetworkInterface* _network);
+    ~IoTConnectNetworkMbed();
+
+    int set_root_ca_cert(const char* _root_ca_pem);
+    int set_client_cert_key(const char* _cert_pem, const char* _key_pem);
+    int set_trust_store(IoTConnectTrustStore* _ca, IoTConnectTrustStore* _client);
+    int set_tls_profile(const IoTConnectTlsProfile* _profile);
+
+    int connect(const char* _host_name, uint16_t _port, int _timeout_ms);
+    int connect_phase(IoTConnectPhase _phase, const char* _host_name, uint16_t _port, int _timeout_ms);
+    int disconnect();
+
+    int read(unsigned char* _buf, int _len, int _timeout_ms);
+    int write(unsigned char* _buf, int _len, int _timeout_ms);
+
+    int sigio(Callback<void()> _func);
+
+private:
+    NetworkInterface* network;
+    TCPSocket* tcp;
+    TLSSocketWrapper* socket;
+    // resolved in the DNS phase
+    SocketAddress address;
+
+    const char* root_ca_pem;
+    const char* client_cert_pem;
+    const char* client_key_pem;
+    IoTConnectTrustStore* ca_store;
+    IoTConnectTrustStore* client_store;
+    const IoTConnectTlsProfile* tls_profile;
+
+    Callback<void()> sigio_func;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include "IoTConnectNetworkRecorder.h"
+
+#define TRACE_GROUP "IoTConnectNetworkRecorder"
+
+IoTConnectNetworkRecorder::IoTConnectNetworkRecorder(IoTConnectNetwork* _transport, FILE* _file) :
+    transport(_transport),
+    file(_file),
+    start_us(iot_connect_us_now()),
+    recording(_file != NULL)
+{
+    if (recording && fwrite(IOT_CONNECT_CAPTURE_MAGIC, 1, IOT_CONNECT_CAPTURE_MAGIC_LEN, file)
+                     != IOT_CONNECT_CAPTURE_MAGIC_LEN) {
+        tr_warn("Capture file write failed, not recording");
+        recording = false;
+    }
+}
+
+int IoTConnectNetworkRecorder::set_root_ca_cert(const char* _root_ca_pem)
+{
+    return transport->set_root_ca_cert(_root_ca_pem);
+}
+
+int IoTConnectNetworkRecorder::set_client_cert_key(const char* _cert_pem, const char* _key_pem)
+{
+    return transport->set_client_cert_key(_cert_pem, _key_pem);
+}
+
+int IoTConnectNetworkRecorder::set_trust_store(IoTConnectTrustStore* _ca, IoTConnectTrustStore* _client)
+{
+    return transport->set_trust_store(_ca, _client);
+}
+
+int IoTConnectNetworkRecorder::set_tls_profile(const IoTConnectTlsProfile* _profile)
+{
+    return transport->set_tls_profile(_profile);
+}
+
+int IoTConnectNetworkRecorder::connect(const char* _host_name, uint16_t _port, int _timeout_ms)
+{
+    int ret = transport->connect(_host_name, _port, _timeout_ms);
+
+    if (ret == 0) {
+        record(IOT_CONNECT_CAPTURE_CONNECT, _host_name, strlen(_host_name));
+    }
+
+    return ret;
+}
+
+int IoTConnectNetworkRecorder::connect_phase(IoTConnectPhase _phase, const char* _host_name, uint16_t _port,
+                                             int _timeout_ms)
+{
+    int ret = transport->connect_phase(_phase, _host_name, _port, _timeout_ms);
+
+    if (ret == 0 && _phase == IOT_CONNECT_PHASE_TLS) {
+        record(IOT_CONNECT_CAPTURE_CONNECT, _host_name, strlen(_host_name));
+    }
+
+    return ret;
+}
+
+int IoTConnectNetworkRecorder::disconnect()
+{
+    record(IOT_CONNECT_CAPTURE_DISCONNECT, NULL, 0);
+
+    mutex.lock();
+    if (recording) {
+        fflush(file);
+    }
+    mutex.unlock();
+
+    return transport->disconnect();
+}
+
+int IoTConnectNetworkRecorder::read(unsigned char* _buf, int _len, int _timeout_ms)
+{
+    int ret = transport->read(_buf, _len, _timeout_ms);
+
+    if (ret > 0) {
+        record(IOT_CONNECT_CAPTURE_READ, _buf, ret);
+    }
+
+    return ret;
+}
+
+int IoTConnectNetworkRecorder::write(unsigned char* _buf, int _len, int _timeout_ms)
+{
+    int ret = transport->write(_buf, _len, _timeout_ms);
+
+    if (ret > 0) {
+        record(IOT_CONNECT_CAPTURE_WRITE, _buf, ret);
+    }
+
+    return ret;
+}
+
+int IoTConnectNetworkRecorder::sigio(Callback<void()> _func)
+{
+    return transport->sigio(_func);
+}
+
+bool IoTConnectNetworkRecorder::is_recording() const
+{
+    return recording;
+}
+
+void IoTConnectNetworkRecorder::record(IoTConnectCaptureRecord _type, const void* _buf, uint32_t _len)
+{
+    unsigned char header[IOT_CONNECT_CAPTURE_HEADER];
+    uint64_t us = iot_connect_us_now() - start_us;
+    int i;
+
+    header[0] = (unsigned char)_type;
+    for (i = 0; i < 8; i++) {
+        header[1 + i] = (unsigned char)(us >> (8 * i));
+    }
+    for (i = 0; i < 4; i++) {
+        header[9 + i] = (unsigned char)(_len >> (8 * i));
+    }
+
+    mutex.lock();
+    if (recording) {
+        if (fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+            (_len && fwrite(_buf, 1, _len, file) != _len)) {
+            tr_warn("Capture file write failed, recording stopped");
+            recording = false;
+        }
+    }
+    mutex.unlock();
+}
@@ -0,0 +1,59 @@
+#ifndef __IOT_CONNECT_NETWORK_RECORDER_H__
+#define __IOT_CONNECT_NETWORK_RECORDER_H__
+
+#include <stdio.h>
+#include "IoTConnectNetwork.h"
+
+// A capture file: the magic, then records of a type byte, the time in microseconds
+// since the recorder was created in 8 bytes, the length in 4 bytes, both little
+// endian, and that many bytes
+#define IOT_CONNECT_CAPTURE_MAGIC "IOTCAP1\n"
+#define IOT_CONNECT_CAPTURE_MAGIC_LEN 8
+#define IOT_CONNECT_CAPTURE_HEADER 13
+
+typedef enum {
+    IOT_CONNECT_CAPTURE_CONNECT = 'C',      // transport connected, the host name
+    IOT_CONNECT_CAPTURE_DISCONNECT = 'D',
+    IOT_CONNECT_CAPTURE_READ = 'R',         // bytes read, as the MQTT session read them
+    IOT_CONNECT_CAPTURE_WRITE = 'W',        // bytes written
+} IoTConnectCaptureRecord;
+
+// Passes everything through to the transport and records the plaintext MQTT traffic
+// to a file, to be replayed by tools/replay. Give it to the client as its transport.
+// The file is written as the traffic goes, and flushed at each disconnect; it holds
+// the SAS token of the CONNECT packet.
+class IoTConnectNetworkRecorder : public IoTConnectNetwork {
+
+public:
+    // _file opened for binary writing, not closed by the recorder
+    IoTConnectNetworkRecorder(IoTConnectNetwork* _transport, FILE* _file);
+
+    int set_root_ca_cert(const char* _root_ca_pem);
+    int set_client_cert_key(const char* _cert_pem, const char* _key_pem);
+    int set_trust_store(IoTConnectTrustStore* _ca, IoTConnectTrustStore* _client);
+    int set_tls_profile(const IoTConnectTlsProfile* _profile);
+
+    int connect(const char* _host_name, uint16_t _port, int _timeout_ms);
+    int connect_phase(IoTConnectPhase _phase, const char* _host_name, uint16_t _port, int _timeout_ms);
+    int disconnect();
+
+    int read(unsigned char* _buf, int _len, int _timeout_ms);
+    int write(unsigned char* _buf, int _len, int _timeout_ms);
+
+    int sigio(Callback<void()> _func);
+
+    // Stops at the first error writing the file
+    bool is_recording() const;
+
+private:
+    IoTConnectNetwork* transport;
+    FILE* file;
+    uint64_t start_us;
+    volatile bool recording;
+    Mutex mutex;
+
+private:
+    void record(IoTConnectCaptureRecord _type, const void* _buf, uint32_t _len);
+};
+
+#endif
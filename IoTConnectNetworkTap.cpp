@@ -0,0 +1,176 @@
+#include "IoTConnectNetworkTap.h"
+
+IoTConnectNetworkTap::IoTConnectNetworkTap(IoTConnectNetwork* _transport) :
+    transport(_transport),
+    last_write_us(0),
+    rx_bytes(0),
+    tx_bytes(0),
+    connect_ms(0),
+    tls_handshake_ms(0),
+    connect_start_us(0),
+    rx_state(RX_HEADER),
+    rx_remaining(0),
+    rx_multiplier(1)
+{
+
+}
+
+int IoTConnectNetworkTap::set_root_ca_cert(const char* _root_ca_pem)
+{
+    return transport->set_root_ca_cert(_root_ca_pem);
+}
+
+int IoTConnectNetworkTap::set_client_cert_key(const char* _cert_pem, const char* _key_pem)
+{
+    return transport->set_client_cert_key(_cert_pem, _key_pem);
+}
+
+int IoTConnectNetworkTap::set_trust_store(IoTConnectTrustStore* _ca, IoTConnectTrustStore* _client)
+{
+    return transport->set_trust_store(_ca, _client);
+}
+
+int IoTConnectNetworkTap::set_tls_profile(const IoTConnectTlsProfile* _profile)
+{
+    return transport->set_tls_profile(_profile);
+}
+
+int IoTConnectNetworkTap::connect(const char* _host_name, uint16_t _port, int _timeout_ms)
+{
+    uint64_t start_us = iot_connect_us_now();
+    int ret = transport->connect(_host_name, _port, _timeout_ms);
+
+    rx_state = RX_HEADER;
+    if (ret == 0) {
+        connect_ms = (uint32_t)((iot_connect_us_now() - start_us) / 1000);
+    }
+
+    return ret;
+}
+
+int IoTConnectNetworkTap::connect_phase(IoTConnectPhase _phase, const char* _host_name, uint16_t _port,
+                                        int _timeout_ms)
+{
+    uint64_t start_us = iot_connect_us_now();
+    uint64_t now_us;
+    int ret;
+
+    if (_phase == IOT_CONNECT_PHASE_DNS) {
+        connect_start_us = start_us;
+    }
+
+    ret = transport->connect_phase(_phase, _host_name, _port, _timeout_ms);
+
+    rx_state = RX_HEADER;
+    if (ret == 0 && _phase == IOT_CONNECT_PHASE_TLS) {
+        now_us = iot_connect_us_now();
+        connect_ms = (uint32_t)((now_us - connect_start_us) / 1000);
+        tls_handshake_ms = (uint32_t)((now_us - start_us) / 1000);
+    }
+
+    return ret;
+}
+
+int IoTConnectNetworkTap::disconnect()
+{
+    rx_state = RX_HEADER;
+    return transport->disconnect();
+}
+
+int IoTConnectNetworkTap::read(unsigned char* _buf, int _len, int _timeout_ms)
+{
+    int ret;
+
+    if (rx_state != RX_HEADER && _timeout_ms < IOT_CONNECT_NETWORK_PACKET_TIMEOUT_MS) {
+        _timeout_ms = IOT_CONNECT_NETWORK_PACKET_TIMEOUT_MS;
+    }
+
+    ret = transport->read(_buf, _len, _timeout_ms);
+    if (ret > 0) {
+        rx_bytes += ret;
+        track_rx(_buf, ret);
+    } else {
+        // the MQTT session gives up on the packet
+        rx_state = RX_HEADER;
+    }
+
+    return ret;
+}
+
+int IoTConnectNetworkTap::write(unsigned char* _buf, int _len, int _timeout_ms)
+{
+    int ret = transport->write(_buf, _len, _timeout_ms);
+
+    if (ret > 0) {
+        tx_bytes += ret;
+    }
+    if (ret == _len) {
+        last_write_us = iot_connect_us_now();
+    }
+
+    return ret;
+}
+
+int IoTConnectNetworkTap::sigio(Callback<void()> _func)
+{
+    return transport->sigio(_func);
+}
+
+// Fixed header byte, 1 to 4 bytes of remaining length, then the rest
+void IoTConnectNetworkTap::track_rx(const unsigned char* _buf, int _len)
+{
+    int i = 0;
+
+    while (i < _len) {
+        switch (rx_state) {
+            case RX_HEADER:
+                rx_remaining = 0;
+                rx_multiplier = 1;
+                rx_state = RX_LENGTH;
+                i++;
+                break;
+            case RX_LENGTH:
+                rx_remaining += (_buf[i] & 0x7F) * rx_multiplier;
+                rx_multiplier *= 128;
+                if (!(_buf[i] & 0x80)) {
+                    rx_state = rx_remaining ? RX_BODY : RX_HEADER;
+                }
+                i++;
+                break;
+            case RX_BODY:
+                if ((uint32_t)(_len - i) >= rx_remaining) {
+                    i += rx_remaining;
+                    rx_state = RX_HEADER;
+                } else {
+                    rx_remaining -= _len - i;
+                    i = _len;
+                }
+                break;
+        }
+    }
+}
+
+uint64_t IoTConnectNetworkTap::get_last_write_us() const
+{
+    return last_write_us;
+}
+
+uint32_t IoTConnectNetworkTap::get_rx_bytes() const
+{
+    return rx_bytes;
+}
+
+uint32_t IoTConnectNetworkTap::get_tx_bytes() const
+{
+    return tx_bytes;
+}
+
+uint32_t IoTConnectNetworkTap::get_connect_ms() const
+{
+    return connect_ms;
+}
+
+uint32_t IoTConnectNetworkTap::get_tls_handshake_ms() const
+{
+    return tls_handshake_ms;
+}
@@ -0,0 +1,63 @@
+#ifndef __IOT_CONNECT_NETWORK_TAP_H__
+#define __IOT_CONNECT_NETWORK_TAP_H__
+
+#include "IoTConnectNetwork.h"
+
+// Reads in the middle of an MQTT packet wait at least this long, so a short
+// yield() doesn't give up on a packet half way
+#define IOT_CONNECT_NETWORK_PACKET_TIMEOUT_MS 1000
+
+// Sits between the MQTT session and the transport and watches the traffic
+class IoTConnectNetworkTap : public IoTConnectNetwork {
+
+public:
+    IoTConnectNetworkTap(IoTConnectNetwork* _transport);
+
+    int set_root_ca_cert(const char* _root_ca_pem);
+    int set_client_cert_key(const char* _cert_pem, const char* _key_pem);
+    int set_trust_store(IoTConnectTrustStore* _ca, IoTConnectTrustStore* _client);
+    int set_tls_profile(const IoTConnectTlsProfile* _profile);
+
+    int connect(const char* _host_name, uint16_t _port, int _timeout_ms);
+    int connect_phase(IoTConnectPhase _phase, const char* _host_name, uint16_t _port, int _timeout_ms);
+    int disconnect();
+
+    int read(unsigned char* _buf, int _len, int _timeout_ms);
+    int write(unsigned char* _buf, int _len, int _timeout_ms);
+
+    int sigio(Callback<void()> _func);
+
+    // When the last write was completely sent, in iot_connect_us_now()
+    uint64_t get_last_write_us() const;
+    // Bytes through the transport since created, wrap around
+    uint32_t get_rx_bytes() const;
+    uint32_t get_tx_bytes() const;
+    // How long the last successful connect took, DNS, TCP and TLS handshake
+    uint32_t get_connect_ms() const;
+    // How long the TLS handshake of the last successful connect_phase() took, 0 with connect()
+    uint32_t get_tls_handshake_ms() const;
+
+private:
+    IoTConnectNetwork* transport;
+
+    uint64_t last_write_us;
+    volatile uint32_t rx_bytes;
+    volatile uint32_t tx_bytes;
+    uint32_t connect_ms;
+    uint32_t tls_handshake_ms;
+    uint64_t connect_start_us;
+
+    // where the inbound stream is in the current MQTT packet
+    enum {
+        RX_HEADER,
+        RX_LENGTH,
+        RX_BODY
+    } rx_state;
+    uint32_t rx_remaining;
+    uint32_t rx_multiplier;
+
+private:
+    void track_rx(const unsigned char* _buf, int _len);
+};
+
+#endif
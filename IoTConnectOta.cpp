@@ -0,0 +1,688 @@
+#include "IoTConnectOta.h"
+#include "IoTConnectClient.h"
+#include "IoTConnectAllocator.h"
+#include "jsmn.h"
+#include "mbedtls/version.h"
+
+#define TRACE_GROUP  "IoTConnectOta"
+
+#if MBEDTLS_VERSION_MAJOR >= 3
+#define mbedtls_sha256_starts_ret mbedtls_sha256_starts
+#define mbedtls_sha256_update_ret mbedtls_sha256_update
+#define mbedtls_sha256_finish_ret mbedtls_sha256_finish
+#endif
+
+#define OTA_JOURNAL_MAGIC 0x4F544A31    // "OTJ1"
+#define OTA_ERASED 0xFF
+// the notification, "ota" and its object, three keys and values
+#define OTA_JSON_TOKENS 9
+#define OTA_REQUEST_SIZE 128
+
+static const unsigned char ota_frame_magic[4] = { 'O', 'T', 'A', 1 };
+
+// Appended to the journal erase unit, the last one with a good crc counts
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    uint32_t offset;
+    uint32_t done;
+    unsigned char sha256[IOT_CONNECT_OTA_SHA256_SIZE];
+    char version[IOT_CONNECT_OTA_VERSION_MAX];
+    uint32_t crc;
+} OtaJournal;
+
+MBED_STATIC_ASSERT(IOT_CONNECT_OTA_CHUNK_SIZE + IOT_CONNECT_OTA_FRAME_HEADER < IOT_CONNECT_MQTT_MAX_PACKET_SIZE,
+                   "ota-chunk-size should leave room for the topic in mbed-mqtt.max-packet-size");
+
+static uint32_t ota_crc32(const void* _buf, size_t _len)
+{
+    const unsigned char* p = (const unsigned char*)_buf;
+    uint32_t crc = 0xFFFFFFFF;
+    int i;
+
+    while (_len--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+
+    return ~crc;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static int jsoneq(const char *json, jsmntok_t *tok, const char *s) {
+    if (tok->type == JSMN_STRING && (int)strlen(s) == tok->end - tok->start &&
+        strncmp(json + tok->start, s, tok->end - tok->start) == 0) {
+        return 0;
+    }
+    return -1;
+}
+
+IoTConnectOta::IoTConnectOta(IoTConnectClient* _client, BlockDevice* _bd, bd_addr_t _addr, bd_size_t _size) :
+    on_state(NULL),
+    client(_client),
+    bd(_bd),
+    addr(_addr),
+    slot_size(_size),
+    journal_addr(0),
+    journal_size(0),
+    record_size(0),
+    record_next(0),
+    program_size(0),
+    state(IOT_CONNECT_OTA_IDLE),
+    size(0),
+    offset(0),
+    requested_to(0),
+    journaled_to(0),
+    erased_to(0),
+    progress_ms(0),
+    retries(0),
+    scratch(NULL),
+    msg_id(0)
+{
+    version[0] = '\0';
+    memset(sha256, 0, sizeof(sha256));
+    memset(&stats, 0, sizeof(stats));
+    mbedtls_sha256_init(&sha);
+}
+
+IoTConnectOta::~IoTConnectOta()
+{
+    mbedtls_sha256_free(&sha);
+    iot_connect_free(scratch, IOT_CONNECT_MEM_OTA);
+}
+
+int IoTConnectOta::init()
+{
+    bd_size_t erase_size;
+    int r;
+
+    if (!client || !bd || scratch) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    program_size = bd->get_program_size();
+    erase_size = bd->get_erase_size(addr);
+    journal_size = bd->get_erase_size(addr + slot_size - 1);
+    journal_addr = addr + slot_size - journal_size;
+    record_size = (sizeof(OtaJournal) + program_size - 1) / program_size * program_size;
+
+    if (addr % erase_size || journal_addr % journal_size || slot_size <= journal_size ||
+        record_size > journal_size || IOT_CONNECT_OTA_CHUNK_SIZE % program_size ||
+        addr + slot_size > bd->size()) {
+        tr_error("Slot 0x%08" PRIx64 " + %" PRIu64 " isn't in erase units, or chunks not in program units",
+                 (uint64_t)addr, (uint64_t)slot_size);
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    scratch = (unsigned char*)iot_connect_malloc(record_size, IOT_CONNECT_MEM_OTA);
+    if (!scratch) {
+        return IOT_CONNECT_ERROR_OUT_OF_MEM;
+    }
+
+    r = read_journal();
+    if (r != 0 || state != IOT_CONNECT_OTA_DOWNLOADING) {
+        return r;
+    }
+
+    // Units after the journaled offset may be programmed already, start at a unit
+    // boundary and erase it again
+    offset -= (addr + offset) % bd->get_erase_size(addr + offset);
+    requested_to = offset;
+    journaled_to = offset;
+    erased_to = offset;
+
+    mbedtls_sha256_starts_ret(&sha, 0);
+    r = hash_flash(&sha, offset);
+    if (r != 0) {
+        fail(IOT_CONNECT_ERROR_OTA_FLASH);
+        return r;
+    }
+
+    stats.resumes++;
+    progress_ms = Kernel::get_ms_count();
+    tr_info("Resume downloading %s at %lu of %lu", version, (unsigned long)offset, (unsigned long)size);
+
+    return 0;
+}
+
+int IoTConnectOta::start(const char* _version, uint32_t _size, const unsigned char _sha256[IOT_CONNECT_OTA_SHA256_SIZE])
+{
+    bool same;
+    int r;
+
+    if (!scratch || !_version || !_sha256 || strlen(_version) >= IOT_CONNECT_OTA_VERSION_MAX) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    same = strcmp(version, _version) == 0 && size == _size && memcmp(sha256, _sha256, sizeof(sha256)) == 0;
+    if (same && (state == IOT_CONNECT_OTA_DOWNLOADING || state == IOT_CONNECT_OTA_DONE)) {
+        tr_debug("%s is %s already", _version, state == IOT_CONNECT_OTA_DONE ? "staged" : "being downloaded");
+        return 0;
+    }
+
+    if (same && state == IOT_CONNECT_OTA_FAILED && offset > 0) {
+        // timed out, what's hashed and programmed is still good
+        tr_info("Resume downloading %s at %lu", version, (unsigned long)offset);
+        retries = 0;
+        requested_to = offset;
+        progress_ms = Kernel::get_ms_count();
+        set_state(IOT_CONNECT_OTA_DOWNLOADING, 0);
+        poll();
+        return 0;
+    }
+
+    if (_size == 0 || _size > journal_addr - addr) {
+        tr_error("Image of %lu bytes doesn't fit the slot", (unsigned long)_size);
+        fail(IOT_CONNECT_ERROR_OTA_SIZE);
+        return IOT_CONNECT_ERROR_OTA_SIZE;
+    }
+
+    strcpy(version, _version);
+    size = _size;
+    memcpy(sha256, _sha256, sizeof(sha256));
+    offset = 0;
+    requested_to = 0;
+    journaled_to = 0;
+    erased_to = 0;
+    retries = 0;
+    mbedtls_sha256_starts_ret(&sha, 0);
+
+    r = erase_journal();
+    if (r == 0) {
+        r = write_journal(false);
+    }
+    if (r != 0) {
+        fail(IOT_CONNECT_ERROR_OTA_FLASH);
+        return IOT_CONNECT_ERROR_OTA_FLASH;
+    }
+
+    tr_info("Download %s, %lu bytes", version, (unsigned long)size);
+    progress_ms = Kernel::get_ms_count();
+    set_state(IOT_CONNECT_OTA_DOWNLOADING, 0);
+    poll();
+
+    return 0;
+}
+
+int IoTConnectOta::cancel()
+{
+    int r;
+
+    if (!scratch) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    r = erase_journal();
+    offset = 0;
+    size = 0;
+    version[0] = '\0';
+    set_state(IOT_CONNECT_OTA_IDLE, 0);
+
+    return r == 0 ? 0 : IOT_CONNECT_ERROR_OTA_FLASH;
+}
+
+bool IoTConnectOta::handle(MQTT::Message* _msg)
+{
+    const unsigned char* p = (const unsigned char*)_msg->payload;
+    int len = _msg->payloadlen;
+
+    if (!scratch || !p) {
+        return false;
+    }
+
+    if (len >= IOT_CONNECT_OTA_FRAME_HEADER && memcmp(p, ota_frame_magic, sizeof(ota_frame_magic)) == 0) {
+        handle_chunk(p, len);
+        return true;
+    }
+
+    if (len > 0 && p[0] == '{') {
+        return handle_notification((const char*)p, len);
+    }
+
+    return false;
+}
+
+bool IoTConnectOta::handle_notification(const char* _json, int _len)
+{
+    jsmn_parser parser;
+    jsmntok_t t[OTA_JSON_TOKENS];
+    char ver[IOT_CONNECT_OTA_VERSION_MAX] = "";
+    unsigned char digest[IOT_CONNECT_OTA_SHA256_SIZE];
+    bool has_digest = false;
+    unsigned long img_size = 0;
+    int r;
+    int i, j;
+
+    jsmn_init(&parser);
+    r = jsmn_parse(&parser, _json, _len, t, sizeof(t) / sizeof(t[0]));
+
+    // other messages are longer, or aren't {"ota":{...}}
+    if (r < 3 || t[0].type != JSMN_OBJECT || t[0].size != 1 || jsoneq(_json, &t[1], "ota") != 0 ||
+        t[2].type != JSMN_OBJECT) {
+        return false;
+    }
+
+    for (i = 3; i + 1 < r; i += 2) {
+        const char* val = _json + t[i + 1].start;
+        int val_len = t[i + 1].end - t[i + 1].start;
+
+        if (jsoneq(_json, &t[i], "ver") == 0 && t[i + 1].type == JSMN_STRING &&
+            val_len < IOT_CONNECT_OTA_VERSION_MAX) {
+            memcpy(ver, val, val_len);
+            ver[val_len] = '\0';
+        } else if (jsoneq(_json, &t[i], "size") == 0 && t[i + 1].type == JSMN_PRIMITIVE) {
+            img_size = strtoul(val, NULL, 10);
+        } else if (jsoneq(_json, &t[i], "sha256") == 0 && t[i + 1].type == JSMN_STRING &&
+                   val_len == IOT_CONNECT_OTA_SHA256_SIZE * 2) {
+            for (j = 0; j < IOT_CONNECT_OTA_SHA256_SIZE; j++) {
+                int hi = hex_value(val[j * 2]);
+                int lo = hex_value(val[j * 2 + 1]);
+                if (hi < 0 || lo < 0) {
+                    break;
+                }
+                digest[j] = hi << 4 | lo;
+            }
+            has_digest = j == IOT_CONNECT_OTA_SHA256_SIZE;
+        }
+    }
+
+    if (ver[0] == '\0' || img_size == 0 || !has_digest) {
+        tr_error("OTA notification without a valid ver, size and sha256");
+        return true;
+    }
+
+    start(ver, img_size, digest);
+
+    return true;
+}
+
+void IoTConnectOta::handle_chunk(const unsigned char* _buf, int _len)
+{
+    uint32_t off = (uint32_t)_buf[4] << 24 | (uint32_t)_buf[5] << 16 | (uint32_t)_buf[6] << 8 | _buf[7];
+    const unsigned char* data = _buf + IOT_CONNECT_OTA_FRAME_HEADER;
+    uint32_t len = _len - IOT_CONNECT_OTA_FRAME_HEADER;
+
+    if (state != IOT_CONNECT_OTA_DOWNLOADING) {
+        return;
+    }
+
+    // in order only, a chunk lost on the way is asked for again when it times out
+    if (off != offset || len == 0 || len > IOT_CONNECT_OTA_CHUNK_SIZE || off + len > size ||
+        (len != IOT_CONNECT_OTA_CHUNK_SIZE && off + len != size)) {
+        tr_debug("Drop chunk at %lu of %lu bytes, expecting %lu", (unsigned long)off, (unsigned long)len,
+                 (unsigned long)offset);
+        stats.dropped++;
+        return;
+    }
+
+    if (program(data, len) != 0) {
+        fail(IOT_CONNECT_ERROR_OTA_FLASH);
+        return;
+    }
+    mbedtls_sha256_update_ret(&sha, data, len);
+
+    offset += len;
+    stats.chunks++;
+    stats.chunk_bytes += len;
+    retries = 0;
+    progress_ms = Kernel::get_ms_count();
+
+    if (offset == size) {
+        int r = finish();
+        if (r != 0) {
+            fail(r);
+        }
+        return;
+    }
+
+    if (offset - journaled_to >= IOT_CONNECT_OTA_JOURNAL_EVERY) {
+        if (write_journal(false) != 0) {
+            tr_warn("Journal at %lu not written, a reboot resumes from %lu", (unsigned long)offset,
+                    (unsigned long)journaled_to);
+        } else {
+            journaled_to = offset;
+        }
+    }
+
+    poll();
+}
+
+void IoTConnectOta::poll()
+{
+    uint64_t now;
+    uint32_t window_end;
+
+    if (state != IOT_CONNECT_OTA_DOWNLOADING) {
+        return;
+    }
+
+    now = Kernel::get_ms_count();
+
+    // requests and chunks in flight are lost with the connection
+    if (!client->is_connected()) {
+        requested_to = offset;
+        progress_ms = now;
+        return;
+    }
+
+    if (requested_to > offset && now - progress_ms >= IOT_CONNECT_OTA_CHUNK_TIMEOUT_MS) {
+        if (++retries > IOT_CONNECT_OTA_RETRIES_MAX) {
+            fail(IOT_CONNECT_ERROR_OTA_TIMEOUT);
+            return;
+        }
+        tr_warn("No chunk at %lu in %d ms, ask again", (unsigned long)offset, IOT_CONNECT_OTA_CHUNK_TIMEOUT_MS);
+        stats.rerequests++;
+        requested_to = offset;
+    }
+
+    if (window_open(&window_end) && request(requested_to, window_end - requested_to) == 0) {
+        if (requested_to == offset) {
+            progress_ms = now;
+        }
+        requested_to = window_end;
+    }
+}
+
+uint64_t IoTConnectOta::next_poll_ms() const
+{
+    uint32_t window_end;
+
+    if (state != IOT_CONNECT_OTA_DOWNLOADING || !client->is_connected()) {
+        return 0;
+    }
+
+    if (window_open(&window_end)) {
+        return Kernel::get_ms_count();
+    }
+
+    return progress_ms + IOT_CONNECT_OTA_CHUNK_TIMEOUT_MS;
+}
+
+// Worth a request, half the window is free or nothing is outstanding, up to *_end
+bool IoTConnectOta::window_open(uint32_t* _end) const
+{
+    uint32_t end = offset + IOT_CONNECT_OTA_WINDOW * IOT_CONNECT_OTA_CHUNK_SIZE;
+
+    if (end > size) {
+        end = size;
+    }
+    *_end = end;
+
+    return requested_to < end && (requested_to == offset || end == size ||
+                                  end - requested_to >= (IOT_CONNECT_OTA_WINDOW + 1) / 2 * IOT_CONNECT_OTA_CHUNK_SIZE);
+}
+
+int IoTConnectOta::request(uint32_t _offset, uint32_t _len)
+{
+    char json[OTA_REQUEST_SIZE];
+    MQTT::Message msg;
+    int r;
+
+    msg.qos = MQTT::QOS0;
+    msg.retained = false;
+    msg.dup = false;
+    msg.id = msg_id++;
+    msg.payload = json;
+    msg.payloadlen = snprintf(json, sizeof(json), "{\"ota\":{\"ver\":\"%s\",\"offset\":%lu,\"len\":%lu,\"chunk\":%d}}",
+                              version, (unsigned long)_offset, (unsigned long)_len, IOT_CONNECT_OTA_CHUNK_SIZE);
+
+    r = client->pub(&msg);
+    if (r != 0) {
+        tr_debug("Request at %lu failed with %d, try again", (unsigned long)_offset, r);
+        return r;
+    }
+    stats.requests++;
+
+    return 0;
+}
+
+// Programs _buf at offset, erasing units ahead of it as it goes
+int IoTConnectOta::program(const unsigned char* _buf, uint32_t _len)
+{
+    uint32_t aligned = _len - _len % program_size;
+    int r;
+
+    while (erased_to < offset + _len) {
+        bd_size_t unit = bd->get_erase_size(addr + erased_to);
+        r = bd->erase(addr + erased_to, unit);
+        if (r != 0) {
+            tr_error("Erase at 0x%08" PRIx64 " failed with %d", (uint64_t)(addr + erased_to), r);
+            return r;
+        }
+        erased_to += unit;
+    }
+
+    if (aligned) {
+        r = bd->program(_buf, addr + offset, aligned);
+        if (r != 0) {
+            tr_error("Program at 0x%08" PRIx64 " failed with %d", (uint64_t)(addr + offset), r);
+            return r;
+        }
+    }
+
+    // the last chunk, padded to the program size
+    if (_len > aligned) {
+        memset(scratch, OTA_ERASED, program_size);
+        memcpy(scratch, _buf + aligned, _len - aligned);
+        r = bd->program(scratch, addr + offset + aligned, program_size);
+        if (r != 0) {
+            tr_error("Program at 0x%08" PRIx64 " failed with %d", (uint64_t)(addr + offset + aligned), r);
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+// Both the hash of what came and of what's read back from the slot should match
+int IoTConnectOta::finish()
+{
+    mbedtls_sha256_context check;
+    unsigned char digest[IOT_CONNECT_OTA_SHA256_SIZE];
+    int r;
+
+    mbedtls_sha256_finish_ret(&sha, digest);
+    if (memcmp(digest, sha256, sizeof(digest)) != 0) {
+        tr_error("SHA-256 of %s doesn't match", version);
+        return IOT_CONNECT_ERROR_OTA_DIGEST;
+    }
+
+    mbedtls_sha256_init(&check);
+    mbedtls_sha256_starts_ret(&check, 0);
+    r = hash_flash(&check, size);
+    if (r == 0) {
+        mbedtls_sha256_finish_ret(&check, digest);
+    }
+    mbedtls_sha256_free(&check);
+    if (r != 0) {
+        return IOT_CONNECT_ERROR_OTA_FLASH;
+    }
+    if (memcmp(digest, sha256, sizeof(digest)) != 0) {
+        tr_error("SHA-256 of %s read back from flash doesn't match", version);
+        return IOT_CONNECT_ERROR_OTA_DIGEST;
+    }
+
+    if (write_journal(true) != 0) {
+        return IOT_CONNECT_ERROR_OTA_FLASH;
+    }
+
+    tr_info("%s downloaded and verified", version);
+    set_state(IOT_CONNECT_OTA_DONE, 0);
+
+    return 0;
+}
+
+void IoTConnectOta::fail(int _error)
+{
+    tr_error("Download of %s failed with %d", version, _error);
+
+    // a timed out download is resumed by the next notification, others start over
+    if (_error != IOT_CONNECT_ERROR_OTA_TIMEOUT) {
+        erase_journal();
+        offset = 0;
+    }
+    set_state(IOT_CONNECT_OTA_FAILED, _error);
+}
+
+void IoTConnectOta::set_state(IoTConnectOtaState _state, int _error)
+{
+    state = _state;
+    if (on_state) {
+        on_state(_state, _error);
+    }
+}
+
+// SHA-256 of the first _len bytes of the slot, through scratch
+int IoTConnectOta::hash_flash(mbedtls_sha256_context* _sha, uint32_t _len)
+{
+    uint32_t done;
+    uint32_t n;
+    int r;
+
+    for (done = 0; done < _len; done += n) {
+        n = _len - done < record_size ? _len - done : record_size;
+        r = bd->read(scratch, addr + done, record_size);
+        if (r != 0) {
+            tr_error("Read at 0x%08" PRIx64 " failed with %d", (uint64_t)(addr + done), r);
+            return r;
+        }
+        mbedtls_sha256_update_ret(_sha, scratch, n);
+    }
+
+    return 0;
+}
+
+int IoTConnectOta::read_journal()
+{
+    OtaJournal rec;
+    bool found = false;
+    int r;
+
+    for (record_next = 0; record_next + record_size <= journal_size; record_next += record_size) {
+        r = bd->read(scratch, journal_addr + record_next, record_size);
+        if (r != 0) {
+            return r;
+        }
+        memcpy(&rec, scratch, sizeof(rec));
+        if (rec.magic != OTA_JOURNAL_MAGIC) {
+            // erased, the end of the journal
+            break;
+        }
+        // a torn record is skipped, it can't be programmed again
+        if (rec.crc != ota_crc32(&rec, offsetof(OtaJournal, crc)) || rec.offset > rec.size ||
+            rec.size > journal_addr - addr || rec.version[IOT_CONNECT_OTA_VERSION_MAX - 1] != '\0') {
+            continue;
+        }
+
+        found = true;
+        memcpy(version, rec.version, sizeof(version));
+        memcpy(sha256, rec.sha256, sizeof(sha256));
+        size = rec.size;
+        offset = rec.offset;
+        state = rec.done ? IOT_CONNECT_OTA_DONE : IOT_CONNECT_OTA_DOWNLOADING;
+    }
+
+    if (found) {
+        tr_debug("Journal of %s at %lu%s", version, (unsigned long)offset, state == IOT_CONNECT_OTA_DONE ? ", done" : "");
+    }
+
+    return 0;
+}
+
+int IoTConnectOta::write_journal(bool _done)
+{
+    OtaJournal rec;
+    int r;
+
+    if (record_next + record_size > journal_size) {
+        // full, a reboot before it's written again starts over
+        r = erase_journal();
+        if (r != 0) {
+            return r;
+        }
+    }
+
+    rec.magic = OTA_JOURNAL_MAGIC;
+    rec.size = size;
+    rec.offset = offset;
+    rec.done = _done;
+    memcpy(rec.sha256, sha256, sizeof(rec.sha256));
+    memset(rec.version, 0, sizeof(rec.version));
+    strcpy(rec.version, version);
+    rec.crc = ota_crc32(&rec, offsetof(OtaJournal, crc));
+
+    memset(scratch, OTA_ERASED, record_size);
+    memcpy(scratch, &rec, sizeof(rec));
+    r = bd->program(scratch, journal_addr + record_next, record_size);
+    if (r != 0) {
+        tr_error("Journal write failed with %d", r);
+        return r;
+    }
+    record_next += record_size;
+
+    return 0;
+}
+
+int IoTConnectOta::erase_journal()
+{
+    int r = bd->erase(journal_addr, journal_size);
+
+    if (r != 0) {
+        tr_error("Journal erase failed with %d", r);
+        return r;
+    }
+    record_next = 0;
+
+    return 0;
+}
+
+IoTConnectOtaState IoTConnectOta::get_state() const
+{
+    return state;
+}
+
+const char* IoTConnectOta::get_version() const
+{
+    return version;
+}
+
+uint32_t IoTConnectOta::get_offset() const
+{
+    return offset;
+}
+
+uint32_t IoTConnectOta::get_size() const
+{
+    return size;
+}
+
+bd_addr_t IoTConnectOta::get_image_addr() const
+{
+    return addr;
+}
+
+int IoTConnectOta::get_stats(IoTConnectOtaStats* _stats)
+{
+    if (!_stats) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    memcpy(_stats, &stats, sizeof(IoTConnectOtaStats));
+
+    return 0;
+}
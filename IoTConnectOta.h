@@ -0,0 +1,132 @@
+#ifndef __IOT_CONNECT_OTA_H__
+#define __IOT_CONNECT_OTA_H__
+
+#include "IoTConnectPlatform.h"
+#if !defined(IOT_CONNECT_PLATFORM_POSIX)
+#include "BlockDevice.h"
+#endif
+#include "MQTTClient.h"
+#include "mbedtls/sha256.h"
+#include "IoTConnectError.h"
+
+#define IOT_CONNECT_OTA_CHUNK_SIZE MBED_CONF_IOT_CONNECT_OTA_CHUNK_SIZE
+#define IOT_CONNECT_OTA_WINDOW MBED_CONF_IOT_CONNECT_OTA_WINDOW
+#define IOT_CONNECT_OTA_CHUNK_TIMEOUT_MS MBED_CONF_IOT_CONNECT_OTA_CHUNK_TIMEOUT_MS
+#define IOT_CONNECT_OTA_JOURNAL_EVERY MBED_CONF_IOT_CONNECT_OTA_JOURNAL_EVERY
+// re-requests in a row without a chunk before the download fails
+#define IOT_CONNECT_OTA_RETRIES_MAX 5
+#define IOT_CONNECT_OTA_VERSION_MAX 24
+#define IOT_CONNECT_OTA_SHA256_SIZE 32
+// a chunk frame: "OTA", 1, the offset in 4 bytes big endian, then the data
+#define IOT_CONNECT_OTA_FRAME_HEADER 8
+
+class IoTConnectClient;
+
+typedef enum {
+    IOT_CONNECT_OTA_IDLE = 0,
+    IOT_CONNECT_OTA_DOWNLOADING,
+    IOT_CONNECT_OTA_DONE,           // staged and verified, ready to be installed
+    IOT_CONNECT_OTA_FAILED,
+} IoTConnectOtaState;
+
+// Download counters, they wrap around
+typedef struct {
+    uint32_t chunks;            // programmed
+    uint32_t chunk_bytes;
+    uint32_t dropped;           // not the expected offset, lost or duplicated ones
+    uint32_t requests;          // request messages published
+    uint32_t rerequests;        // a chunk didn't come in ota-chunk-timeout-ms, asked again
+    uint32_t resumes;           // started from a journal left by a reboot
+} IoTConnectOtaStats;
+
+// Firmware download into a staging slot of a BlockDevice, over the client's C2D / D2C
+// messages. A notification {"ota":{"ver":"1.2.0","size":N,"sha256":"<hex>"}} starts it,
+// the device asks for chunks with {"ota":{"ver":..,"offset":X,"len":L,"chunk":C}} and
+// the backend answers with binary frames, at most ota-window chunks outstanding and
+// asked for again once half of them came.
+// Chunks are programmed straight from the MQTT receive buffer, hashed as they come,
+// and the offset is journaled in the slot's last erase unit, so a reboot resumes
+// instead of starting over. Handled in the client's context, see set_ota().
+class IoTConnectOta {
+
+public:
+    // Called in the client's context when the state changes, with 0 or the error
+    Callback<void(IoTConnectOtaState, int)> on_state;
+
+public:
+    // _addr and _size in erase units of _bd, the last one is kept for the journal
+    IoTConnectOta(IoTConnectClient* _client, BlockDevice* _bd, bd_addr_t _addr, bd_size_t _size);
+    ~IoTConnectOta();
+
+    // Reads the journal, and resumes a download a reboot interrupted. _bd should be
+    // initialized. Call before setting it to the client.
+    int init();
+
+    // Start downloading _version, unless it's already being downloaded or staged
+    int start(const char* _version, uint32_t _size, const unsigned char _sha256[IOT_CONNECT_OTA_SHA256_SIZE]);
+    // Forget the download and the staged image
+    int cancel();
+
+    // A notification or a chunk is consumed, true. Other messages aren't touched.
+    bool handle(MQTT::Message* _msg);
+    // Asks for chunks as the window opens, and again when they time out
+    void poll();
+    // Kernel ms the next poll() is due, 0 for none
+    uint64_t next_poll_ms() const;
+
+    IoTConnectOtaState get_state() const;
+    const char* get_version() const;
+    // Verified and programmed bytes
+    uint32_t get_offset() const;
+    uint32_t get_size() const;
+    // Where the staged image is, valid when done
+    bd_addr_t get_image_addr() const;
+    int get_stats(IoTConnectOtaStats* _stats);
+
+private:
+    IoTConnectClient* client;
+    BlockDevice* bd;
+    bd_addr_t addr;
+    bd_size_t slot_size;
+    bd_addr_t journal_addr;
+    bd_size_t journal_size;
+    bd_size_t record_size;
+    // next journal record, in journal_size
+    bd_size_t record_next;
+    bd_size_t program_size;
+
+    IoTConnectOtaState state;
+    char version[IOT_CONNECT_OTA_VERSION_MAX];
+    uint32_t size;
+    unsigned char sha256[IOT_CONNECT_OTA_SHA256_SIZE];
+    mbedtls_sha256_context sha;
+
+    uint32_t offset;
+    uint32_t requested_to;
+    uint32_t journaled_to;
+    bd_size_t erased_to;
+    uint64_t progress_ms;
+    int retries;
+
+    // a journal record, or the padded last chunk
+    unsigned char* scratch;
+
+    int msg_id;
+    IoTConnectOtaStats stats;
+
+private:
+    bool handle_notification(const char* _json, int _len);
+    void handle_chunk(const unsigned char* _buf, int _len);
+    bool window_open(uint32_t* _end) const;
+    int request(uint32_t _offset, uint32_t _len);
+    int program(const unsigned char* _buf, uint32_t _len);
+    int finish();
+    void fail(int _error);
+    void set_state(IoTConnectOtaState _state, int _error);
+    int hash_flash(mbedtls_sha256_context* _sha, uint32_t _len);
+    int read_journal();
+    int write_journal(bool _done);
+    int erase_journal();
+};
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef __IOT_CONNECT_PLATFORM_H__
+#define __IOT_CONNECT_PLATFORM_H__
+
+// The platform the library runs on. It's Mbed OS by default, a host build
+// (e.g. Linux gateways, CI) defines IOT_CONNECT_PLATFORM_POSIX and adds
+// posix/ to the include path. Besides the transport (see IoTConnectNetwork.h),
+// the library only uses this subset of mbed:
+//  - Callback / callback()
+//  - CircularBuffer, CriticalSectionLock
+//  - Thread, Mutex, osStatus
+//  - EventQueue call() / call_in() / cancel(), for start_event_loop()
+//  - Kernel::get_ms_count(), the us ticker
+//  - BlockDevice, for IoTConnectOta
+//  - MBED_STATIC_ASSERT, MBED_NOINLINE
+//  - mbed_trace tr_xxx() macros
+//  - MBED_CONF_IOT_CONNECT_XXX and MBED_CONF_MBED_MQTT_XXX configs
+#if defined(IOT_CONNECT_PLATFORM_POSIX)
+#include "IoTConnectPosix.h"
+#else
+#include "mbed.h"
+#include "mbed_trace.h"
+#include "hal/us_ticker_api.h"
+#endif
+
+#define IOT_CONNECT_MQTT_MAX_PACKET_SIZE MBED_CONF_MBED_MQTT_MAX_PACKET_SIZE
+#define IOT_CONNECT_MQTT_MAX_HANDLERS MBED_CONF_MBED_MQTT_MAX_CONNECTIONS
+
+// Added to thread stacks given by the library. On a host, the C library keeps
+// the thread descriptor and TLS at the top of a given stack, and frames are larger.
+#if defined(IOT_CONNECT_PLATFORM_POSIX)
+#define IOT_CONNECT_THREAD_STACK_EXTRA (16 * 1024)
+#else
+#define IOT_CONNECT_THREAD_STACK_EXTRA 0
+#endif
+
+// Microseconds since boot, for latency measurement
+static inline uint64_t iot_connect_us_now()
+{
+#if defined(IOT_CONNECT_PLATFORM_POSIX)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    return ticker_read_us(get_us_ticker_data());
+#endif
+}
+
+// CPU time of the calling thread in microseconds, to profile the client. Mbed OS
+// has no per-thread clock, it's the us ticker there: other threads running in
+// between are counted too.
+static inline uint64_t iot_connect_cpu_us()
+{
+#if defined(IOT_CONNECT_PLATFORM_POSIX)
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    return ticker_read_us(get_us_ticker_data());
+#endif
+}
+
+// Timer for the MQTT session
+class IoTConnectCountdown {
+
+public:
+    IoTConnectCountdown() :
+        end_ms(Kernel::get_ms_count())
+    {
+
+    }
+
+    IoTConnectCountdown(int _ms)
+    {
+        countdown_ms(_ms);
+    }
+
+    bool expired()
+    {
+        return Kernel::get_ms_count() >= end_ms;
+    }
+
+    void countdown_ms(unsigned long _ms)
+    {
+        end_ms = Kernel::get_ms_count() + _ms;
+    }
+
+    void countdown(int _seconds)
+    {
+        countdown_ms((unsigned long)_seconds * 1000);
+    }
+
+    int left_ms()
+    {
+        uint64_t now = Kernel::get_ms_count();
+        return now >= end_ms ? 0 : (int)(end_ms - now);
+    }
+
+private:
+    uint64_t end_ms;
+};
+
+#endif
@@ -1,57 +1,72 @@
-#include "mbed.h"
+#include "IoTConnectPlatform.h"
 #include "IoTConnectProperty.h"
-#include "mbed_trace.h"
+#include "IoTConnectJson.h"
+#include "IoTConnectAllocator.h"
 
 
 #define TRACE_GROUP  "IoTConnectProperty"
 
+// Values are set by the app and C2D updates, and read into pub_props() messages
+static Mutex value_mutex;
+
+// FNV-1a
+static uint32_t value_hash(const char* _val)
+{
+    uint32_t hash = 2166136261UL;
+
+    while (_val && *_val) {
+        hash ^= (uint8_t)*_val++;
+        hash *= 16777619UL;
+    }
+
+    return hash;
+}
+
 IoTConnectStringProperty::IoTConnectStringProperty(const char* _key, const char* _value) :
     key(_key),
-    buf(NULL)
+    buf(inline_buf),
+    cap(IOT_CONNECT_STRING_INLINE_SIZE)
 {
+    inline_buf[0] = '\0';
+
     if (_value) {
-        size_t value_len = strlen(_value);
-        buf = (char*)malloc(value_len + 1);
-        buf[value_len] = '\0';
+        assign(_value, strlen(_value));
     }
 }
 
 IoTConnectStringProperty::IoTConnectStringProperty(const char* _key, bool _value) :
     key(_key),
-    buf(NULL)
+    buf(inline_buf),
+    cap(IOT_CONNECT_STRING_INLINE_SIZE)
 {
-    size_t buf_len = 6;
-
-    buf = (char*)malloc(buf_len);
-    memset(buf, 0, buf_len);
+    inline_buf[0] = '\0';
 
     if (_value) {
-        sprintf(buf, "true");
-    } else
-    {
-        sprintf(buf, "false");
+        assign("true", 4);
+    } else {
+        assign("false", 5);
     }
 }
 
 IoTConnectStringProperty::IoTConnectStringProperty(const char* _key, int _value) :
     key(_key),
-    buf(NULL)
+    buf(inline_buf),
+    cap(IOT_CONNECT_STRING_INLINE_SIZE)
 {
     // 32bit integer
-    size_t buf_len = 12;
+    char str[12];
 
-    buf = (char*)malloc(buf_len);
-    memset(buf, 0, buf_len);
+    inline_buf[0] = '\0';
 
-    sprintf(buf, "%d", _value);
+    assign(str, snprintf(str, sizeof(str), "%d", _value));
 }
 
 IoTConnectStringProperty::~IoTConnectStringProperty()
 {
-    if (buf) {
-        free(buf);
-        buf = NULL;
+    if (buf != inline_buf) {
+        iot_connect_free(buf, IOT_CONNECT_MEM_PROPERTY);
     }
+    buf = NULL;
 }
 
 const char* IoTConnectStringProperty::get_key() const
@@ -71,32 +86,56 @@ void IoTConnectStringProperty::get_value(const char** pval_in_str)
 
 void IoTConnectStringProperty::set_value(const char* _new_value)
 {
-    size_t new_value_len = strlen(_new_value);
+    if (!_new_value) {
+        return;
+    }
+
+    set_value(_new_value, strlen(_new_value));
+}
+
+bool IoTConnectStringProperty::reserve(size_t _len)
+{
+    char* new_buf;
+
+    if (_len < cap) {
+        return true;
+    }
+
+    new_buf = (char*)iot_connect_malloc(_len + 1, IOT_CONNECT_MEM_PROPERTY);
+    if (!new_buf) {
+        return false;
+    }
 
-    set_value(_new_value, new_value_len);
+    if (buf != inline_buf) {
+        iot_connect_free(buf, IOT_CONNECT_MEM_PROPERTY);
+    }
+    buf = new_buf;
+    cap = _len + 1;
+
+    return true;
 }
 
 void IoTConnectStringProperty::set_value(const char* _new_value, size_t _len)
 {
-    size_t new_value_len;
-    char * new_value_buf;
-
     if (!_new_value) {
         return;
     }
 
-    new_value_len = _len;
-    new_value_buf = (char*)malloc(new_value_len + 1);
-    memset(new_value_buf, 0, new_value_len + 1);
-    sprintf(new_value_buf, "%.*s", new_value_len, _new_value);
+    value_mutex.lock();
+    assign(_new_value, _len);
+    value_mutex.unlock();
+}
 
-    // free old value buf
-    if (buf) {
-        free(buf);
+void IoTConnectStringProperty::assign(const char* _new_value, size_t _len)
+{
+    // keep the old value if out of memory
+    if (!reserve(_len)) {
+        return;
     }
 
-    buf = new_value_buf;
-
+    // may overlap with the current value
+    memmove(buf, _new_value, _len);
+    buf[_len] = '\0';
 }
 
 IoTConnectBoolProperty::IoTConnectBoolProperty(const char* _key, bool _value) :
@@ -186,6 +225,97 @@ void IoTConnectIntProperty::set_value(int _new_value)
     IoTConnectStringProperty::set_value(buf);
 }
 
+IoTConnectSeriesProperty::IoTConnectSeriesProperty(const char* _key, int _aggregates) :
+    IoTConnectStringProperty(_key, (const char*)NULL),
+    aggregates(_aggregates)
+{
+    // Empty object until the first window is closed
+    assign("{}", 2);
+    reset_window();
+}
+
+IoTConnectSeriesProperty::~IoTConnectSeriesProperty()
+{
+
+}
+
+void IoTConnectSeriesProperty::add_sample(int _sample)
+{
+    CriticalSectionLock lock;
+
+    if (count == 0 || _sample < min) {
+        min = _sample;
+    }
+    if (count == 0 || _sample > max) {
+        max = _sample;
+    }
+    sum += _sample;
+    last = _sample;
+    count++;
+}
+
+int IoTConnectSeriesProperty::close_window()
+{
+    // {"min":-2147483648,"max":...,"count":4294967295}
+    char buf[96];
+    int len = 0;
+    uint32_t w_count;
+    int64_t w_sum;
+    int w_min;
+    int w_max;
+    int w_last;
+
+    {
+        CriticalSectionLock lock;
+        w_count = count;
+        w_sum = sum;
+        w_min = min;
+        w_max = max;
+        w_last = last;
+        reset_window();
+    }
+
+    // Nothing sampled in this window, keep the last aggregated value
+    if (w_count == 0) {
+        return 0;
+    }
+
+    buf[len++] = '{';
+    if (aggregates & IOT_CONNECT_AGGREGATE_MIN) {
+        len += snprintf(buf + len, sizeof(buf) - len, "\"min\":%d,", w_min);
+    }
+    if (aggregates & IOT_CONNECT_AGGREGATE_MAX) {
+        len += snprintf(buf + len, sizeof(buf) - len, "\"max\":%d,", w_max);
+    }
+    if (aggregates & IOT_CONNECT_AGGREGATE_MEAN) {
+        len += snprintf(buf + len, sizeof(buf) - len, "\"mean\":%d,", (int)(w_sum / (int64_t)w_count));
+    }
+    if (aggregates & IOT_CONNECT_AGGREGATE_LAST) {
+        len += snprintf(buf + len, sizeof(buf) - len, "\"last\":%d,", w_last);
+    }
+    if (aggregates & IOT_CONNECT_AGGREGATE_COUNT) {
+        len += snprintf(buf + len, sizeof(buf) - len, "\"count\":%u,", (unsigned int)w_count);
+    }
+    // replace the end , or close the empty object
+    if (buf[len - 1] == ',') {
+        len--;
+    }
+    buf[len++] = '}';
+
+    IoTConnectStringProperty::set_value(buf, len);
+
+    return 0;
+}
+
+void IoTConnectSeriesProperty::reset_window()
+{
+    count = 0;
+    sum = 0;
+    min = 0;
+    max = 0;
+    last = 0;
+}
+
 IoTConnectProperty::IoTConnectProperty() :
     jstr(NULL)
 {
@@ -195,39 +325,107 @@ IoTConnectProperty::IoTConnectProperty() :
         tokens[i].type = IOT_CONNECT_PROPERTY_TYPE_UNDEFINED;
         tokens[i].obj = NULL;
         tokens[i].on_change = NULL;
+        tokens[i].has_policy = false;
+        tokens[i].in_flight = false;
+        tokens[i].reported = false;
+        tokens[i].last_report_ms = 0;
+        tokens[i].last_int = 0;
+        tokens[i].last_hash = 0;
     }
 }
 
 IoTConnectProperty::~IoTConnectProperty()
 {
     if (jstr) {
-        free(jstr);
+        iot_connect_free(jstr, IOT_CONNECT_MEM_JSON);
     }
 }
 
-int IoTConnectProperty::add(IoTConnectStringProperty* _prop, Callback<void(void*)> _on_change)
+int IoTConnectProperty::add_token(const char* _key, IoTConnectPropertyType _type, void* _obj, Callback<void(void*)> _on_change)
 {
     int i;
 
+    for (i = 0; i < IOT_CONNECT_PROPERTYS_MAX; i++) {
+        if (tokens[i].key == NULL) {
+            tokens[i].key = _key;
+            tokens[i].type = _type;
+            tokens[i].obj = _obj;
+
+            if (_on_change) {
+                tokens[i].on_change = _on_change;
+            }
+
+            return 0;
+        }
+    }
+
+    return IOT_CONNECT_ERROR_PROPERTY_FULL;
+}
+
+int IoTConnectProperty::add(IoTConnectStringProperty* _prop, Callback<void(void*)> _on_change)
+{
+    if (!_prop) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    return add_token(_prop->get_key(), IOT_CONNECT_PROPERTY_TYPE_STRING, _prop, _on_change);
+}
+
+int IoTConnectProperty::add(IoTConnectIntProperty* _prop, Callback<void(void*)> _on_change)
+{
     if (!_prop) {
         return IOT_CONNECT_ERROR_INVAL;
     }
 
+    return add_token(_prop->get_key(), IOT_CONNECT_PROPERTY_TYPE_INT, _prop, _on_change);
+}
+
+int IoTConnectProperty::add(IoTConnectBoolProperty* _prop, Callback<void(void*)> _on_change)
+{
+    if (!_prop) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    return add_token(_prop->get_key(), IOT_CONNECT_PROPERTY_TYPE_BOOL, _prop, _on_change);
+}
+
+int IoTConnectProperty::add(IoTConnectSeriesProperty* _prop)
+{
+    if (!_prop) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    // aggregated value is a json object, it's published as is
+    return add_token(_prop->get_key(), IOT_CONNECT_PROPERTY_TYPE_OBJECT, _prop, NULL);
+}
+
+int IoTConnectProperty::set_report_policy(const char* _key, const IoTConnectReportPolicy* _policy)
+{
+    int i;
+
+    if (!_key) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
     for (i = 0; i < IOT_CONNECT_PROPERTYS_MAX; i++) {
         if (tokens[i].key == NULL) {
-            tokens[i].key = _prop->get_key();
-            tokens[i].type = IOT_CONNECT_PROPERTY_TYPE_STRING;
-            tokens[i].obj = _prop;
+            break;
+        }
 
-            if (_on_change) {
-                tokens[i].on_change = _on_change;
+        if (strcmp(tokens[i].key, _key) == 0) {
+            // NULL policy - always report
+            if (_policy) {
+                tokens[i].policy = *_policy;
+                tokens[i].has_policy = true;
+            } else {
+                tokens[i].has_policy = false;
             }
 
             return 0;
         }
     }
 
-    return IOT_CONNECT_ERROR_PROPERTY_FULL;
+    return IOT_CONNECT_ERROR_PROPERTY_NOT_FOUND;
 }
 
 int IoTConnectProperty::prop(const char* _key, void** _obj, IoTConnectPropertyType* _type)
@@ -272,46 +470,77 @@ void* IoTConnectProperty::prop(const char* _key)
     return NULL;
 }
 
-// Note: String should have a buf to store the real str
 int IoTConnectProperty::to_json(const char** _ppjson)
 {
-    int i;
-    int len;
-    char *p;
+    return to_json(_ppjson, 0xFFFFFFFF);
+}
+
+// Note: String should have a buf to store the real str
+int IoTConnectProperty::to_json(const char** _ppjson, uint32_t _mask)
+{
+    char* json;
 
     if (_ppjson == NULL) {
         return IOT_CONNECT_ERROR_INVAL;
     }
 
-    len = calc_json_str_len();
+    value_mutex.lock();
+    json = build_json(_mask, NULL);
+    value_mutex.unlock();
+    if (json == NULL) {
+        return IOT_CONNECT_ERROR_OUT_OF_MEM;
+    }
 
     // properties may change, the old json string would be timeout
-    // free the old json string and generate a new buf
+    // free the old json string and keep the new one
     if (jstr) {
-        free(jstr);
+        iot_connect_free(jstr, IOT_CONNECT_MEM_JSON);
     }
+    jstr = json;
+    *_ppjson = jstr;
 
-    jstr = (char*)malloc(len + 1);
-    if (jstr == NULL) {
-        return IOT_CONNECT_ERROR_OUT_OF_MEM;
+    return 0;
+}
+
+// A new json string of the properties in _mask, and what's in it in _snap if given.
+// With value_mutex held.
+char* IoTConnectProperty::build_json(uint32_t _mask, IoTConnectReportSnapshot* _snap)
+{
+    int i;
+    int len;
+    char* json;
+    char *p;
+
+    len = calc_json_str_len(_mask);
+
+    json = (char*)iot_connect_malloc(len + 1, IOT_CONNECT_MEM_JSON);
+    if (json == NULL) {
+        return NULL;
+    }
+
+    if (_snap) {
+        _snap->mask = _mask;
     }
 
     // Empty Properties
     if (len == 2) {
-        jstr[0] = '{';
-        jstr[1] = '}';
-        jstr[2] = '\0';
+        json[0] = '{';
+        json[1] = '}';
+        json[2] = '\0';
 
-        return 0;
+        return json;
     }
 
-    p = jstr;
+    p = json;
     *p++ = '{';
 
     for (i = 0; i < IOT_CONNECT_PROPERTYS_MAX; i++) {
         if (tokens[i].key == NULL) {
             break;
         }
+        if (!(_mask & (1UL << i))) {
+            continue;
+        }
         sprintf(p, "\"%s\":", tokens[i].key);
         p += strlen(tokens[i].key) + 3;
         switch (tokens[i].type) {
@@ -321,8 +550,25 @@ int IoTConnectProperty::to_json(const char** _ppjson)
             {
                 const char * str_val = NULL;
                 ((IoTConnectStringProperty*)tokens[i].obj)->get_value(&str_val);
-                sprintf(p, "\"%s\"", str_val);
-                p += strlen(str_val) + 2;
+                *p++ = '"';
+                p = iot_connect_json_escape(p, str_val, strlen(str_val));
+                *p++ = '"';
+                if (_snap && tokens[i].type == IOT_CONNECT_PROPERTY_TYPE_INT) {
+                    _snap->value[i] = (uint32_t)strtoimax(str_val, NULL, 10);
+                } else if (_snap) {
+                    _snap->value[i] = value_hash(str_val);
+                }
+                break;
+            }
+            case IOT_CONNECT_PROPERTY_TYPE_OBJECT:
+            {
+                const char * obj_val = NULL;
+                ((IoTConnectSeriesProperty*)tokens[i].obj)->get_value(&obj_val);
+                sprintf(p, "%s", obj_val);
+                p += strlen(obj_val);
+                if (_snap) {
+                    _snap->value[i] = value_hash(obj_val);
+                }
                 break;
             }
             default:
@@ -335,9 +581,7 @@ int IoTConnectProperty::to_json(const char** _ppjson)
     *--p = '}';
     *++p = '\0';
 
-    *_ppjson = jstr;
-
-    return 0;
+    return json;
 }
 
 const char* IoTConnectProperty::get_json()
@@ -352,7 +596,7 @@ const char* IoTConnectProperty::get_json()
     return js;
 }
 
-int IoTConnectProperty::calc_json_str_len()
+int IoTConnectProperty::calc_json_str_len(uint32_t _mask)
 {
     int i;
     int len = 0;
@@ -361,6 +605,9 @@ int IoTConnectProperty::calc_json_str_len()
         if (tokens[i].key == NULL) {
             break;
         }
+        if (!(_mask & (1UL << i))) {
+            continue;
+        }
 
         len += strlen(tokens[i].key) + 3;   // "key":
         switch (tokens[i].type)
@@ -371,7 +618,14 @@ int IoTConnectProperty::calc_json_str_len()
             {
                 const char * str_val = NULL;
                 ((IoTConnectStringProperty*)tokens[i].obj)->get_value(&str_val);
-                len += strlen(str_val) + 2;    // "value"
+                len += iot_connect_json_escaped_len(str_val, strlen(str_val)) + 2;    // "value"
+                break;
+            }
+            case IOT_CONNECT_PROPERTY_TYPE_OBJECT:
+            {
+                const char * obj_val = NULL;
+                ((IoTConnectSeriesProperty*)tokens[i].obj)->get_value(&obj_val);
+                len += strlen(obj_val);        // {...}
                 break;
             }
             default:
@@ -389,11 +643,174 @@ int IoTConnectProperty::calc_json_str_len()
 
         // add {}
         len += 2;
+    } else {
+        // {}
+        len = 2;
     }
 
     return len;
 }
 
+void IoTConnectProperty::close_series_windows()
+{
+    int i;
+
+    for (i = 0; i < IOT_CONNECT_PROPERTYS_MAX; i++) {
+        if (tokens[i].key == NULL) {
+            break;
+        }
+
+        if (tokens[i].type == IOT_CONNECT_PROPERTY_TYPE_OBJECT) {
+            ((IoTConnectSeriesProperty*)tokens[i].obj)->close_window();
+        }
+    }
+}
+
+bool IoTConnectProperty::is_reportable(int _index, uint64_t _now)
+{
+    PropToken* token = &tokens[_index];
+    const IoTConnectReportPolicy* policy = &token->policy;
+    uint64_t elapsed;
+
+    if (token->in_flight) {
+        return false;
+    }
+
+    if (!token->has_policy || !token->reported) {
+        return true;
+    }
+
+    elapsed = _now - token->last_report_ms;
+
+    if (policy->min_interval_ms > 0 && elapsed < (uint64_t)policy->min_interval_ms) {
+        return false;
+    }
+
+    if (policy->max_silence_ms > 0 && elapsed >= (uint64_t)policy->max_silence_ms) {
+        return true;
+    }
+
+    if (token->type == IOT_CONNECT_PROPERTY_TYPE_INT) {
+        int64_t val = ((IoTConnectIntProperty*)token->obj)->get_value();
+        int64_t last = token->last_int;
+        int64_t delta = val > last ? val - last : last - val;
+
+        switch (policy->deadband_type) {
+            case IOT_CONNECT_DEADBAND_ABSOLUTE:
+                return delta != 0 && delta >= policy->deadband;
+            case IOT_CONNECT_DEADBAND_PERCENT:
+                return delta != 0 && delta * 100 >= (int64_t)policy->deadband * (last < 0 ? -last : last);
+            default:
+                return delta != 0;
+        }
+    }
+
+    return value_hash(((IoTConnectStringProperty*)token->obj)->get_value()) != token->last_hash;
+}
+
+uint32_t IoTConnectProperty::reportable_mask()
+{
+    int i;
+    uint32_t mask = 0;
+    uint64_t now = Kernel::get_ms_count();
+
+    MBED_STATIC_ASSERT(IOT_CONNECT_PROPERTYS_MAX <= 32, "Report mask is 32 bits");
+
+    value_mutex.lock();
+    for (i = 0; i < IOT_CONNECT_PROPERTYS_MAX; i++) {
+        if (tokens[i].key == NULL) {
+            break;
+        }
+
+        if (is_reportable(i, now)) {
+            mask |= 1UL << i;
+        }
+    }
+    value_mutex.unlock();
+
+    return mask;
+}
+
+int IoTConnectProperty::report_json(char** _json, IoTConnectReportSnapshot* _snap)
+{
+    uint32_t mask = 0;
+    uint64_t now = Kernel::get_ms_count();
+    int i;
+
+    *_json = NULL;
+    _snap->mask = 0;
+
+    // the values sent, the snapshot and the in flight marks all at once
+    value_mutex.lock();
+    for (i = 0; i < IOT_CONNECT_PROPERTYS_MAX; i++) {
+        if (tokens[i].key == NULL) {
+            break;
+        }
+        if (is_reportable(i, now)) {
+            mask |= 1UL << i;
+        }
+    }
+
+    if (mask == 0) {
+        value_mutex.unlock();
+        return 0;
+    }
+
+    *_json = build_json(mask, _snap);
+    if (*_json == NULL) {
+        value_mutex.unlock();
+        return IOT_CONNECT_ERROR_OUT_OF_MEM;
+    }
+
+    for (i = 0; i < IOT_CONNECT_PROPERTYS_MAX; i++) {
+        if (mask & (1UL << i)) {
+            tokens[i].in_flight = true;
+        }
+    }
+    value_mutex.unlock();
+
+    return 0;
+}
+
+void IoTConnectProperty::mark_reported(const IoTConnectReportSnapshot* _snap)
+{
+    int i;
+    uint64_t now = Kernel::get_ms_count();
+
+    value_mutex.lock();
+    for (i = 0; i < IOT_CONNECT_PROPERTYS_MAX; i++) {
+        if (tokens[i].key == NULL) {
+            break;
+        }
+        if (!(_snap->mask & (1UL << i))) {
+            continue;
+        }
+
+        tokens[i].in_flight = false;
+        tokens[i].reported = true;
+        tokens[i].last_report_ms = now;
+        if (tokens[i].type == IOT_CONNECT_PROPERTY_TYPE_INT) {
+            tokens[i].last_int = (int)_snap->value[i];
+        } else {
+            tokens[i].last_hash = _snap->value[i];
+        }
+    }
+    value_mutex.unlock();
+}
+
+void IoTConnectProperty::clear_in_flight(const IoTConnectReportSnapshot* _snap)
+{
+    int i;
+
+    value_mutex.lock();
+    for (i = 0; i < IOT_CONNECT_PROPERTYS_MAX; i++) {
+        if (_snap->mask & (1UL << i)) {
+            tokens[i].in_flight = false;
+        }
+    }
+    value_mutex.unlock();
+}
+
 static int jsoneq(const char *json, jsmntok_t *tok, const char *s) {
     if (tok->type == JSMN_STRING && (int)strlen(s) == tok->end - tok->start &&
         strncmp(json + tok->start, s, tok->end - tok->start) == 0) {
@@ -413,11 +830,17 @@ int IoTConnectProperty::update(const char* _json, size_t _len)
         return IOT_CONNECT_ERROR_INVAL;
     }
 
+    if (!iot_connect_utf8_is_valid(_json, _len)) {
+        tr_error("Properties json is not valid UTF-8");
+        return IOT_CONNECT_ERROR_PROPERTY_JSON_ENCODING;
+    }
+
     tr_debug("Dump devive properties json before update");
     tr_debug("%s", jstr);
 
     jsmn_parser parser;
-    jsmntok_t t[IOT_CONNECT_PROPERTYS_MAX * 2];
+    // the object, then a key and a value for each property
+    jsmntok_t t[IOT_CONNECT_PROPERTYS_MAX * 2 + 1];
 
     jsmn_init(&parser);
 
@@ -449,7 +872,29 @@ int IoTConnectProperty::update(const char* _json, size_t _len)
                     case IOT_CONNECT_PROPERTY_TYPE_STRING:
                     case IOT_CONNECT_PROPERTY_TYPE_INT:
                     case IOT_CONNECT_PROPERTY_TYPE_BOOL:
+                    {
+                        char* unescaped = NULL;
+
+                        if (t_val->type == JSMN_STRING && memchr(to_read, '\\', read_len)) {
+                            // unescaped string is never longer
+                            unescaped = (char*)iot_connect_malloc(read_len > 0 ? read_len : 1, IOT_CONNECT_MEM_JSON);
+                            if (!unescaped) {
+                                return IOT_CONNECT_ERROR_OUT_OF_MEM;
+                            }
+                            read_len = iot_connect_json_unescape(unescaped, to_read, read_len);
+                            if (read_len < 0) {
+                                tr_err("Property[%s] has an invalid escaped string", tokens[j].key);
+                                iot_connect_free(unescaped, IOT_CONNECT_MEM_JSON);
+                                i++;
+                                break;
+                            }
+                            to_read = unescaped;
+                        }
+
                         ((IoTConnectStringProperty*)tokens[j].obj)->set_value(to_read, read_len);
+                        if (unescaped) {
+                            iot_connect_free(unescaped, IOT_CONNECT_MEM_JSON);
+                        }
                         tr_info("Property[%s] changed", tokens[j].key);
                         tr_debug("Note: It %s have an on_change() callback", tokens[j].on_change ? "does" : "doesn't");
                         if (tokens[j].on_change) {
@@ -459,6 +904,7 @@ int IoTConnectProperty::update(const char* _json, size_t _len)
                         // value token has been parse
                         i++;
                         break;
+                    }
                     // TODO: To support Array, Object type
                     default:
                         tr_err("Property[%s] has an unsupport value type: %d", tokens[j].key, tokens[i].type);
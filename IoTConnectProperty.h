@@ -1,10 +1,12 @@
 #ifndef __IOT_CONNECT_PROPERTY_H__
 #define __IOT_CONNECT_PROPERTY_H__
 
+#include "IoTConnectPlatform.h"
 #include "jsmn.h"
 #include "IoTConnectError.h"
 
 #define IOT_CONNECT_PROPERTYS_MAX 10
+#define IOT_CONNECT_STRING_INLINE_SIZE MBED_CONF_IOT_CONNECT_PROPERTY_STRING_INLINE_SIZE
 
 typedef enum {
     IOT_CONNECT_PROPERTY_TYPE_UNDEFINED = JSMN_UNDEFINED,
@@ -17,6 +19,37 @@ typedef enum {
     IOT_CONNECT_PROPERTY_TYPE_NULL = JSMN_PRIMITIVE + 3
 } IoTConnectPropertyType;
 
+typedef enum {
+    IOT_CONNECT_AGGREGATE_MIN   = 0x01,
+    IOT_CONNECT_AGGREGATE_MAX   = 0x02,
+    IOT_CONNECT_AGGREGATE_MEAN  = 0x04,
+    IOT_CONNECT_AGGREGATE_LAST  = 0x08,
+    IOT_CONNECT_AGGREGATE_COUNT = 0x10,
+    IOT_CONNECT_AGGREGATE_ALL   = 0x1F
+} IoTConnectAggregate;
+
+typedef enum {
+    IOT_CONNECT_DEADBAND_NONE = 0,      /*!< report on any change */
+    IOT_CONNECT_DEADBAND_ABSOLUTE,      /*!< report if |new - last| >= deadband */
+    IOT_CONNECT_DEADBAND_PERCENT        /*!< report if |new - last| >= deadband% of |last| */
+} IoTConnectDeadbandType;
+
+// Decides whether a property is worth being published by pub_props().
+// Deadband only applies to int properties, others are reported on change.
+typedef struct {
+    IoTConnectDeadbandType deadband_type;
+    int deadband;
+    int min_interval_ms;    /*!< 0 - no limit */
+    int max_silence_ms;     /*!< heartbeat, report even not changed, 0 - never */
+} IoTConnectReportPolicy;
+
+// The properties put in a pub_props() message and their values in it, marked as
+// reported once the message is published. value is the int, or a hash of the value.
+typedef struct {
+    uint32_t mask;
+    uint32_t value[IOT_CONNECT_PROPERTYS_MAX];
+} IoTConnectReportSnapshot;
+
 class IoTConnectStringProperty {
 
 public:
@@ -35,7 +68,18 @@ public:
 
 private:
     const char* key;
+    // inline_buf, or a heap buffer once a value didn't fit. Values are
+    // overwritten in place while they fit, the buffer never shrinks.
     char* buf;
+    size_t cap;
+    char inline_buf[IOT_CONNECT_STRING_INLINE_SIZE];
+
+protected:
+    // set_value() without taking the lock, for constructors
+    void assign(const char* _new_value, size_t _len);
+
+private:
+    bool reserve(size_t _len);
 };
 
 class IoTConnectBoolProperty : public IoTConnectStringProperty {
@@ -60,6 +104,33 @@ public:
     void set_value(int _new_value);
 };
 
+// Aggregates int samples into a window as they come, the value is a json
+// object like {"min":1,"max":9,"mean":5,"last":7} which is refreshed every
+// time the window is closed.
+class IoTConnectSeriesProperty : public IoTConnectStringProperty {
+
+public:
+    IoTConnectSeriesProperty(const char* _key, int _aggregates = IOT_CONNECT_AGGREGATE_ALL);
+    ~IoTConnectSeriesProperty();
+
+    // Could be called in ISR context
+    void add_sample(int _sample);
+    int close_window();
+
+private:
+    void reset_window();
+
+private:
+    int aggregates;
+
+    // window accumulators, updated in a critical section
+    uint32_t count;
+    int64_t sum;
+    int min;
+    int max;
+    int last;
+};
+
 class IoTConnectProperty
 {
 public:
@@ -67,17 +138,38 @@ public:
     ~IoTConnectProperty();
 
     int add(IoTConnectStringProperty* _prop, Callback<void(void*)> _on_change = NULL);
+    int add(IoTConnectIntProperty* _prop, Callback<void(void*)> _on_change = NULL);
+    int add(IoTConnectBoolProperty* _prop, Callback<void(void*)> _on_change = NULL);
+    int add(IoTConnectSeriesProperty* _prop);
+    int set_report_policy(const char* _key, const IoTConnectReportPolicy* _policy);
     int prop(const char* _key, void** _obj, IoTConnectPropertyType* _type = 0);
     void* prop(const char* _key);
 
     int to_json(const char** _ppjson);
+    // Only properties selected by mask (bit i for the i-th added property)
+    int to_json(const char** _ppjson, uint32_t _mask);
     const char* get_json();
     int update(const char* _json);
     int update(const char* _json, size_t _len);
 
+    void close_series_windows();
+
+    // Properties should be reported now according to their report policies, and
+    // not already on the way
+    uint32_t reportable_mask();
+    // A json string of the reportable properties, NULL if none, to be freed with
+    // iot_connect_free(.., IOT_CONNECT_MEM_JSON). They're in flight, not reportable,
+    // until mark_reported() or clear_in_flight() with _snap.
+    int report_json(char** _json, IoTConnectReportSnapshot* _snap);
+    void mark_reported(const IoTConnectReportSnapshot* _snap);
+    void clear_in_flight(const IoTConnectReportSnapshot* _snap);
+
 private:
 
-    int calc_json_str_len();
+    int add_token(const char* _key, IoTConnectPropertyType _type, void* _obj, Callback<void(void*)> _on_change);
+    int calc_json_str_len(uint32_t _mask);
+    char* build_json(uint32_t _mask, IoTConnectReportSnapshot* _snap);
+    bool is_reportable(int _index, uint64_t _now);
 
 private:
 
@@ -86,6 +178,16 @@ private:
         IoTConnectPropertyType type;
         void* obj;
         Callback<void(void*)> on_change;
+
+        bool has_policy;
+        IoTConnectReportPolicy policy;
+
+        // last reported state
+        bool in_flight;
+        bool reported;
+        uint64_t last_report_ms;
+        int last_int;
+        uint32_t last_hash;
     }PropToken;
 
     PropToken tokens[IOT_CONNECT_PROPERTYS_MAX];
@@ -0,0 +1,242 @@
+#include "IoTConnectPlatform.h"
+#include "IoTConnectSasToken.h"
+#include "IoTConnectError.h"
+#include "IoTConnectAllocator.h"
+#include "mbedtls/base64.h"
+#include "mbedtls/version.h"
+
+#define TRACE_GROUP  "IoTConnectSasToken"
+
+#if MBEDTLS_VERSION_MAJOR >= 3
+#define mbedtls_sha256_starts_ret mbedtls_sha256_starts
+#define mbedtls_sha256_update_ret mbedtls_sha256_update
+#define mbedtls_sha256_finish_ret mbedtls_sha256_finish
+#define mbedtls_sha256_ret mbedtls_sha256
+#endif
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_SIZE 32
+#define SAS_KEY_MAX 64
+
+// The RTC should be set (e.g. by NTP), a token signed at 1970 expires at once
+#define SAS_TIME_MIN 1577836800    // 2020-01-01
+
+static const char sas_prefix[] = "SharedAccessSignature sr=";
+
+static bool url_is_unreserved(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '-' || c == '_' || c == '.' || c == '~';
+}
+
+// _dst should have 3 * strlen(_src) + 1 bytes
+static size_t url_encode(char* _dst, const char* _src)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char* d = _dst;
+
+    for (; *_src; _src++) {
+        if (url_is_unreserved(*_src)) {
+            *d++ = *_src;
+        } else {
+            *d++ = '%';
+            *d++ = hex[(uint8_t)*_src >> 4];
+            *d++ = hex[(uint8_t)*_src & 0x0F];
+        }
+    }
+    *d = '\0';
+
+    return d - _dst;
+}
+
+IoTConnectSasToken::IoTConnectSasToken() :
+    resource(NULL),
+    token(NULL),
+    token_size(0),
+    ttl(IOT_CONNECT_SAS_TOKEN_TTL),
+    expiry(0)
+{
+    mbedtls_sha256_init(&inner);
+    mbedtls_sha256_init(&outer);
+}
+
+IoTConnectSasToken::~IoTConnectSasToken()
+{
+    mbedtls_sha256_free(&inner);
+    mbedtls_sha256_free(&outer);
+
+    if (resource) {
+        iot_connect_free(resource, IOT_CONNECT_MEM_DEVICE);
+    }
+
+    if (token) {
+        iot_connect_free(token, IOT_CONNECT_MEM_DEVICE);
+    }
+}
+
+int IoTConnectSasToken::init(const char* _host_name, const char* _client_id, const char* _key, uint32_t _ttl_s)
+{
+    unsigned char key[SAS_KEY_MAX];
+    unsigned char pad[SHA256_BLOCK_SIZE];
+    size_t key_len = 0;
+    size_t resource_len;
+    int i;
+    int r;
+
+    if (!_host_name || !_client_id || !_key || _ttl_s == 0) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    r = mbedtls_base64_decode(key, sizeof(key), &key_len, (const unsigned char*)_key, strlen(_key));
+    if (r != 0 || key_len == 0) {
+        tr_error("Symmetric key is not a valid base64 string (max %d bytes)", SAS_KEY_MAX);
+        return IOT_CONNECT_ERROR_SAS_KEY;
+    }
+
+    // "{host_name}/devices/{client_id}", url encoded
+    resource_len = strlen(_host_name) + strlen(_client_id) + 9;
+    {
+        char* raw = (char*)iot_connect_malloc(resource_len + 1, IOT_CONNECT_MEM_DEVICE);
+        if (!raw) {
+            return IOT_CONNECT_ERROR_OUT_OF_MEM;
+        }
+        sprintf(raw, "%s/devices/%s", _host_name, _client_id);
+
+        if (resource) {
+            iot_connect_free(resource, IOT_CONNECT_MEM_DEVICE);
+        }
+        resource = (char*)iot_connect_malloc(resource_len * 3 + 1, IOT_CONNECT_MEM_DEVICE);
+        if (resource) {
+            url_encode(resource, raw);
+        }
+
+        iot_connect_free(raw, IOT_CONNECT_MEM_DEVICE);
+        if (!resource) {
+            return IOT_CONNECT_ERROR_OUT_OF_MEM;
+        }
+    }
+
+    // prefix + resource + "&sig=" + url encoded base64(sha256) + "&se=" + time_t
+    if (token) {
+        iot_connect_free(token, IOT_CONNECT_MEM_DEVICE);
+    }
+    token_size = sizeof(sas_prefix) + strlen(resource) + 5 + 44 * 3 + 4 + 20 + 1;
+    token = (char*)iot_connect_malloc(token_size, IOT_CONNECT_MEM_DEVICE);
+    if (!token) {
+        return IOT_CONNECT_ERROR_OUT_OF_MEM;
+    }
+    token[0] = '\0';
+
+    // HMAC key pads, H((K ^ opad) || H((K ^ ipad) || msg))
+    memset(pad, 0, sizeof(pad));
+    if (key_len > SHA256_BLOCK_SIZE) {
+        mbedtls_sha256_ret(key, key_len, pad, 0);
+    } else {
+        memcpy(pad, key, key_len);
+    }
+
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] ^= 0x36;
+    }
+    mbedtls_sha256_starts_ret(&inner, 0);
+    mbedtls_sha256_update_ret(&inner, pad, SHA256_BLOCK_SIZE);
+
+    // 0x36 ^ 0x5C
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] ^= 0x36 ^ 0x5C;
+    }
+    mbedtls_sha256_starts_ret(&outer, 0);
+    mbedtls_sha256_update_ret(&outer, pad, SHA256_BLOCK_SIZE);
+
+    // Don't leave the key on stack
+    memset(key, 0, sizeof(key));
+    memset(pad, 0, sizeof(pad));
+
+    ttl = _ttl_s;
+    expiry = 0;
+
+    return 0;
+}
+
+int IoTConnectSasToken::sign(const char* _str, size_t _len, unsigned char _mac[32])
+{
+    mbedtls_sha256_context ctx;
+    unsigned char digest[SHA256_SIZE];
+    int r;
+
+    mbedtls_sha256_init(&ctx);
+
+    mbedtls_sha256_clone(&ctx, &inner);
+    r = mbedtls_sha256_update_ret(&ctx, (const unsigned char*)_str, _len);
+    if (r == 0) {
+        r = mbedtls_sha256_finish_ret(&ctx, digest);
+    }
+
+    if (r == 0) {
+        mbedtls_sha256_clone(&ctx, &outer);
+        r = mbedtls_sha256_update_ret(&ctx, digest, SHA256_SIZE);
+    }
+    if (r == 0) {
+        r = mbedtls_sha256_finish_ret(&ctx, _mac);
+    }
+
+    mbedtls_sha256_free(&ctx);
+
+    return r;
+}
+
+int IoTConnectSasToken::generate(time_t _now)
+{
+    unsigned char mac[SHA256_SIZE];
+    unsigned char sig[48];
+    size_t sig_len = 0;
+    time_t se;
+    char* p;
+    int len;
+    int r;
+
+    if (!token) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    if (_now < SAS_TIME_MIN) {
+        tr_error("Device time is not set, could not sign a SAS token");
+        return IOT_CONNECT_ERROR_SAS_TIME;
+    }
+
+    se = _now + ttl;
+
+    // "{resource}\n{expiry}" is the string to sign, build it in the token buffer
+    len = snprintf(token, token_size, "%s\n%lu", resource, (unsigned long)se);
+    r = sign(token, len, mac);
+    if (r != 0) {
+        return IOT_CONNECT_ERROR_SAS_KEY;
+    }
+
+    r = mbedtls_base64_encode(sig, sizeof(sig), &sig_len, mac, sizeof(mac));
+    if (r != 0) {
+        return IOT_CONNECT_ERROR_SAS_KEY;
+    }
+    sig[sig_len] = '\0';
+
+    p = token;
+    p += sprintf(p, "%s%s&sig=", sas_prefix, resource);
+    p += url_encode(p, (const char*)sig);
+    sprintf(p, "&se=%lu", (unsigned long)se);
+
+    expiry = se;
+
+    tr_info("SAS token renewed, expires at %lu", (unsigned long)se);
+
+    return 0;
+}
+
+const char* IoTConnectSasToken::get_token() const
+{
+    return token;
+}
+
+time_t IoTConnectSasToken::get_expiry() const
+{
+    return expiry;
+}
@@ -0,0 +1,43 @@
+#ifndef __IOT_CONNECT_SAS_TOKEN_H__
+#define __IOT_CONNECT_SAS_TOKEN_H__
+
+#include <time.h>
+#include "mbedtls/sha256.h"
+
+#define IOT_CONNECT_SAS_TOKEN_TTL MBED_CONF_IOT_CONNECT_SAS_TOKEN_TTL
+#define IOT_CONNECT_SAS_TOKEN_RENEW_MARGIN MBED_CONF_IOT_CONNECT_SAS_TOKEN_RENEW_MARGIN
+
+// Generates "SharedAccessSignature sr={resource}&sig={signature}&se={expiry}"
+// with the device symmetric key. The HMAC-SHA256 key pads are hashed once
+// in init(), so generate() only hashes the string to sign.
+class IoTConnectSasToken {
+
+public:
+    IoTConnectSasToken();
+    ~IoTConnectSasToken();
+
+    // _key is the base64 encoded symmetric key
+    int init(const char* _host_name, const char* _client_id, const char* _key, uint32_t _ttl_s);
+    int generate(time_t _now);
+
+    const char* get_token() const;
+    time_t get_expiry() const;
+
+private:
+    int sign(const char* _str, size_t _len, unsigned char _mac[32]);
+
+private:
+    // sha256 state after key ^ ipad / key ^ opad
+    mbedtls_sha256_context inner;
+    mbedtls_sha256_context outer;
+
+    // url encoded "{host_name}/devices/{client_id}"
+    char* resource;
+    char* token;
+    size_t token_size;
+
+    uint32_t ttl;
+    time_t expiry;
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "IoTConnectTlsHeap.h"
+#include "IoTConnectAllocator.h"
+#include "IoTConnectError.h"
+#include "mbedtls/platform.h"
+
+
+#define TRACE_GROUP  "IoTConnectTlsHeap"
+
+static bool started;
+static size_t live_bytes;
+static size_t peak_bytes;
+static Mutex heap_mutex;
+// held from iot_connect_tls_heap_begin() to _end(), one handshake measured at a time
+static Mutex handshake_mutex;
+
+#if defined(MBEDTLS_PLATFORM_MEMORY)
+// a header keeps the size for free()
+static void* tls_calloc(size_t _n, size_t _size)
+{
+    uint8_t* p;
+    size_t len;
+
+    if (_size && _n > ((size_t)-1 - IOT_CONNECT_MEM_ALIGN) / _size) {
+        return NULL;
+    }
+    len = _n * _size;
+
+    p = (uint8_t*)calloc(1, len + IOT_CONNECT_MEM_ALIGN);
+    if (!p) {
+        return NULL;
+    }
+    *(size_t*)p = len;
+
+    heap_mutex.lock();
+    live_bytes += len;
+    if (live_bytes > peak_bytes) {
+        peak_bytes = live_bytes;
+    }
+    heap_mutex.unlock();
+
+    return p + IOT_CONNECT_MEM_ALIGN;
+}
+
+static void tls_free(void* _ptr)
+{
+    uint8_t* p;
+
+    if (!_ptr) {
+        return;
+    }
+
+    p = (uint8_t*)_ptr - IOT_CONNECT_MEM_ALIGN;
+
+    heap_mutex.lock();
+    live_bytes -= *(size_t*)p;
+    heap_mutex.unlock();
+
+    free(p);
+}
+#endif
+
+int iot_connect_tls_heap_start()
+{
+#if defined(MBEDTLS_PLATFORM_MEMORY)
+    if (!started) {
+        mbedtls_platform_set_calloc_free(tls_calloc, tls_free);
+        started = true;
+    }
+    return 0;
+#else
+    tr_warn("MBEDTLS_PLATFORM_MEMORY is off, the TLS heap can't be counted");
+    return IOT_CONNECT_ERROR_NS_UNSUPPORTED;
+#endif
+}
+
+bool iot_connect_tls_heap_started()
+{
+    return started;
+}
+
+size_t iot_connect_tls_heap_live()
+{
+    size_t live;
+
+    heap_mutex.lock();
+    live = live_bytes;
+    heap_mutex.unlock();
+
+    return live;
+}
+
+size_t iot_connect_tls_heap_peak()
+{
+    size_t peak;
+
+    heap_mutex.lock();
+    peak = peak_bytes;
+    heap_mutex.unlock();
+
+    return peak;
+}
+
+void iot_connect_tls_heap_reset_peak()
+{
+    heap_mutex.lock();
+    peak_bytes = live_bytes;
+    heap_mutex.unlock();
+}
+
+size_t iot_connect_tls_heap_begin()
+{
+    size_t base;
+
+    handshake_mutex.lock();
+
+    heap_mutex.lock();
+    base = live_bytes;
+    peak_bytes = live_bytes;
+    heap_mutex.unlock();
+
+    return base;
+}
+
+void iot_connect_tls_heap_end(size_t _base, size_t* _held, size_t* _peak)
+{
+    heap_mutex.lock();
+    *_held = live_bytes > _base ? live_bytes - _base : 0;
+    *_peak = peak_bytes > _base ? peak_bytes - _base : 0;
+    heap_mutex.unlock();
+
+    handshake_mutex.unlock();
+}
@@ -0,0 +1,24 @@
+#ifndef __IOT_CONNECT_TLS_HEAP_H__
+#define __IOT_CONNECT_TLS_HEAP_H__
+
+#include <stddef.h>
+#include "IoTConnectPlatform.h"
+
+// Counts the heap mbedTLS holds, by its calloc / free. Needs MBEDTLS_PLATFORM_MEMORY,
+// which tls-heap-stats turns on in mbedtls_azure_config.h. Start it at boot, before
+// anything uses mbedTLS: blocks allocated before can't be freed through it.
+int iot_connect_tls_heap_start();
+bool iot_connect_tls_heap_started();
+
+// Bytes now, and the most since iot_connect_tls_heap_reset_peak(). All connections.
+size_t iot_connect_tls_heap_live();
+size_t iot_connect_tls_heap_peak();
+void iot_connect_tls_heap_reset_peak();
+
+// Around a handshake, what it kept and the most it took on top of _base. The counters
+// are global: begin waits for any other measured handshake to end, so they don't count
+// each other, but records of established connections meanwhile are still counted.
+size_t iot_connect_tls_heap_begin();
+void iot_connect_tls_heap_end(size_t _base, size_t* _held, size_t* _peak);
+
+#endif
@@ -0,0 +1,70 @@
+#include "IoTConnectTlsProfile.h"
+#include "IoTConnectError.h"
+
+
+#define TRACE_GROUP  "IoTConnectTlsProfile"
+
+#if IOT_CONNECT_TLS_MAX_FRAG_LEN == 512
+#define TLS_MAX_FRAG_LEN_CODE MBEDTLS_SSL_MAX_FRAG_LEN_512
+#elif IOT_CONNECT_TLS_MAX_FRAG_LEN == 1024
+#define TLS_MAX_FRAG_LEN_CODE MBEDTLS_SSL_MAX_FRAG_LEN_1024
+#elif IOT_CONNECT_TLS_MAX_FRAG_LEN == 2048
+#define TLS_MAX_FRAG_LEN_CODE MBEDTLS_SSL_MAX_FRAG_LEN_2048
+#elif IOT_CONNECT_TLS_MAX_FRAG_LEN == 4096
+#define TLS_MAX_FRAG_LEN_CODE MBEDTLS_SSL_MAX_FRAG_LEN_4096
+#elif IOT_CONNECT_TLS_MAX_FRAG_LEN == 0
+#define TLS_MAX_FRAG_LEN_CODE MBEDTLS_SSL_MAX_FRAG_LEN_NONE
+#else
+#error "tls-max-frag-len should be 0, 512, 1024, 2048 or 4096"
+#endif
+
+static const int default_ciphersuites[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    0
+};
+
+static const mbedtls_ecp_group_id default_curves[] = {
+    MBEDTLS_ECP_DP_SECP256R1,
+    MBEDTLS_ECP_DP_NONE
+};
+
+static const IoTConnectTlsProfile default_profile = {
+    default_ciphersuites,
+    default_curves,
+    TLS_MAX_FRAG_LEN_CODE
+};
+
+const IoTConnectTlsProfile* iot_connect_tls_profile_default()
+{
+    return &default_profile;
+}
+
+int iot_connect_tls_profile_apply(const IoTConnectTlsProfile* _profile, mbedtls_ssl_config* _conf)
+{
+    if (!_profile || !_conf) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    if (_profile->ciphersuites) {
+        mbedtls_ssl_conf_ciphersuites(_conf, _profile->ciphersuites);
+    }
+
+    if (_profile->curves) {
+        mbedtls_ssl_conf_curves(_conf, _profile->curves);
+    }
+
+    if (_profile->max_frag_len != MBEDTLS_SSL_MAX_FRAG_LEN_NONE) {
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+        int ret = mbedtls_ssl_conf_max_frag_len(_conf, _profile->max_frag_len);
+        if (ret != 0) {
+            tr_error("Could not set max fragment length! Returned -0x%04X", -ret);
+            return ret;
+        }
+#else
+        tr_warn("MBEDTLS_SSL_MAX_FRAGMENT_LENGTH is off, max fragment length isn't negotiated");
+#endif
+    }
+
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __IOT_CONNECT_TLS_PROFILE_H__
+#define __IOT_CONNECT_TLS_PROFILE_H__
+
+#include "IoTConnectPlatform.h"
+#include "mbedtls/ssl.h"
+
+#define IOT_CONNECT_TLS_MAX_FRAG_LEN MBED_CONF_IOT_CONNECT_TLS_MAX_FRAG_LEN
+
+// What the client offers in the TLS handshake. A short list means a smaller
+// ClientHello and no key exchange or curve the device would have to compute slowly.
+// The lists are referenced, not copied, keep them.
+struct IoTConnectTlsProfile {
+    // MBEDTLS_TLS_XXX in order of preference, 0 terminated. NULL for mbedTLS's list.
+    const int* ciphersuites;
+    // MBEDTLS_ECP_DP_NONE terminated, NULL for mbedTLS's list
+    const mbedtls_ecp_group_id* curves;
+    // MBEDTLS_SSL_MAX_FRAG_LEN_XXX to ask the server for, or MBEDTLS_SSL_MAX_FRAG_LEN_NONE
+    unsigned char max_frag_len;
+};
+
+// ECDHE-ECDSA-AES128-GCM, then ECDHE-RSA-AES128-GCM for the hub's RSA certificate,
+// P-256 only and tls-max-frag-len
+const IoTConnectTlsProfile* iot_connect_tls_profile_default();
+
+// Applied to a client config, before mbedtls_ssl_setup()
+int iot_connect_tls_profile_apply(const IoTConnectTlsProfile* _profile, mbedtls_ssl_config* _conf);
+
+#endif
@@ -0,0 +1,63 @@
+#include "IoTConnectTokenBucket.h"
+
+IoTConnectTokenBucket::IoTConnectTokenBucket() :
+    rate(0),
+    burst(0),
+    level(0),
+    last_ms(0)
+{
+
+}
+
+void IoTConnectTokenBucket::set(uint32_t _rate, uint32_t _burst, uint64_t _now_ms)
+{
+    rate = _rate;
+    burst = _burst ? _burst : _rate;
+    level = (int64_t)burst * 1000;
+    last_ms = _now_ms;
+}
+
+bool IoTConnectTokenBucket::is_limited() const
+{
+    return rate != 0;
+}
+
+uint32_t IoTConnectTokenBucket::wait_ms(uint32_t _cost, uint64_t _now_ms)
+{
+    int64_t need;
+
+    if (!rate) {
+        return 0;
+    }
+
+    refill(_now_ms);
+
+    need = (int64_t)(_cost < burst ? _cost : burst) * 1000;
+    if (level >= need) {
+        return 0;
+    }
+
+    // rounded up, a ms early would find it short
+    return (uint32_t)((need - level + rate - 1) / rate);
+}
+
+void IoTConnectTokenBucket::take(uint32_t _cost, uint64_t _now_ms)
+{
+    if (!rate) {
+        return;
+    }
+
+    refill(_now_ms);
+    level -= (int64_t)_cost * 1000;
+}
+
+void IoTConnectTokenBucket::refill(uint64_t _now_ms)
+{
+    if (_now_ms > last_ms) {
+        level += (int64_t)(_now_ms - last_ms) * rate;
+        if (level > (int64_t)burst * 1000) {
+            level = (int64_t)burst * 1000;
+        }
+    }
+    last_ms = _now_ms;
+}
@@ -0,0 +1,33 @@
+#ifndef __IOT_CONNECT_TOKEN_BUCKET_H__
+#define __IOT_CONNECT_TOKEN_BUCKET_H__
+
+#include <stdint.h>
+
+// Refills at a rate of tokens a second up to the burst, e.g. messages or bytes.
+// A cost larger than the burst goes once the bucket is full, and leaves it in
+// debt. Time is in ms, see Kernel::get_ms_count().
+class IoTConnectTokenBucket {
+
+public:
+    IoTConnectTokenBucket();
+
+    // _rate tokens a second, 0 for no limit; _burst 0 for a second's worth. Starts full.
+    void set(uint32_t _rate, uint32_t _burst, uint64_t _now_ms);
+    bool is_limited() const;
+
+    // ms until _cost could be taken, 0 for now
+    uint32_t wait_ms(uint32_t _cost, uint64_t _now_ms);
+    void take(uint32_t _cost, uint64_t _now_ms);
+
+private:
+    uint32_t rate;
+    uint32_t burst;
+    // in thousandths, a ms of refill is rate of them
+    int64_t level;
+    uint64_t last_ms;
+
+private:
+    void refill(uint64_t _now_ms);
+};
+
+#endif
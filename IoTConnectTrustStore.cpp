@@ -0,0 +1,209 @@
+#include "IoTConnectTrustStore.h"
+#include "IoTConnectError.h"
+#include "AzureRootCert.h"
+#include "mbedtls/version.h"
+#if MBEDTLS_VERSION_MAJOR >= 3
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#endif
+
+
+#define TRACE_GROUP  "IoTConnectTrustStore"
+
+static IoTConnectTrustStore azure_root;
+static bool azure_root_loaded;
+static Mutex azure_root_mutex;
+
+IoTConnectTrustStore::IoTConnectTrustStore() :
+    ca_loaded(false),
+    client_loaded(false)
+{
+    mbedtls_x509_crt_init(&ca_chain);
+    mbedtls_x509_crt_init(&client_cert);
+    mbedtls_pk_init(&client_key);
+}
+
+IoTConnectTrustStore::~IoTConnectTrustStore()
+{
+    mbedtls_pk_free(&client_key);
+    mbedtls_x509_crt_free(&client_cert);
+    mbedtls_x509_crt_free(&ca_chain);
+}
+
+int IoTConnectTrustStore::add_ca_cert(const char* _pem)
+{
+    int ret;
+
+    if (!_pem) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    // the length includes '\0' for PEM
+    ret = mbedtls_x509_crt_parse(&ca_chain, (const unsigned char*)_pem, strlen(_pem) + 1);
+    if (ret < 0) {
+        tr_error("Could not parse ca cert! Returned -0x%04X", -ret);
+        return ret;
+    }
+    if (ret > 0) {
+        tr_warn("%d certificates of the ca bundle could not be parsed", ret);
+    }
+
+    ca_loaded = true;
+
+    return 0;
+}
+
+int IoTConnectTrustStore::add_ca_cert_der(const unsigned char* _der, size_t _len)
+{
+    int ret;
+
+    if (!_der || _len == 0) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+#if MBEDTLS_VERSION_NUMBER >= 0x02110000
+    ret = mbedtls_x509_crt_parse_der_nocopy(&ca_chain, _der, _len);
+#else
+    ret = mbedtls_x509_crt_parse_der(&ca_chain, _der, _len);
+#endif
+    if (ret != 0) {
+        tr_error("Could not parse ca cert! Returned -0x%04X", -ret);
+        return ret;
+    }
+
+    ca_loaded = true;
+
+    return 0;
+}
+
+int IoTConnectTrustStore::parse_key(const unsigned char* _key, size_t _len)
+{
+    int ret;
+
+#if MBEDTLS_VERSION_MAJOR >= 3
+    // only used for blinding while parsing
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+    ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0);
+    if (ret == 0) {
+        ret = mbedtls_pk_parse_key(&client_key, _key, _len, NULL, 0, mbedtls_ctr_drbg_random, &ctr_drbg);
+    }
+    mbedtls_ctr_drbg_free(&ctr_drbg);
+    mbedtls_entropy_free(&entropy);
+#else
+    ret = mbedtls_pk_parse_key(&client_key, _key, _len, NULL, 0);
+#endif
+
+    return ret;
+}
+
+int IoTConnectTrustStore::set_client_cert_key(const char* _cert_pem, const char* _key_pem)
+{
+    int ret;
+
+    if (!_cert_pem || !_key_pem) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    mbedtls_x509_crt_free(&client_cert);
+    mbedtls_x509_crt_init(&client_cert);
+    mbedtls_pk_free(&client_key);
+    mbedtls_pk_init(&client_key);
+    client_loaded = false;
+
+    ret = mbedtls_x509_crt_parse(&client_cert, (const unsigned char*)_cert_pem, strlen(_cert_pem) + 1);
+    if (ret < 0) {
+        tr_error("Could not parse client cert! Returned -0x%04X", -ret);
+        return ret;
+    }
+
+    ret = parse_key((const unsigned char*)_key_pem, strlen(_key_pem) + 1);
+    if (ret != 0) {
+        tr_error("Could not parse client key! Returned -0x%04X", -ret);
+        return ret;
+    }
+
+    client_loaded = true;
+
+    return 0;
+}
+
+int IoTConnectTrustStore::set_client_cert_key_der(const unsigned char* _cert_der, size_t _cert_len,
+                                                  const unsigned char* _key_der, size_t _key_len)
+{
+    int ret;
+
+    if (!_cert_der || !_cert_len || !_key_der || !_key_len) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    mbedtls_x509_crt_free(&client_cert);
+    mbedtls_x509_crt_init(&client_cert);
+    mbedtls_pk_free(&client_key);
+    mbedtls_pk_init(&client_key);
+    client_loaded = false;
+
+#if MBEDTLS_VERSION_NUMBER >= 0x02110000
+    ret = mbedtls_x509_crt_parse_der_nocopy(&client_cert, _cert_der, _cert_len);
+#else
+    ret = mbedtls_x509_crt_parse_der(&client_cert, _cert_der, _cert_len);
+#endif
+    if (ret != 0) {
+        tr_error("Could not parse client cert! Returned -0x%04X", -ret);
+        return ret;
+    }
+
+    ret = parse_key(_key_der, _key_len);
+    if (ret != 0) {
+        tr_error("Could not parse client key! Returned -0x%04X", -ret);
+        return ret;
+    }
+
+    client_loaded = true;
+
+    return 0;
+}
+
+bool IoTConnectTrustStore::has_ca_cert() const
+{
+    return ca_loaded;
+}
+
+bool IoTConnectTrustStore::has_client_cert() const
+{
+    return client_loaded;
+}
+
+mbedtls_x509_crt* IoTConnectTrustStore::get_ca_chain()
+{
+    return ca_loaded ? &ca_chain : NULL;
+}
+
+mbedtls_x509_crt* IoTConnectTrustStore::get_client_cert()
+{
+    return client_loaded ? &client_cert : NULL;
+}
+
+mbedtls_pk_context* IoTConnectTrustStore::get_client_key()
+{
+    return client_loaded ? &client_key : NULL;
+}
+
+IoTConnectTrustStore* IoTConnectTrustStore::get_azure_root()
+{
+    IoTConnectTrustStore* store = NULL;
+
+    azure_root_mutex.lock();
+    if (!azure_root_loaded) {
+        azure_root_loaded = azure_root.add_ca_cert(azure_root_certs) == 0;
+    }
+    if (azure_root_loaded) {
+        store = &azure_root;
+    }
+    azure_root_mutex.unlock();
+
+    return store;
+}
@@ -0,0 +1,49 @@
+#ifndef __IOT_CONNECT_TRUST_STORE_H__
+#define __IOT_CONNECT_TRUST_STORE_H__
+
+#include <stddef.h>
+#include "IoTConnectPlatform.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+
+// Root CAs and / or a client certificate and key, parsed once and referenced by
+// any number of transports and reconnects instead of parsing PEM at every connect.
+// Load it before the first connect, it's read only afterwards. DER certificates
+// are referenced in place, keep them (e.g. const arrays in flash).
+class IoTConnectTrustStore {
+
+public:
+    IoTConnectTrustStore();
+    ~IoTConnectTrustStore();
+
+    // PEM, a bundle is fine, or a DER certificate. Could be called for more CAs.
+    int add_ca_cert(const char* _pem);
+    int add_ca_cert_der(const unsigned char* _der, size_t _len);
+
+    int set_client_cert_key(const char* _cert_pem, const char* _key_pem);
+    int set_client_cert_key_der(const unsigned char* _cert_der, size_t _cert_len,
+                                const unsigned char* _key_der, size_t _key_len);
+
+    bool has_ca_cert() const;
+    bool has_client_cert() const;
+
+    mbedtls_x509_crt* get_ca_chain();
+    mbedtls_x509_crt* get_client_cert();
+    mbedtls_pk_context* get_client_key();
+
+    // azure_root_certs, parsed at the first call and shared by every client.
+    // NULL if it couldn't be parsed.
+    static IoTConnectTrustStore* get_azure_root();
+
+private:
+    mbedtls_x509_crt ca_chain;
+    mbedtls_x509_crt client_cert;
+    mbedtls_pk_context client_key;
+    bool ca_loaded;
+    bool client_loaded;
+
+private:
+    int parse_key(const unsigned char* _key, size_t _len);
+};
+
+#endif
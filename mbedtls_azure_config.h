@@ -74,6 +74,11 @@
 #endif // MBEDTLS_AES_FEWER_TABLES
 
 
+// SAS token generated on device
+#ifndef MBEDTLS_BASE64_C
+    #define MBEDTLS_BASE64_C
+#endif //MBEDTLS_BASE64_C
+
 #ifndef MBEDTLS_BIGNUM_C
     #define MBEDTLS_BIGNUM_C
 #endif //MBEDTLS_BIGNUM_C
@@ -183,6 +188,33 @@
     #define MBEDTLS_SSL_MAX_CONTENT_LEN (5*1024)
 #endif //MBEDTLS_SSL_MAX_CONTENT_LEN
 
+// Received records are as long as the server likes, ours are short MQTT packets
+#if !defined(MBEDTLS_SSL_IN_CONTENT_LEN) && defined(MBED_CONF_IOT_CONNECT_TLS_IN_CONTENT_LEN)
+    #define MBEDTLS_SSL_IN_CONTENT_LEN MBED_CONF_IOT_CONNECT_TLS_IN_CONTENT_LEN
+#endif //MBEDTLS_SSL_IN_CONTENT_LEN
+
+#if !defined(MBEDTLS_SSL_OUT_CONTENT_LEN) && defined(MBED_CONF_IOT_CONNECT_TLS_OUT_CONTENT_LEN)
+    #define MBEDTLS_SSL_OUT_CONTENT_LEN MBED_CONF_IOT_CONNECT_TLS_OUT_CONTENT_LEN
+#endif //MBEDTLS_SSL_OUT_CONTENT_LEN
+
+// Buffers at full length for the handshake only
+#if defined(MBED_CONF_IOT_CONNECT_TLS_VARIABLE_BUFFER) && MBED_CONF_IOT_CONNECT_TLS_VARIABLE_BUFFER
+#ifndef MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+    #define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+#endif //MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+#endif
+
+// calloc / free could be counted, see IoTConnectTlsHeap.h
+#if defined(MBED_CONF_IOT_CONNECT_TLS_HEAP_STATS) && MBED_CONF_IOT_CONNECT_TLS_HEAP_STATS
+#ifndef MBEDTLS_PLATFORM_C
+    #define MBEDTLS_PLATFORM_C
+#endif //MBEDTLS_PLATFORM_C
+
+#ifndef MBEDTLS_PLATFORM_MEMORY
+    #define MBEDTLS_PLATFORM_MEMORY
+#endif //MBEDTLS_PLATFORM_MEMORY
+#endif
+
 // Multiple Precision Integers when using RSA can be smaller
 #define MBEDTLS_MPI_MAX_SIZE 512
 #define MBEDTLS_MPI_WINDOW_SIZE 1
@@ -0,0 +1,151 @@
+#include "IoTConnectFileBlockDevice.h"
+
+#define TRACE_GROUP  "IoTConnectFileBlockDevice"
+#define FILE_BD_ERASED 0xFF
+
+IoTConnectFileBlockDevice::IoTConnectFileBlockDevice(const char* _path, bd_size_t _size, bd_size_t _program_size,
+                                                     bd_size_t _erase_size) :
+    path(_path),
+    file(NULL),
+    bd_size(_size),
+    program_size(_program_size),
+    erase_size(_erase_size)
+{
+
+}
+
+IoTConnectFileBlockDevice::~IoTConnectFileBlockDevice()
+{
+    deinit();
+}
+
+int IoTConnectFileBlockDevice::init()
+{
+    long len;
+
+    if (file) {
+        return BD_ERROR_OK;
+    }
+    if (!program_size || !erase_size || erase_size % program_size || bd_size % erase_size) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    file = fopen(path, "r+b");
+    if (!file) {
+        file = fopen(path, "w+b");
+    }
+    if (!file) {
+        tr_error("Could not open %s", path);
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    // a new or shorter file is erased up to the size
+    fseek(file, 0, SEEK_END);
+    len = ftell(file);
+    for (; len >= 0 && (bd_size_t)len < bd_size; len++) {
+        fputc(FILE_BD_ERASED, file);
+    }
+    fflush(file);
+
+    return BD_ERROR_OK;
+}
+
+int IoTConnectFileBlockDevice::deinit()
+{
+    if (file) {
+        fclose(file);
+        file = NULL;
+    }
+
+    return BD_ERROR_OK;
+}
+
+bool IoTConnectFileBlockDevice::is_valid(bd_addr_t _addr, bd_size_t _size, bd_size_t _align) const
+{
+    return file && _addr % _align == 0 && _size % _align == 0 && _addr + _size <= bd_size;
+}
+
+int IoTConnectFileBlockDevice::read(void* _buf, bd_addr_t _addr, bd_size_t _size)
+{
+    if (!is_valid(_addr, _size, 1)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    fseek(file, _addr, SEEK_SET);
+    if (fread(_buf, 1, _size, file) != _size) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    return BD_ERROR_OK;
+}
+
+int IoTConnectFileBlockDevice::program(const void* _buf, bd_addr_t _addr, bd_size_t _size)
+{
+    unsigned char old[256];
+    bd_size_t done;
+
+    if (!is_valid(_addr, _size, program_size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    for (done = 0; done < _size; done += sizeof(old)) {
+        bd_size_t n = _size - done < sizeof(old) ? _size - done : sizeof(old);
+        bd_size_t i;
+
+        fseek(file, _addr + done, SEEK_SET);
+        if (fread(old, 1, n, file) != n) {
+            return BD_ERROR_DEVICE_ERROR;
+        }
+        for (i = 0; i < n; i++) {
+            if (old[i] != FILE_BD_ERASED) {
+                tr_error("Programming 0x%08" PRIx64 " which isn't erased", _addr + done + i);
+                return BD_ERROR_DEVICE_ERROR;
+            }
+        }
+    }
+
+    fseek(file, _addr, SEEK_SET);
+    if (fwrite(_buf, 1, _size, file) != _size) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+    fflush(file);
+
+    return BD_ERROR_OK;
+}
+
+int IoTConnectFileBlockDevice::erase(bd_addr_t _addr, bd_size_t _size)
+{
+    bd_size_t i;
+
+    if (!is_valid(_addr, _size, erase_size)) {
+        return BD_ERROR_DEVICE_ERROR;
+    }
+
+    fseek(file, _addr, SEEK_SET);
+    for (i = 0; i < _size; i++) {
+        fputc(FILE_BD_ERASED, file);
+    }
+    fflush(file);
+
+    return BD_ERROR_OK;
+}
+
+bd_size_t IoTConnectFileBlockDevice::get_read_size() const
+{
+    return 1;
+}
+
+bd_size_t IoTConnectFileBlockDevice::get_program_size() const
+{
+    return program_size;
+}
+
+bd_size_t IoTConnectFileBlockDevice::get_erase_size(bd_addr_t _addr) const
+{
+    return erase_size;
+}
+
+bd_size_t IoTConnectFileBlockDevice::size() const
+{
+    return bd_size;
+}
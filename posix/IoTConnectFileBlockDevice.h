@@ -0,0 +1,37 @@
+#ifndef __IOT_CONNECT_FILE_BLOCK_DEVICE_H__
+#define __IOT_CONNECT_FILE_BLOCK_DEVICE_H__
+
+#include "IoTConnectPlatform.h"
+
+// A flash-like BlockDevice in a file, for host builds and tests. Erased bytes
+// read 0xFF, programming bytes that aren't erased fails like NOR flash would.
+class IoTConnectFileBlockDevice : public BlockDevice {
+
+public:
+    IoTConnectFileBlockDevice(const char* _path, bd_size_t _size, bd_size_t _program_size = 256,
+                              bd_size_t _erase_size = 4096);
+    ~IoTConnectFileBlockDevice();
+
+    // The file is created erased, or kept as it is
+    int init();
+    int deinit();
+    int read(void* _buf, bd_addr_t _addr, bd_size_t _size);
+    int program(const void* _buf, bd_addr_t _addr, bd_size_t _size);
+    int erase(bd_addr_t _addr, bd_size_t _size);
+    bd_size_t get_read_size() const;
+    bd_size_t get_program_size() const;
+    bd_size_t get_erase_size(bd_addr_t _addr) const;
+    bd_size_t size() const;
+
+private:
+    const char* path;
+    FILE* file;
+    bd_size_t bd_size;
+    bd_size_t program_size;
+    bd_size_t erase_size;
+
+private:
+    bool is_valid(bd_addr_t _addr, bd_size_t _size, bd_size_t _align) const;
+};
+
+#endif
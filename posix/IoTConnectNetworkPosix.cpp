@@ -0,0 +1,437 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "IoTConnectNetworkPosix.h"
+#include "IoTConnectTrustStore.h"
+#include "IoTConnectTlsProfile.h"
+#include "IoTConnectError.h"
+#include "mbedtls/version.h"
+#include "mbedtls/net_sockets.h"
+
+
+#define TRACE_GROUP  "IoTConnectNetworkPosix"
+
+static const char pers[] = "iot_connect";
+
+IoTConnectNetworkPosix::IoTConnectNetworkPosix() :
+    fd(-1),
+    addrs(NULL),
+    rng_ready(false),
+    tls_ready(false),
+    ssl_open(false),
+    has_client_cert(false),
+    ca_store(NULL),
+    client_store(NULL),
+    tls_profile(NULL)
+{
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+    mbedtls_ssl_init(&ssl);
+    mbedtls_ssl_config_init(&conf);
+    mbedtls_x509_crt_init(&ca_chain);
+    mbedtls_x509_crt_init(&client_cert);
+    mbedtls_pk_init(&client_key);
+}
+
+IoTConnectNetworkPosix::~IoTConnectNetworkPosix()
+{
+    disconnect();
+
+    mbedtls_pk_free(&client_key);
+    mbedtls_x509_crt_free(&client_cert);
+    mbedtls_x509_crt_free(&ca_chain);
+    mbedtls_ssl_config_free(&conf);
+    mbedtls_ssl_free(&ssl);
+    mbedtls_ctr_drbg_free(&ctr_drbg);
+    mbedtls_entropy_free(&entropy);
+}
+
+int IoTConnectNetworkPosix::set_root_ca_cert(const char* _root_ca_pem)
+{
+    int ret;
+
+    mbedtls_x509_crt_free(&ca_chain);
+    mbedtls_x509_crt_init(&ca_chain);
+    tls_ready = false;
+
+    // the length includes '\0' for PEM
+    ret = mbedtls_x509_crt_parse(&ca_chain, (const unsigned char*)_root_ca_pem, strlen(_root_ca_pem) + 1);
+    if (ret < 0) {
+        tr_error("Could not parse ca cert! Returned -0x%04X", -ret);
+        return ret;
+    }
+
+    return 0;
+}
+
+int IoTConnectNetworkPosix::set_client_cert_key(const char* _cert_pem, const char* _key_pem)
+{
+    int ret;
+
+    if (!_cert_pem || !_key_pem) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    mbedtls_x509_crt_free(&client_cert);
+    mbedtls_x509_crt_init(&client_cert);
+    mbedtls_pk_free(&client_key);
+    mbedtls_pk_init(&client_key);
+    has_client_cert = false;
+    tls_ready = false;
+
+    ret = mbedtls_x509_crt_parse(&client_cert, (const unsigned char*)_cert_pem, strlen(_cert_pem) + 1);
+    if (ret < 0) {
+        tr_error("Could not parse client cert! Returned -0x%04X", -ret);
+        return ret;
+    }
+
+#if MBEDTLS_VERSION_MAJOR >= 3
+    ret = mbedtls_pk_parse_key(&client_key, (const unsigned char*)_key_pem, strlen(_key_pem) + 1,
+                               NULL, 0, mbedtls_ctr_drbg_random, &ctr_drbg);
+#else
+    ret = mbedtls_pk_parse_key(&client_key, (const unsigned char*)_key_pem, strlen(_key_pem) + 1, NULL, 0);
+#endif
+    if (ret != 0) {
+        tr_error("Could not parse client key! Returned -0x%04X", -ret);
+        return ret;
+    }
+
+    has_client_cert = true;
+
+    return 0;
+}
+
+int IoTConnectNetworkPosix::set_trust_store(IoTConnectTrustStore* _ca, IoTConnectTrustStore* _client)
+{
+    if (_ca && !_ca->has_ca_cert()) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+    if (_client && !_client->has_client_cert()) {
+        return IOT_CONNECT_ERROR_INVAL;
+    }
+
+    // the client gives the same stores at every connect
+    if (_ca != ca_store || _client != client_store) {
+        ca_store = _ca;
+        client_store = _client;
+        tls_ready = false;
+    }
+
+    return 0;
+}
+
+int IoTConnectNetworkPosix::set_tls_profile(const IoTConnectTlsProfile* _profile)
+{
+    if (_profile != tls_profile) {
+        tls_profile = _profile;
+        tls_ready = false;
+    }
+
+    return 0;
+}
+
+int IoTConnectNetworkPosix::wait_fd(bool _for_write, int _timeout_ms)
+{
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = fd;
+    pfd.events = _for_write ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+
+    do {
+        ret = poll(&pfd, 1, _timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+int IoTConnectNetworkPosix::resolve(const char* _host_name, uint16_t _port)
+{
+    struct addrinfo hints;
+    char port[8];
+    int ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    snprintf(port, sizeof(port), "%u", _port);
+
+    ret = getaddrinfo(_host_name, port, &hints, &addrs);
+    if (ret != 0) {
+        tr_error("Could not resolve %s! Returned %s", _host_name, gai_strerror(ret));
+        addrs = NULL;
+        return IOT_CONNECT_ERROR_NS_DNS_FAILURE;
+    }
+
+    return 0;
+}
+
+int IoTConnectNetworkPosix::tcp_connect(const char* _host_name, uint16_t _port, int _timeout_ms)
+{
+    struct addrinfo* ai;
+
+    if (!addrs) {
+        return IOT_CONNECT_ERROR_NS_NO_ADDRESS;
+    }
+
+    for (ai = addrs; ai; ai = ai->ai_next) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        // Non-blocking from now on, every read and write waits with poll()
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+        if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 ||
+            (errno == EINPROGRESS && wait_fd(true, _timeout_ms) > 0 &&
+             getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0)) {
+            break;
+        }
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addrs);
+    addrs = NULL;
+
+    if (fd < 0) {
+        tr_error("Could not connect to %s:%u", _host_name, _port);
+        return IOT_CONNECT_ERROR_NS_NO_CONNECTION;
+    }
+
+    return 0;
+}
+
+int IoTConnectNetworkPosix::bio_send(void* _ctx, const unsigned char* _buf, size_t _len)
+{
+    IoTConnectNetworkPosix* net = (IoTConnectNetworkPosix*)_ctx;
+    ssize_t ret = send(net->fd, _buf, _len, MSG_NOSIGNAL);
+
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return MBEDTLS_ERR_SSL_WANT_WRITE;
+        }
+        return MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+
+    return (int)ret;
+}
+
+int IoTConnectNetworkPosix::bio_recv(void* _ctx, unsigned char* _buf, size_t _len)
+{
+    IoTConnectNetworkPosix* net = (IoTConnectNetworkPosix*)_ctx;
+    ssize_t ret = recv(net->fd, _buf, _len, 0);
+
+    if (ret < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return MBEDTLS_ERR_SSL_WANT_READ;
+        }
+        return MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+    if (ret == 0) {
+        return MBEDTLS_ERR_NET_CONN_RESET;
+    }
+
+    return (int)ret;
+}
+
+int IoTConnectNetworkPosix::connect(const char* _host_name, uint16_t _port, int _timeout_ms)
+{
+    return connect_by_phases(_host_name, _port, _timeout_ms);
+}
+
+int IoTConnectNetworkPosix::connect_phase(IoTConnectPhase _phase, const char* _host_name, uint16_t _port,
+                                          int _timeout_ms)
+{
+    switch (_phase) {
+        case IOT_CONNECT_PHASE_DNS:
+            disconnect();
+            return resolve(_host_name, _port);
+        case IOT_CONNECT_PHASE_TCP:
+            return tcp_connect(_host_name, _port, _timeout_ms);
+        case IOT_CONNECT_PHASE_TLS:
+            return tls_handshake(_host_name, _timeout_ms);
+        default:
+            return 0;
+    }
+}
+
+int IoTConnectNetworkPosix::tls_handshake(const char* _host_name, int _timeout_ms)
+{
+    uint64_t deadline = Kernel::get_ms_count() + _timeout_ms;
+    int ret;
+
+    if (fd < 0) {
+        return IOT_CONNECT_ERROR_NS_NO_SOCKET;
+    }
+
+    if (!rng_ready) {
+        ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
+                                    (const unsigned char*)pers, sizeof(pers) - 1);
+        if (ret != 0) {
+            tr_error("Could not seed the RNG! Returned -0x%04X", -ret);
+            return ret;
+        }
+        rng_ready = true;
+    }
+
+    mbedtls_ssl_free(&ssl);
+    mbedtls_ssl_init(&ssl);
+
+    // kept over reconnects, own certificates are appended to a config rather than replaced
+    if (!tls_ready) {
+        mbedtls_ssl_config_free(&conf);
+        mbedtls_ssl_config_init(&conf);
+
+        ret = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT,
+                                          MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+        if (ret != 0) {
+            return ret;
+        }
+        mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
+        if (tls_profile) {
+            ret = iot_connect_tls_profile_apply(tls_profile, &conf);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+
+        mbedtls_ssl_conf_ca_chain(&conf, ca_store ? ca_store->get_ca_chain() : &ca_chain, NULL);
+        if (client_store) {
+            ret = mbedtls_ssl_conf_own_cert(&conf, client_store->get_client_cert(), client_store->get_client_key());
+        } else if (has_client_cert) {
+            ret = mbedtls_ssl_conf_own_cert(&conf, &client_cert, &client_key);
+        }
+        if (ret != 0) {
+            tr_error("Could not set keys! Returned -0x%04X", -ret);
+            return ret;
+        }
+
+        tls_ready = true;
+    }
+
+    ret = mbedtls_ssl_setup(&ssl, &conf);
+    if (ret == 0) {
+        ret = mbedtls_ssl_set_hostname(&ssl, _host_name);
+    }
+    if (ret != 0) {
+        disconnect();
+        return ret;
+    }
+    mbedtls_ssl_set_bio(&ssl, this, bio_send, bio_recv, NULL);
+    ssl_open = true;
+
+    while ((ret = mbedtls_ssl_handshake(&ssl)) != 0) {
+        uint64_t now = Kernel::get_ms_count();
+
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            tr_error("TLS handshake failed! Returned -0x%04X", -ret);
+            disconnect();
+            return ret;
+        }
+        if (now >= deadline || wait_fd(ret == MBEDTLS_ERR_SSL_WANT_WRITE, (int)(deadline - now)) <= 0) {
+            tr_error("TLS handshake timeout");
+            disconnect();
+            return IOT_CONNECT_ERROR_NS_CONNECTION_TIMEOUT;
+        }
+    }
+
+    tr_info("Connection established");
+
+    return 0;
+}
+
+int IoTConnectNetworkPosix::disconnect()
+{
+    if (fd >= 0) {
+        if (ssl_open) {
+            mbedtls_ssl_close_notify(&ssl);
+            ssl_open = false;
+        }
+        close(fd);
+        fd = -1;
+    }
+
+    if (addrs) {
+        freeaddrinfo(addrs);
+        addrs = NULL;
+    }
+
+    return 0;
+}
+
+int IoTConnectNetworkPosix::read(unsigned char* _buf, int _len, int _timeout_ms)
+{
+    uint64_t deadline = Kernel::get_ms_count() + _timeout_ms;
+    int got = 0;
+
+    if (fd < 0) {
+        return IOT_CONNECT_ERROR_NS_NO_SOCKET;
+    }
+
+    while (got < _len) {
+        int ret = mbedtls_ssl_read(&ssl, _buf + got, _len - got);
+        uint64_t now;
+
+        if (ret > 0) {
+            got += ret;
+            continue;
+        }
+        if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || ret == MBEDTLS_ERR_NET_CONN_RESET) {
+            return IOT_CONNECT_ERROR_NS_CONNECTION_LOST;
+        }
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            tr_error("TLS read failed! Returned -0x%04X", -ret);
+            return ret;
+        }
+
+        now = Kernel::get_ms_count();
+        if (now >= deadline || wait_fd(ret == MBEDTLS_ERR_SSL_WANT_WRITE, (int)(deadline - now)) <= 0) {
+            break;
+        }
+    }
+
+    return got;
+}
+
+int IoTConnectNetworkPosix::write(unsigned char* _buf, int _len, int _timeout_ms)
+{
+    uint64_t deadline = Kernel::get_ms_count() + _timeout_ms;
+    int sent = 0;
+
+    if (fd < 0) {
+        return IOT_CONNECT_ERROR_NS_NO_SOCKET;
+    }
+
+    while (sent < _len) {
+        int ret = mbedtls_ssl_write(&ssl, _buf + sent, _len - sent);
+        uint64_t now;
+
+        if (ret > 0) {
+            sent += ret;
+            continue;
+        }
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            tr_error("TLS write failed! Returned -0x%04X", -ret);
+            return ret;
+        }
+
+        now = Kernel::get_ms_count();
+        if (now >= deadline || wait_fd(ret == MBEDTLS_ERR_SSL_WANT_WRITE, (int)(deadline - now)) <= 0) {
+            break;
+        }
+    }
+
+    return sent;
+}
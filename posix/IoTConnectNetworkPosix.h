@@ -0,0 +1,63 @@
+#ifndef __IOT_CONNECT_NETWORK_POSIX_H__
+#define __IOT_CONNECT_NETWORK_POSIX_H__
+
+#include "IoTConnectNetwork.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+
+struct addrinfo;
+
+// BSD socket with mbedTLS
+class IoTConnectNetworkPosix : public IoTConnectNetwork {
+
+public:
+    IoTConnectNetworkPosix();
+    ~IoTConnectNetworkPosix();
+
+    int set_root_ca_cert(const char* _root_ca_pem);
+    int set_client_cert_key(const char* _cert_pem, const char* _key_pem);
+    int set_trust_store(IoTConnectTrustStore* _ca, IoTConnectTrustStore* _client);
+    int set_tls_profile(const IoTConnectTlsProfile* _profile);
+
+    int connect(const char* _host_name, uint16_t _port, int _timeout_ms);
+    int connect_phase(IoTConnectPhase _phase, const char* _host_name, uint16_t _port, int _timeout_ms);
+    int disconnect();
+
+    int read(unsigned char* _buf, int _len, int _timeout_ms);
+    int write(unsigned char* _buf, int _len, int _timeout_ms);
+
+private:
+    int fd;
+    // resolved, until the TCP phase
+    struct addrinfo* addrs;
+    bool rng_ready;
+    // conf is set up for the current certificates and profile
+    bool tls_ready;
+    // handshake started on fd
+    bool ssl_open;
+
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt ca_chain;
+    mbedtls_x509_crt client_cert;
+    mbedtls_pk_context client_key;
+    bool has_client_cert;
+    IoTConnectTrustStore* ca_store;
+    IoTConnectTrustStore* client_store;
+    const IoTConnectTlsProfile* tls_profile;
+
+private:
+    int resolve(const char* _host_name, uint16_t _port);
+    int tcp_connect(const char* _host_name, uint16_t _port, int _timeout_ms);
+    int tls_handshake(const char* _host_name, int _timeout_ms);
+    int wait_fd(bool _for_write, int _timeout_ms);
+    static int bio_send(void* _ctx, const unsigned char* _buf, size_t _len);
+    static int bio_recv(void* _ctx, unsigned char* _buf, size_t _len);
+};
+
+#endif
@@ -0,0 +1,26 @@
+#include <stdarg.h>
+#include "IoTConnectPosix.h"
+
+static std::mutex trace_mutex;
+
+void iot_connect_posix_trace(int _level, const char* _group, const char* _fmt, ...)
+{
+    static const char* const names[] = { "ERR ", "WARN", "INFO", "DBG " };
+    const char* name = names[3];
+    va_list ap;
+
+    if (_level <= TRACE_LEVEL_ERROR) {
+        name = names[0];
+    } else if (_level <= TRACE_LEVEL_WARN) {
+        name = names[1];
+    } else if (_level <= TRACE_LEVEL_INFO) {
+        name = names[2];
+    }
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    fprintf(stderr, "[%s][%s]: ", name, _group);
+    va_start(ap, _fmt);
+    vfprintf(stderr, _fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
@@ -0,0 +1,517 @@
+#ifndef __IOT_CONNECT_POSIX_H__
+#define __IOT_CONNECT_POSIX_H__
+
+// The subset of mbed used by the library, on top of POSIX and C++11 threads.
+// See IoTConnectPlatform.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <pthread.h>
+#include <system_error>
+
+// Configs, the same defaults as mbed_lib.json
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_PUB_BUFFER_MAX
+#define MBED_CONF_IOT_CONNECT_MQTT_PUB_BUFFER_MAX 5
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_SUB_BUFFER_MAX
+#define MBED_CONF_IOT_CONNECT_MQTT_SUB_BUFFER_MAX 5
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_CLIENT_INSTANCE_MAX
+#define MBED_CONF_IOT_CONNECT_MQTT_CLIENT_INSTANCE_MAX 2
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_CLIENT_THREAD_STACK_SIZE
+#define MBED_CONF_IOT_CONNECT_MQTT_CLIENT_THREAD_STACK_SIZE 4096
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_CLIENT_STACK_STATS
+#define MBED_CONF_IOT_CONNECT_MQTT_CLIENT_STACK_STATS 0
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_CLIENT_PROFILE
+#define MBED_CONF_IOT_CONNECT_MQTT_CLIENT_PROFILE 0
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_PROPERTY_STRING_INLINE_SIZE
+#define MBED_CONF_IOT_CONNECT_PROPERTY_STRING_INLINE_SIZE 16
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_KEEPALIVE
+#define MBED_CONF_IOT_CONNECT_MQTT_KEEPALIVE 60
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_PING_TIMEOUT_MS
+#define MBED_CONF_IOT_CONNECT_MQTT_PING_TIMEOUT_MS 10000
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_VERSION
+#define MBED_CONF_IOT_CONNECT_MQTT_VERSION 4
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_TOPIC_ALIASES
+#define MBED_CONF_IOT_CONNECT_MQTT_TOPIC_ALIASES 4
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_QOS2_RECEIVE_MAX
+#define MBED_CONF_IOT_CONNECT_MQTT_QOS2_RECEIVE_MAX 4
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_MESSAGE_EXPIRY
+#define MBED_CONF_IOT_CONNECT_MQTT_MESSAGE_EXPIRY 0
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_PUB_RATE_MSGS
+#define MBED_CONF_IOT_CONNECT_MQTT_PUB_RATE_MSGS 0
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_PUB_RATE_MSG_BURST
+#define MBED_CONF_IOT_CONNECT_MQTT_PUB_RATE_MSG_BURST 0
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_PUB_RATE_BYTES
+#define MBED_CONF_IOT_CONNECT_MQTT_PUB_RATE_BYTES 0
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_PUB_RATE_BYTE_BURST
+#define MBED_CONF_IOT_CONNECT_MQTT_PUB_RATE_BYTE_BURST 0
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_MQTT_TOPIC_PROPS_MAX
+#define MBED_CONF_IOT_CONNECT_MQTT_TOPIC_PROPS_MAX 256
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_OTA_CHUNK_SIZE
+#define MBED_CONF_IOT_CONNECT_OTA_CHUNK_SIZE 512
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_OTA_WINDOW
+#define MBED_CONF_IOT_CONNECT_OTA_WINDOW 4
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_OTA_CHUNK_TIMEOUT_MS
+#define MBED_CONF_IOT_CONNECT_OTA_CHUNK_TIMEOUT_MS 10000
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_OTA_JOURNAL_EVERY
+#define MBED_CONF_IOT_CONNECT_OTA_JOURNAL_EVERY 16384
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_TLS_MAX_FRAG_LEN
+#define MBED_CONF_IOT_CONNECT_TLS_MAX_FRAG_LEN 2048
+#endif
+// the system's mbedTLS is built with its own buffer lengths
+#ifndef MBED_CONF_IOT_CONNECT_TLS_IN_CONTENT_LEN
+#define MBED_CONF_IOT_CONNECT_TLS_IN_CONTENT_LEN 5120
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_TLS_OUT_CONTENT_LEN
+#define MBED_CONF_IOT_CONNECT_TLS_OUT_CONTENT_LEN 2048
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_TLS_VARIABLE_BUFFER
+#define MBED_CONF_IOT_CONNECT_TLS_VARIABLE_BUFFER 1
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_TLS_HEAP_STATS
+#define MBED_CONF_IOT_CONNECT_TLS_HEAP_STATS 0
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_SAS_TOKEN_TTL
+#define MBED_CONF_IOT_CONNECT_SAS_TOKEN_TTL 3600
+#endif
+#ifndef MBED_CONF_IOT_CONNECT_SAS_TOKEN_RENEW_MARGIN
+#define MBED_CONF_IOT_CONNECT_SAS_TOKEN_RENEW_MARGIN 300
+#endif
+#ifndef MBED_CONF_MBED_MQTT_MAX_PACKET_SIZE
+#define MBED_CONF_MBED_MQTT_MAX_PACKET_SIZE 1024
+#endif
+#ifndef MBED_CONF_MBED_MQTT_MAX_CONNECTIONS
+#define MBED_CONF_MBED_MQTT_MAX_CONNECTIONS 5
+#endif
+
+#define MBED_STATIC_ASSERT(expr, msg) static_assert(expr, msg)
+#define MBED_NOINLINE __attribute__((noinline))
+
+// Callback
+template <typename F>
+using Callback = std::function<F>;
+
+template <typename T, typename R, typename... Args>
+Callback<R(Args...)> callback(T* _obj, R (T::*_method)(Args...))
+{
+    return [_obj, _method](Args... _args) -> R { return (_obj->*_method)(_args...); };
+}
+
+template <typename R, typename... Args>
+Callback<R(Args...)> callback(R (*_func)(Args...))
+{
+    return _func;
+}
+
+// CriticalSectionLock, there are no ISRs on a host, a process wide lock
+class CriticalSectionLock {
+
+public:
+    CriticalSectionLock()
+    {
+        mutex().lock();
+    }
+
+    ~CriticalSectionLock()
+    {
+        mutex().unlock();
+    }
+
+private:
+    static std::recursive_mutex& mutex()
+    {
+        static std::recursive_mutex m;
+        return m;
+    }
+};
+
+// CircularBuffer, the mbed one is protected by critical sections
+template <typename T, uint32_t BufferSize, typename CounterType = uint32_t>
+class CircularBuffer {
+
+public:
+    CircularBuffer() : head(0), tail(0), full_flag(false) {}
+
+    void push(const T& _data)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (full_flag) {
+            tail = (tail + 1) % BufferSize;
+        }
+        pool[head] = _data;
+        head = (head + 1) % BufferSize;
+        full_flag = head == tail;
+    }
+
+    bool pop(T& _data)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (head == tail && !full_flag) {
+            return false;
+        }
+        _data = pool[tail];
+        tail = (tail + 1) % BufferSize;
+        full_flag = false;
+        return true;
+    }
+
+    bool peek(T& _data) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (head == tail && !full_flag) {
+            return false;
+        }
+        _data = pool[tail];
+        return true;
+    }
+
+    bool empty() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return head == tail && !full_flag;
+    }
+
+    bool full() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return full_flag;
+    }
+
+    CounterType size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (full_flag) {
+            return BufferSize;
+        }
+        return (head + BufferSize - tail) % BufferSize;
+    }
+
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        head = 0;
+        tail = 0;
+        full_flag = false;
+    }
+
+private:
+    T pool[BufferSize];
+    CounterType head;
+    CounterType tail;
+    bool full_flag;
+    mutable std::mutex mutex;
+};
+
+// Thread over pthreads, priority is left to the OS. The stack is the
+// OS default unless stack memory is given.
+typedef int32_t osStatus;
+#define osOK 0
+#define osErrorResource -3
+
+typedef enum {
+    osPriorityLow = 8,
+    osPriorityBelowNormal = 16,
+    osPriorityNormal = 24,
+    osPriorityAboveNormal = 32,
+    osPriorityHigh = 40,
+    osPriorityRealtime = 48,
+} osPriority;
+
+class Thread {
+
+public:
+    Thread(osPriority _priority = osPriorityNormal, uint32_t _stack_size = 0,
+           unsigned char* _stack_mem = NULL, const char* _name = NULL) :
+        stack_size(_stack_size),
+        stack_mem(_stack_mem),
+        started(false)
+    {
+
+    }
+
+    ~Thread()
+    {
+        if (started) {
+            pthread_detach(thread);
+        }
+    }
+
+    osStatus start(Callback<void()> _task)
+    {
+        pthread_attr_t attr;
+        int r;
+
+        if (started) {
+            return osErrorResource;
+        }
+
+        task = _task;
+        pthread_attr_init(&attr);
+        if (stack_mem && stack_size) {
+            pthread_attr_setstack(&attr, stack_mem, stack_size);
+        }
+        r = pthread_create(&thread, &attr, entry, this);
+        pthread_attr_destroy(&attr);
+        if (r != 0) {
+            return osErrorResource;
+        }
+
+        started = true;
+        return osOK;
+    }
+
+    osStatus join()
+    {
+        if (started) {
+            pthread_join(thread, NULL);
+            started = false;
+        }
+        return osOK;
+    }
+
+private:
+    uint32_t stack_size;
+    unsigned char* stack_mem;
+    bool started;
+    pthread_t thread;
+    Callback<void()> task;
+
+    static void* entry(void* _thread)
+    {
+        ((Thread*)_thread)->task();
+        return NULL;
+    }
+};
+
+class Mutex {
+
+public:
+    void lock()
+    {
+        mutex.lock();
+    }
+
+    bool trylock()
+    {
+        return mutex.try_lock();
+    }
+
+    void unlock()
+    {
+        mutex.unlock();
+    }
+
+private:
+    std::recursive_mutex mutex;
+};
+
+namespace Kernel {
+inline uint64_t get_ms_count()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+}
+
+namespace ThisThread {
+inline void sleep_for(uint32_t _ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = _ms / 1000;
+    ts.tv_nsec = (long)(_ms % 1000) * 1000000;
+    while (nanosleep(&ts, &ts) != 0) {
+    }
+}
+}
+
+// BlockDevice, the part IoTConnectOta uses. IoTConnectFileBlockDevice keeps one in a file.
+#define BD_ERROR_OK 0
+#define BD_ERROR_DEVICE_ERROR -4001
+
+typedef uint64_t bd_addr_t;
+typedef uint64_t bd_size_t;
+
+class BlockDevice {
+
+public:
+    virtual ~BlockDevice() {}
+
+    virtual int init() = 0;
+    virtual int deinit() = 0;
+    virtual int read(void* _buf, bd_addr_t _addr, bd_size_t _size) = 0;
+    virtual int program(const void* _buf, bd_addr_t _addr, bd_size_t _size) = 0;
+    virtual int erase(bd_addr_t _addr, bd_size_t _size) = 0;
+    virtual bd_size_t get_read_size() const = 0;
+    virtual bd_size_t get_program_size() const = 0;
+    virtual bd_size_t get_erase_size(bd_addr_t _addr) const = 0;
+    virtual bd_size_t size() const = 0;
+};
+
+// EventQueue, events run in the thread in dispatch(). call(), call_in() and
+// cancel() may be called from any thread. Event ids are never 0.
+class EventQueue {
+
+public:
+    EventQueue() :
+        next_id(1),
+        broken(false)
+    {
+
+    }
+
+    int call(Callback<void()> _func)
+    {
+        return call_in(0, _func);
+    }
+
+    int call_in(int _ms, Callback<void()> _func)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        int id = next_id++;
+
+        if (next_id <= 0) {
+            next_id = 1;
+        }
+        events.insert(std::make_pair(Kernel::get_ms_count() + (_ms > 0 ? _ms : 0), Event(id, _func)));
+        cond.notify_all();
+
+        return id;
+    }
+
+    bool cancel(int _id)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::multimap<uint64_t, Event>::iterator it;
+
+        for (it = events.begin(); it != events.end(); ++it) {
+            if (it->second.first == _id) {
+                events.erase(it);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Run events for _ms milliseconds, -1 until break_dispatch()
+    void dispatch(int _ms = -1)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t end = Kernel::get_ms_count() + (_ms > 0 ? _ms : 0);
+
+        while (!broken) {
+            uint64_t now = Kernel::get_ms_count();
+            uint64_t wake = end;
+
+            if (!events.empty() && events.begin()->first <= now) {
+                Callback<void()> func = events.begin()->second.second;
+
+                events.erase(events.begin());
+                lock.unlock();
+                func();
+                lock.lock();
+                continue;
+            }
+
+            if (_ms >= 0 && now >= end) {
+                break;
+            }
+
+            if (!events.empty() && (_ms < 0 || events.begin()->first < wake)) {
+                wake = events.begin()->first;
+            } else if (_ms < 0) {
+                cond.wait(lock);
+                continue;
+            }
+            cond.wait_for(lock, std::chrono::milliseconds(wake - now));
+        }
+        broken = false;
+    }
+
+    void dispatch_forever()
+    {
+        dispatch(-1);
+    }
+
+    void break_dispatch()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        broken = true;
+        cond.notify_all();
+    }
+
+private:
+    typedef std::pair<int, Callback<void()> > Event;
+
+    std::multimap<uint64_t, Event> events;
+    int next_id;
+    bool broken;
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+// Tracing, printed to stderr up to IOT_CONNECT_POSIX_TRACE_LEVEL
+#define TRACE_LEVEL_ERROR 0x02
+#define TRACE_LEVEL_WARN  0x04
+#define TRACE_LEVEL_INFO  0x08
+#define TRACE_LEVEL_DEBUG 0x10
+
+#ifndef MBED_TRACE_MAX_LEVEL
+#define MBED_TRACE_MAX_LEVEL TRACE_LEVEL_INFO
+#endif
+
+#ifndef IOT_CONNECT_POSIX_TRACE_LEVEL
+#define IOT_CONNECT_POSIX_TRACE_LEVEL TRACE_LEVEL_WARN
+#endif
+
+void iot_connect_posix_trace(int _level, const char* _group, const char* _fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#define IOT_CONNECT_POSIX_TRACE(level, ...) \
+    do { \
+        if ((level) <= IOT_CONNECT_POSIX_TRACE_LEVEL) { \
+            iot_connect_posix_trace(level, TRACE_GROUP, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define tr_error(...)   IOT_CONNECT_POSIX_TRACE(TRACE_LEVEL_ERROR, __VA_ARGS__)
+#define tr_err(...)     IOT_CONNECT_POSIX_TRACE(TRACE_LEVEL_ERROR, __VA_ARGS__)
+#define tr_warn(...)    IOT_CONNECT_POSIX_TRACE(TRACE_LEVEL_WARN, __VA_ARGS__)
+#define tr_warning(...) IOT_CONNECT_POSIX_TRACE(TRACE_LEVEL_WARN, __VA_ARGS__)
+#define tr_info(...)    IOT_CONNECT_POSIX_TRACE(TRACE_LEVEL_INFO, __VA_ARGS__)
+#define tr_debug(...)   IOT_CONNECT_POSIX_TRACE(TRACE_LEVEL_DEBUG, __VA_ARGS__)
+#define tr_array(buf, len) ((void)(buf), (void)(len))
+
+#endif
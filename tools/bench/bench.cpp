@@ -0,0 +1,507 @@
+// Microbenchmarks of the library's hot paths, see README.md
+
+#include <getopt.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "IoTConnectClient.h"
+
+
+#define TRACE_GROUP  "Bench"
+#define BENCH_MIN_TIME_MS 200
+#define BENCH_NAME_LEN 64
+#define BENCH_BASELINE_TOKENS_MAX 1024
+
+typedef struct {
+    char name[BENCH_NAME_LEN];
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+} BenchResult;
+
+static std::vector<BenchResult> results;
+static const char* filter = NULL;
+
+// Allocation accounting, glibc only, every malloc / calloc / realloc is an allocation
+static size_t alloc_count;
+static size_t alloc_bytes;
+
+#if defined(__GLIBC__)
+extern "C" {
+void* __libc_malloc(size_t _size);
+void* __libc_calloc(size_t _num, size_t _size);
+void* __libc_realloc(void* _ptr, size_t _size);
+void __libc_free(void* _ptr);
+
+void* malloc(size_t _size)
+{
+    alloc_count++;
+    alloc_bytes += _size;
+    return __libc_malloc(_size);
+}
+
+void* calloc(size_t _num, size_t _size)
+{
+    alloc_count++;
+    alloc_bytes += _num * _size;
+    return __libc_calloc(_num, _size);
+}
+
+void* realloc(void* _ptr, size_t _size)
+{
+    alloc_count++;
+    alloc_bytes += _size;
+    return __libc_realloc(_ptr, _size);
+}
+
+void free(void* _ptr)
+{
+    __libc_free(_ptr);
+}
+}
+#endif
+
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Run _op in growing batches until it takes BENCH_MIN_TIME_MS
+template <typename F>
+static void bench(const char* _name, F _op)
+{
+    BenchResult r;
+    uint64_t ops = 1;
+    uint64_t elapsed;
+    size_t count;
+    size_t bytes;
+    uint64_t i;
+
+    if (filter && !strstr(_name, filter)) {
+        return;
+    }
+
+    // warm up
+    for (i = 0; i < 16; i++) {
+        _op();
+    }
+
+    while (1) {
+        uint64_t start;
+
+        count = alloc_count;
+        bytes = alloc_bytes;
+        start = now_ns();
+        for (i = 0; i < ops; i++) {
+            _op();
+        }
+        elapsed = now_ns() - start;
+        count = alloc_count - count;
+        bytes = alloc_bytes - bytes;
+
+        if (elapsed >= (uint64_t)BENCH_MIN_TIME_MS * 1000000) {
+            break;
+        }
+        ops = elapsed > 0 ? ops * 2 + ops * (uint64_t)BENCH_MIN_TIME_MS * 1000000 / elapsed / 2 : ops * 10;
+    }
+
+    snprintf(r.name, sizeof(r.name), "%s", _name);
+    r.ns_per_op = (double)elapsed / ops;
+    r.allocs_per_op = (double)count / ops;
+    r.bytes_per_op = (double)bytes / ops;
+    results.push_back(r);
+
+    printf("%-36s %12.1f ns/op %8.2f allocs/op %10.1f B/op\n", r.name, r.ns_per_op, r.allocs_per_op, r.bytes_per_op);
+}
+
+static const char* const prop_keys[] = {"p0", "p1", "p2", "p3", "p4", "p5", "p6", "p7", "p8", "p9"};
+static const int props_nums[] = {1, 4, IOT_CONNECT_PROPERTYS_MAX};
+static const size_t value_lens[] = {8, 64, 512};
+
+// int / string / bool in turn
+static void add_props(IoTConnectProperty* _p, std::vector<IoTConnectStringProperty*>* _props, int _num)
+{
+    int i;
+
+    for (i = 0; i < _num; i++) {
+        IoTConnectStringProperty* prop;
+
+        switch (i % 3) {
+            case 0:
+                prop = new IoTConnectIntProperty(prop_keys[i], i * 100);
+                _p->add((IoTConnectIntProperty*)prop);
+                break;
+            case 1:
+                prop = new IoTConnectStringProperty(prop_keys[i], (const char*)NULL);
+                prop->set_value("value of a string");
+                _p->add(prop);
+                break;
+            default:
+                prop = new IoTConnectBoolProperty(prop_keys[i], true);
+                _p->add((IoTConnectBoolProperty*)prop);
+                break;
+        }
+        _props->push_back(prop);
+    }
+}
+
+static void free_props(std::vector<IoTConnectStringProperty*>* _props)
+{
+    size_t i;
+
+    for (i = 0; i < _props->size(); i++) {
+        delete (*_props)[i];
+    }
+    _props->clear();
+}
+
+// {"p0":N,"p1":"...","p2":true|false,...}
+static std::string make_update_json(int _num, int _seed)
+{
+    std::string js = "{";
+    char buf[64];
+    int i;
+
+    for (i = 0; i < _num; i++) {
+        switch (i % 3) {
+            case 0:
+                snprintf(buf, sizeof(buf), "\"%s\":%d", prop_keys[i], _seed + i);
+                break;
+            case 1:
+                snprintf(buf, sizeof(buf), "\"%s\":\"value %d\"", prop_keys[i], _seed + i);
+                break;
+            default:
+                snprintf(buf, sizeof(buf), "\"%s\":%s", prop_keys[i], ((_seed + i) & 1) ? "true" : "false");
+                break;
+        }
+        if (i > 0) {
+            js += ",";
+        }
+        js += buf;
+    }
+    js += "}";
+
+    return js;
+}
+
+static void bench_string_set_value()
+{
+    char name[BENCH_NAME_LEN];
+    size_t i;
+
+    for (i = 0; i < sizeof(value_lens) / sizeof(value_lens[0]); i++) {
+        IoTConnectStringProperty prop("s", (const char*)NULL);
+        std::string a(value_lens[i], 'a');
+        std::string b(value_lens[i], 'b');
+        bool flip = false;
+
+        snprintf(name, sizeof(name), "string_set_value/len=%zu", value_lens[i]);
+        bench(name, [&]() {
+            flip = !flip;
+            prop.set_value(flip ? a.c_str() : b.c_str(), value_lens[i]);
+        });
+    }
+}
+
+static void bench_to_json()
+{
+    char name[BENCH_NAME_LEN];
+    size_t i;
+
+    for (i = 0; i < sizeof(props_nums) / sizeof(props_nums[0]); i++) {
+        IoTConnectProperty p;
+        std::vector<IoTConnectStringProperty*> props;
+        const char* json;
+
+        add_props(&p, &props, props_nums[i]);
+
+        snprintf(name, sizeof(name), "to_json/props=%d", props_nums[i]);
+        bench(name, [&]() {
+            p.to_json(&json);
+        });
+
+        free_props(&props);
+    }
+}
+
+static void bench_update()
+{
+    char name[BENCH_NAME_LEN];
+    size_t i;
+
+    for (i = 0; i < sizeof(props_nums) / sizeof(props_nums[0]); i++) {
+        IoTConnectProperty p;
+        std::vector<IoTConnectStringProperty*> props;
+        // every update changes all properties
+        std::string a = make_update_json(props_nums[i], 1);
+        std::string b = make_update_json(props_nums[i], 2);
+        bool flip = false;
+
+        add_props(&p, &props, props_nums[i]);
+
+        snprintf(name, sizeof(name), "update/props=%d", props_nums[i]);
+        bench(name, [&]() {
+            flip = !flip;
+            p.update(flip ? a.c_str() : b.c_str());
+        });
+
+        free_props(&props);
+    }
+}
+
+static void bench_topic_matched()
+{
+    static const char topic[] = "devices/617449FD62B649E7AD1050DB4E95096E-led3/messages/devicebound/%24.to=%2Fdevices%2Fled3";
+    static const char exact[] = "devices/617449FD62B649E7AD1050DB4E95096E-led3/messages/devicebound/%24.to=%2Fdevices%2Fled3";
+    static const char wildcard[] = "devices/617449FD62B649E7AD1050DB4E95096E-led3/messages/devicebound/#";
+    static const char other[] = "devices/617449FD62B649E7AD1050DB4E95096E-led2/messages/devicebound/#";
+    MQTTString name = MQTTString_initializer;
+    volatile bool matched;
+
+    name.lenstring.data = (char*)topic;
+    name.lenstring.len = sizeof(topic) - 1;
+
+    bench("topic_matched/exact", [&]() {
+        matched = mqtt_is_topic_matched(exact, name);
+    });
+    bench("topic_matched/wildcard", [&]() {
+        matched = mqtt_is_topic_matched(wildcard, name);
+    });
+    bench("topic_matched/miss", [&]() {
+        matched = mqtt_is_topic_matched(other, name);
+    });
+    (void)matched;
+}
+
+// Never connected, pub() only queues
+class NullNetwork : public IoTConnectNetwork {
+
+public:
+    int set_root_ca_cert(const char* _root_ca_pem) { return 0; }
+    int set_client_cert_key(const char* _cert_pem, const char* _key_pem) { return 0; }
+    int connect(const char* _host_name, uint16_t _port, int _timeout_ms) { return 0; }
+    int disconnect() { return 0; }
+    int read(unsigned char* _buf, int _len, int _timeout_ms) { return 0; }
+    int write(unsigned char* _buf, int _len, int _timeout_ms) { return _len; }
+};
+
+static void bench_pub()
+{
+    static const size_t payload_lens[] = {64, 512};
+    char name[BENCH_NAME_LEN];
+    IoTConnectEntry entry("Bench", "BENCH");
+    size_t i;
+
+    // the device builds its user name from the host
+    entry.set_mqtt("localhost", 8883);
+
+    IoTConnectDevice device("dev", "dev", "pwd", &entry);
+    NullNetwork network;
+    IoTConnectClient client(&network, &device);
+
+    for (i = 0; i < sizeof(payload_lens) / sizeof(payload_lens[0]); i++) {
+        std::string payload(payload_lens[i], 'x');
+        MQTT::Message msg;
+
+        msg.qos = MQTT::QOS0;
+        msg.retained = false;
+        msg.dup = false;
+        msg.id = 0;
+        msg.payload = (void*)payload.data();
+        msg.payloadlen = payload.size();
+
+        // enqueue, then dequeue and release as the main loop does after publishing
+        snprintf(name, sizeof(name), "pub_enqueue_dequeue/payload=%zu", payload_lens[i]);
+        bench(name, [&]() {
+            IoTConnectPubMsg* pub_msg = NULL;
+
+            client.pub(&msg);
+            client.pubs.pop(pub_msg);
+            free(pub_msg->msg.payload);
+            free(pub_msg);
+        });
+    }
+}
+
+static int save_results(const char* _path)
+{
+    FILE* f = fopen(_path, "w");
+    size_t i;
+
+    if (!f) {
+        printf("could not write %s\n", _path);
+        return -1;
+    }
+
+    // one benchmark a line
+    fprintf(f, "{\"benchmarks\":[\n");
+    for (i = 0; i < results.size(); i++) {
+        fprintf(f, "{\"name\":\"%s\",\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,\"bytes_per_op\":%.1f}%s\n",
+                results[i].name, results[i].ns_per_op, results[i].allocs_per_op, results[i].bytes_per_op,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+
+    return 0;
+}
+
+static const BenchResult* find_result(const char* _name, size_t _len)
+{
+    size_t i;
+
+    for (i = 0; i < results.size(); i++) {
+        if (strlen(results[i].name) == _len && strncmp(results[i].name, _name, _len) == 0) {
+            return &results[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the number of regressions, or -1 if the baseline could not be read
+static int compare_baseline(const char* _path, double _tolerance)
+{
+    std::string js;
+    char buf[512];
+    size_t n;
+    FILE* f = fopen(_path, "r");
+    jsmn_parser parser;
+    std::vector<jsmntok_t> tokens(BENCH_BASELINE_TOKENS_MAX);
+    int tokens_num;
+    int regressions = 0;
+    int i;
+
+    if (!f) {
+        printf("could not read baseline %s\n", _path);
+        return -1;
+    }
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        js.append(buf, n);
+    }
+    fclose(f);
+
+    jsmn_init(&parser);
+    tokens_num = jsmn_parse(&parser, js.c_str(), js.size(), tokens.data(), tokens.size());
+    if (tokens_num < 0) {
+        printf("could not parse baseline %s\n", _path);
+        return -1;
+    }
+
+    printf("\n%-36s %12s %12s %8s %8s\n", "vs baseline", "ns/op", "base", "allocs", "base");
+
+    // every object with a "name" is a benchmark, its fields follow as key / value tokens
+    for (i = 0; i < tokens_num; i++) {
+        const jsmntok_t* obj = &tokens[i];
+        const char* name = NULL;
+        size_t name_len = 0;
+        double base_ns = 0;
+        double base_allocs = 0;
+        double base_bytes = 0;
+        const BenchResult* r;
+        bool regressed = false;
+        int k;
+
+        if (obj->type != JSMN_OBJECT || i + 2 * obj->size >= tokens_num) {
+            continue;
+        }
+
+        for (k = 0; k < obj->size; k++) {
+            const jsmntok_t* key = &tokens[i + 1 + 2 * k];
+            const jsmntok_t* val = &tokens[i + 2 + 2 * k];
+            std::string key_str(js, key->start, key->end - key->start);
+            double v = atof(js.c_str() + val->start);
+
+            if (key_str == "name") {
+                name = js.c_str() + val->start;
+                name_len = val->end - val->start;
+            } else if (key_str == "ns_per_op") {
+                base_ns = v;
+            } else if (key_str == "allocs_per_op") {
+                base_allocs = v;
+            } else if (key_str == "bytes_per_op") {
+                base_bytes = v;
+            }
+        }
+
+        if (!name) {
+            continue;
+        }
+
+        r = find_result(name, name_len);
+        if (!r) {
+            continue;
+        }
+
+        // time is noisy, allocations are not
+        if (r->ns_per_op > base_ns * (1 + _tolerance / 100)) {
+            regressed = true;
+        }
+        if (r->allocs_per_op > base_allocs + 0.01 || r->bytes_per_op > base_bytes + 0.5) {
+            regressed = true;
+        }
+        if (regressed) {
+            regressions++;
+        }
+
+        printf("%-36s %12.1f %12.1f %8.2f %8.2f %s\n", r->name, r->ns_per_op, base_ns,
+               r->allocs_per_op, base_allocs, regressed ? "REGRESSED" : "");
+    }
+
+    return regressions;
+}
+
+static void usage(const char* _prog)
+{
+    printf("usage: %s [options]\n"
+           "  -f filter         only run benchmarks whose name contains filter\n"
+           "  -o file           write results as json\n"
+           "  -b file           compare with a baseline written by -o, exit 1 on regressions\n"
+           "  -t percent        ns/op tolerance against the baseline (10)\n", _prog);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* out = NULL;
+    const char* baseline = NULL;
+    double tolerance = 10;
+    int c;
+
+    while ((c = getopt(argc, argv, "f:o:b:t:h")) != -1) {
+        switch (c) {
+            case 'f': filter = optarg; break;
+            case 'o': out = optarg; break;
+            case 'b': baseline = optarg; break;
+            case 't': tolerance = atof(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+#if !defined(__GLIBC__)
+    printf("allocations are not counted without glibc\n");
+#endif
+
+    bench_string_set_value();
+    bench_to_json();
+    bench_update();
+    bench_topic_matched();
+    bench_pub();
+
+    if (out && save_results(out) != 0) {
+        return 1;
+    }
+
+    if (baseline) {
+        int regressions = compare_baseline(baseline, tolerance);
+        if (regressions < 0) {
+            return 1;
+        }
+        if (regressions > 0) {
+            printf("%d regression(s) against %s\n", regressions, baseline);
+            return 1;
+        }
+    }
+
+    return 0;
+}
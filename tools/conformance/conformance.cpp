@@ -0,0 +1,601 @@
+// MQTT conformance run of IoTConnectMqttSession against a real broker, e.g. mosquitto.
+// See README.md for the build and the options.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+#include "IoTConnectMqttSession.h"
+#include "IoTConnectNetworkPosix.h"
+#include "MQTTPacket.h"
+
+
+#define TRACE_GROUP  "Conformance"
+#define CONF_TIMEOUT_MS 5000
+// to wait for a message, and then for one that shouldn't come
+#define CONF_WAIT_MS 2000
+#define CONF_QUIET_MS 500
+#define CONF_STREAM_CHUNK 100
+
+typedef struct {
+    const char* host;
+    int port;
+    const char* ca_path;
+    const char* user;
+    const char* pwd;
+    // 4 for 3.1.1, 5, or 0 for both
+    int version;
+} ConfOptions;
+
+// Plain TCP, for a broker's 1883 listener
+class TcpNetwork : public IoTConnectNetwork {
+
+public:
+    TcpNetwork() :
+        fd(-1)
+    {
+
+    }
+
+    ~TcpNetwork()
+    {
+        disconnect();
+    }
+
+    int set_root_ca_cert(const char* _root_ca_pem)
+    {
+        return 0;
+    }
+
+    int set_client_cert_key(const char* _cert_pem, const char* _key_pem)
+    {
+        return 0;
+    }
+
+    int connect(const char* _host_name, uint16_t _port, int _timeout_ms)
+    {
+        struct addrinfo hints;
+        struct addrinfo* addrs;
+        struct addrinfo* ai;
+        char port[8];
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(port, sizeof(port), "%u", _port);
+        if (getaddrinfo(_host_name, port, &hints, &addrs) != 0) {
+            return IOT_CONNECT_ERROR_NS_DNS_FAILURE;
+        }
+
+        for (ai = addrs; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(addrs);
+
+        if (fd < 0) {
+            return IOT_CONNECT_ERROR_NS_NO_CONNECTION;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        return 0;
+    }
+
+    int disconnect()
+    {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+
+        return 0;
+    }
+
+    int read(unsigned char* _buf, int _len, int _timeout_ms)
+    {
+        uint64_t deadline = Kernel::get_ms_count() + _timeout_ms;
+        int got = 0;
+
+        if (fd < 0) {
+            return IOT_CONNECT_ERROR_NS_NO_SOCKET;
+        }
+
+        while (got < _len) {
+            ssize_t ret = recv(fd, _buf + got, _len - got, 0);
+            uint64_t now;
+
+            if (ret > 0) {
+                got += ret;
+                continue;
+            }
+            if (ret == 0) {
+                return IOT_CONNECT_ERROR_NS_CONNECTION_LOST;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return IOT_CONNECT_ERROR_NS_CONNECTION_LOST;
+            }
+
+            now = Kernel::get_ms_count();
+            if (now >= deadline || wait_fd(POLLIN, (int)(deadline - now)) <= 0) {
+                break;
+            }
+        }
+
+        return got;
+    }
+
+    int write(unsigned char* _buf, int _len, int _timeout_ms)
+    {
+        uint64_t deadline = Kernel::get_ms_count() + _timeout_ms;
+        int sent = 0;
+
+        if (fd < 0) {
+            return IOT_CONNECT_ERROR_NS_NO_SOCKET;
+        }
+
+        while (sent < _len) {
+            ssize_t ret = send(fd, _buf + sent, _len - sent, MSG_NOSIGNAL);
+            uint64_t now;
+
+            if (ret > 0) {
+                sent += ret;
+                continue;
+            }
+            if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return IOT_CONNECT_ERROR_NS_CONNECTION_LOST;
+            }
+
+            now = Kernel::get_ms_count();
+            if (now >= deadline || wait_fd(POLLOUT, (int)(deadline - now)) <= 0) {
+                break;
+            }
+        }
+
+        return sent;
+    }
+
+private:
+    int fd;
+
+private:
+    int wait_fd(short _events, int _timeout_ms)
+    {
+        struct pollfd pfd;
+        int ret;
+
+        pfd.fd = fd;
+        pfd.events = _events;
+        pfd.revents = 0;
+        do {
+            ret = poll(&pfd, 1, _timeout_ms);
+        } while (ret < 0 && errno == EINTR);
+
+        return ret;
+    }
+};
+
+// Passes a transport through, optionally swallowing the PUBRECs written, so the
+// broker keeps a QoS2 message unacknowledged and sends it again on reconnect
+class AckDropper : public IoTConnectNetwork {
+
+public:
+    bool drop_pubrec;
+    int pubrecs;
+    int pubcomps;
+
+public:
+    AckDropper(IoTConnectNetwork* _network) :
+        drop_pubrec(false),
+        pubrecs(0),
+        pubcomps(0),
+        network(_network)
+    {
+
+    }
+
+    int set_root_ca_cert(const char* _root_ca_pem)
+    {
+        return network->set_root_ca_cert(_root_ca_pem);
+    }
+
+    int set_client_cert_key(const char* _cert_pem, const char* _key_pem)
+    {
+        return network->set_client_cert_key(_cert_pem, _key_pem);
+    }
+
+    int connect(const char* _host_name, uint16_t _port, int _timeout_ms)
+    {
+        return network->connect(_host_name, _port, _timeout_ms);
+    }
+
+    int disconnect()
+    {
+        return network->disconnect();
+    }
+
+    int read(unsigned char* _buf, int _len, int _timeout_ms)
+    {
+        return network->read(_buf, _len, _timeout_ms);
+    }
+
+    int write(unsigned char* _buf, int _len, int _timeout_ms)
+    {
+        // the session writes an ack in one go
+        if (_len == 4 && (_buf[0] >> 4) == PUBREC) {
+            pubrecs++;
+            if (drop_pubrec) {
+                return _len;
+            }
+        } else if (_len == 4 && (_buf[0] >> 4) == PUBCOMP) {
+            pubcomps++;
+        }
+
+        return network->write(_buf, _len, _timeout_ms);
+    }
+
+private:
+    IoTConnectNetwork* network;
+};
+
+typedef struct {
+    std::string topic;
+    std::string payload;
+    int qos;
+} ConfMessage;
+
+static void on_message(MQTT::MessageData& _data, void* _context)
+{
+    std::vector<ConfMessage>* inbox = (std::vector<ConfMessage>*)_context;
+    ConfMessage m;
+
+    m.topic.assign(_data.topicName.lenstring.data, _data.topicName.lenstring.len);
+    m.payload.assign((const char*)_data.message.payload, _data.message.payloadlen);
+    m.qos = _data.message.qos;
+    inbox->push_back(m);
+}
+
+// A client of the broker, its transport and session
+class ConfPeer {
+
+public:
+    AckDropper tap;
+    IoTConnectMqttSession session;
+    std::vector<ConfMessage> inbox;
+
+public:
+    // network is set by new_network() as tap is made
+    ConfPeer(const ConfOptions* _opt, const char* _name, int _version) :
+        tap(new_network(_opt)),
+        session(tap, CONF_TIMEOUT_MS),
+        opt(_opt),
+        version(_version)
+    {
+        snprintf(client_id, sizeof(client_id), "iotc-conf-%s-%d", _name, (int)getpid());
+    }
+
+    ~ConfPeer()
+    {
+        if (session.is_connected()) {
+            session.disconnect();
+        }
+        tap.disconnect();
+        delete network;
+    }
+
+    int connect(bool _clean, int _keepalive_s)
+    {
+        MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+        int rc = tap.connect(opt->host, opt->port, CONF_TIMEOUT_MS);
+
+        if (rc != 0) {
+            return rc;
+        }
+
+        data.MQTTVersion = version;
+        data.clientID.cstring = client_id;
+        data.cleansession = _clean;
+        data.keepAliveInterval = _keepalive_s;
+        if (opt->user) {
+            data.username.cstring = (char*)opt->user;
+        }
+        if (opt->pwd) {
+            data.password.cstring = (char*)opt->pwd;
+        }
+
+        return session.connect(data);
+    }
+
+    void close()
+    {
+        if (session.is_connected()) {
+            session.disconnect();
+        }
+        tap.disconnect();
+    }
+
+    // Yield until _count messages came, then a while longer for any extra
+    size_t wait_inbox(size_t _count)
+    {
+        uint64_t end = Kernel::get_ms_count() + CONF_WAIT_MS;
+
+        while (inbox.size() < _count && Kernel::get_ms_count() < end && session.is_connected()) {
+            session.yield(50);
+        }
+        yield_for(CONF_QUIET_MS);
+
+        return inbox.size();
+    }
+
+    void yield_for(int _ms)
+    {
+        uint64_t end = Kernel::get_ms_count() + _ms;
+
+        while (Kernel::get_ms_count() < end && session.is_connected()) {
+            session.yield(50);
+        }
+    }
+
+private:
+    IoTConnectNetwork* network;
+    const ConfOptions* opt;
+    int version;
+    char client_id[48];
+
+private:
+    IoTConnectNetwork* new_network(const ConfOptions* _opt)
+    {
+        if (_opt->ca_path) {
+            IoTConnectNetworkPosix* tls = new IoTConnectNetworkPosix();
+            std::string pem;
+            FILE* f = fopen(_opt->ca_path, "rb");
+            char buf[512];
+            size_t n;
+
+            if (f) {
+                while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+                    pem.append(buf, n);
+                }
+                fclose(f);
+            }
+            tls->set_root_ca_cert(pem.c_str());
+            network = tls;
+        } else {
+            network = new TcpNetwork();
+        }
+
+        return network;
+    }
+};
+
+static int checks;
+static int failures;
+
+static bool check(const char* _name, bool _ok, const char* _detail = "")
+{
+    checks++;
+    if (!_ok) {
+        failures++;
+    }
+    printf("  %-40s %s %s\n", _name, _ok ? "pass" : "FAIL", _ok ? "" : _detail);
+
+    return _ok;
+}
+
+static int publish(ConfPeer* _peer, const std::string& _topic, const char* _payload, int _qos, bool _fixed_topic = false)
+{
+    MQTT::Message msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.qos = (MQTT::QoS)_qos;
+    msg.payload = (void*)_payload;
+    msg.payloadlen = strlen(_payload);
+
+    return _peer->session.publish(_topic.c_str(), msg, 0, _fixed_topic);
+}
+
+static int publish_stream(ConfPeer* _peer, const std::string& _topic, size_t _len)
+{
+    MQTT::Message msg;
+    size_t off = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.qos = MQTT::QOS1;
+    msg.payloadlen = _len;
+
+    // a byte pattern, a chunk at a time
+    return _peer->session.publish_stream(_topic.c_str(), msg, [&off](unsigned char* _buf, int _len) -> int {
+        int n = _len < CONF_STREAM_CHUNK ? _len : CONF_STREAM_CHUNK;
+        int i;
+
+        for (i = 0; i < n; i++) {
+            _buf[i] = 'a' + (off + i) % 26;
+        }
+        off += n;
+        return n;
+    });
+}
+
+static void run(const ConfOptions* _opt, int _version)
+{
+    char prefix[64];
+    char detail[96];
+    std::string filter;
+    std::string pattern;
+    size_t i;
+    int q;
+
+    printf("MQTT %s\n", _version == IOT_CONNECT_MQTT5_VERSION ? "5" : "3.1.1");
+    snprintf(prefix, sizeof(prefix), "iotc-conf/%d/v%d/", (int)getpid(), _version);
+    filter = std::string(prefix) + "#";
+
+    ConfPeer sub(_opt, "sub", _version);
+    ConfPeer pub(_opt, "pub", _version);
+    int rc_sub = sub.connect(true, 60);
+    int rc_pub = pub.connect(true, 60);
+
+    snprintf(detail, sizeof(detail), "%d / %d", rc_sub, rc_pub);
+    if (!check("connect", rc_sub == MQTT::SUCCESS && rc_pub == MQTT::SUCCESS, detail)) {
+        return;
+    }
+    if (!check("subscribe QoS2", sub.session.subscribe(filter.c_str(), MQTT::QOS2, on_message, &sub.inbox) ==
+               MQTT::SUCCESS)) {
+        return;
+    }
+
+    // each QoS once, at the publisher's QoS
+    for (q = 0; q <= 2; q++) {
+        char name[40];
+        char payload[8];
+        int rc;
+
+        snprintf(name, sizeof(name), "QoS%d publish delivered once", q);
+        snprintf(payload, sizeof(payload), "q%d", q);
+        sub.inbox.clear();
+        rc = publish(&pub, std::string(prefix) + payload, payload, q);
+        sub.wait_inbox(1);
+        snprintf(detail, sizeof(detail), "publish %d, %d received", rc, (int)sub.inbox.size());
+        check(name, rc == MQTT::SUCCESS && sub.inbox.size() == 1 && sub.inbox[0].payload == payload &&
+              sub.inbox[0].qos == q && sub.inbox[0].topic == std::string(prefix) + payload, detail);
+    }
+
+    // a topic alias with MQTT 5 after the first one
+    sub.inbox.clear();
+    for (i = 0; i < 3; i++) {
+        publish(&pub, std::string(prefix) + "alias", i == 0 ? "0" : i == 1 ? "1" : "2", 1, true);
+    }
+    sub.wait_inbox(3);
+    snprintf(detail, sizeof(detail), "%d received", (int)sub.inbox.size());
+    check("same topic 3 times", sub.inbox.size() == 3 && sub.inbox[0].topic == std::string(prefix) + "alias" &&
+          sub.inbox[2].topic == sub.inbox[0].topic && sub.inbox[2].payload == "2", detail);
+
+    // a streamed payload in chunks, and one larger than the send buffer
+    sub.inbox.clear();
+    for (i = 0; i < 600; i++) {
+        pattern += (char)('a' + i % 26);
+    }
+    {
+        // nobody reads the large one, it's beyond the receive buffer
+        int rc = publish_stream(&pub, std::string(prefix) + "stream", pattern.size());
+
+        sub.wait_inbox(1);
+        snprintf(detail, sizeof(detail), "publish %d, %d received", rc, (int)sub.inbox.size());
+        check("stream publish delivered", rc == MQTT::SUCCESS && sub.inbox.size() == 1 &&
+              sub.inbox[0].payload == pattern, detail);
+
+        rc = publish_stream(&pub, std::string(prefix, strlen(prefix) - 1) + "-big", 3 * IOT_CONNECT_MQTT_MAX_PACKET_SIZE);
+        snprintf(detail, sizeof(detail), "publish %d", rc);
+        check("stream publish over the buffer acked", rc == MQTT::SUCCESS, detail);
+    }
+
+    // keepalive pings while idle
+    {
+        ConfPeer idle(_opt, "idle", _version);
+        int rc = idle.connect(true, 1);
+
+        idle.yield_for(3500);
+        snprintf(detail, sizeof(detail), "connect %d, %u pings, %u timeouts", rc, (unsigned)idle.session.get_pings(),
+                 (unsigned)idle.session.get_ping_timeouts());
+        check("keepalive pings", rc == MQTT::SUCCESS && idle.session.is_connected() &&
+              idle.session.get_pings() >= 2 && idle.session.get_ping_timeouts() == 0, detail);
+    }
+
+    // a QoS2 message sent again after a reconnect, its PUBREC lost. MQTT 5 sessions
+    // end at disconnect without a session expiry, which the session doesn't send.
+    if (_version != IOT_CONNECT_MQTT5_VERSION) {
+        ConfPeer dup(_opt, "dup", _version);
+        std::string topic = std::string(prefix) + "dup/x";
+        // the session keeps the filter
+        std::string dup_filter = std::string(prefix) + "dup/#";
+        int rc;
+
+        // start from no session
+        dup.connect(true, 60);
+        dup.close();
+        rc = dup.connect(false, 60);
+        if (rc == MQTT::SUCCESS) {
+            rc = dup.session.subscribe(dup_filter.c_str(), MQTT::QOS2, on_message, &dup.inbox);
+        }
+        dup.tap.drop_pubrec = true;
+        if (rc == MQTT::SUCCESS) {
+            rc = publish(&pub, topic, "once", 2);
+        }
+        dup.wait_inbox(1);
+        dup.close();
+        dup.tap.drop_pubrec = false;
+        dup.tap.pubrecs = 0;
+        if (rc == MQTT::SUCCESS) {
+            rc = dup.connect(false, 60);
+        }
+        dup.yield_for(CONF_WAIT_MS);
+        snprintf(detail, sizeof(detail), "rc %d, %d received, %d PUBRECs and %d PUBCOMPs after reconnect", rc,
+                 (int)dup.inbox.size(), dup.tap.pubrecs, dup.tap.pubcomps);
+        check("QoS2 retransmit not delivered again", rc == MQTT::SUCCESS && dup.inbox.size() == 1 &&
+              dup.tap.pubrecs >= 1 && dup.tap.pubcomps >= 1, detail);
+        dup.close();
+        dup.connect(true, 60);
+    }
+
+    sub.inbox.clear();
+    check("unsubscribe", sub.session.unsubscribe(filter.c_str()) == MQTT::SUCCESS);
+    publish(&pub, std::string(prefix) + "after", "after", 1);
+    sub.yield_for(CONF_QUIET_MS);
+    snprintf(detail, sizeof(detail), "%d received", (int)sub.inbox.size());
+    check("nothing after unsubscribe", sub.inbox.empty(), detail);
+
+    check("disconnect", sub.session.disconnect() == MQTT::SUCCESS && pub.session.disconnect() == MQTT::SUCCESS);
+}
+
+static void usage(const char* _prog)
+{
+    printf("usage: %s [options]\n"
+           "  -H host           broker host (localhost)\n"
+           "  -p port           broker port (1883, 8883 with -c)\n"
+           "  -c ca.pem         TLS with this root CA, plain TCP without\n"
+           "  -u user           user name\n"
+           "  -P password       password\n"
+           "  -v version        4 for 3.1.1, 5, 0 for both (0)\n", _prog);
+}
+
+int main(int argc, char* argv[])
+{
+    ConfOptions opt = {"localhost", 0, NULL, NULL, NULL, 0};
+    int c;
+
+    while ((c = getopt(argc, argv, "H:p:c:u:P:v:h")) != -1) {
+        switch (c) {
+            case 'H': opt.host = optarg; break;
+            case 'p': opt.port = atoi(optarg); break;
+            case 'c': opt.ca_path = optarg; break;
+            case 'u': opt.user = optarg; break;
+            case 'P': opt.pwd = optarg; break;
+            case 'v': opt.version = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (opt.port == 0) {
+        opt.port = opt.ca_path ? 8883 : 1883;
+    }
+
+    printf("broker               %s:%d%s\n", opt.host, opt.port, opt.ca_path ? " over TLS" : "");
+    if (opt.version != IOT_CONNECT_MQTT5_VERSION) {
+        run(&opt, 4);
+    }
+    if (opt.version != 4) {
+        run(&opt, IOT_CONNECT_MQTT5_VERSION);
+    }
+    printf("%d of %d checks passed\n", checks - failures, checks);
+
+    return failures ? 1 : 0;
+}
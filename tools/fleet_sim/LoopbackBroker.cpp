@@ -0,0 +1,601 @@
+#include <chrono>
+#include "LoopbackBroker.h"
+#include "IoTConnectError.h"
+#include "IoTConnectMqtt5.h"
+#include "MQTTPacket.h"
+
+
+#define TRACE_GROUP  "LoopbackBroker"
+#define LOOPBACK_SUB_FILTERS_MAX 8
+// given to MQTT 5 clients in CONNACK
+#define LOOPBACK_RECEIVE_MAX 16
+#define LOOPBACK_TOPIC_ALIAS_MAX 8
+
+LoopbackBroker::LoopbackBroker() :
+    on_publish(NULL),
+    accept_rate(0),
+    accept_window_ms(0),
+    accept_num(0),
+    connects(0),
+    refused(0),
+    publishes(0),
+    publish_bytes(0)
+{
+
+}
+
+void LoopbackBroker::set_accept_rate(int _per_s)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    accept_rate = _per_s;
+}
+
+bool LoopbackBroker::accept()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t now = Kernel::get_ms_count();
+
+    if (accept_rate > 0) {
+        if (now - accept_window_ms >= 1000) {
+            accept_window_ms = now;
+            accept_num = 0;
+        }
+        if (accept_num >= accept_rate) {
+            refused++;
+            return false;
+        }
+        accept_num++;
+    }
+
+    connects++;
+    return true;
+}
+
+void LoopbackBroker::attach(const std::string& _client_id, LoopbackNetwork* _net)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    sessions[_client_id] = _net;
+}
+
+void LoopbackBroker::detach(LoopbackNetwork* _net)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, LoopbackNetwork*>::iterator it = sessions.find(_net->client_id);
+
+    if (it != sessions.end() && it->second == _net) {
+        sessions.erase(it);
+    }
+}
+
+void LoopbackBroker::drop_all()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, LoopbackNetwork*>::iterator it;
+
+    for (it = sessions.begin(); it != sessions.end(); ++it) {
+        it->second->drop();
+    }
+    sessions.clear();
+}
+
+bool LoopbackBroker::publish(const char* _client_id, const char* _topic, const char* _payload, int _len)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<std::string, LoopbackNetwork*>::iterator it = sessions.find(_client_id);
+    MQTTString topic = MQTTString_initializer;
+    std::vector<unsigned char> buf(_len + strlen(_topic) + 16);
+    int len;
+
+    if (it == sessions.end()) {
+        return false;
+    }
+
+    topic.cstring = (char*)_topic;
+    if (it->second->v5) {
+        // QoS0 and no properties
+        unsigned char* p = buf.data();
+        int topic_len = strlen(_topic);
+
+        *p++ = PUBLISH << 4;
+        p = iot_connect_mqtt5_write_vbi(p, 2 + topic_len + 1 + _len);
+        p = iot_connect_mqtt5_write_str(p, _topic, topic_len);
+        *p++ = 0;
+        memcpy(p, _payload, _len);
+        len = p + _len - buf.data();
+    } else {
+        len = MQTTSerialize_publish(buf.data(), buf.size(), 0, 0, 0, 0, topic, (unsigned char*)_payload, _len);
+    }
+    if (len <= 0) {
+        return false;
+    }
+
+    it->second->send(buf.data(), len);
+
+    return true;
+}
+
+uint64_t LoopbackBroker::get_connects() const
+{
+    return connects;
+}
+
+uint64_t LoopbackBroker::get_refused() const
+{
+    return refused;
+}
+
+uint64_t LoopbackBroker::get_publishes() const
+{
+    return publishes;
+}
+
+uint64_t LoopbackBroker::get_publish_bytes() const
+{
+    return publish_bytes;
+}
+
+LoopbackNetwork::LoopbackNetwork(LoopbackBroker* _broker) :
+    broker(_broker),
+    up(false),
+    v5(false),
+    tx_head(0)
+{
+
+}
+
+LoopbackNetwork::~LoopbackNetwork()
+{
+    disconnect();
+}
+
+int LoopbackNetwork::set_root_ca_cert(const char* _root_ca_pem)
+{
+    return 0;
+}
+
+int LoopbackNetwork::set_client_cert_key(const char* _cert_pem, const char* _key_pem)
+{
+    return 0;
+}
+
+int LoopbackNetwork::connect(const char* _host_name, uint16_t _port, int _timeout_ms)
+{
+    disconnect();
+
+    if (!broker->accept()) {
+        return IOT_CONNECT_ERROR_NS_NO_CONNECTION;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    up = true;
+    v5 = false;
+    rx.clear();
+    tx.clear();
+    tx_head = 0;
+
+    return 0;
+}
+
+int LoopbackNetwork::disconnect()
+{
+    drop();
+    broker->detach(this);
+
+    return 0;
+}
+
+void LoopbackNetwork::drop()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    up = false;
+    cond.notify_all();
+    if (sigio_func) {
+        sigio_func();
+    }
+}
+
+void LoopbackNetwork::send(const unsigned char* _buf, int _len)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (up) {
+        tx.insert(tx.end(), _buf, _buf + _len);
+        cond.notify_all();
+        if (sigio_func) {
+            sigio_func();
+        }
+    }
+}
+
+int LoopbackNetwork::sigio(Callback<void()> _func)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    sigio_func = _func;
+
+    return 0;
+}
+
+int LoopbackNetwork::read(unsigned char* _buf, int _len, int _timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(_timeout_ms);
+    int got = 0;
+
+    while (got < _len) {
+        size_t n = tx.size() - tx_head;
+
+        if (!up) {
+            return IOT_CONNECT_ERROR_NS_CONNECTION_LOST;
+        }
+
+        if (n > 0) {
+            if (n > (size_t)(_len - got)) {
+                n = _len - got;
+            }
+            memcpy(_buf + got, &tx[tx_head], n);
+            tx_head += n;
+            got += n;
+            if (tx_head == tx.size()) {
+                tx.clear();
+                tx_head = 0;
+            }
+            continue;
+        }
+
+        if (cond.wait_until(lock, deadline) == std::cv_status::timeout) {
+            break;
+        }
+    }
+
+    return got;
+}
+
+int LoopbackNetwork::write(unsigned char* _buf, int _len, int _timeout_ms)
+{
+    std::vector<std::vector<unsigned char> > packets;
+    size_t i;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t off = 0;
+
+        if (!up) {
+            return IOT_CONNECT_ERROR_NS_CONNECTION_LOST;
+        }
+
+        rx.insert(rx.end(), _buf, _buf + _len);
+
+        // split complete packets, by the remaining length in the fixed header
+        while (rx.size() - off >= 2) {
+            size_t rem_len = 0;
+            size_t multiplier = 1;
+            size_t pos = off + 1;
+            bool complete = false;
+
+            while (pos < rx.size() && pos - off <= 4) {
+                unsigned char c = rx[pos++];
+                rem_len += (c & 0x7F) * multiplier;
+                multiplier *= 128;
+                if (!(c & 0x80)) {
+                    complete = true;
+                    break;
+                }
+            }
+
+            if (!complete || rx.size() - pos < rem_len) {
+                break;
+            }
+
+            packets.push_back(std::vector<unsigned char>(rx.begin() + off, rx.begin() + pos + rem_len));
+            off = pos + rem_len;
+        }
+
+        rx.erase(rx.begin(), rx.begin() + off);
+    }
+
+    // locks are not held, handlers lock the broker then the session
+    for (i = 0; i < packets.size(); i++) {
+        handle_packet(packets[i].data(), packets[i].size());
+    }
+
+    return _len;
+}
+
+void LoopbackNetwork::handle_packet(unsigned char* _buf, int _len)
+{
+    unsigned char out[8 + 2 * LOOPBACK_SUB_FILTERS_MAX];
+    int len = 0;
+
+    if (handle_packet5(_buf, _len)) {
+        return;
+    }
+
+    switch (_buf[0] >> 4) {
+        case CONNECT:
+        {
+            MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+
+            if (MQTTDeserialize_connect(&data, _buf, _len) != 1) {
+                tr_error("Malformed CONNECT");
+                drop();
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                client_id.assign(data.clientID.lenstring.data, data.clientID.lenstring.len);
+            }
+            broker->attach(client_id, this);
+
+            len = MQTTSerialize_connack(out, sizeof(out), MQTT_CONNECTION_ACCEPTED, 0);
+            break;
+        }
+        case PUBLISH:
+        {
+            unsigned char dup;
+            int qos;
+            unsigned char retained;
+            unsigned short packet_id;
+            MQTTString topic;
+            unsigned char* payload;
+            int payload_len;
+
+            if (MQTTDeserialize_publish(&dup, &qos, &retained, &packet_id, &topic,
+                                        &payload, &payload_len, _buf, _len) != 1) {
+                tr_error("Malformed PUBLISH");
+                drop();
+                return;
+            }
+
+            broker->publishes++;
+            broker->publish_bytes += _len;
+            if (broker->on_publish) {
+                broker->on_publish(client_id.c_str(), (const char*)payload, payload_len);
+            }
+
+            if (qos == 1) {
+                len = MQTTSerialize_puback(out, sizeof(out), packet_id);
+            } else if (qos == 2) {
+                len = MQTTSerialize_ack(out, sizeof(out), PUBREC, 0, packet_id);
+            }
+            break;
+        }
+        case PUBREL:
+        {
+            unsigned char type;
+            unsigned char dup;
+            unsigned short packet_id;
+
+            if (MQTTDeserialize_ack(&type, &dup, &packet_id, _buf, _len) == 1) {
+                len = MQTTSerialize_ack(out, sizeof(out), PUBCOMP, 0, packet_id);
+            }
+            break;
+        }
+        case SUBSCRIBE:
+        {
+            unsigned char dup;
+            unsigned short packet_id;
+            int count = 0;
+            MQTTString filters[LOOPBACK_SUB_FILTERS_MAX];
+            int qoss[LOOPBACK_SUB_FILTERS_MAX];
+
+            if (MQTTDeserialize_subscribe(&dup, &packet_id, LOOPBACK_SUB_FILTERS_MAX, &count,
+                                          filters, qoss, _buf, _len) != 1) {
+                tr_error("Malformed SUBSCRIBE");
+                drop();
+                return;
+            }
+
+            // grant what is requested, C2D goes to the session anyway
+            len = MQTTSerialize_suback(out, sizeof(out), packet_id, count, qoss);
+            break;
+        }
+        case UNSUBSCRIBE:
+        {
+            unsigned char dup;
+            unsigned short packet_id;
+            int count = 0;
+            MQTTString filters[LOOPBACK_SUB_FILTERS_MAX];
+
+            if (MQTTDeserialize_unsubscribe(&dup, &packet_id, LOOPBACK_SUB_FILTERS_MAX, &count,
+                                            filters, _buf, _len) == 1) {
+                len = MQTTSerialize_unsuback(out, sizeof(out), packet_id);
+            }
+            break;
+        }
+        case PINGREQ:
+            out[0] = PINGRESP << 4;
+            out[1] = 0;
+            len = 2;
+            break;
+        case DISCONNECT:
+            broker->detach(this);
+            drop();
+            return;
+        default:
+            break;
+    }
+
+    if (len > 0) {
+        send(out, len);
+    }
+}
+
+static uint16_t read_u16(const unsigned char* _p)
+{
+    return (_p[0] << 8) | _p[1];
+}
+
+// CONNECT of protocol level 5 and the packets of MQTT 5 sessions that differ
+// from 3.1.1, false for the others. MQTTPacket only knows 3.1.1.
+bool LoopbackNetwork::handle_packet5(unsigned char* _buf, int _len)
+{
+    const unsigned char* end = _buf + _len;
+    const unsigned char* p;
+    unsigned char out[16 + LOOPBACK_SUB_FILTERS_MAX];
+    unsigned char* o = out;
+    IoTConnectMqtt5Props props;
+    uint32_t rem_len;
+    uint16_t packet_id;
+    int type = _buf[0] >> 4;
+    int n;
+
+    // write() split packets by the remaining length
+    p = _buf + 1 + iot_connect_mqtt5_read_vbi(_buf + 1, end, &rem_len);
+
+    if (type == CONNECT) {
+        uint16_t id_len;
+
+        // protocol name, level, flags and keepalive
+        if (end - p < 10 || p[6] != IOT_CONNECT_MQTT5_VERSION) {
+            return false;
+        }
+        p += 10;
+        n = iot_connect_mqtt5_read_props(p, end, &props);
+        if (n < 0 || end - p - n < 2 || end - p - n - 2 < read_u16(p + n)) {
+            return drop_malformed(type);
+        }
+        p += n;
+        id_len = read_u16(p);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            client_id.assign((const char*)p + 2, id_len);
+        }
+        v5 = true;
+        aliases.clear();
+        broker->attach(client_id, this);
+
+        // session present, reason code, then the properties
+        *o++ = CONNACK << 4;
+        *o++ = 2 + 1 + 6;
+        *o++ = 0;
+        *o++ = MQTT_CONNECTION_ACCEPTED;
+        *o++ = 6;
+        *o++ = MQTT5_PROP_RECEIVE_MAX;
+        o = iot_connect_mqtt5_write_u16(o, LOOPBACK_RECEIVE_MAX);
+        *o++ = MQTT5_PROP_TOPIC_ALIAS_MAX;
+        o = iot_connect_mqtt5_write_u16(o, LOOPBACK_TOPIC_ALIAS_MAX);
+        send(out, o - out);
+        return true;
+    }
+
+    if (!v5) {
+        return false;
+    }
+
+    switch (type) {
+        case PUBLISH:
+        {
+            int qos = (_buf[0] >> 1) & 0x03;
+            std::string topic;
+
+            if (end - p < 2 || end - p - 2 < read_u16(p)) {
+                return drop_malformed(type);
+            }
+            topic.assign((const char*)p + 2, read_u16(p));
+            p += 2 + topic.size();
+            packet_id = 0;
+            if (qos > 0) {
+                if (end - p < 2) {
+                    return drop_malformed(type);
+                }
+                packet_id = read_u16(p);
+                p += 2;
+            }
+            n = iot_connect_mqtt5_read_props(p, end, &props);
+            if (n < 0) {
+                return drop_malformed(type);
+            }
+            p += n;
+
+            if (props.topic_alias > LOOPBACK_TOPIC_ALIAS_MAX) {
+                return drop_malformed(type);
+            }
+            if (props.topic_alias && !topic.empty()) {
+                aliases[props.topic_alias] = topic;
+            } else if (props.topic_alias) {
+                std::map<uint16_t, std::string>::iterator it = aliases.find(props.topic_alias);
+                if (it == aliases.end()) {
+                    tr_error("Unknown topic alias %u", props.topic_alias);
+                    return drop_malformed(type);
+                }
+                topic = it->second;
+            } else if (topic.empty()) {
+                return drop_malformed(type);
+            }
+
+            broker->publishes++;
+            broker->publish_bytes += _len;
+            if (broker->on_publish) {
+                broker->on_publish(client_id.c_str(), (const char*)p, end - p);
+            }
+
+            // no reason code is success
+            if (qos > 0) {
+                *o++ = (qos == 1 ? PUBACK : PUBREC) << 4;
+                *o++ = 2;
+                o = iot_connect_mqtt5_write_u16(o, packet_id);
+            }
+            break;
+        }
+        case SUBSCRIBE:
+        case UNSUBSCRIBE:
+        {
+            unsigned char reasons[LOOPBACK_SUB_FILTERS_MAX];
+            int count = 0;
+
+            if (end - p < 2) {
+                return drop_malformed(type);
+            }
+            packet_id = read_u16(p);
+            p += 2;
+            n = iot_connect_mqtt5_read_props(p, end, &props);
+            if (n < 0) {
+                return drop_malformed(type);
+            }
+            p += n;
+
+            while (p < end) {
+                if (count == LOOPBACK_SUB_FILTERS_MAX || end - p < 2 || end - p - 2 < read_u16(p)) {
+                    return drop_malformed(type);
+                }
+                p += 2 + read_u16(p);
+                if (type == SUBSCRIBE) {
+                    if (p == end) {
+                        return drop_malformed(type);
+                    }
+                    // grant the QoS asked for
+                    reasons[count++] = *p++ & 0x03;
+                } else {
+                    reasons[count++] = 0;
+                }
+            }
+
+            *o++ = (type == SUBSCRIBE ? SUBACK : UNSUBACK) << 4;
+            *o++ = 2 + 1 + count;
+            o = iot_connect_mqtt5_write_u16(o, packet_id);
+            *o++ = 0;
+            memcpy(o, reasons, count);
+            o += count;
+            break;
+        }
+        default:
+            // PUBREL, PINGREQ and DISCONNECT without a reason read as 3.1.1
+            return false;
+    }
+
+    if (o > out) {
+        send(out, o - out);
+    }
+    return true;
+}
+
+bool LoopbackNetwork::drop_malformed(int _type)
+{
+    tr_error("Malformed MQTT 5 packet of type %d", _type);
+    drop();
+
+    return true;
+}
@@ -0,0 +1,103 @@
+#ifndef __LOOPBACK_BROKER_H__
+#define __LOOPBACK_BROKER_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <string>
+#include <vector>
+#include "IoTConnectNetwork.h"
+
+class LoopbackNetwork;
+
+// An in-process MQTT 3.1.1 or 5 broker stand-in. It accepts every client, acks
+// CONNECT / SUBSCRIBE / PUBLISH / PINGREQ, and hands publishes to on_publish
+// rather than routing them. Cloud to device messages are injected by publish().
+// MQTT 5 sessions get a receive maximum and topic aliases.
+class LoopbackBroker {
+
+public:
+    Callback<void(const char* _client_id, const char* _payload, int _len)> on_publish;
+
+public:
+    LoopbackBroker();
+
+    // Accept at most _per_s connections a second, 0 for unlimited
+    void set_accept_rate(int _per_s);
+    // Drop every connection, like a broker restart
+    void drop_all();
+    // Send to the session of _client_id, false if it isn't connected
+    bool publish(const char* _client_id, const char* _topic, const char* _payload, int _len);
+
+    uint64_t get_connects() const;
+    uint64_t get_refused() const;
+    uint64_t get_publishes() const;
+    uint64_t get_publish_bytes() const;
+
+private:
+    friend class LoopbackNetwork;
+
+    std::mutex mutex;
+    std::map<std::string, LoopbackNetwork*> sessions;
+
+    int accept_rate;
+    uint64_t accept_window_ms;
+    int accept_num;
+
+    std::atomic<uint64_t> connects;
+    std::atomic<uint64_t> refused;
+    std::atomic<uint64_t> publishes;
+    std::atomic<uint64_t> publish_bytes;
+
+private:
+    bool accept();
+    void attach(const std::string& _client_id, LoopbackNetwork* _net);
+    void detach(LoopbackNetwork* _net);
+};
+
+// Client side of a loopback connection
+class LoopbackNetwork : public IoTConnectNetwork {
+
+public:
+    LoopbackNetwork(LoopbackBroker* _broker);
+    ~LoopbackNetwork();
+
+    int set_root_ca_cert(const char* _root_ca_pem);
+    int set_client_cert_key(const char* _cert_pem, const char* _key_pem);
+
+    int connect(const char* _host_name, uint16_t _port, int _timeout_ms);
+    int disconnect();
+
+    int read(unsigned char* _buf, int _len, int _timeout_ms);
+    int write(unsigned char* _buf, int _len, int _timeout_ms);
+
+    int sigio(Callback<void()> _func);
+
+private:
+    friend class LoopbackBroker;
+
+    LoopbackBroker* broker;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool up;
+    std::string client_id;
+    // MQTT 5 session, and the topic aliases the client registered
+    std::atomic<bool> v5;
+    std::map<uint16_t, std::string> aliases;
+    // client to broker, a partial packet may be left
+    std::vector<unsigned char> rx;
+    // broker to client
+    std::vector<unsigned char> tx;
+    size_t tx_head;
+    Callback<void()> sigio_func;
+
+private:
+    void handle_packet(unsigned char* _buf, int _len);
+    bool handle_packet5(unsigned char* _buf, int _len);
+    bool drop_malformed(int _type);
+    void send(const unsigned char* _buf, int _len);
+    void drop();
+};
+
+#endif
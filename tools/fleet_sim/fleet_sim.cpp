@@ -0,0 +1,650 @@
+// Fleet simulator, N device / client pairs against an in-process broker.
+// See README.md for the build and the options.
+
+#include <getopt.h>
+#include <malloc.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "IoTConnectClient.h"
+#include "LoopbackBroker.h"
+
+
+#define TRACE_GROUP  "FleetSim"
+// enqueue times kept per device, looked up by the seq property
+#define SIM_SEQ_WINDOW 1024
+#define SIM_RECONNECT_BACKOFF_MS 100
+
+typedef struct {
+    int devices;
+    int props;
+    double pub_hz;
+    double c2d_hz;
+    int duration_s;
+    int storm_at_s;
+    int accept_rate;
+    MQTT::QoS qos;
+    int event_queues;
+    int keepalive_s;
+    int mqtt_version;
+    int pub_rate;
+    int pub_burst;
+} SimOptions;
+
+typedef struct {
+    std::mutex mutex;
+    std::vector<uint32_t> pub_latency_us;
+    std::vector<uint32_t> c2d_latency_us;
+
+    std::atomic<uint64_t> pub_enqueued;
+    std::atomic<uint64_t> pub_dropped;
+    std::atomic<uint64_t> pub_unmatched;
+    std::atomic<uint64_t> c2d_sent;
+    std::atomic<uint64_t> c2d_received;
+
+    std::atomic<uint64_t> connect_attempts;
+    std::atomic<uint64_t> reconnects;
+    std::atomic<int> down;
+    std::atomic<uint64_t> storm_at_us;
+    std::atomic<uint64_t> recovered_at_us;
+} SimStats;
+
+static SimStats stats;
+
+static const char* const prop_keys[] = {"p0", "p1", "p2", "p3", "p4", "p5", "p6", "p7", "p8"};
+
+static uint64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t heap_in_use()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#else
+    return (unsigned)mallinfo().uordblks;
+#endif
+}
+
+class SimDevice {
+
+public:
+    SimDevice(int _index, const IoTConnectEntry* _entry, LoopbackBroker* _broker, const SimOptions* _opt);
+    ~SimDevice();
+
+    // On its own thread, or on _queue
+    int start(EventQueue* _queue);
+    void publish();
+    void send_c2d(LoopbackBroker* _broker);
+    void on_broker_publish(const char* _payload, int _len);
+
+    const char* get_client_id() const;
+    void merge_latency(IoTConnectLatencyStage _stage, IoTConnectHistogram* _hist);
+    void get_stats(IoTConnectClientStats* _stats);
+    void get_footprint(IoTConnectClientFootprint* _footprint);
+
+    uint64_t next_pub_us;
+    uint64_t next_c2d_us;
+
+private:
+    char id[16];
+    char c2d_topic[96];
+    const SimOptions* opt;
+
+    IoTConnectDevice* device;
+    LoopbackNetwork* network;
+    IoTConnectClient* client;
+
+    IoTConnectIntProperty* seq;
+    std::vector<IoTConnectStringProperty*> props;
+
+    std::mutex mutex;
+    uint64_t enqueue_us[SIM_SEQ_WINDOW];
+    int next_seq;
+    bool connected;
+    EventQueue* queue;
+    bool retry_pending;
+
+private:
+    void on_received(MQTT::Message* _msg);
+    void on_connection_lost();
+    void on_connect_phase(IoTConnectPhase _phase, int _result);
+    void connect_async();
+    void on_connected();
+};
+
+SimDevice::SimDevice(int _index, const IoTConnectEntry* _entry, LoopbackBroker* _broker, const SimOptions* _opt) :
+    opt(_opt),
+    next_seq(0),
+    connected(false),
+    queue(NULL),
+    retry_pending(false)
+{
+    int i;
+
+    snprintf(id, sizeof(id), "dev%05d", _index);
+    device = new IoTConnectDevice(id, id, "pwd", _entry);
+    network = new LoopbackNetwork(_broker);
+    client = new IoTConnectClient(network, device);
+    client->set_keepalive(opt->keepalive_s);
+    client->set_mqtt_version(opt->mqtt_version);
+    if (opt->pub_rate) {
+        client->set_pub_rate(opt->pub_rate, opt->pub_burst);
+    }
+
+    snprintf(c2d_topic, sizeof(c2d_topic), "devices/%s/messages/devicebound/sim", device->get_client_id());
+
+    // synthetic schema, int / string / bool in turn
+    seq = new IoTConnectIntProperty("seq", 0);
+    device->add(seq);
+    for (i = 0; i < opt->props; i++) {
+        IoTConnectStringProperty* p;
+
+        switch (i % 3) {
+            case 0:
+                p = new IoTConnectIntProperty(prop_keys[i], i);
+                device->add((IoTConnectIntProperty*)p);
+                break;
+            case 1:
+                p = new IoTConnectStringProperty(prop_keys[i], "init");
+                device->add(p);
+                break;
+            default:
+                p = new IoTConnectBoolProperty(prop_keys[i], false);
+                device->add((IoTConnectBoolProperty*)p);
+                break;
+        }
+        props.push_back(p);
+    }
+}
+
+SimDevice::~SimDevice()
+{
+    size_t i;
+
+    delete client;
+    delete network;
+    delete device;
+
+    delete seq;
+    for (i = 0; i < props.size(); i++) {
+        delete props[i];
+    }
+}
+
+const char* SimDevice::get_client_id() const
+{
+    return device->get_client_id();
+}
+
+int SimDevice::start(EventQueue* _queue)
+{
+    // the first connect goes the same way as reconnects, in the client thread
+    client->set_event_handler(callback(this, &SimDevice::on_connection_lost));
+    stats.down++;
+    queue = _queue;
+    return _queue ? client->start_event_loop(_queue) : client->start_main_loop();
+}
+
+void SimDevice::on_connection_lost()
+{
+    if (connected) {
+        connected = false;
+        stats.down++;
+    }
+
+    // called once a connection is lost, a failed connect retries by itself
+    if (!retry_pending) {
+        connect_async();
+    }
+}
+
+void SimDevice::connect_async()
+{
+    retry_pending = false;
+    if (!client->is_connecting() &&
+        client->connect_async(callback(this, &SimDevice::on_connect_phase)) == 0) {
+        stats.connect_attempts++;
+    }
+}
+
+void SimDevice::on_connect_phase(IoTConnectPhase _phase, int _result)
+{
+    if (_result != 0) {
+        // on a queue, wait without holding it up
+        if (queue) {
+            retry_pending = true;
+            queue->call_in(SIM_RECONNECT_BACKOFF_MS, callback(this, &SimDevice::connect_async));
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(SIM_RECONNECT_BACKOFF_MS));
+            connect_async();
+        }
+        return;
+    }
+
+    if (_phase == IOT_CONNECT_PHASE_MQTT &&
+        client->subscribe(opt->qos, callback(this, &SimDevice::on_received)) == 0) {
+        on_connected();
+    }
+}
+
+void SimDevice::on_connected()
+{
+    uint64_t now = now_us();
+
+    connected = true;
+    if (stats.storm_at_us) {
+        stats.reconnects++;
+    }
+    if (--stats.down == 0) {
+        stats.recovered_at_us = now;
+    }
+}
+
+void SimDevice::publish()
+{
+    size_t i;
+    int r;
+
+    for (i = 0; i < props.size(); i++) {
+        switch (i % 3) {
+            case 0:
+                ((IoTConnectIntProperty*)props[i])->set_value(rand() % 1000);
+                break;
+            case 1:
+            {
+                char buf[16];
+                snprintf(buf, sizeof(buf), "v%d", rand() % 1000);
+                props[i]->set_value(buf);
+                break;
+            }
+            default:
+                ((IoTConnectBoolProperty*)props[i])->set_value(rand() & 1);
+                break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        enqueue_us[next_seq % SIM_SEQ_WINDOW] = now_us();
+    }
+    seq->set_value(next_seq);
+
+    r = client->pub_props(opt->qos);
+    if (r == 0) {
+        next_seq++;
+        stats.pub_enqueued++;
+    } else {
+        stats.pub_dropped++;
+    }
+}
+
+void SimDevice::on_broker_publish(const char* _payload, int _len)
+{
+    static const char tag[] = "\"seq\":";
+    std::string s(_payload, _len);
+    size_t pos = s.find(tag);
+    uint64_t now = now_us();
+    int n;
+
+    if (pos == std::string::npos) {
+        stats.pub_unmatched++;
+        return;
+    }
+    pos += sizeof(tag) - 1;
+    // int properties are sent as strings
+    if (s[pos] == '"') {
+        pos++;
+    }
+    n = atoi(s.c_str() + pos);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (n > next_seq || next_seq - n >= SIM_SEQ_WINDOW) {
+        stats.pub_unmatched++;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock_stats(stats.mutex);
+    stats.pub_latency_us.push_back(now - enqueue_us[n % SIM_SEQ_WINDOW]);
+}
+
+void SimDevice::send_c2d(LoopbackBroker* _broker)
+{
+    char payload[48];
+    int len = snprintf(payload, sizeof(payload), "{\"sent_us\":%" PRIu64 "}", now_us());
+
+    if (_broker->publish(device->get_client_id(), c2d_topic, payload, len)) {
+        stats.c2d_sent++;
+    }
+}
+
+void SimDevice::on_received(MQTT::Message* _msg)
+{
+    static const char tag[] = "\"sent_us\":";
+    std::string s((const char*)_msg->payload, _msg->payloadlen);
+    size_t pos = s.find(tag);
+    uint64_t now = now_us();
+
+    stats.c2d_received++;
+    if (pos == std::string::npos) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    stats.c2d_latency_us.push_back(now - strtoull(s.c_str() + pos + sizeof(tag) - 1, NULL, 10));
+}
+
+static std::unordered_map<std::string, SimDevice*> devices_by_id;
+
+static void on_broker_publish(const char* _client_id, const char* _payload, int _len)
+{
+    std::unordered_map<std::string, SimDevice*>::iterator it = devices_by_id.find(_client_id);
+
+    if (it == devices_by_id.end()) {
+        stats.pub_unmatched++;
+        return;
+    }
+
+    it->second->on_broker_publish(_payload, _len);
+}
+
+void SimDevice::merge_latency(IoTConnectLatencyStage _stage, IoTConnectHistogram* _hist)
+{
+    IoTConnectHistogram h;
+
+    if (client->get_latency(_stage, &h) == 0) {
+        _hist->merge(h);
+    }
+}
+
+void SimDevice::get_stats(IoTConnectClientStats* _stats)
+{
+    client->get_stats(_stats);
+}
+
+void SimDevice::get_footprint(IoTConnectClientFootprint* _footprint)
+{
+    client->get_footprint(_footprint);
+}
+
+static void print_percentiles(const char* _name, std::vector<uint32_t>& _v)
+{
+    size_t n = _v.size();
+
+    if (n == 0) {
+        printf("%-20s -\n", _name);
+        return;
+    }
+
+    std::sort(_v.begin(), _v.end());
+    printf("%-20s p50 %u  p90 %u  p99 %u  p99.9 %u  max %u (n=%zu)\n", _name,
+           _v[n * 50 / 100], _v[n * 90 / 100], _v[n * 99 / 100], _v[n * 999 / 1000], _v[n - 1], n);
+}
+
+static void print_stage(const char* _name, std::vector<SimDevice*>& _sims, IoTConnectLatencyStage _stage)
+{
+    IoTConnectHistogram h;
+    size_t i;
+
+    for (i = 0; i < _sims.size(); i++) {
+        _sims[i]->merge_latency(_stage, &h);
+    }
+
+    if (h.get_count() == 0) {
+        printf("%-20s -\n", _name);
+        return;
+    }
+
+    // bucket resolution, each value is the upper bound of a power of 2 bucket
+    printf("%-20s p50 %u  p90 %u  p99 %u  p99.9 %u  max %u (n=%u)\n", _name,
+           h.get_percentile(50), h.get_percentile(90), h.get_percentile(99), h.get_percentile(99.9f),
+           h.get_max(), h.get_count());
+}
+
+static void print_client_stats(std::vector<SimDevice*>& _sims)
+{
+    IoTConnectClientStats st;
+    uint64_t pub_full = 0;
+    uint64_t yield_errors = 0;
+    uint64_t pings = 0;
+    uint64_t ping_timeouts = 0;
+    uint64_t throttled = 0;
+    uint64_t connect_ms = 0;
+    uint32_t queue_high = 0;
+    size_t i;
+
+    for (i = 0; i < _sims.size(); i++) {
+        _sims[i]->get_stats(&st);
+        pub_full += st.pub_full;
+        yield_errors += st.yield_errors;
+        pings += st.pings;
+        ping_timeouts += st.ping_timeouts;
+        throttled += st.pub_throttled;
+        connect_ms += st.connect_ms;
+        if (st.queue_high > queue_high) {
+            queue_high = st.queue_high;
+        }
+    }
+
+    printf("%-20s queue high %u of %d, %" PRIu64 " pub full, %" PRIu64 " yield errors, connect %.1f ms avg\n",
+           "client stats", queue_high, MQTT_PUB_BUFFER_MSG_NUMBER, pub_full, yield_errors,
+           _sims.empty() ? 0.0 : connect_ms / (double)_sims.size());
+    printf("%-20s %" PRIu64 " sent, %" PRIu64 " timed out\n", "pings", pings, ping_timeouts);
+    printf("%-20s %" PRIu64 " held by the publish rate limit\n", "throttled", throttled);
+}
+
+static void print_client_footprint(std::vector<SimDevice*>& _sims)
+{
+    IoTConnectClientFootprint fp;
+    uint32_t stack_size = 0;
+    uint32_t stack_max = 0;
+    uint32_t callback_stack_max = 0;
+    size_t i;
+
+    for (i = 0; i < _sims.size(); i++) {
+        _sims[i]->get_footprint(&fp);
+        stack_size = fp.stack_size;
+        if (fp.stack_max > stack_max) {
+            stack_max = fp.stack_max;
+        }
+        if (fp.callback_stack_max > callback_stack_max) {
+            callback_stack_max = fp.callback_stack_max;
+        }
+    }
+
+    if (stack_size == 0) {
+        printf("%-20s none, on event queues\n", "client stack");
+        return;
+    }
+
+    // host frames, the C library's TLS at the top of the stack included
+    printf("%-20s high-water %u of %u bytes, callbacks %u\n", "client stack",
+           stack_max, stack_size, callback_stack_max);
+}
+
+static void usage(const char* _prog)
+{
+    printf("usage: %s [options]\n"
+           "  -n devices        device / client pairs (100)\n"
+           "  -p props          synthetic properties per device, besides seq (4)\n"
+           "  -r hz             property publishes per device a second (1)\n"
+           "  -c hz             C2D messages per device a second (0.1)\n"
+           "  -d seconds        duration (10)\n"
+           "  -s seconds        drop every connection at this time, -1 for never (-1)\n"
+           "  -a per_second     connections accepted a second, 0 for unlimited (0)\n"
+           "  -q qos            publish and subscribe QoS (0)\n"
+           "  -e queues         run clients on this many event queues, 0 for a thread each (0)\n"
+           "  -k seconds        MQTT keepalive, 0 for none (%d)\n"
+           "  -5                MQTT 5 with topic aliases instead of 3.1.1\n"
+           "  -m per_second     publish rate limit per client, 0 for none (0)\n"
+           "  -b messages       publish burst per client with -m, 0 for a second's worth (0)\n", _prog, MQTT_KEEPALIVE);
+}
+
+int main(int argc, char* argv[])
+{
+    SimOptions opt = {100, 4, 1, 0.1, 10, -1, 0, MQTT::QOS0, 0, MQTT_KEEPALIVE, 4, 0, 0};
+    std::vector<SimDevice*> sims;
+    std::vector<EventQueue*> queues;
+    std::vector<std::thread> dispatchers;
+    LoopbackBroker broker;
+    IoTConnectEntry entry("Fleet Sim", "SIM");
+    size_t heap_before;
+    size_t heap_after;
+    uint64_t start_us;
+    uint64_t end_us;
+    uint64_t pub_period_us;
+    uint64_t c2d_period_us;
+    int c;
+    int i;
+
+    while ((c = getopt(argc, argv, "n:p:r:c:d:s:a:q:e:k:5m:b:h")) != -1) {
+        switch (c) {
+            case 'n': opt.devices = atoi(optarg); break;
+            case 'p': opt.props = atoi(optarg); break;
+            case 'r': opt.pub_hz = atof(optarg); break;
+            case 'c': opt.c2d_hz = atof(optarg); break;
+            case 'd': opt.duration_s = atoi(optarg); break;
+            case 's': opt.storm_at_s = atoi(optarg); break;
+            case 'a': opt.accept_rate = atoi(optarg); break;
+            case 'q': opt.qos = (MQTT::QoS)atoi(optarg); break;
+            case 'e': opt.event_queues = std::max(atoi(optarg), 0); break;
+            case 'k': opt.keepalive_s = std::max(atoi(optarg), 0); break;
+            case '5': opt.mqtt_version = 5; break;
+            case 'm': opt.pub_rate = std::max(atoi(optarg), 0); break;
+            case 'b': opt.pub_burst = std::max(atoi(optarg), 0); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (opt.devices <= 0 || opt.devices > MBED_CONF_IOT_CONNECT_MQTT_CLIENT_INSTANCE_MAX) {
+        printf("devices should be 1 ~ %d, see MBED_CONF_IOT_CONNECT_MQTT_CLIENT_INSTANCE_MAX\n",
+               MBED_CONF_IOT_CONNECT_MQTT_CLIENT_INSTANCE_MAX);
+        return 1;
+    }
+    opt.props = std::min(std::max(opt.props, 0), (int)(sizeof(prop_keys) / sizeof(prop_keys[0])));
+    if (opt.props + 1 > IOT_CONNECT_PROPERTYS_MAX) {
+        opt.props = IOT_CONNECT_PROPERTYS_MAX - 1;
+    }
+
+    entry.set_mqtt("loopback", 8883);
+    broker.set_accept_rate(opt.accept_rate);
+    broker.on_publish = on_broker_publish;
+
+    heap_before = heap_in_use();
+    for (i = 0; i < opt.devices; i++) {
+        sims.push_back(new SimDevice(i, &entry, &broker, &opt));
+    }
+    heap_after = heap_in_use();
+
+    for (i = 0; i < opt.devices; i++) {
+        devices_by_id[sims[i]->get_client_id()] = sims[i];
+    }
+
+    pub_period_us = opt.pub_hz > 0 ? (uint64_t)(1000000 / opt.pub_hz) : 0;
+    c2d_period_us = opt.c2d_hz > 0 ? (uint64_t)(1000000 / opt.c2d_hz) : 0;
+
+    for (i = 0; i < opt.event_queues; i++) {
+        queues.push_back(new EventQueue);
+        dispatchers.push_back(std::thread(&EventQueue::dispatch_forever, queues[i]));
+    }
+
+    start_us = now_us();
+    for (i = 0; i < opt.devices; i++) {
+        // spread devices over a period rather than publish in lockstep
+        sims[i]->next_pub_us = start_us + (pub_period_us ? rand() % pub_period_us : 0);
+        sims[i]->next_c2d_us = start_us + (c2d_period_us ? rand() % c2d_period_us : 0);
+        if (sims[i]->start(queues.empty() ? NULL : queues[i % queues.size()]) != 0) {
+            printf("start device %d failed\n", i);
+            return 1;
+        }
+    }
+
+    end_us = start_us + (uint64_t)opt.duration_s * 1000000;
+    while (1) {
+        uint64_t now = now_us();
+
+        if (now >= end_us) {
+            break;
+        }
+
+        if (opt.storm_at_s >= 0 && !stats.storm_at_us && now - start_us >= (uint64_t)opt.storm_at_s * 1000000) {
+            stats.recovered_at_us = 0;
+            stats.storm_at_us = now;
+            broker.drop_all();
+        }
+
+        for (i = 0; i < opt.devices; i++) {
+            SimDevice* sim = sims[i];
+
+            if (pub_period_us && now >= sim->next_pub_us) {
+                sim->publish();
+                sim->next_pub_us += pub_period_us;
+            }
+            if (c2d_period_us && now >= sim->next_c2d_us) {
+                sim->send_c2d(&broker);
+                sim->next_c2d_us += c2d_period_us;
+            }
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // let the buffered messages drain
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    printf("%-20s %d\n", "devices", opt.devices);
+    printf("%-20s %d\n", "duration_s", opt.duration_s);
+    printf("%-20s %" PRIu64 " (%.1f msg/s, %.1f KB/s, %.1f bytes/msg)\n", "published", broker.get_publishes(),
+           broker.get_publishes() / (double)opt.duration_s,
+           broker.get_publish_bytes() / 1024.0 / opt.duration_s,
+           broker.get_publishes() ? broker.get_publish_bytes() / (double)broker.get_publishes() : 0.0);
+    printf("%-20s %" PRIu64 " enqueued, %" PRIu64 " dropped (buffer full), %" PRIu64 " unmatched\n", "pub",
+           (uint64_t)stats.pub_enqueued, (uint64_t)stats.pub_dropped, (uint64_t)stats.pub_unmatched);
+    printf("%-20s %" PRIu64 " sent, %" PRIu64 " received\n", "c2d",
+           (uint64_t)stats.c2d_sent, (uint64_t)stats.c2d_received);
+    print_percentiles("pub latency us", stats.pub_latency_us);
+    print_percentiles("c2d latency us", stats.c2d_latency_us);
+    print_stage("  client queue us", sims, IOT_CONNECT_LATENCY_QUEUE);
+    print_stage("  client write us", sims, IOT_CONNECT_LATENCY_WRITE);
+    print_stage("  client ack us", sims, IOT_CONNECT_LATENCY_ACK);
+    print_stage("  client total us", sims, IOT_CONNECT_LATENCY_TOTAL);
+    if (opt.pub_rate) {
+        print_stage("  client throttle us", sims, IOT_CONNECT_LATENCY_THROTTLE);
+    }
+    print_client_stats(sims);
+    print_client_footprint(sims);
+    printf("%-20s %" PRIu64 " attempts, %" PRIu64 " accepted, %" PRIu64 " refused\n", "connects",
+           (uint64_t)stats.connect_attempts, broker.get_connects(), broker.get_refused());
+    if (stats.storm_at_us) {
+        if (stats.recovered_at_us) {
+            printf("%-20s %" PRIu64 " reconnected in %.1f ms\n", "storm",
+                   (uint64_t)stats.reconnects, (stats.recovered_at_us - stats.storm_at_us) / 1000.0);
+        } else {
+            printf("%-20s %" PRIu64 " reconnected, %d still down\n", "storm",
+                   (uint64_t)stats.reconnects, (int)stats.down);
+        }
+    }
+    printf("%-20s %zu bytes (client %zu, device %zu)\n", "heap per device",
+           (heap_after - heap_before) / opt.devices, sizeof(IoTConnectClient), sizeof(IoTConnectDevice));
+
+    // clients on a queue are destroyed once it stopped
+    for (i = 0; i < opt.event_queues; i++) {
+        queues[i]->break_dispatch();
+        dispatchers[i].join();
+    }
+
+    for (i = 0; i < opt.devices; i++) {
+        delete sims[i];
+    }
+
+    for (i = 0; i < opt.event_queues; i++) {
+        delete queues[i];
+    }
+
+    return 0;
+}
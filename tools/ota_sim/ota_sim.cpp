@@ -0,0 +1,518 @@
+// OTA download simulator, a device against an in-process broker and a backend
+// serving a generated image. See README.md for the build and the options.
+
+#include <getopt.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <vector>
+#include "IoTConnectClient.h"
+#include "IoTConnectOta.h"
+#include "IoTConnectFileBlockDevice.h"
+#include "LoopbackBroker.h"
+#include "mbedtls/version.h"
+
+#if MBEDTLS_VERSION_MAJOR >= 3
+#define mbedtls_sha256_ret mbedtls_sha256
+#endif
+
+#define TRACE_GROUP  "OtaSim"
+#define SIM_RECONNECT_BACKOFF_MS 100
+#define SIM_DISPATCH_MS 10
+
+typedef struct {
+    uint32_t image_size;
+    double loss;
+    int latency_ms;
+    int drop_at_s;
+    int reboot_at_pct;
+    int duration_s;
+    bd_size_t program_size;
+    bd_size_t erase_size;
+    const char* path;
+    bool keep;
+} SimOptions;
+
+static uint64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Answers chunk requests from its own thread, after the latency, losing some
+class OtaBackend {
+
+public:
+    OtaBackend(LoopbackBroker* _broker, const SimOptions* _opt);
+    ~OtaBackend();
+
+    void notify(const char* _client_id, const char* _topic);
+    void on_request(const char* _client_id, const char* _payload, int _len);
+
+    std::vector<unsigned char> image;
+    unsigned char sha256[IOT_CONNECT_OTA_SHA256_SIZE];
+
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> chunks_sent;
+    std::atomic<uint64_t> chunks_lost;
+
+private:
+    typedef struct {
+        uint64_t due_us;
+        std::vector<unsigned char> frame;
+    } Frame;
+
+    LoopbackBroker* broker;
+    const SimOptions* opt;
+    std::string client_id;
+    std::string topic;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Frame> frames;
+    bool running;
+    std::thread thread;
+
+private:
+    void run();
+};
+
+OtaBackend::OtaBackend(LoopbackBroker* _broker, const SimOptions* _opt) :
+    requests(0),
+    chunks_sent(0),
+    chunks_lost(0),
+    broker(_broker),
+    opt(_opt),
+    running(true)
+{
+    uint32_t i;
+
+    image.resize(opt->image_size);
+    for (i = 0; i < opt->image_size; i++) {
+        image[i] = rand();
+    }
+    mbedtls_sha256_ret(image.data(), image.size(), sha256, 0);
+
+    thread = std::thread(&OtaBackend::run, this);
+}
+
+OtaBackend::~OtaBackend()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+    }
+    cond.notify_all();
+    thread.join();
+}
+
+void OtaBackend::notify(const char* _client_id, const char* _topic)
+{
+    char json[160];
+    char hex[IOT_CONNECT_OTA_SHA256_SIZE * 2 + 1];
+    int len;
+    int i;
+
+    for (i = 0; i < IOT_CONNECT_OTA_SHA256_SIZE; i++) {
+        snprintf(hex + i * 2, 3, "%02x", sha256[i]);
+    }
+    len = snprintf(json, sizeof(json), "{\"ota\":{\"ver\":\"2.0.0\",\"size\":%lu,\"sha256\":\"%s\"}}",
+                   (unsigned long)image.size(), hex);
+    broker->publish(_client_id, _topic, json, len);
+}
+
+// {"ota":{"ver":..,"offset":X,"len":L,"chunk":C}}
+void OtaBackend::on_request(const char* _client_id, const char* _payload, int _len)
+{
+    std::string s(_payload, _len);
+    size_t off_pos = s.find("\"offset\":");
+    size_t len_pos = s.find("\"len\":");
+    size_t chunk_pos = s.find("\"chunk\":");
+    uint64_t due = now_us() + (uint64_t)opt->latency_ms * 1000;
+    uint32_t off;
+    uint32_t end;
+    uint32_t chunk;
+
+    if (s.find("{\"ota\":") != 0 || off_pos == std::string::npos || len_pos == std::string::npos ||
+        chunk_pos == std::string::npos) {
+        return;
+    }
+    requests++;
+
+    off = strtoul(s.c_str() + off_pos + 9, NULL, 10);
+    end = off + strtoul(s.c_str() + len_pos + 6, NULL, 10);
+    chunk = strtoul(s.c_str() + chunk_pos + 8, NULL, 10);
+    if (end > image.size() || chunk == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // answered on the device's C2D topic, also when it resumed without a notification
+    client_id = _client_id;
+    topic = "devices/" + client_id + "/messages/devicebound/ota";
+    for (; off < end; off += chunk) {
+        uint32_t n = std::min(chunk, end - off);
+        Frame f;
+
+        if (opt->loss > 0 && rand() < opt->loss * RAND_MAX) {
+            chunks_lost++;
+            continue;
+        }
+
+        f.due_us = due;
+        f.frame.resize(IOT_CONNECT_OTA_FRAME_HEADER + n);
+        memcpy(f.frame.data(), "OTA\x01", 4);
+        f.frame[4] = off >> 24;
+        f.frame[5] = off >> 16;
+        f.frame[6] = off >> 8;
+        f.frame[7] = off;
+        memcpy(f.frame.data() + IOT_CONNECT_OTA_FRAME_HEADER, image.data() + off, n);
+        frames.push_back(f);
+    }
+    cond.notify_all();
+}
+
+void OtaBackend::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (running) {
+        uint64_t now;
+
+        if (frames.empty()) {
+            cond.wait(lock);
+            continue;
+        }
+
+        now = now_us();
+        if (frames.front().due_us > now) {
+            cond.wait_for(lock, std::chrono::microseconds(frames.front().due_us - now));
+            continue;
+        }
+
+        Frame f = frames.front();
+        std::string id = client_id;
+        std::string to = topic;
+        frames.pop_front();
+        lock.unlock();
+        // lost with the connection if it's down, as on a broker
+        if (broker->publish(id.c_str(), to.c_str(), (const char*)f.frame.data(), f.frame.size())) {
+            chunks_sent++;
+        }
+        lock.lock();
+    }
+}
+
+// The device, on an event queue dispatched by main() so a reboot never races the client
+class SimDevice {
+
+public:
+    SimDevice(const IoTConnectEntry* _entry, LoopbackBroker* _broker, const SimOptions* _opt);
+    ~SimDevice();
+
+    int start(EventQueue* _queue);
+    // Lose the RAM state, the OTA journal and the staged chunks stay in the block device
+    int reboot();
+
+    const char* get_client_id() const;
+    IoTConnectOta* ota;
+    IoTConnectFileBlockDevice bd;
+
+    uint64_t done_us;
+    int error;
+
+private:
+    const SimOptions* opt;
+    IoTConnectDevice* device;
+    LoopbackNetwork* network;
+    IoTConnectClient* client;
+    EventQueue* queue;
+    bool retry_pending;
+
+private:
+    void on_received(MQTT::Message* _msg);
+    void on_connection_lost();
+    void on_connect_phase(IoTConnectPhase _phase, int _result);
+    void connect_async();
+    void on_ota_state(IoTConnectOtaState _state, int _error);
+    int new_ota();
+};
+
+static bd_size_t slot_size(const SimOptions* _opt)
+{
+    // the image and the journal unit
+    return (_opt->image_size + _opt->erase_size - 1) / _opt->erase_size * _opt->erase_size + _opt->erase_size;
+}
+
+SimDevice::SimDevice(const IoTConnectEntry* _entry, LoopbackBroker* _broker, const SimOptions* _opt) :
+    ota(NULL),
+    bd(_opt->path, slot_size(_opt), _opt->program_size, _opt->erase_size),
+    done_us(0),
+    error(0),
+    opt(_opt),
+    queue(NULL),
+    retry_pending(false)
+{
+    device = new IoTConnectDevice("ota0", "ota0", "pwd", _entry);
+    network = new LoopbackNetwork(_broker);
+    client = new IoTConnectClient(network, device);
+}
+
+SimDevice::~SimDevice()
+{
+    delete client;
+    delete ota;
+    delete network;
+    delete device;
+}
+
+const char* SimDevice::get_client_id() const
+{
+    return device->get_client_id();
+}
+
+int SimDevice::new_ota()
+{
+    int r;
+
+    ota = new IoTConnectOta(client, &bd, 0, slot_size(opt));
+    ota->on_state = callback(this, &SimDevice::on_ota_state);
+    r = ota->init();
+    if (r != 0) {
+        return r;
+    }
+
+    return client->set_ota(ota);
+}
+
+int SimDevice::start(EventQueue* _queue)
+{
+    int r = bd.init();
+
+    if (r != 0) {
+        return r;
+    }
+    r = new_ota();
+    if (r != 0) {
+        return r;
+    }
+
+    queue = _queue;
+    client->set_event_handler(callback(this, &SimDevice::on_connection_lost));
+    return client->start_event_loop(_queue);
+}
+
+int SimDevice::reboot()
+{
+    client->set_ota(NULL);
+    delete ota;
+    ota = NULL;
+    bd.deinit();
+
+    client->disconnect();
+    if (bd.init() != 0) {
+        return IOT_CONNECT_ERROR_OTA_FLASH;
+    }
+
+    return new_ota();
+}
+
+void SimDevice::on_connection_lost()
+{
+    if (!retry_pending) {
+        connect_async();
+    }
+}
+
+void SimDevice::connect_async()
+{
+    retry_pending = false;
+    if (!client->is_connecting()) {
+        client->connect_async(callback(this, &SimDevice::on_connect_phase));
+    }
+}
+
+void SimDevice::on_connect_phase(IoTConnectPhase _phase, int _result)
+{
+    if (_result != 0) {
+        retry_pending = true;
+        queue->call_in(SIM_RECONNECT_BACKOFF_MS, callback(this, &SimDevice::connect_async));
+        return;
+    }
+
+    if (_phase == IOT_CONNECT_PHASE_MQTT) {
+        client->subscribe(MQTT::QOS0, callback(this, &SimDevice::on_received));
+    }
+}
+
+void SimDevice::on_received(MQTT::Message* _msg)
+{
+    tr_info("Not an OTA message, %d bytes", (int)_msg->payloadlen);
+}
+
+void SimDevice::on_ota_state(IoTConnectOtaState _state, int _error)
+{
+    if (_state == IOT_CONNECT_OTA_DONE || _state == IOT_CONNECT_OTA_FAILED) {
+        done_us = now_us();
+        error = _error;
+    }
+}
+
+// The staged image against the backend's
+static bool verify_slot(IoTConnectFileBlockDevice* _bd, const std::vector<unsigned char>& _image)
+{
+    std::vector<unsigned char> staged(_image.size());
+
+    if (_bd->read(staged.data(), 0, staged.size()) != 0) {
+        return false;
+    }
+
+    return staged == _image;
+}
+
+static void usage(const char* _prog)
+{
+    printf("usage: %s [options]\n"
+           "  -s bytes          image size (262144)\n"
+           "  -l loss           fraction of chunks lost on the way (0)\n"
+           "  -t ms             backend latency of a chunk (5)\n"
+           "  -k seconds        drop the connection at this time, -1 for never (-1)\n"
+           "  -b percent        reboot the device at this much downloaded, -1 for never (-1)\n"
+           "  -d seconds        give up after (60)\n"
+           "  -p bytes          block device program size (256)\n"
+           "  -z bytes          block device erase size (4096)\n"
+           "  -f path           block device file (ota_sim.bin)\n"
+           "  -R                keep the file, to resume a download of a previous run\n", _prog);
+}
+
+int main(int argc, char* argv[])
+{
+    SimOptions opt = {256 * 1024, 0, 5, -1, -1, 60, 256, 4096, "ota_sim.bin", false};
+    IoTConnectHeapAllocator heap;
+    IoTConnectAccountingAllocator accounting(&heap);
+    IoTConnectMemStats ota_mem;
+    IoTConnectOtaStats st;
+    LoopbackBroker broker;
+    EventQueue queue;
+    IoTConnectEntry entry("OTA Sim", "SIM");
+    char topic[96];
+    bool dropped = false;
+    bool rebooted = false;
+    bool match;
+    uint64_t start_us;
+    uint64_t end_us;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:l:t:k:b:d:p:z:f:Rh")) != -1) {
+        switch (c) {
+            case 's': opt.image_size = strtoul(optarg, NULL, 10); break;
+            case 'l': opt.loss = atof(optarg); break;
+            case 't': opt.latency_ms = std::max(atoi(optarg), 0); break;
+            case 'k': opt.drop_at_s = atoi(optarg); break;
+            case 'b': opt.reboot_at_pct = atoi(optarg); break;
+            case 'd': opt.duration_s = atoi(optarg); break;
+            case 'p': opt.program_size = strtoul(optarg, NULL, 10); break;
+            case 'z': opt.erase_size = strtoul(optarg, NULL, 10); break;
+            case 'f': opt.path = optarg; break;
+            case 'R': opt.keep = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (opt.image_size == 0 || !opt.program_size || opt.erase_size % opt.program_size) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!opt.keep) {
+        unlink(opt.path);
+    }
+
+    // before anything allocates, to count the OTA's RAM
+    iot_connect_set_allocator(&accounting);
+
+    entry.set_mqtt("loopback", 8883);
+    // the same image every run, for -R
+    srand(1);
+    OtaBackend backend(&broker, &opt);
+    broker.on_publish = callback(&backend, &OtaBackend::on_request);
+
+    SimDevice* sim = new SimDevice(&entry, &broker, &opt);
+    snprintf(topic, sizeof(topic), "devices/%s/messages/devicebound/ota", sim->get_client_id());
+    if (sim->start(&queue) != 0) {
+        printf("start failed, see the block device options\n");
+        return 1;
+    }
+    if (sim->ota->get_state() == IOT_CONNECT_OTA_DOWNLOADING) {
+        printf("%-20s %lu of %lu\n", "resumed from", (unsigned long)sim->ota->get_offset(),
+               (unsigned long)sim->ota->get_size());
+    }
+
+    start_us = now_us();
+    if (sim->ota->get_state() == IOT_CONNECT_OTA_DONE) {
+        printf("%-20s %s, by a previous run\n", "staged already", sim->ota->get_version());
+        sim->done_us = start_us;
+    }
+    end_us = start_us + (uint64_t)opt.duration_s * 1000000;
+    while (!sim->done_us && now_us() < end_us) {
+        uint64_t now;
+        IoTConnectOta* ota = sim->ota;
+
+        queue.dispatch(SIM_DISPATCH_MS);
+        now = now_us();
+
+        // notified once connected, again after a reboot like a backend retrying
+        if (ota->get_state() == IOT_CONNECT_OTA_IDLE && broker.get_connects() > 0) {
+            backend.notify(sim->get_client_id(), topic);
+        }
+
+        if (opt.drop_at_s >= 0 && !dropped && now - start_us >= (uint64_t)opt.drop_at_s * 1000000) {
+            dropped = true;
+            printf("%-20s at %lu\n", "connection dropped", (unsigned long)ota->get_offset());
+            broker.drop_all();
+        }
+
+        if (opt.reboot_at_pct >= 0 && !rebooted && ota->get_size() &&
+            ota->get_offset() >= (uint64_t)ota->get_size() * opt.reboot_at_pct / 100) {
+            rebooted = true;
+            printf("%-20s at %lu\n", "rebooted", (unsigned long)ota->get_offset());
+            if (sim->reboot() != 0) {
+                printf("reboot failed\n");
+                return 1;
+            }
+            printf("%-20s %lu\n", "resumed from", (unsigned long)sim->ota->get_offset());
+        }
+    }
+
+    sim->ota->get_stats(&st);
+    accounting.get_stats(IOT_CONNECT_MEM_OTA, &ota_mem);
+    match = sim->ota->get_state() == IOT_CONNECT_OTA_DONE && verify_slot(&sim->bd, backend.image);
+
+    printf("%-20s %lu bytes, window %d x %d bytes, timeout %d ms\n", "image", (unsigned long)opt.image_size,
+           IOT_CONNECT_OTA_WINDOW, IOT_CONNECT_OTA_CHUNK_SIZE, IOT_CONNECT_OTA_CHUNK_TIMEOUT_MS);
+    if (sim->done_us) {
+        double s = std::max((sim->done_us - start_us) / 1000000.0, 0.001);
+        printf("%-20s %s (%d) in %.2f s, %.1f KB/s\n", "result",
+               sim->ota->get_state() == IOT_CONNECT_OTA_DONE ? "done" : "failed", sim->error, s,
+               st.chunk_bytes / 1024.0 / s);
+    } else {
+        printf("%-20s not finished in %d s, at %lu\n", "result", opt.duration_s,
+               (unsigned long)sim->ota->get_offset());
+    }
+    printf("%-20s %s\n", "staged image", match ? "matches" : "DOESN'T MATCH");
+    printf("%-20s %u chunks, %u dropped, %u requests, %u re-requests, %u resumes\n", "device",
+           st.chunks, st.dropped, st.requests, st.rerequests, st.resumes);
+    printf("%-20s %" PRIu64 " requests, %" PRIu64 " chunks sent, %" PRIu64 " lost\n", "backend",
+           (uint64_t)backend.requests, (uint64_t)backend.chunks_sent, (uint64_t)backend.chunks_lost);
+    printf("%-20s %zu bytes peak, %zu object, receive buffer %d\n", "ota ram", ota_mem.peak_bytes,
+           sizeof(IoTConnectOta), IOT_CONNECT_MQTT_MAX_PACKET_SIZE);
+
+    // the client is destroyed in the queue's thread, this one
+    delete sim;
+    iot_connect_set_allocator(NULL);
+
+    return match ? 0 : 2;
+}
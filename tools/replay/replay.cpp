@@ -0,0 +1,1080 @@
+// Replays MQTT traffic recorded by IoTConnectNetworkRecorder through a client and
+// profiles it. See README.md for the build, the capture format and the options.
+
+#include <getopt.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "IoTConnectClient.h"
+#include "IoTConnectNetworkRecorder.h"
+#include "LoopbackBroker.h"
+#include "jsmn.h"
+
+#define TRACE_GROUP  "Replay"
+#define REPLAY_STALL_MS 5000
+#define REPLAY_JSON_TOKENS_MAX 128
+
+// MQTT control packet types
+#define MQTT_CONNECT 1
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 4
+#define MQTT_PUBREC 5
+#define MQTT_PUBCOMP 7
+#define MQTT_SUBSCRIBE 8
+#define MQTT_SUBACK 9
+#define MQTT_UNSUBSCRIBE 10
+#define MQTT_UNSUBACK 11
+#define MQTT_PINGREQ 12
+#define MQTT_PINGRESP 13
+#define MQTT_DISCONNECT 14
+
+typedef struct {
+    uint64_t us;
+    std::vector<unsigned char> bytes;
+    // outbound packets the client wrote before it came
+    uint32_t before;
+} ReplayPacket;
+
+// A recorded outbound PUBLISH, published again with pub()
+typedef struct {
+    uint64_t us;
+    uint32_t in_before;
+    MQTT::QoS qos;
+    std::string payload;
+} ReplayPublish;
+
+// From a connect to the next one
+typedef struct {
+    uint64_t start_us;
+    std::string host;
+    std::vector<ReplayPacket> in;
+    // pings and DISCONNECT aren't counted, the client pings on its own schedule
+    uint32_t out_total;
+    // ids of the outbound packets that take a new one, PUBLISH QoS > 0 / SUBSCRIBE / UNSUBSCRIBE
+    std::vector<uint16_t> out_ids;
+    std::vector<ReplayPublish> pubs;
+    int sub_qos;
+} ReplaySession;
+
+typedef struct {
+    const char* path;
+    bool original_timing;
+    int repeat;
+    // -g
+    int messages;
+    int sessions;
+    int qos;
+    int mqtt_version;
+} ReplayOptions;
+
+static uint64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint16_t read_u16(const unsigned char* _p)
+{
+    return (_p[0] << 8) | _p[1];
+}
+
+// Variable byte integer, its size in *_size, -1 if malformed
+static int read_varint(const unsigned char* _p, const unsigned char* _end, int* _size)
+{
+    int value = 0;
+    int i;
+
+    for (i = 0; i < 4 && _p + i < _end; i++) {
+        value += (_p[i] & 0x7F) << (7 * i);
+        if (!(_p[i] & 0x80)) {
+            *_size = i + 1;
+            return value;
+        }
+    }
+
+    return -1;
+}
+
+// Splits a byte stream into MQTT packets, a partial one is kept
+class PacketFramer {
+
+public:
+    void push(const unsigned char* _buf, size_t _len)
+    {
+        buf.insert(buf.end(), _buf, _buf + _len);
+    }
+
+    // Started with bytes pushed when nothing was left over
+    bool empty() const
+    {
+        return buf.empty();
+    }
+
+    bool next(std::vector<unsigned char>* _packet)
+    {
+        int size = 0;
+        int rem_len;
+
+        if (buf.size() < 2) {
+            return false;
+        }
+        rem_len = read_varint(buf.data() + 1, buf.data() + buf.size(), &size);
+        if (rem_len < 0 || buf.size() < (size_t)(1 + size + rem_len)) {
+            return false;
+        }
+
+        _packet->assign(buf.begin(), buf.begin() + 1 + size + rem_len);
+        buf.erase(buf.begin(), buf.begin() + 1 + size + rem_len);
+
+        return true;
+    }
+
+private:
+    std::vector<unsigned char> buf;
+};
+
+// Where the variable header starts
+static const unsigned char* packet_body(const std::vector<unsigned char>& _packet)
+{
+    int size = 0;
+
+    read_varint(_packet.data() + 1, _packet.data() + _packet.size(), &size);
+
+    return _packet.data() + 1 + size;
+}
+
+// Payload of a PUBLISH, and its packet id for QoS > 0
+static bool parse_publish(const std::vector<unsigned char>& _packet, bool _v5, std::string* _payload,
+                          uint16_t* _id)
+{
+    const unsigned char* p = packet_body(_packet);
+    const unsigned char* end = _packet.data() + _packet.size();
+    int qos = (_packet[0] >> 1) & 3;
+
+    if (end - p < 2 || end - p < 2 + read_u16(p)) {
+        return false;
+    }
+    p += 2 + read_u16(p);
+    if (qos > 0) {
+        if (end - p < 2) {
+            return false;
+        }
+        *_id = read_u16(p);
+        p += 2;
+    }
+    if (_v5) {
+        int size = 0;
+        int props_len = read_varint(p, end, &size);
+        if (props_len < 0 || end - p < size + props_len) {
+            return false;
+        }
+        p += size + props_len;
+    }
+
+    _payload->assign((const char*)p, end - p);
+
+    return true;
+}
+
+// Client id, keepalive and protocol level of a CONNECT
+static bool parse_connect(const std::vector<unsigned char>& _packet, std::string* _client_id, int* _keepalive_s,
+                          int* _level)
+{
+    const unsigned char* p = packet_body(_packet);
+    const unsigned char* end = _packet.data() + _packet.size();
+
+    // "MQTT", level, flags, keepalive
+    if (end - p < 10) {
+        return false;
+    }
+    *_level = p[6];
+    *_keepalive_s = read_u16(p + 8);
+    p += 10;
+    if (*_level == IOT_CONNECT_MQTT5_VERSION) {
+        int size = 0;
+        int props_len = read_varint(p, end, &size);
+        if (props_len < 0 || end - p < size + props_len) {
+            return false;
+        }
+        p += size + props_len;
+    }
+    if (end - p < 2 || end - p < 2 + read_u16(p)) {
+        return false;
+    }
+    _client_id->assign((const char*)p + 2, read_u16(p));
+
+    return true;
+}
+
+typedef struct {
+    std::vector<ReplaySession> sessions;
+    std::string client_id;
+    int keepalive_s;
+    int mqtt_version;
+} ReplayCapture;
+
+static bool load_capture(const char* _path, ReplayCapture* _cap)
+{
+    FILE* f = fopen(_path, "rb");
+    char magic[IOT_CONNECT_CAPTURE_MAGIC_LEN];
+    unsigned char header[IOT_CONNECT_CAPTURE_HEADER];
+    std::vector<unsigned char> data;
+    std::vector<unsigned char> packet;
+    PacketFramer rx;
+    PacketFramer tx;
+    uint64_t rx_start_us = 0;
+    uint64_t tx_start_us = 0;
+    uint32_t in_count = 0;
+    uint32_t out_count = 0;
+    ReplaySession* s = NULL;
+    bool v5 = false;
+
+    if (!f) {
+        printf("can't open %s\n", _path);
+        return false;
+    }
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, IOT_CONNECT_CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        printf("%s isn't a capture\n", _path);
+        fclose(f);
+        return false;
+    }
+
+    _cap->keepalive_s = 0;
+    _cap->mqtt_version = 4;
+
+    while (fread(header, 1, sizeof(header), f) == sizeof(header)) {
+        uint64_t us = 0;
+        uint32_t len = 0;
+        int i;
+
+        for (i = 7; i >= 0; i--) {
+            us = (us << 8) | header[1 + i];
+        }
+        for (i = 3; i >= 0; i--) {
+            len = (len << 8) | header[9 + i];
+        }
+        data.resize(len);
+        if (len && fread(data.data(), 1, len, f) != len) {
+            // cut short, the recorder may not have flushed
+            break;
+        }
+
+        if (header[0] == IOT_CONNECT_CAPTURE_CONNECT) {
+            _cap->sessions.push_back(ReplaySession());
+            s = &_cap->sessions.back();
+            s->start_us = us;
+            s->host.assign((const char*)data.data(), len);
+            s->out_total = 0;
+            s->sub_qos = -1;
+            rx = PacketFramer();
+            tx = PacketFramer();
+            in_count = 0;
+            out_count = 0;
+            continue;
+        }
+        if (!s || (header[0] != IOT_CONNECT_CAPTURE_READ && header[0] != IOT_CONNECT_CAPTURE_WRITE)) {
+            continue;
+        }
+
+        if (header[0] == IOT_CONNECT_CAPTURE_READ) {
+            if (rx.empty()) {
+                rx_start_us = us;
+            }
+            rx.push(data.data(), len);
+            while (rx.next(&packet)) {
+                int type = packet[0] >> 4;
+                if (type != MQTT_PINGRESP && type != MQTT_DISCONNECT) {
+                    ReplayPacket in = {rx_start_us, packet, out_count};
+                    s->in.push_back(in);
+                    in_count++;
+                }
+                rx_start_us = us;
+            }
+            continue;
+        }
+
+        if (tx.empty()) {
+            tx_start_us = us;
+        }
+        tx.push(data.data(), len);
+        while (tx.next(&packet)) {
+            const unsigned char* body = packet_body(packet);
+            int type = packet[0] >> 4;
+            uint16_t id = 0;
+
+            if (type == MQTT_PINGREQ || type == MQTT_DISCONNECT) {
+                tx_start_us = us;
+                continue;
+            }
+            out_count++;
+            s->out_total++;
+
+            if (type == MQTT_CONNECT) {
+                int level = 4;
+                if (parse_connect(packet, &_cap->client_id, &_cap->keepalive_s, &level)) {
+                    _cap->mqtt_version = level;
+                    v5 = level == IOT_CONNECT_MQTT5_VERSION;
+                }
+            } else if (type == MQTT_PUBLISH) {
+                ReplayPublish pub;
+                pub.us = tx_start_us;
+                pub.in_before = in_count;
+                pub.qos = (MQTT::QoS)((packet[0] >> 1) & 3);
+                if (parse_publish(packet, v5, &pub.payload, &id) && !pub.payload.empty()) {
+                    s->pubs.push_back(pub);
+                }
+                if (pub.qos > MQTT::QOS0) {
+                    s->out_ids.push_back(id);
+                }
+            } else if (type == MQTT_SUBSCRIBE || type == MQTT_UNSUBSCRIBE) {
+                s->out_ids.push_back(read_u16(body));
+                if (type == MQTT_SUBSCRIBE && s->sub_qos < 0) {
+                    // the first filter's options, after its length and the id / properties
+                    const unsigned char* p = body + 2;
+                    const unsigned char* end = packet.data() + packet.size();
+                    int size = 0;
+                    if (v5) {
+                        int props_len = read_varint(p, end, &size);
+                        p += props_len < 0 ? 0 : size + props_len;
+                    }
+                    if (end - p >= 3 && end - p >= 2 + read_u16(p) + 1) {
+                        s->sub_qos = p[2 + read_u16(p)] & 3;
+                    }
+                }
+            }
+            tx_start_us = us;
+        }
+    }
+
+    fclose(f);
+
+    if (_cap->sessions.empty() || _cap->client_id.empty()) {
+        printf("%s has no MQTT session\n", _path);
+        return false;
+    }
+
+    return true;
+}
+
+// The client's transport, it plays the recorded inbound packets back as the client
+// writes its own. Inbound packet i comes once the client wrote as many packets as
+// had been written before it, and its time is due with original timing. Acks get
+// the client's packet ids, PINGREQs are answered at once.
+class ReplayNetwork : public IoTConnectNetwork {
+
+public:
+    ReplayNetwork(const ReplayCapture* _cap, const ReplayOptions* _opt) :
+        cap(_cap),
+        opt(_opt),
+        session(-1),
+        connected(false),
+        finished(false),
+        session_start_us(0),
+        in_next(0),
+        out_live(0),
+        new_ids(0),
+        progress_us(now_us())
+    {
+
+    }
+
+    int set_root_ca_cert(const char* _root_ca_pem)
+    {
+        return 0;
+    }
+
+    int set_client_cert_key(const char* _cert_pem, const char* _key_pem)
+    {
+        return 0;
+    }
+
+    int connect(const char* _host_name, uint16_t _port, int _timeout_ms)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (finished || session + 1 >= (int)cap->sessions.size() * opt->repeat) {
+            return IOT_CONNECT_ERROR_NS_NO_CONNECTION;
+        }
+
+        session++;
+        connected = true;
+        session_start_us = now_us();
+        in_next = 0;
+        out_live = 0;
+        new_ids = 0;
+        ids.clear();
+        rx.clear();
+        rx_head = 0;
+        tx = PacketFramer();
+        progress_us = session_start_us;
+        cond.notify_all();
+
+        return 0;
+    }
+
+    int disconnect()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        connected = false;
+
+        return 0;
+    }
+
+    int read(unsigned char* _buf, int _len, int _timeout_ms)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t deadline = now_us() + (uint64_t)_timeout_ms * 1000;
+
+        while (true) {
+            const ReplaySession& s = current();
+            uint64_t due = 0;
+
+            if (!connected) {
+                return IOT_CONNECT_ERROR_NS_NO_CONNECTION;
+            }
+
+            if (rx_head < rx.size()) {
+                int n = std::min((size_t)_len, rx.size() - rx_head);
+                memcpy(_buf, rx.data() + rx_head, n);
+                rx_head += n;
+                return n;
+            }
+
+            if (in_next < s.in.size() && out_live >= s.in[in_next].before) {
+                due = opt->original_timing ? session_start_us + (s.in[in_next].us - s.start_us) : 0;
+                if (due <= now_us()) {
+                    release(s.in[in_next].bytes);
+                    in_next++;
+                    progress_us = now_us();
+                    cond.notify_all();
+                    continue;
+                }
+            }
+
+            if (in_next == s.in.size() && out_live >= s.out_total) {
+                if (session + 1 < (int)cap->sessions.size() * opt->repeat) {
+                    // on to the next session, through a reconnect
+                    connected = false;
+                    return IOT_CONNECT_ERROR_NS_CONNECTION_LOST;
+                }
+                if (!finished) {
+                    finished = true;
+                    cond.notify_all();
+                }
+            }
+
+            if (now_us() >= deadline) {
+                return 0;
+            }
+            cond.wait_until(lock, to_time_point(due && due < deadline ? due : deadline));
+        }
+    }
+
+    int write(unsigned char* _buf, int _len, int _timeout_ms)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        std::vector<unsigned char> packet;
+
+        if (!connected) {
+            return IOT_CONNECT_ERROR_NS_NO_CONNECTION;
+        }
+
+        tx.push(_buf, _len);
+        while (tx.next(&packet)) {
+            int type = packet[0] >> 4;
+
+            if (type == MQTT_PINGREQ) {
+                static const unsigned char pingresp[] = {MQTT_PINGRESP << 4, 0};
+                rx.insert(rx.end(), pingresp, pingresp + sizeof(pingresp));
+                continue;
+            }
+            if (type == MQTT_DISCONNECT) {
+                continue;
+            }
+            out_live++;
+            progress_us = now_us();
+
+            // the client numbers its packets its own way
+            if (takes_new_id(packet) && new_ids < current().out_ids.size()) {
+                ids[current().out_ids[new_ids]] = live_id(packet);
+                new_ids++;
+            }
+        }
+        cond.notify_all();
+        // its answer may be ready
+        signal(lock);
+
+        return _len;
+    }
+
+    int sigio(Callback<void()> _func)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        sigio_func = _func;
+
+        return 0;
+    }
+
+    // Blocks until the inbound packets a recorded publish came after are in,
+    // and its time is due; false if the capture is done or stalled
+    bool wait_publish(int _session, const ReplayPublish& _pub)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (!finished) {
+            if (session == _session && in_next >= _pub.in_before) {
+                uint64_t due = opt->original_timing ? session_start_us + (_pub.us - current().start_us) : 0;
+                if (due <= now_us()) {
+                    return true;
+                }
+                wait_step(lock, due);
+                continue;
+            }
+            if (stalled()) {
+                return false;
+            }
+            wait_step(lock, 0);
+        }
+
+        return false;
+    }
+
+    // Blocks until the last session is played back, false if it stalled
+    bool wait_finished()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (!finished) {
+            if (stalled()) {
+                return false;
+            }
+            wait_step(lock, 0);
+        }
+
+        return true;
+    }
+
+    void report_stall()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const ReplaySession& s = current();
+
+        printf("stalled in session %d: %zu of %zu inbound packets played, the client wrote %u of %u packets\n",
+               session, in_next, s.in.size(), out_live, s.out_total);
+    }
+
+private:
+    const ReplayCapture* cap;
+    const ReplayOptions* opt;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+
+    int session;
+    bool connected;
+    bool finished;
+    uint64_t session_start_us;
+    size_t in_next;
+    uint32_t out_live;
+    size_t new_ids;
+    Callback<void()> sigio_func;
+    // recorded packet id to the client's
+    std::map<uint16_t, uint16_t> ids;
+    std::vector<unsigned char> rx;
+    size_t rx_head;
+    PacketFramer tx;
+    uint64_t progress_us;
+
+private:
+    const ReplaySession& current() const
+    {
+        return cap->sessions[(session < 0 ? 0 : session) % cap->sessions.size()];
+    }
+
+    void signal(std::unique_lock<std::mutex>& _lock)
+    {
+        Callback<void()> func = sigio_func;
+
+        if (func) {
+            _lock.unlock();
+            func();
+            _lock.lock();
+        }
+    }
+
+    // Waits for a change, until _until_us if not 0, and tells the client when the
+    // next inbound packet falls due with original timing
+    void wait_step(std::unique_lock<std::mutex>& _lock, uint64_t _until_us)
+    {
+        const ReplaySession& s = current();
+        uint64_t until = _until_us ? _until_us : now_us() + 100000;
+
+        if (opt->original_timing && connected && in_next < s.in.size() && out_live >= s.in[in_next].before) {
+            uint64_t due = session_start_us + (s.in[in_next].us - s.start_us);
+            if (due <= now_us()) {
+                signal(_lock);
+                until = std::min(until, now_us() + 1000);
+            } else {
+                until = std::min(until, due);
+            }
+        }
+
+        cond.wait_until(_lock, to_time_point(until));
+    }
+
+    bool stalled() const
+    {
+        return now_us() - progress_us > (uint64_t)REPLAY_STALL_MS * 1000 &&
+               !(opt->original_timing && in_next < current().in.size());
+    }
+
+    static std::chrono::steady_clock::time_point to_time_point(uint64_t _us)
+    {
+        return std::chrono::steady_clock::time_point(std::chrono::microseconds(_us));
+    }
+
+    bool takes_new_id(const std::vector<unsigned char>& _packet) const
+    {
+        int type = _packet[0] >> 4;
+
+        return type == MQTT_SUBSCRIBE || type == MQTT_UNSUBSCRIBE ||
+               (type == MQTT_PUBLISH && ((_packet[0] >> 1) & 3) > 0);
+    }
+
+    uint16_t live_id(const std::vector<unsigned char>& _packet) const
+    {
+        const unsigned char* body = packet_body(_packet);
+
+        if ((_packet[0] >> 4) == MQTT_PUBLISH) {
+            return read_u16(body + 2 + read_u16(body));
+        }
+
+        return read_u16(body);
+    }
+
+    void release(const std::vector<unsigned char>& _packet)
+    {
+        int type = _packet[0] >> 4;
+        size_t at;
+
+        if (rx_head == rx.size()) {
+            rx.clear();
+            rx_head = 0;
+        }
+        at = rx.size();
+        rx.insert(rx.end(), _packet.begin(), _packet.end());
+
+        if (type == MQTT_PUBACK || type == MQTT_PUBREC || type == MQTT_PUBCOMP ||
+            type == MQTT_SUBACK || type == MQTT_UNSUBACK) {
+            unsigned char* body = rx.data() + at + (packet_body(_packet) - _packet.data());
+            std::map<uint16_t, uint16_t>::iterator it = ids.find(read_u16(body));
+            if (it != ids.end()) {
+                body[0] = it->second >> 8;
+                body[1] = it->second & 0xFF;
+            }
+        }
+    }
+};
+
+// Properties of the device, from the top-level keys of inbound JSON payloads
+class ReplaySchema {
+
+public:
+    ~ReplaySchema()
+    {
+        size_t i;
+
+        for (i = 0; i < props.size(); i++) {
+            delete props[i];
+        }
+    }
+
+    void learn(const ReplayCapture* _cap, bool _v5)
+    {
+        size_t i;
+        size_t j;
+
+        for (i = 0; i < _cap->sessions.size(); i++) {
+            for (j = 0; j < _cap->sessions[i].in.size(); j++) {
+                const std::vector<unsigned char>& packet = _cap->sessions[i].in[j].bytes;
+                std::string payload;
+                uint16_t id;
+
+                if ((packet[0] >> 4) == MQTT_PUBLISH && parse_publish(packet, _v5, &payload, &id)) {
+                    learn_json(payload);
+                }
+            }
+        }
+    }
+
+    void add_to(IoTConnectDevice* _device)
+    {
+        size_t i;
+
+        for (i = 0; i < props.size(); i++) {
+            switch (types[i]) {
+                case IOT_CONNECT_PROPERTY_TYPE_INT:
+                    _device->add((IoTConnectIntProperty*)props[i]);
+                    break;
+                case IOT_CONNECT_PROPERTY_TYPE_BOOL:
+                    _device->add((IoTConnectBoolProperty*)props[i]);
+                    break;
+                default:
+                    _device->add(props[i]);
+                    break;
+            }
+        }
+    }
+
+    size_t size() const
+    {
+        return props.size();
+    }
+
+private:
+    std::vector<std::string> keys;
+    std::vector<IoTConnectStringProperty*> props;
+    std::vector<IoTConnectPropertyType> types;
+
+private:
+    void learn_json(const std::string& _json)
+    {
+        jsmn_parser parser;
+        jsmntok_t tokens[REPLAY_JSON_TOKENS_MAX];
+        int n;
+        int i;
+
+        jsmn_init(&parser);
+        n = jsmn_parse(&parser, _json.c_str(), _json.size(), tokens, REPLAY_JSON_TOKENS_MAX);
+        if (n < 1 || tokens[0].type != JSMN_OBJECT) {
+            return;
+        }
+
+        // keys and primitive or string values of the top-level object
+        for (i = 1; i + 1 < n; i += 2) {
+            std::string key(_json.c_str() + tokens[i].start, tokens[i].end - tokens[i].start);
+            const jsmntok_t& v = tokens[i + 1];
+
+            if (v.type == JSMN_OBJECT || v.type == JSMN_ARRAY) {
+                break;
+            }
+            if (std::find(keys.begin(), keys.end(), key) != keys.end() ||
+                props.size() >= IOT_CONNECT_PROPERTYS_MAX) {
+                continue;
+            }
+
+            keys.push_back(key);
+            if (v.type == JSMN_STRING) {
+                props.push_back(new IoTConnectStringProperty(keys.back().c_str(), ""));
+                types.push_back(IOT_CONNECT_PROPERTY_TYPE_STRING);
+            } else if (_json[v.start] == 't' || _json[v.start] == 'f') {
+                props.push_back(new IoTConnectBoolProperty(keys.back().c_str(), false));
+                types.push_back(IOT_CONNECT_PROPERTY_TYPE_BOOL);
+            } else {
+                props.push_back(new IoTConnectIntProperty(keys.back().c_str(), 0));
+                types.push_back(IOT_CONNECT_PROPERTY_TYPE_INT);
+            }
+        }
+    }
+};
+
+// Connects the next session in the client's context, as on a connection lost
+class ReplayHarness {
+
+public:
+    ReplayHarness(IoTConnectClient* _client, const ReplayCapture* _cap, int _repeat) :
+        client(_client),
+        cap(_cap),
+        sessions(_cap->sessions.size() * _repeat),
+        session(-1)
+    {
+
+    }
+
+    void on_connection_lost()
+    {
+        const ReplaySession* s;
+
+        if (session + 1 >= sessions) {
+            return;
+        }
+        session++;
+        s = &cap->sessions[session % cap->sessions.size()];
+
+        if (client->connect() != 0) {
+            printf("connect of session %d failed\n", session);
+            return;
+        }
+        if (s->sub_qos >= 0 && client->subscribe((MQTT::QoS)s->sub_qos) != 0) {
+            printf("subscribe of session %d failed\n", session);
+        }
+    }
+
+private:
+    IoTConnectClient* client;
+    const ReplayCapture* cap;
+    int sessions;
+    int session;
+};
+
+// Reconnects the generating client, in its context
+class GenerateConnector {
+
+public:
+    GenerateConnector(IoTConnectClient* _client, MQTT::QoS _qos) :
+        client(_client),
+        qos(_qos)
+    {
+
+    }
+
+    void on_connection_lost()
+    {
+        if (client->connect() == 0) {
+            client->subscribe(qos);
+        }
+    }
+
+private:
+    IoTConnectClient* client;
+    MQTT::QoS qos;
+};
+
+// A capture of a device through LoopbackBroker: property publishes, C2D property
+// updates, and the broker dropping the connection between sessions
+static int generate(const ReplayOptions* _opt)
+{
+    FILE* f = fopen(_opt->path, "wb");
+    LoopbackBroker broker;
+    EventQueue queue;
+    IoTConnectEntry entry("Replay", "");
+    IoTConnectIntProperty temp("temp", 20);
+    IoTConnectStringProperty mode("mode", "auto");
+    IoTConnectBoolProperty on("on", true);
+    IoTConnectIntProperty rssi("rssi", -60);
+    IoTConnectStringProperty fw("fw", "1.0.0");
+    IoTConnectBoolProperty alarm("alarm", false);
+    char c2d_topic[96];
+    char payload[160];
+    int per_session;
+    int i;
+
+    if (!f) {
+        printf("can't create %s\n", _opt->path);
+        return 1;
+    }
+
+    entry.set_mqtt("loopback", 8883);
+    IoTConnectDevice device("replay-dev", "replay-dev", "pwd", &entry);
+    device.add(&temp);
+    device.add(&mode);
+    device.add(&on);
+    device.add(&rssi);
+    device.add(&fw);
+    device.add(&alarm);
+    snprintf(c2d_topic, sizeof(c2d_topic), "devices/%s/messages/devicebound/replay", device.get_client_id());
+
+    LoopbackNetwork network(&broker);
+    IoTConnectNetworkRecorder recorder(&network, f);
+    IoTConnectClient* client = new IoTConnectClient(&recorder, &device);
+    GenerateConnector connector(client, (MQTT::QoS)_opt->qos);
+
+    client->set_mqtt_version(_opt->mqtt_version);
+    client->set_event_handler(callback(&connector, &GenerateConnector::on_connection_lost));
+    client->start_event_loop(&queue);
+    std::thread dispatcher(&EventQueue::dispatch_forever, &queue);
+
+    per_session = std::max(_opt->messages / std::max(_opt->sessions, 1), 1);
+    for (i = 0; i < _opt->messages; i++) {
+        uint64_t connects = broker.get_connects();
+
+        if (i && i % per_session == 0) {
+            broker.drop_all();
+            while (broker.get_connects() == connects) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        temp.set_value(15 + rand() % 20);
+        rssi.set_value(-40 - rand() % 50);
+        on.set_value(i % 2 == 0);
+        while (client->pub_props((MQTT::QoS)_opt->qos) == IOT_CONNECT_ERROR_CLIENT_PUB_FULL) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // every other message, the backend changes a few properties
+        if (i % 2 == 0) {
+            int len = snprintf(payload, sizeof(payload), "{\"mode\":\"%s\",\"alarm\":%s,\"temp\":%d}",
+                               i % 4 ? "eco" : "boost", i % 3 ? "false" : "true", 18 + rand() % 8);
+            while (!broker.publish(device.get_client_id(), c2d_topic, payload, len)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    while (client->pubs.size() > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // the client is destroyed in the queue's thread, or once it's stopped
+    queue.break_dispatch();
+    dispatcher.join();
+    delete client;
+    fclose(f);
+
+    printf("%-20s %s, %d messages in %d sessions, recording %s\n", "generated", _opt->path, _opt->messages,
+           _opt->sessions, recorder.is_recording() ? "ok" : "FAILED");
+
+    return recorder.is_recording() ? 0 : 1;
+}
+
+static void usage(const char* _prog)
+{
+    printf("usage: %s [options] capture\n"
+           "  -t                original timing, rather than as fast as the client goes\n"
+           "  -r times          replay the capture this many times (1)\n"
+           "  -g                generate a capture through a loopback broker, rather than replay\n"
+           "  -n messages       -g: property publishes, a C2D update every other one (1000)\n"
+           "  -s sessions       -g: connections, the broker drops each (2)\n"
+           "  -q qos            -g: publish and subscribe QoS (0)\n"
+           "  -5                -g: MQTT 5\n", _prog);
+}
+
+static const char* section_names[IOT_CONNECT_PROFILE_SECTIONS] = {"receive", "update", "publish"};
+
+int main(int argc, char* argv[])
+{
+    ReplayOptions opt = {NULL, false, 1, 1000, 2, 0, 4};
+    IoTConnectHeapAllocator heap;
+    IoTConnectAccountingAllocator accounting(&heap);
+    IoTConnectClientStats st;
+    IoTConnectProfile prof;
+    ReplayCapture cap;
+    ReplaySchema schema;
+    bool gen = false;
+    bool ok = true;
+    size_t in_total = 0;
+    size_t pub_total = 0;
+    uint64_t start_us;
+    double s;
+    int session;
+    int c;
+    int i;
+
+    while ((c = getopt(argc, argv, "tr:gn:s:q:5h")) != -1) {
+        switch (c) {
+            case 't': opt.original_timing = true; break;
+            case 'r': opt.repeat = std::max(atoi(optarg), 1); break;
+            case 'g': gen = true; break;
+            case 'n': opt.messages = std::max(atoi(optarg), 1); break;
+            case 's': opt.sessions = std::max(atoi(optarg), 1); break;
+            case 'q': opt.qos = std::min(std::max(atoi(optarg), 0), 1); break;
+            case '5': opt.mqtt_version = IOT_CONNECT_MQTT5_VERSION; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    opt.path = argv[optind];
+
+    if (gen) {
+        return generate(&opt);
+    }
+
+    if (!load_capture(opt.path, &cap)) {
+        return 1;
+    }
+    for (i = 0; i < (int)cap.sessions.size(); i++) {
+        in_total += cap.sessions[i].in.size();
+        pub_total += cap.sessions[i].pubs.size();
+    }
+
+    // before anything allocates, for allocations in the profile
+    iot_connect_set_allocator(&accounting);
+
+    IoTConnectEntry entry("Replay", "");
+    entry.set_mqtt(cap.sessions[0].host.c_str(), 8883);
+    IoTConnectDevice* device = new IoTConnectDevice(cap.client_id.c_str(), cap.client_id.c_str(), "pwd", &entry);
+    schema.learn(&cap, cap.mqtt_version == IOT_CONNECT_MQTT5_VERSION);
+    schema.add_to(device);
+
+    EventQueue queue;
+    ReplayNetwork network(&cap, &opt);
+    IoTConnectClient* client = new IoTConnectClient(&network, device);
+    ReplayHarness harness(client, &cap, opt.repeat);
+    client->set_mqtt_version(cap.mqtt_version);
+    client->set_keepalive(cap.keepalive_s);
+    client->set_event_handler(callback(&harness, &ReplayHarness::on_connection_lost));
+
+    // on a queue, it drains the publish buffer at once rather than a message a yield
+    start_us = now_us();
+    client->start_event_loop(&queue);
+    std::thread dispatcher(&EventQueue::dispatch_forever, &queue);
+
+    // the recorded publishes, in order, as the inbound packets before them are played
+    for (session = 0; ok && session < (int)cap.sessions.size() * opt.repeat; session++) {
+        const ReplaySession& rs = cap.sessions[session % cap.sessions.size()];
+        size_t j;
+
+        for (j = 0; ok && j < rs.pubs.size(); j++) {
+            MQTT::Message msg;
+
+            if (!network.wait_publish(session, rs.pubs[j])) {
+                ok = false;
+                break;
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.qos = rs.pubs[j].qos;
+            msg.payload = (void*)rs.pubs[j].payload.data();
+            msg.payloadlen = rs.pubs[j].payload.size();
+            while (client->pub(&msg) == IOT_CONNECT_ERROR_CLIENT_PUB_FULL) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+    ok = ok && network.wait_finished();
+    s = std::max((now_us() - start_us) / 1000000.0, 0.000001);
+    if (!ok) {
+        network.report_stall();
+    }
+
+    client->get_stats(&st);
+    printf("%-20s %s, client id %s, MQTT %s, %zu properties learned\n", "capture", opt.path,
+           cap.client_id.c_str(), cap.mqtt_version == IOT_CONNECT_MQTT5_VERSION ? "5" : "3.1.1", schema.size());
+    printf("%-20s %zu sessions x %d, %zu inbound packets, %zu publishes, %s\n", "replayed", cap.sessions.size(),
+           opt.repeat, in_total * opt.repeat, pub_total * opt.repeat,
+           opt.original_timing ? "original timing" : "as fast as possible");
+    printf("%-20s %.3f s, %.0f messages/s\n", "elapsed", s, (st.recv_msgs + st.pub_msgs) / s);
+    printf("%-20s %u received, %u parse errors, %u published, %u publish errors\n", "client",
+           st.recv_msgs, st.parse_errors, st.pub_msgs, st.pub_errors);
+
+    if (client->get_profile(IOT_CONNECT_PROFILE_RECEIVE, &prof) != 0) {
+        printf("no profile, build with -DMBED_CONF_IOT_CONNECT_MQTT_CLIENT_PROFILE=1\n");
+    } else {
+        printf("%-20s %10s %12s %12s %10s\n", "section", "calls", "cpu us/op", "cpu max us", "allocs/op");
+        for (i = 0; i < IOT_CONNECT_PROFILE_SECTIONS; i++) {
+            client->get_profile((IoTConnectProfileSection)i, &prof);
+            printf("%-20s %10u %12.2f %12u %10.2f\n", section_names[i], prof.calls,
+                   prof.calls ? (double)prof.cpu_us / prof.calls : 0.0, prof.cpu_max_us,
+                   prof.calls ? (double)prof.allocs / prof.calls : 0.0);
+        }
+    }
+
+    queue.break_dispatch();
+    dispatcher.join();
+    delete client;
+    delete device;
+    iot_connect_set_allocator(NULL);
+
+    return ok ? 0 : 2;
+}
@@ -0,0 +1,203 @@
+#!/usr/bin/env python3
+"""Worst-case stack depth from GCC call graph files.
+
+Build with -fcallgraph-info=su,da (GCC 10 or later), then run it on the .ci
+files or the directories holding them. Every root is walked down its call
+graph, the deepest path is the sum of the static frames on it.
+
+What it can't see is reported rather than guessed: calls through pointers
+(callbacks, virtual methods), functions without a .ci file (libc, the RTOS,
+prebuilt libraries), recursion and dynamically sized frames. Use -a to give
+known callees a size, and -i for every indirect call.
+"""
+
+import argparse
+import os
+import re
+import shutil
+import subprocess
+import sys
+
+NODE_RE = re.compile(r'node:\s*\{\s*title:\s*"((?:[^"\\]|\\.)*)"\s*label:\s*"((?:[^"\\]|\\.)*)"')
+EDGE_RE = re.compile(r'edge:\s*\{\s*sourcename:\s*"((?:[^"\\]|\\.)*)"\s*targetname:\s*"((?:[^"\\]|\\.)*)"')
+FRAME_RE = re.compile(r'(\d+) bytes \(([a-z,]+)\)')
+
+INDIRECT = "__indirect_call"
+DEFAULT_ROOTS = [r"IoTConnectClient::thread_main_loop\(\)"]
+
+
+class Function:
+    def __init__(self, title):
+        self.title = title
+        self.name = title
+        self.frame = None       # None if there is no .ci file for it
+        self.qualifier = ""
+        self.callees = set()
+
+
+def load(paths):
+    funcs = {}
+
+    def get(title):
+        if title not in funcs:
+            funcs[title] = Function(title)
+        return funcs[title]
+
+    files = []
+    for p in paths:
+        if os.path.isdir(p):
+            for root, _, names in os.walk(p):
+                files += [os.path.join(root, n) for n in names if n.endswith(".ci")]
+        else:
+            files.append(p)
+
+    for path in files:
+        with open(path, errors="replace") as f:
+            text = f.read()
+        for title, label in NODE_RE.findall(text):
+            fn = get(title)
+            lines = label.split("\\n")
+            m = FRAME_RE.search(label)
+            if m:
+                fn.frame = int(m.group(1))
+                fn.qualifier = m.group(2)
+            if fn.name == title and lines[0]:
+                fn.name = lines[0]
+        for src, dst in EDGE_RE.findall(text):
+            get(src).callees.add(dst)
+            get(dst)
+
+    demangle(funcs)
+
+    return funcs
+
+
+# GCC cuts the label of some templates and variadic functions, the title is
+# the mangled name, behind "file:" for local ones.
+def demangle(funcs):
+    cxxfilt = shutil.which("c++filt")
+    titles = [t for t in funcs if t != INDIRECT]
+
+    if not cxxfilt or not titles:
+        return
+
+    mangled = [t.rsplit(":", 1)[-1] for t in titles]
+    try:
+        out = subprocess.run([cxxfilt], input="\n".join(mangled), capture_output=True,
+                             text=True, check=True).stdout.split("\n")
+    except (OSError, subprocess.CalledProcessError):
+        return
+
+    for title, name in zip(titles, out):
+        if name:
+            funcs[title].name = name
+
+
+class Walker:
+    def __init__(self, funcs, assume, indirect):
+        self.funcs = funcs
+        self.assume = assume
+        self.indirect = indirect
+        self.memo = {}
+        self.recursive = set()
+        self.unknown = set()
+        self.dynamic = set()
+        self.indirect_callers = set()
+
+    def frame(self, fn):
+        for pattern, size in self.assume:
+            if pattern.search(fn.name):
+                return size
+        if fn.title == INDIRECT:
+            return self.indirect
+        if fn.frame is None:
+            self.unknown.add(fn.name)
+            return 0
+        if "dynamic" in fn.qualifier and "bounded" not in fn.qualifier:
+            self.dynamic.add(fn.name)
+        return fn.frame
+
+    # (depth, path) of the deepest call chain from a function
+    def deepest(self, title, stack):
+        if title in self.memo:
+            return self.memo[title]
+        fn = self.funcs[title]
+        best = (0, [])
+        stack.add(title)
+        for callee in sorted(fn.callees):
+            if callee in stack:
+                self.recursive.add(fn.name)
+                continue
+            if callee == INDIRECT:
+                self.indirect_callers.add(fn.name)
+            depth, path = self.deepest(callee, stack)
+            if depth > best[0] or not best[1]:
+                best = (depth, path)
+        stack.discard(title)
+        own = self.frame(fn)
+        result = (own + best[0], [(own, fn.name)] + best[1])
+        self.memo[title] = result
+        return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Worst-case stack depth from GCC -fcallgraph-info files")
+    parser.add_argument("paths", nargs="+", help=".ci files or directories")
+    parser.add_argument("-r", "--root", action="append",
+                        help="regex of the root functions, IoTConnectClient::thread_main_loop() by default")
+    parser.add_argument("-a", "--assume", action="append", default=[], metavar="REGEX=BYTES",
+                        help="stack of functions matching REGEX, e.g. for libc or callbacks")
+    parser.add_argument("-i", "--indirect", type=int, default=0, metavar="BYTES",
+                        help="stack assumed for every indirect call (0)")
+    parser.add_argument("-l", "--limit", type=int, default=0, metavar="BYTES",
+                        help="exit with 1 if a root is deeper than this")
+    args = parser.parse_args()
+
+    assume = []
+    for a in args.assume:
+        pattern, _, size = a.rpartition("=")
+        if not pattern or not size.isdigit():
+            parser.error("bad --assume %s" % a)
+        assume.append((re.compile(pattern), int(size)))
+
+    funcs = load(args.paths)
+    if not funcs:
+        print("no call graph found, build with -fcallgraph-info=su,da", file=sys.stderr)
+        return 2
+
+    roots = [re.compile(r) for r in (args.root or DEFAULT_ROOTS)]
+    walker = Walker(funcs, assume, args.indirect)
+    over = False
+    found = False
+
+    for title in sorted(funcs):
+        fn = funcs[title]
+        if fn.frame is None or not any(r.search(fn.name) for r in roots):
+            continue
+        found = True
+        depth, path = walker.deepest(title, set())
+        print("%s: %d bytes" % (fn.name, depth))
+        for size, name in path:
+            print("  %6d  %s" % (size, name))
+        print()
+        if args.limit and depth > args.limit:
+            over = True
+
+    if not found:
+        print("no root function matched", file=sys.stderr)
+        return 2
+
+    for title, names in (("Not counted, no call graph (use -a)", walker.unknown),
+                         ("Indirect calls, %d bytes each (use -i)" % args.indirect, walker.indirect_callers),
+                         ("Recursive, counted once", walker.recursive),
+                         ("Unbounded dynamic frames", walker.dynamic)):
+        if names:
+            print("%s:" % title)
+            for name in sorted(names):
+                print("  %s" % name)
+
+    return 1 if over else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())